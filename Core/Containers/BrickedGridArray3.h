@@ -0,0 +1,221 @@
+#ifndef __MANTA_BRICKED_GRID_ARRAY3__
+#define __MANTA_BRICKED_GRID_ARRAY3__
+
+/* A read-only 3D grid of type T that lives in a brick file (see
+ * Core/Util/BrickFile.h) instead of in memory, so that volumes larger
+ * than memory can be used.  Only the bricks that are touched are read,
+ * and only as many of them as fit in the memory budget are kept.
+ *
+ * The value range of every brick is known without reading the brick,
+ * so traversals can skip the bricks that cannot contain what they are
+ * looking for.  The cells from (bx, by, bz)*getBrickSize() up to the
+ * next brick belong to brick (bx, by, bz).
+ */
+
+#include <Core/Containers/GridArray3.h>
+#include <Core/Exceptions/InputError.h>
+#include <Core/Exceptions/OutputError.h>
+#include <Core/Math/MinMax.h>
+#include <Core/Util/BrickFile.h>
+
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace Manta {
+
+  template<typename T>
+  class BrickedGridArray3 {
+   public:
+    BrickedGridArray3(const std::string& filename,
+                      size_t memoryBudget = 512*1024*1024) {
+      if(!file.open(filename, sizeof(T), memoryBudget))
+        throw InputError("BrickedGridArray3: " + filename +
+                         " is not a brick file of the right type");
+      const BrickFile::Header& header = file.getHeader();
+      nx = header.nx;
+      ny = header.ny;
+      nz = header.nz;
+      brickSize = header.brickSize;
+      side = brickSize+1;
+    }
+
+    T operator()(int x, int y, int z) const {
+      // The last voxel of a brick is also the first of the next one, so
+      // the voxels past the last brick are found in the last brick.
+      const BrickFile::Header& header = file.getHeader();
+      int bx = Min(x/brickSize, header.numBricksX-1);
+      int by = Min(y/brickSize, header.numBricksY-1);
+      int bz = Min(z/brickSize, header.numBricksZ-1);
+      const T* brick = getBrick(bx, by, bz);
+      return brick[getLocalIndex(x-bx*brickSize, y-by*brickSize,
+                                 z-bz*brickSize)];
+    }
+
+    // The values at the eight corners of cell (x, y, z), which must be
+    // less than (nx-1, ny-1, nz-1), in the order (0,0,0), (0,0,1),
+    // (0,1,0), (0,1,1), (1,0,0), ... (1,1,1).
+    void getCell(int x, int y, int z, float rhos[8]) const {
+      int bx = x/brickSize;
+      int by = y/brickSize;
+      int bz = z/brickSize;
+      const T* p = getBrick(bx, by, bz) +
+        getLocalIndex(x-bx*brickSize, y-by*brickSize, z-bz*brickSize);
+      const int ystride = side;
+      const int zstride = side*side;
+      rhos[0] = p[0];
+      rhos[1] = p[zstride];
+      rhos[2] = p[ystride];
+      rhos[3] = p[ystride+zstride];
+      rhos[4] = p[1];
+      rhos[5] = p[1+zstride];
+      rhos[6] = p[1+ystride];
+      rhos[7] = p[1+ystride+zstride];
+    }
+
+    void getBrickRange(int bx, int by, int bz, float& min, float& max) const {
+      file.getBrickRange(file.getBrickIndex(bx, by, bz), min, max);
+    }
+
+    int getNx() const {
+      return nx;
+    }
+    int getNy() const {
+      return ny;
+    }
+    int getNz() const {
+      return nz;
+    }
+    int getBrickSize() const {
+      return brickSize;
+    }
+    int getNumBricksX() const {
+      return file.getHeader().numBricksX;
+    }
+    int getNumBricksY() const {
+      return file.getHeader().numBricksY;
+    }
+    int getNumBricksZ() const {
+      return file.getHeader().numBricksZ;
+    }
+    float getDataMin() const {
+      return file.getHeader().dataMin;
+    }
+    float getDataMax() const {
+      return file.getHeader().dataMax;
+    }
+
+    BrickFile& getFile() {
+      return file;
+    }
+    const BrickFile& getFile() const {
+      return file;
+    }
+
+    // Writes a brick file with the values of data, which can be anything
+    // that returns the value of voxel (x, y, z) from data(x, y, z), such
+    // as a GridArray3.  Only one brick of the volume is held in memory at
+    // a time.
+    template<class Source>
+    static void write(const std::string& filename,
+                      int nx, int ny, int nz, const Source& data,
+                      int brickSize = 16) {
+      if(nx < 2 || ny < 2 || nz < 2 || brickSize < 1)
+        throw OutputError("BrickedGridArray3: cannot write a volume of size "
+                          "less than 2 or bricks of size less than 1");
+      BrickFile::Header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, BrickFile::Magic, sizeof(header.magic));
+      header.version = BrickFile::Version;
+      header.valueSize = sizeof(T);
+      header.nx = nx;
+      header.ny = ny;
+      header.nz = nz;
+      header.brickSize = brickSize;
+      BrickFile::layout(header);
+
+      FILE* out = fopen(filename.c_str(), "wb");
+      if(!out)
+        throw OutputError("BrickedGridArray3: cannot open " + filename);
+
+      // The header and the ranges are written once all of the bricks
+      // have been.
+      const int side = brickSize+1;
+      const size_t numBricks = (size_t)header.numBricksX*header.numBricksY*header.numBricksZ;
+      std::vector<float> ranges(2*numBricks);
+      std::vector<char> buffer(header.brickStride, 0);
+      T* brick = reinterpret_cast<T*>(&buffer[0]);
+      bool ok = fseek(out, header.bricksOffset, SEEK_SET) == 0;
+      float dataMin = FLT_MAX;
+      float dataMax = -FLT_MAX;
+      size_t index = 0;
+      for(int bz = 0; bz < header.numBricksZ && ok; bz++){
+        for(int by = 0; by < header.numBricksY && ok; by++){
+          for(int bx = 0; bx < header.numBricksX && ok; bx++){
+            float min = FLT_MAX;
+            float max = -FLT_MAX;
+            for(int z = 0; z < side; z++){
+              // The voxels past the edge of the volume repeat the last
+              // one, and are left out of the range.
+              const int gz = bz*brickSize+z;
+              for(int y = 0; y < side; y++){
+                const int gy = by*brickSize+y;
+                for(int x = 0; x < side; x++){
+                  const int gx = bx*brickSize+x;
+                  T value = data(Min(gx, nx-1), Min(gy, ny-1), Min(gz, nz-1));
+                  brick[(z*side + y)*side + x] = value;
+                  if(gx < nx && gy < ny && gz < nz){
+                    if(value < min) min = value;
+                    if(value > max) max = value;
+                  }
+                }
+              }
+            }
+            ranges[2*index] = min;
+            ranges[2*index+1] = max;
+            index++;
+            if(min < dataMin) dataMin = min;
+            if(max > dataMax) dataMax = max;
+            ok = fwrite(&buffer[0], buffer.size(), 1, out) == 1;
+          }
+        }
+      }
+      header.dataMin = dataMin;
+      header.dataMax = dataMax;
+      if(ok)
+        ok = (fseek(out, 0, SEEK_SET) == 0 &&
+              fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(&ranges[0], sizeof(float), ranges.size(), out) == ranges.size());
+      if(fclose(out) != 0)
+        ok = false;
+      if(!ok)
+        throw OutputError("BrickedGridArray3: error writing " + filename);
+    }
+
+    static void write(const std::string& filename, const GridArray3<T>& data,
+                      int brickSize = 16) {
+      write(filename, data.getNx(), data.getNy(), data.getNz(), data,
+            brickSize);
+    }
+
+   private:
+    BrickedGridArray3(const BrickedGridArray3&);
+    BrickedGridArray3& operator=(const BrickedGridArray3&);
+
+    const T* getBrick(int bx, int by, int bz) const {
+      return reinterpret_cast<const T*>(file.getBrick(file.getBrickIndex(bx, by, bz)));
+    }
+    int getLocalIndex(int x, int y, int z) const {
+      return (z*side + y)*side + x;
+    }
+
+    BrickFile file;
+    int nx, ny, nz;
+    int brickSize;
+    int side;
+  };
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef Manta_Core_MappedArray_h
+#define Manta_Core_MappedArray_h
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+namespace Manta {
+
+  // A contiguous array that either owns its elements (and then behaves
+  // like a std::vector) or is a view of memory owned by someone else,
+  // such as a region of a MappedFile.  Element access always goes
+  // through a single pointer so that traversal code pays nothing for
+  // the choice.
+  //
+  // Anything that changes the number of elements of an external view
+  // first copies the view into owned storage.  Writing to individual
+  // elements of an external view writes to the external memory, so the
+  // owner of that memory has to allow it (e.g. a copy-on-write mapping).
+  template<class T>
+  class MappedArray {
+  public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    MappedArray() : ptr(0), count(0), external(false) {}
+
+    MappedArray(const MappedArray& copy)
+      : owned(copy.begin(), copy.end()), external(false)
+    {
+      sync();
+    }
+
+    MappedArray& operator=(const MappedArray& copy)
+    {
+      if (this != &copy) {
+        std::vector<T>(copy.begin(), copy.end()).swap(owned);
+        external = false;
+        sync();
+      }
+      return *this;
+    }
+
+    inline T& operator[](size_t i) const { return ptr[i]; }
+
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+
+    inline iterator begin() const { return ptr; }
+    inline iterator end() const { return ptr+count; }
+
+    // True if the elements live in memory not owned by this array.
+    bool isExternal() const { return external; }
+
+    // Become a view of [data, data+num).  Any owned storage is released.
+    void setExternal(T* data, size_t num)
+    {
+      std::vector<T>().swap(owned);
+      ptr = data;
+      count = num;
+      external = true;
+    }
+
+    void resize(size_t num)
+    {
+      detach();
+      owned.resize(num);
+      sync();
+    }
+
+    void clear()
+    {
+      std::vector<T>().swap(owned);
+      external = false;
+      sync();
+    }
+
+    // Copy the elements into a std::vector (for serialization).
+    void copyTo(std::vector<T>& out) const
+    {
+      out.assign(begin(), end());
+    }
+
+    // Take ownership of the elements of in.  in is left empty.
+    void swapIn(std::vector<T>& in)
+    {
+      owned.swap(in);
+      std::vector<T>().swap(in);
+      external = false;
+      sync();
+    }
+
+    // Exchange the elements (owned or not) of two arrays.
+    void swap(MappedArray& other)
+    {
+      owned.swap(other.owned);
+      std::swap(ptr, other.ptr);
+      std::swap(count, other.count);
+      std::swap(external, other.external);
+    }
+
+  private:
+    // Turn an external view into owned storage.
+    void detach()
+    {
+      if (external) {
+        std::vector<T>(ptr, ptr+count).swap(owned);
+        external = false;
+      }
+    }
+
+    void sync()
+    {
+      ptr = owned.empty() ? 0 : &owned[0];
+      count = owned.size();
+    }
+
+    std::vector<T> owned;
+    T* ptr;
+    size_t count;
+    bool external;
+  };
+}
+
+#endif
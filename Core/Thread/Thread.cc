@@ -52,6 +52,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <algorithm>
+#include <fstream>
+#include <vector>
 
 #if defined(_AIX)
 // Needed for StrCaseCmp on aix 4.3 (on 5.1 we don't need this.)
@@ -72,6 +75,7 @@
 
 #elif defined(__GNUC__) && defined(__linux)
 #include <execinfo.h>
+#include <sched.h>
 #include <unistd.h>
 #endif
 
@@ -393,6 +397,194 @@ Thread::setStackSize(unsigned long stacksize)
   stacksize_=stacksize;
 }
 
+int
+Thread::getProcessor() const
+{
+  return cpu_;
+}
+
+/*
+ * Thread placement
+ */
+Thread::PlacementPolicy Thread::placementPolicy = Thread::NoPlacement;
+
+namespace {
+  struct ProcessorInfo {
+    int proc;
+    int socket;
+    int core;
+    int coreRank; // Index of the core among the cores of its socket
+    int smt;
+    bool known;
+  };
+
+  // The processors the process started with, sorted by processor
+  // number, and the order in which each policy hands them out.
+  std::vector<ProcessorInfo> processors;
+  std::vector<int> compactOrder;
+  std::vector<int> scatterOrder;
+
+  struct CompactLess {
+    const std::vector<ProcessorInfo>& p;
+    CompactLess(const std::vector<ProcessorInfo>& p) : p(p) {}
+    bool operator()(int a, int b) const {
+      if(p[a].socket != p[b].socket) return p[a].socket < p[b].socket;
+      if(p[a].smt != p[b].smt)       return p[a].smt < p[b].smt;
+      if(p[a].core != p[b].core)     return p[a].core < p[b].core;
+      return p[a].proc < p[b].proc;
+    }
+  };
+
+  struct ScatterLess {
+    const std::vector<ProcessorInfo>& p;
+    ScatterLess(const std::vector<ProcessorInfo>& p) : p(p) {}
+    bool operator()(int a, int b) const {
+      if(p[a].smt != p[b].smt)           return p[a].smt < p[b].smt;
+      if(p[a].coreRank != p[b].coreRank) return p[a].coreRank < p[b].coreRank;
+      if(p[a].socket != p[b].socket)     return p[a].socket < p[b].socket;
+      return p[a].proc < p[b].proc;
+    }
+  };
+
+  bool readTopologyValue(int proc, const char* name, int& value)
+  {
+    char path[128];
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/%s", proc, name);
+    std::ifstream in(path);
+    in >> value;
+    return !in.fail();
+  }
+
+  // Called from Thread::initialize, before any thread is pinned, so that
+  // the affinity mask of the process is still the one it started with.
+  void initProcessors()
+  {
+    if(!processors.empty())
+      return;
+
+    std::vector<int> procs;
+#if defined(__linux)
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if(sched_getaffinity(0, sizeof(mask), &mask) == 0){
+      for(int i=0;i<CPU_SETSIZE;i++)
+        if(CPU_ISSET(i, &mask))
+          procs.push_back(i);
+    }
+#endif
+    if(procs.empty()){
+      for(int i=0;i<Thread::numProcessors();i++)
+        procs.push_back(i);
+    }
+
+    int n = (int)procs.size();
+    processors.resize(n);
+    for(int i=0;i<n;i++){
+      ProcessorInfo& info = processors[i];
+      info.proc = procs[i];
+      info.known = readTopologyValue(info.proc, "physical_package_id",
+                                     info.socket)
+        && readTopologyValue(info.proc, "core_id", info.core);
+      if(!info.known){
+        info.socket = 0;
+        info.core = info.proc;
+      }
+    }
+    for(int i=0;i<n;i++){
+      ProcessorInfo& info = processors[i];
+      info.smt = 0;
+      std::vector<int> cores;
+      for(int j=0;j<n;j++){
+        if(processors[j].socket != info.socket)
+          continue;
+        if(processors[j].core == info.core && j < i)
+          info.smt++;
+        if(processors[j].core < info.core)
+          cores.push_back(processors[j].core);
+      }
+      std::sort(cores.begin(), cores.end());
+      info.coreRank = (int)(std::unique(cores.begin(), cores.end())
+                            - cores.begin());
+    }
+
+    compactOrder.resize(n);
+    for(int i=0;i<n;i++)
+      compactOrder[i] = i;
+    scatterOrder = compactOrder;
+    std::sort(compactOrder.begin(), compactOrder.end(),
+              CompactLess(processors));
+    std::sort(scatterOrder.begin(), scatterOrder.end(),
+              ScatterLess(processors));
+  }
+}
+
+void
+Thread::setPlacementPolicy(PlacementPolicy policy)
+{
+  placementPolicy = policy;
+}
+
+Thread::PlacementPolicy
+Thread::getPlacementPolicy()
+{
+  return placementPolicy;
+}
+
+const char*
+Thread::getPlacementPolicyName(PlacementPolicy policy)
+{
+  switch(policy){
+  case NoPlacement:      return "none";
+  case CompactPlacement: return "compact";
+  case ScatterPlacement: return "scatter";
+  }
+  return "unknown";
+}
+
+int
+Thread::placeThread(int index)
+{
+  initProcessors();
+  int n = (int)processors.size();
+  switch(placementPolicy){
+  case CompactPlacement:
+    return processors[compactOrder[index % n]].proc;
+  case ScatterPlacement:
+    return processors[scatterOrder[index % n]].proc;
+  default:
+    return -1;
+  }
+}
+
+bool
+Thread::getProcessorTopology(int proc, int& socket, int& core, int& smt)
+{
+  initProcessors();
+  for(size_t i=0;i<processors.size();i++){
+    if(processors[i].proc == proc){
+      socket = processors[i].socket;
+      core = processors[i].core;
+      smt = processors[i].smt;
+      return processors[i].known;
+    }
+  }
+  return false;
+}
+
+int
+Thread::numAvailableProcessors()
+{
+  initProcessors();
+  return (int)processors.size();
+}
+
+int
+Thread::availableProcessor(int i)
+{
+  initProcessors();
+  return processors[i].proc;
+}
+
 /*
  * Return the statename for p
  */
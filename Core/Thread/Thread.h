@@ -180,9 +180,45 @@ DESCRIPTION
 	    //////////
 	    // Request that the thread migrate to processor <i>proc</i>.
 	    // If <i>proc</i> is -1, then the thread is free to run
-	    // anywhere.
+	    // anywhere.  On Linux this sets the affinity of the thread (to
+	    // the processors the process started with for -1); elsewhere it
+	    // is a hint at most.
 	    void migrate(int proc);
-	    
+
+	    //////////
+	    // The processor last passed to <b>migrate</b>, or -1 if the
+	    // thread is free to run anywhere.
+	    int getProcessor() const;
+
+	    //////////
+	    // How <b>placeThread</b> spreads a group of threads over the
+	    // processors.  SMT siblings of a core are only used once every
+	    // physical core of the socket (Compact) or of the machine
+	    // (Scatter) has a thread.
+	    enum PlacementPolicy {
+		NoPlacement,      // Leave it to the OS (the default)
+		CompactPlacement, // Fill one socket, then the next
+		ScatterPlacement  // Round robin over the sockets
+	    };
+
+	    static void setPlacementPolicy(PlacementPolicy policy);
+	    static PlacementPolicy getPlacementPolicy();
+	    static const char* getPlacementPolicyName(PlacementPolicy policy);
+
+	    //////////
+	    // The processor that thread <i>index</i> of a group should
+	    // <b>migrate</b> to under the placement policy, or -1 for
+	    // NoPlacement.  Only the processors the process started with
+	    // are used; indices beyond their number wrap around.
+	    static int placeThread(int index);
+
+	    //////////
+	    // The socket and core of processor <i>proc</i>, and which SMT
+	    // sibling of the core it is (0 for the first).  Returns false
+	    // if the topology is unknown.
+	    static bool getProcessorTopology(int proc, int& socket, int& core,
+	                                     int& smt);
+
 	    //////////
 	    // Start up several threads that will run in parallel.  A new
 	    // <b>ThreadGroup</b> is created as a child of the optional parent.
@@ -339,6 +375,10 @@ DESCRIPTION
 	    static void checkExit();
 
             static const char* defaultAbortMode;
+	    static PlacementPolicy placementPolicy;
+	    // The processors the process started with, in increasing order.
+	    static int numAvailableProcessors();
+	    static int availableProcessor(int i);
 	    int cpu_;
 	    ~Thread();
 	    Thread_private* priv_;
@@ -111,11 +111,17 @@ ThreadPool::parallel(const ParallelBase& helper, int nthreads)
 			     Thread::Stopped);
       t->setDaemon(true);
       t->detach();
-      t->migrate(i);
+      t->migrate(Thread::placeThread(i));
       t->resume();
     }
   }
-  Thread::self()->migrate(nthreads%Thread::numProcessors());
+  // The caller works alongside the group, so it is placed like the
+  // rest of it for as long as it does.
+  Thread* self = Thread::self();
+  int callerProc = self->getProcessor();
+  int proc = Thread::placeThread(nthreads);
+  if(proc != -1)
+    self->migrate(proc);
   for(int i=0;i<nthreads;i++){
     threads_[i]->helper = &helper;
     //	threads_[i]->start_sema.up();
@@ -126,6 +132,8 @@ ThreadPool::parallel(const ParallelBase& helper, int nthreads)
     //threads_[i]->done_sema.down();
     threads_[i]->helper = 0;
   }
+  if(proc != -1)
+    self->migrate(callerProc);
   lock_.unlock();
 }
 
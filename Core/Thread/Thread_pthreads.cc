@@ -296,6 +296,23 @@ ThreadGroup::gangSchedule()
 }
 
 
+#ifdef __linux
+// The mask that pins a thread to proc, or lets it run on any processor
+// the process started with for -1.
+static void
+getAffinityMask(int proc, cpu_set_t& mask)
+{
+  CPU_ZERO(&mask);
+  if (proc != -1) {
+    CPU_SET(proc, &mask);
+  } else {
+    for (int i = 0;i<Thread::numAvailableProcessors();i++)
+      CPU_SET(Thread::availableProcessor(i), &mask);
+  }
+}
+#endif
+
+
 static
 void
 Thread_shutdown(Thread* thread)
@@ -494,6 +511,15 @@ Thread::os_start(bool stopped)
   pthread_attr_t attr;
   pthread_attr_init(&attr);
   pthread_attr_setstacksize(&attr, stacksize_);
+#ifdef __linux
+  // Start the thread on its processor, so that its stack and everything
+  // else it touches first is allocated on that processor's node.
+  if (cpu_ != -1) {
+    cpu_set_t mask;
+    getAffinityMask(cpu_, mask);
+    pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask);
+  }
+#endif
 
   lock_scheduler();
   active[numActive]=priv_;
@@ -907,6 +933,7 @@ Thread::initialize()
   if (!getenv("THREAD_NO_CATCH_SIGNALS"))
     install_signal_handlers();
   numProcessors();  //initialize the processor count;
+  numAvailableProcessors(); // record the affinity mask before pinning anything
 }
 
 
@@ -921,6 +948,14 @@ void
 Thread::migrate(int proc)
 {
   cpu_ = proc;
+#ifdef __linux
+  // Threads that are not running yet get their affinity in os_start.
+  if (priv_ && priv_->threadid != 0) {
+    cpu_set_t mask;
+    getAffinityMask(proc, mask);
+    pthread_setaffinity_np(priv_->threadid, sizeof(mask), &mask);
+  }
+#endif
 }
 
 
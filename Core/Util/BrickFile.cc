@@ -0,0 +1,196 @@
+#include <Core/Util/BrickFile.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+using namespace Manta;
+using namespace std;
+
+const char BrickFile::Magic[8] = { 'M', 'n', 't', 'B', 'r', 'i', 'c', 'k' };
+
+namespace {
+  size_t roundUp(size_t size, size_t alignment)
+  {
+    return (size + alignment-1)/alignment*alignment;
+  }
+
+  struct OlderBrick {
+    const unsigned int* lastUse;
+    OlderBrick(const unsigned int* lastUse) : lastUse(lastUse) {}
+    bool operator()(int a, int b) const {
+      return lastUse[a] < lastUse[b];
+    }
+  };
+}
+
+BrickFile::BrickFile()
+  : ranges(0), bricks(0), memoryBudget(0), useClock(0),
+    lock("BrickFile lock"), bytes(0), peakBytes(0), faults(0), evictions(0)
+{
+  memset(&header, 0, sizeof(header));
+}
+
+BrickFile::~BrickFile()
+{
+  close();
+}
+
+void BrickFile::layout(Header& header)
+{
+  const int size = header.brickSize;
+  // Every cell (the voxels 0 to n-2 along each axis) belongs to a brick.
+  header.numBricksX = (header.nx-2)/size+1;
+  header.numBricksY = (header.ny-2)/size+1;
+  header.numBricksZ = (header.nz-2)/size+1;
+  const size_t numBricks = (size_t)header.numBricksX*header.numBricksY*header.numBricksZ;
+  header.bricksOffset = roundUp(sizeof(Header) + 2*numBricks*sizeof(float),
+                                BrickAlignment);
+  header.brickStride = roundUp((size_t)(size+1)*(size+1)*(size+1)*header.valueSize,
+                               BrickAlignment);
+}
+
+bool BrickFile::open(const std::string& filename, int valueSize,
+                     size_t memoryBudget)
+{
+  close();
+
+  if (!file.open(filename, MappedFile::ReadOnlyShared))
+    return false;
+
+  const size_t size = file.size();
+  bool valid = size >= sizeof(header);
+  if (valid) {
+    memcpy(&header, file.data(), sizeof(header));
+    Header expected = header;
+    valid = (memcmp(header.magic, Magic, sizeof(header.magic)) == 0 &&
+             header.version == Version &&
+             header.valueSize == valueSize &&
+             header.nx >= 2 && header.ny >= 2 && header.nz >= 2 &&
+             header.brickSize >= 1);
+    if (valid) {
+      layout(expected);
+      valid = (header.numBricksX == expected.numBricksX &&
+               header.numBricksY == expected.numBricksY &&
+               header.numBricksZ == expected.numBricksZ &&
+               header.bricksOffset == expected.bricksOffset &&
+               header.brickStride == expected.brickStride &&
+               header.bricksOffset + getNumBricks()*header.brickStride <= size);
+    }
+  }
+  if (!valid) {
+    file.close();
+    return false;
+  }
+
+  ranges = reinterpret_cast<const float*>(file.data() + sizeof(Header));
+  bricks = file.data() + header.bricksOffset;
+  this->memoryBudget = memoryBudget;
+
+  // Only the bricks that are touched should be read.
+  file.advise(MappedFile::AdviseRandom);
+
+  resident.assign(getNumBricks(), 0);
+  lastUse.assign(getNumBricks(), 0);
+  residentBricks.clear();
+  useClock = 0;
+  bytes = 0;
+  return true;
+}
+
+void BrickFile::close()
+{
+  file.close();
+  ranges = 0;
+  bricks = 0;
+  resident.clear();
+  lastUse.clear();
+  residentBricks.clear();
+  bytes = 0;
+}
+
+void BrickFile::setMemoryBudget(size_t bytes)
+{
+  lock.lock();
+  memoryBudget = bytes;
+  if (this->bytes > memoryBudget)
+    evict();
+  lock.unlock();
+}
+
+void BrickFile::fault(int brick) const
+{
+  lock.lock();
+  lastUse[brick] = ++useClock;
+  if (!resident[brick]) {
+    resident[brick] = 1;
+    residentBricks.push_back(brick);
+    faults++;
+    bytes += header.brickStride;
+    if (bytes > peakBytes)
+      peakBytes = bytes;
+    // Read the whole brick at once rather than a page at a time.
+    file.advise(MappedFile::AdviseWillNeed,
+                brick*header.brickStride + header.bricksOffset,
+                header.brickStride);
+    if (bytes > memoryBudget)
+      evict();
+  }
+  lock.unlock();
+}
+
+void BrickFile::evict() const
+{
+  // Evict down to a little under the budget, so that the next few faults
+  // do not have to evict again.
+  const size_t target = memoryBudget - memoryBudget/8;
+  sort(residentBricks.begin(), residentBricks.end(), OlderBrick(&lastUse[0]));
+
+  // The newest brick is kept, even if it does not fit on its own.
+  size_t count = 0;
+  while (bytes > target && count+1 < residentBricks.size()) {
+    const int brick = residentBricks[count++];
+    resident[brick] = 0;
+    bytes -= header.brickStride;
+    evictions++;
+    // Threads still reading the brick read its pages from the file again.
+    file.advise(MappedFile::AdviseDontNeed,
+                brick*header.brickStride + header.bricksOffset,
+                header.brickStride);
+  }
+  residentBricks.erase(residentBricks.begin(), residentBricks.begin()+count);
+}
+
+BrickFile::Statistics BrickFile::getStatistics() const
+{
+  Statistics stats;
+  lock.lock();
+  stats.faults = faults;
+  stats.evictions = evictions;
+  stats.bricks = residentBricks.size();
+  stats.bytes = bytes;
+  stats.peakBytes = peakBytes;
+  lock.unlock();
+  return stats;
+}
+
+void BrickFile::resetStatistics()
+{
+  lock.lock();
+  faults = 0;
+  evictions = 0;
+  peakBytes = bytes;
+  lock.unlock();
+}
+
+void BrickFile::printStatistics(std::ostream& out) const
+{
+  const Statistics stats = getStatistics();
+  out << "BrickFile " << file.filename() << ": "
+      << stats.faults << " faults, "
+      << stats.evictions << " evictions, "
+      << stats.bricks << " of " << getNumBricks() << " bricks resident ("
+      << stats.bytes/(1024*1024) << " MB, peak "
+      << stats.peakBytes/(1024*1024) << " MB, budget "
+      << memoryBudget/(1024*1024) << " MB)\n";
+}
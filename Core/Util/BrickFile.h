@@ -0,0 +1,134 @@
+#ifndef Manta_Core_BrickFile_h
+#define Manta_Core_BrickFile_h
+
+#include <Core/Thread/Mutex.h>
+#include <Core/Util/MappedFile.h>
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace Manta
+{
+  // A volume that has been cut into bricks and written to disk, mapped
+  // into memory.  Brick (bx, by, bz) holds the voxels from
+  // (bx, by, bz)*brickSize up to and including (bx+1, by+1, bz+1)*brickSize
+  // (clamped to the volume), so all eight corners of every cell lie in
+  // one brick.  The value range of every brick is kept in front of the
+  // voxels, so that it can be read without touching them.
+  //
+  // Bricks are read from the file by the OS the first time they are
+  // touched.  When more bricks than the memory budget have been
+  // touched, the ones used longest ago are dropped from memory again.
+  // A dropped brick can still be read at any time; its pages are simply
+  // read from the file again, so the readers need no locking.
+  //
+  // BrickedGridArray3 gives typed access to the voxels.
+  class BrickFile {
+  public:
+    enum {
+      Version = 1,
+      // Bricks start at multiples of this, so that they can be dropped
+      // from memory one at a time.
+      BrickAlignment = 4096
+    };
+
+    struct Header {
+      char magic[8];
+      int version;
+      int valueSize;
+      int nx, ny, nz;
+      int brickSize;
+      int numBricksX, numBricksY, numBricksZ;
+      float dataMin, dataMax;
+      // Offset of the first brick and the distance between bricks.
+      unsigned long long bricksOffset;
+      unsigned long long brickStride;
+    };
+
+    BrickFile();
+    ~BrickFile();
+
+    // Returns false (and leaves the object closed) if the file could not
+    // be mapped or is not a brick file with values of valueSize bytes.
+    bool open(const std::string& filename, int valueSize,
+              size_t memoryBudget = 512*1024*1024);
+    void close();
+    bool isOpen() const { return file.isOpen(); }
+
+    const Header& getHeader() const { return header; }
+    int getBrickIndex(int bx, int by, int bz) const {
+      return (bz*header.numBricksY + by)*header.numBricksX + bx;
+    }
+    int getNumBricks() const {
+      return header.numBricksX*header.numBricksY*header.numBricksZ;
+    }
+    void getBrickRange(int brick, float& min, float& max) const {
+      min = ranges[2*brick];
+      max = ranges[2*brick+1];
+    }
+
+    // Returns the voxels of a brick, which stay readable for as long as
+    // the file is open.
+    const char* getBrick(int brick) const {
+      // These are only hints for the eviction, so the threads do not
+      // need to agree on them.
+      if(!resident[brick])
+        fault(brick);
+      else if(lastUse[brick] != useClock)
+        lastUse[brick] = useClock;
+      return bricks + brick*header.brickStride;
+    }
+
+    void setMemoryBudget(size_t bytes);
+    size_t getMemoryBudget() const {
+      return memoryBudget;
+    }
+
+    struct Statistics {
+      size_t faults;        // Bricks touched while not resident
+      size_t evictions;     // Bricks dropped from memory
+      size_t bricks;        // Bricks resident now
+      size_t bytes;         // Bytes of bricks resident now
+      size_t peakBytes;
+    };
+    Statistics getStatistics() const;
+    void resetStatistics();
+    void printStatistics(std::ostream& out) const;
+
+    // The start of every brick file.
+    static const char Magic[8];
+
+    // Fills in the fields of header that follow from the others, with
+    // bricks of valueSize byte values.
+    static void layout(Header& header);
+
+  private:
+    BrickFile(const BrickFile&);
+    BrickFile& operator=(const BrickFile&);
+
+    void fault(int brick) const;
+    void evict() const;
+
+    // Only the advice given to the mapping changes after open.
+    mutable MappedFile file;
+    Header header;
+    const float* ranges;
+    const char* bricks;
+    size_t memoryBudget;
+
+    mutable std::vector<char> resident;
+    mutable std::vector<unsigned int> lastUse;
+    mutable unsigned int useClock;
+
+    // Guards everything below as well as the changes to resident.
+    mutable Mutex lock;
+    mutable std::vector<int> residentBricks;
+    mutable size_t bytes;
+    mutable size_t peakBytes;
+    mutable size_t faults;
+    mutable size_t evictions;
+  };
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include <Core/Util/MappedFile.h>
+#include <Core/Util/LargeFile.h>
+
+#include <stdio.h>
+
+#ifdef __unix__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace Manta;
+
+MappedFile::MappedFile()
+  : data_(0), size_(0), mapped_(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+bool MappedFile::open(const std::string& filename, Mode mode)
+{
+  close();
+
+#ifdef __unix__
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat filestat;
+  if (fstat(fd, &filestat) || filestat.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  const size_t size = filestat.st_size;
+  const int prot = (mode == CopyOnWrite) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+  const int flags = (mode == CopyOnWrite) ? MAP_PRIVATE : MAP_SHARED;
+  void* addr = mmap(0, size, prot, flags, fd, 0);
+  // The mapping keeps its own reference to the file.
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+
+  data_ = static_cast<char*>(addr);
+  size_ = size;
+  mapped_ = true;
+#else
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (size <= 0) {
+    fclose(file);
+    return false;
+  }
+  char* buffer = static_cast<char*>(malloc(size));
+  if (!buffer || fread_big(buffer, size, 1, file) != 1) {
+    free(buffer);
+    fclose(file);
+    return false;
+  }
+  fclose(file);
+
+  data_ = buffer;
+  size_ = size;
+  mapped_ = false;
+#endif
+
+  filename_ = filename;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (!data_)
+    return;
+
+#ifdef __unix__
+  if (mapped_)
+    munmap(data_, size_);
+  else
+    free(data_);
+#else
+  free(data_);
+#endif
+
+  data_ = 0;
+  size_ = 0;
+  mapped_ = false;
+  filename_.clear();
+}
+
+bool MappedFile::advise(Advice advice, size_t offset, size_t length)
+{
+  if (!mapped_ || offset >= size_)
+    return false;
+
+#ifdef __unix__
+  // madvise wants a page aligned start address.
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t begin = offset & ~(page-1);
+  const size_t end = (length == 0 || offset+length > size_) ? size_ : offset+length;
+
+  int flag;
+  switch (advice) {
+  case AdviseSequential: flag = MADV_SEQUENTIAL; break;
+  case AdviseRandom:     flag = MADV_RANDOM;     break;
+  case AdviseWillNeed:   flag = MADV_WILLNEED;   break;
+  case AdviseDontNeed:   flag = MADV_DONTNEED;   break;
+  case AdviseHugePages:
+#ifdef MADV_HUGEPAGE
+    flag = MADV_HUGEPAGE;
+    break;
+#else
+    return false;
+#endif
+  default:               flag = MADV_NORMAL;     break;
+  }
+  return madvise(data_ + begin, end - begin, flag) == 0;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,68 @@
+#ifndef Manta_Core_MappedFile_h
+#define Manta_Core_MappedFile_h
+
+#include <stdlib.h>
+#include <string>
+
+namespace Manta
+{
+  // A read-mostly view of a file on disk.  On unix systems the file is
+  // mmap'ed so that nothing is read until it is touched and several
+  // processes mapping the same file share one page cache copy.  On
+  // other systems the file is simply read into memory.
+  class MappedFile {
+  public:
+    enum Mode {
+      // Pages are read-only and shared with every other mapping of the
+      // file.
+      ReadOnlyShared,
+      // Pages start out shared but may be written to, in which case the
+      // written page is privately copied.  Nothing is written back to
+      // the file.
+      CopyOnWrite
+    };
+
+    enum Advice {
+      AdviseNormal,
+      AdviseSequential,
+      AdviseRandom,
+      AdviseWillNeed,
+      // Back the mapping with transparent huge pages if the kernel
+      // supports it.
+      AdviseHugePages,
+      // Drops the pages from memory.  A ReadOnlyShared mapping reads
+      // them from the file again when they are next touched; the
+      // changes to a CopyOnWrite mapping are lost.
+      AdviseDontNeed
+    };
+
+    MappedFile();
+    ~MappedFile();
+
+    // Returns false (and leaves the object closed) if the file could not
+    // be opened or mapped.
+    bool open(const std::string& filename, Mode mode = ReadOnlyShared);
+    void close();
+
+    // Passes a hint about the expected access pattern on to the OS.
+    // A length of 0 means up to the end of the file.  Returns false if
+    // the hint is not supported.
+    bool advise(Advice advice, size_t offset = 0, size_t length = 0);
+
+    bool isOpen() const { return data_ != 0; }
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string& filename() const { return filename_; }
+
+  private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    char* data_;
+    size_t size_;
+    bool mapped_;
+    std::string filename_;
+  };
+}
+
+#endif
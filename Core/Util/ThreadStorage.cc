@@ -29,6 +29,7 @@
 #include <Core/Util/ThreadStorage.h>
 #include <Interface/Context.h>
 #include <cstdlib>
+#include <cstring>
 
 using namespace Manta;
 
@@ -74,5 +75,9 @@ void ThreadStorage::allocateStorage( int proc ) {
 
   if (storage[proc] == 0)
     throw InternalError( "Could not allocate thread local memory");
+
+  // Touch the memory here, in the thread that owns it, so that its
+  // pages are placed on the owner's NUMA node.
+  memset( storage[proc], 0, requested );
 }
 
@@ -42,6 +42,7 @@
 #include <Interface/LightSet.h>
 #include <Interface/LoadBalancer.h>
 #include <Interface/Object.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/PixelSampler.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
@@ -89,6 +90,27 @@ using namespace std;
 #define RENDER_THREAD_STACKSIZE 8*1024*1024
 #define USE_UPDATE_GRAPH 0
 
+// Prints where Thread::placeThread puts render threads [first, last).
+static void printPlacement(int first, int last)
+{
+  if(Thread::getPlacementPolicy() == Thread::NoPlacement || first >= last)
+    return;
+  cerr << "RTRT: " << Thread::getPlacementPolicyName(Thread::getPlacementPolicy())
+       << " placement of render threads " << first << " to " << last-1 << ":";
+  for(int i=first;i<last;i++){
+    int proc = Thread::placeThread(i);
+    int socket, core, smt;
+    cerr << (i == first ? " " : ", ") << i << "->cpu " << proc;
+    if(Thread::getProcessorTopology(proc, socket, core, smt)){
+      cerr << " (socket " << socket << ", core " << core;
+      if(smt > 0)
+        cerr << ", smt " << smt;
+      cerr << ")";
+    }
+  }
+  cerr << "\n";
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
@@ -152,6 +174,7 @@ RTRT::RTRT()
   workersAnimAndImage=0;
   workersChanged = false;
   lastChanged = false;
+  frameProfile = 0;
   running=false;
   animFrameState.frameSerialNumber = 0;
   animFrameState.animationFrameNumber = 0;
@@ -522,6 +545,7 @@ void RTRT::beginRendering(bool blockUntilFinished) throw (Exception &)
   }
 
   // Startup rendering threads.
+  printPlacement(0, workersWanted);
   for(int i=0;i<workersWanted;i++){
     if(i>0 || !blockUntilFinished){
       ostringstream name;
@@ -529,7 +553,7 @@ void RTRT::beginRendering(bool blockUntilFinished) throw (Exception &)
       Thread* t = workers[i] =
         new Thread(new Worker(this, i, false), name.str().c_str(),
                    0, Thread::NotActivated);
-      t->migrate(i);
+      t->migrate(Thread::placeThread(i));
       t->setStackSize(RENDER_THREAD_STACKSIZE);
       t->activate(false);
     }
@@ -538,8 +562,13 @@ void RTRT::beginRendering(bool blockUntilFinished) throw (Exception &)
   // All rendering threads active.
 
   // Block until finished is set while running in bin/manta
-  if(blockUntilFinished)
+  if(blockUntilFinished){
+    // The calling thread becomes worker 0 for good, so it is pinned
+    // like one.  Without a placement policy its affinity is left alone.
+    if(Thread::placeThread(0) != -1)
+      Thread::self()->migrate(Thread::placeThread(0));
     internalRenderLoop(0, false);
+  }
 
 }
 
@@ -681,6 +710,12 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
 
   bool changed = true;
   bool firstFrame = true;
+  // The frame this thread is working on, and the start of the stage it is
+  // in, for the frame profile.
+  long profileFrame = 0;
+  double stageStart = 0;
+  // Temporary ray packets for everything this thread renders.
+  RayPacketArena packetArena;
   if(lateComerFlag){
     firstFrame = false;
     goto skipToRendering;
@@ -753,7 +788,10 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
     // Start of non-rendering portion of the loop. Make callbacks
     // that could possibly change state and get everything set up to
     // render the next frame
+    stageStart = profileStart();
     barrier1.wait(workersRendering);
+    profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
+    profileFrame = animFrameState.frameSerialNumber;
 
     // Copy over the frame state
     if(proc == 0)
@@ -763,20 +801,33 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
     changed=false;
     //callbackLock.readLock();
 
-    if(proc == 0)
+    if(proc == 0){
+      stageStart = profileStart();
       postTransactions(changed);
+      profileStage(proc, FrameProfile::Transactions, profileFrame, stageStart);
+    }
 
+    stageStart = profileStart();
     barrier1.wait(workersRendering);
+    profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
 
 #if !(USE_UPDATE_GRAPH)
+    stageStart = profileStart();
     doSerialAnimationCallbacks(changed, proc, workersAnimAndImage);
     doParallelAnimationCallbacks(changed, proc, workersAnimAndImage);
+    profileStage(proc, FrameProfile::Animation, profileFrame, stageStart);
 #else
 #warning "Using UpdateGraph instead of animation callbacks"
+    stageStart = profileStart();
     doSerialAnimationCallbacks(changed, proc, workersAnimAndImage);
     doParallelAnimationCallbacks(changed, proc, workersAnimAndImage);
+    profileStage(proc, FrameProfile::Animation, profileFrame, stageStart);
+    stageStart = profileStart();
     doUpdates(changed, proc, workersRendering);
+    profileStage(proc, FrameProfile::Update, profileFrame, stageStart);
+    stageStart = profileStart();
     barrier1.wait(workersRendering);
+    profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
     if (proc == 0) {
       // NOTE(boulos): Use this code to rebuild the first Object in the group every frame
 #warning "Sending update transaction for first Object in group"
@@ -788,6 +839,7 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
     }
 #endif
 
+    stageStart = profileStart();
     if(!firstFrame){
       for(size_t index = 0;index < channels.size();index++){
         Channel* channel = channels[index];
@@ -821,13 +873,14 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
         rngs.resize(newWorkers);
         int oldworkers = workersRendering;
         workersRendering = workersWanted;
+        printPlacement(oldworkers, newWorkers);
         for(int i=oldworkers;i<newWorkers;i++){
           ostringstream name;
           name << "RTRT Worker " << i;
           workers[i] = new Thread(new Worker(this, i, true), name.str().c_str(),
                                   0, Thread::NotActivated);
 
-          workers[i]->migrate(i);
+          workers[i]->migrate(Thread::placeThread(i));
           // Set the stack size.
           workers[i]->setStackSize(RENDER_THREAD_STACKSIZE);
 
@@ -851,6 +904,7 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
       }
       if (workersChanged) pipelineNeedsSetup = true;
     }
+    profileStage(proc, FrameProfile::Setup, profileFrame, stageStart);
 
     // New scope to control variable lifetimes
     {
@@ -859,7 +913,9 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
       // after the barrier, and we need to reduce on that number
       int numProcs = workersAnimAndImage;
       changedFlags[proc].changed = changed;
+      stageStart = profileStart();
       barrier2.wait(numProcs);
+      profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
       changed=false;
       for(int i=0;i<numProcs;i++){
         if(changedFlags[i].changed){
@@ -869,10 +925,15 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
       }
 
       if(changed != lastChanged || firstFrame){
-        if(proc == 0)
+        if(proc == 0){
+          stageStart = profileStart();
           doIdleModeCallbacks(changed, firstFrame, pipelineNeedsSetup,
                               proc, numProcs);
+          profileStage(proc, FrameProfile::Setup, profileFrame, stageStart);
+        }
+        stageStart = profileStart();
         barrier2.wait(numProcs);
+        profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
         lastChanged = changed;
       }
       if(firstFrame)
@@ -881,6 +942,7 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
       if(pipelineNeedsSetup){
 
         // Negotiate the image pipeline for each channel
+        stageStart = profileStart();
         if(proc == 0){
           // Send the number of workers wanted to setupPipelines, so
           // that we can allocate memory for the new set of render
@@ -892,8 +954,13 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
           resizeImages(renderFrameState.frameSerialNumber);
         }
 
+        profileStage(proc, FrameProfile::Setup, profileFrame, stageStart);
+
         // Wait for processor zero to setup the image pipeline
+        stageStart = profileStart();
         barrier3.wait(numProcs);
+        profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
+        stageStart = profileStart();
 
         // Allocate thread local storage for each thread.
         if(proc < workersRendering) {
@@ -917,12 +984,16 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
 
           currentImageTraverser->setupFrame(myContext);
         }
+        profileStage(proc, FrameProfile::Setup, profileFrame, stageStart);
+        stageStart = profileStart();
         barrier3.wait(numProcs);
+        profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
         pipelineNeedsSetup = false;
       }
 
       if (displayBeforeRender) {
         // Image display, if image is valid
+        stageStart = profileStart();
         for(ChannelListType::iterator iter = channels.begin();
             iter != channels.end(); iter++) {
           Channel* channel = *iter;
@@ -933,6 +1004,7 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
             channel->display->displayImage(myContext, image);
           }
         }
+        profileStage(proc, FrameProfile::Display, profileFrame-1, stageStart);
       }
 
       // Possibly change # of workers
@@ -961,14 +1033,19 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
       }
     }
   skipToRendering:
+    profileFrame = renderFrameState.frameSerialNumber;
     // Pre-render callbacks
     //callbackLock.readLock();
+    stageStart = profileStart();
     doSerialPreRenderCallbacks(proc, workersRendering);
     doParallelPreRenderCallbacks(proc, workersRendering);
+    profileStage(proc, FrameProfile::PreRender, profileFrame, stageStart);
     //callbackLock.readUnlock();
 
     if(workersChanged){
+      stageStart = profileStart();
       workers_changed_barrier.wait(workersRendering);
+      profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
       if(proc == 0)
         changedFlags.resize(workersRendering);
     }
@@ -977,6 +1054,7 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
     //if(!idle){
     // #endif
     {
+      stageStart = profileStart();
       for(size_t index = 0;index < channels.size();index++){
         Channel* channel = channels[index];
         long renderFrame = renderFrameState.frameSerialNumber%channel->pipelineDepth;
@@ -987,8 +1065,10 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
                                 channel->camera, scene, thread_storage,
                                 rngs[proc],
                                 currentSampleGenerator);
+        myContext.packetArena = &packetArena;
         currentImageTraverser->renderImage(myContext, image);
       }
+      profileStage(proc, FrameProfile::Render, profileFrame, stageStart);
     }
     // #if NOTFINISHED
     //    how to set rendering complete flag?;
@@ -1000,9 +1080,12 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
     //#endif
 
     if (!displayBeforeRender) {
+      stageStart = profileStart();
       barrier1.wait(workersRendering);
+      profileStage(proc, FrameProfile::Barrier, profileFrame, stageStart);
 
       // Image display, if image is valid
+      stageStart = profileStart();
       for(ChannelListType::iterator iter = channels.begin();
           iter != channels.end(); iter++){
         Channel* channel = *iter;
@@ -1013,9 +1096,13 @@ void RTRT::internalRenderLoop(int proc, bool lateComerFlag)
           channel->display->displayImage(myContext, image);
         }
       }
+      profileStage(proc, FrameProfile::Display, profileFrame, stageStart);
     }
   }
 
+  if(frameProfile)
+    frameProfile->recordPacketHighWaterMark(proc, packetArena.getHighWaterMark());
+
 #ifdef MANTA_SSE
   // Restore floating point register flags
   _mm_setcsr( oldMXCSR ); //write the new MXCSR setting to the MXCSR
@@ -1572,6 +1659,9 @@ void RTRT::shootOneRay( Color &result_color, RayPacket &result_rays, Real image_
                                channel->camera, scene, thread_storage,
                                rngs[0],
                                currentSampleGenerator);
+  // The calling thread has no arena of its own.
+  RayPacketArena packetArena;
+  render_context.packetArena = &packetArena;
 
   // Send this to the renderer.  It will fill in the colors for us.
   currentRenderer->traceEyeRays( render_context, result_rays );
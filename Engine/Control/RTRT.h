@@ -30,6 +30,7 @@
 #define Manta_Engine_RTRT_h
 
 #include <Interface/MantaInterface.h>
+#include <Interface/FrameProfile.h>
 #include <Interface/FrameState.h>
 #include <Interface/Object.h>
 #include <Parameters.h>
@@ -88,6 +89,13 @@ namespace Manta {
       return displayBeforeRender;
     }
 
+    virtual void setFrameProfile(FrameProfile* profile) {
+      frameProfile = profile;
+    }
+    virtual FrameProfile* getFrameProfile() const {
+      return frameProfile;
+    }
+
     // Image Traversers
     virtual void setImageTraverser( ImageTraverser *image_traverser_ );
     virtual ImageTraverser *getImageTraverser() const;
@@ -326,6 +334,17 @@ namespace Manta {
     vector<ReductionData> changedFlags;
     bool lastChanged;
 
+    // Frame profiling.  Not owned; both helpers do nothing without one.
+    FrameProfile* frameProfile;
+    double profileStart() const {
+      return frameProfile ? FrameProfile::currentTime() : 0;
+    }
+    void profileStage(int proc, FrameProfile::Stage stage, long frame,
+                      double start) {
+      if(frameProfile)
+        frameProfile->record(proc, stage, frame, start);
+    }
+
     ///////////////////////////////////////////////////////////////////////////
     // Callbacks Queues
 
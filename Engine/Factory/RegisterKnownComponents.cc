@@ -45,6 +45,7 @@
 #include <Engine/LoadBalancers/CyclicLoadBalancer.h>
 #include <Engine/LoadBalancers/SimpleLoadBalancer.h>
 #include <Engine/LoadBalancers/WQLoadBalancer.h>
+#include <Engine/LoadBalancers/WSLoadBalancer.h>
 #include <Engine/PixelSamplers/ClusterSampler.h>
 #include <Engine/PixelSamplers/FastSampler.h>
 #include <Engine/PixelSamplers/JitterSampler.h>
@@ -118,6 +119,7 @@ namespace Manta {
     engine->registerComponent("cyclic", &CyclicLoadBalancer::create);
     engine->registerComponent("simple", &SimpleLoadBalancer::create);
     engine->registerComponent("workqueue", &WQLoadBalancer::create);
+    engine->registerComponent("workstealing", &WSLoadBalancer::create);
 
     // Register pixel samplers
     engine->registerComponent("fast", &FastSampler::create);
@@ -31,7 +31,9 @@
 #include <Core/Exceptions/IllegalArgument.h>
 #include <Core/Math/MinMax.h>
 #include <Core/Math/Expon.h>
+#include <Core/Math/MiscMath.h>
 #include <Core/Thread/Mutex.h>
+#include <Core/Thread/Time.h>
 #include <Core/Util/Args.h>
 #include <Core/Util/NotFinished.h>
 #include <Interface/Context.h>
@@ -45,13 +47,17 @@
 
 using namespace Manta;
 
+// Weight of the newest frame in the per-cell cost average.
+static const float kCostBlend = 0.5f;
+
 ImageTraverser* TiledImageTraverser::create(const vector<string>& args)
 {
   return new TiledImageTraverser(args);
 }
 
 TiledImageTraverser::TiledImageTraverser( const int xtilesize_, const int ytilesize_ )
-  : xtilesize( xtilesize_ ), ytilesize( ytilesize_ )
+  : xtilesize( xtilesize_ ), ytilesize( ytilesize_ ),
+    adaptive( false ), cellsize( 8 )
 {
   if (xtilesize == ytilesize)
     shape = Fragment::SquareShape;
@@ -74,6 +80,8 @@ TiledImageTraverser::TiledImageTraverser(const vector<string>& args)
   ytilesize = Min(64, 8 * static_cast<int>(Sqrt(static_cast<Real>(Fragment::MaxSize))));
 #endif
   shape = Fragment::LineShape;
+  adaptive = false;
+  cellsize = 8;
   for(size_t i = 0; i<args.size();i++){
     string arg = args[i];
     if(arg == "-tilesize"){
@@ -87,6 +95,14 @@ TiledImageTraverser::TiledImageTraverser(const vector<string>& args)
                                   i, args);
 */
         shape = Fragment::SquareShape;
+    } else if (arg == "-adaptive") {
+      adaptive = true;
+    } else if (arg == "-cellsize") {
+      if(!getIntArg(i, args, cellsize) || cellsize < 1)
+        throw IllegalArgument("TiledImageTraverser -cellsize", i, args);
+      // Tiles have to start on a multiple of 4 pixels in x, or the SSE
+      // code in SimpleImage::set writes to unaligned memory.
+      cellsize = (cellsize+3)&(~3);
     } else {
       throw IllegalArgument("TiledImageTraverser", i, args);
     }
@@ -101,6 +117,8 @@ void TiledImageTraverser::setupBegin(SetupContext& context, int numChannels)
 {
   context.loadBalancer->setupBegin(context, numChannels);
   context.pixelSampler->setupBegin(context, numChannels);
+  if(adaptive)
+    channelInfo.resize(numChannels);
 }
 
 void TiledImageTraverser::setupDisplayChannel(SetupContext& context)
@@ -116,6 +134,27 @@ void TiledImageTraverser::setupDisplayChannel(SetupContext& context)
 
   // Tell the load balancer how much work to assign.
   int numAssignments = xtiles * ytiles;
+
+  if(adaptive){
+    // The adaptive layout has as many tiles as the fixed one, but never
+    // more than there are cells.
+    ChannelInfo& ci = channelInfo[context.channelIndex];
+    int xcells = (xres + cellsize-1)/cellsize;
+    int ycells = (yres + cellsize-1)/cellsize;
+    if(ci.xres != xres || ci.yres != yres || ci.xcells != xcells ||
+       ci.ycells != ycells){
+      ci.xres = xres;
+      ci.yres = yres;
+      ci.xcells = xcells;
+      ci.ycells = ycells;
+      ci.cost.assign(xcells*ycells, 1.0f);
+      ci.measured = false;
+      ci.rendered = false;
+    }
+    numAssignments = Min(numAssignments, xcells*ycells);
+    ci.numTiles = numAssignments;
+    layoutTiles(ci);
+  }
   context.loadBalancer->setupDisplayChannel(context, numAssignments);
 
   // Continue setting up the rendering stack.
@@ -124,6 +163,16 @@ void TiledImageTraverser::setupDisplayChannel(SetupContext& context)
 
 void TiledImageTraverser::setupFrame(const RenderContext& context)
 {
+  // Nobody renders until every thread is done with setupFrame, so proc 0
+  // can lay the tiles out for the coming frame.
+  if(adaptive && context.proc == 0){
+    ChannelInfo& ci = channelInfo[context.channelIndex];
+    if(ci.rendered){
+      ci.measured = true;
+      ci.rendered = false;
+      layoutTiles(ci);
+    }
+  }
   context.loadBalancer->setupFrame(context);
   context.pixelSampler->setupFrame(context);
 }
@@ -137,11 +186,24 @@ void TiledImageTraverser::renderImage(const RenderContext& context, Image* image
   image->getResolution(stereo, xres, yres);
   int numEyes = stereo?2:1;
 
+  ChannelInfo* ci = 0;
+  if(adaptive)
+    ci = &channelInfo[context.channelIndex];
+
   int s,e;
   while(context.loadBalancer->getNextAssignment(context, s, e)){
 
     for(int assignment = s; assignment < e; assignment++){
 
+      if(ci){
+        const Tile& tile = ci->tiles[assignment];
+        double start = Time::currentSeconds();
+        renderTile(context, image, tile.xstart, tile.xend, tile.ystart, tile.yend,
+                   xres, numEyes);
+        recordCost(*ci, tile, Time::currentSeconds()-start);
+        continue;
+      }
+
       int xtile = assignment/ytiles;
       int ytile = assignment%ytiles;
       int xstart = xtile * xtilesize;
@@ -156,153 +218,275 @@ void TiledImageTraverser::renderImage(const RenderContext& context, Image* image
       if(yend > yres)
         yend = yres;
 
+      renderTile(context, image, xstart, xend, ystart, yend, xres, numEyes);
+    }
+  }
+  // This can potentially happen before the other procesors are finished
+  // rendering, but that is okay because it won't get displayed until
+  // everyone enters the barrier anyway
+  if(context.proc == 0){
+    image->setValid(true);
+    if(ci)
+      ci->rendered = true;
+  }
+}
+
+void TiledImageTraverser::renderTile(const RenderContext& context, Image* image,
+                                     int xstart, int xend, int ystart, int yend,
+                                     int xres, int numEyes)
+{
 #ifdef MANTA_SSE
-      __m128i vec_4 = _mm_set1_epi32(4);
-      __m128i vec_cascade = _mm_set_epi32(3, 2, 1, 0);
+  __m128i vec_4 = _mm_set1_epi32(4);
+  __m128i vec_cascade = _mm_set_epi32(3, 2, 1, 0);
 #endif
-      // Create a Fragment that is consecutive in X pixels
-      switch (shape) {
-      case Fragment::LineShape:
-      {
-          Fragment frag(Fragment::LineShape, Fragment::ConsecutiveX|Fragment::ConstantEye);
-
-          int fsize = Min(Fragment::MaxSize, xend-xstart);
-          for(int eye = 0; eye < numEyes; eye++){
+  // Create a Fragment that is consecutive in X pixels
+  switch (shape) {
+  case Fragment::LineShape:
+  {
+      Fragment frag(Fragment::LineShape, Fragment::ConsecutiveX|Fragment::ConstantEye);
+
+      int fsize = Min(Fragment::MaxSize, xend-xstart);
+      for(int eye = 0; eye < numEyes; eye++){
 #ifdef MANTA_SSE
-              // This finds the upper bound of the groups of 4.  Even if you
-              // write more than you need (say 8 for a fragment size of 6),
-              // you won't blow the top of the array, because
-              // (Fragment::MaxSize+3)&(~3) == Fragment::MaxSize.
-              int e = (fsize+3)&(~3);
-              __m128i vec_eye = _mm_set1_epi32(eye);
-              for(int i=0;i<e;i+=4)
-                  _mm_store_si128((__m128i*)&frag.whichEye[i], vec_eye);
+          // This finds the upper bound of the groups of 4.  Even if you
+          // write more than you need (say 8 for a fragment size of 6),
+          // you won't blow the top of the array, because
+          // (Fragment::MaxSize+3)&(~3) == Fragment::MaxSize.
+          int e = (fsize+3)&(~3);
+          __m128i vec_eye = _mm_set1_epi32(eye);
+          for(int i=0;i<e;i+=4)
+              _mm_store_si128((__m128i*)&frag.whichEye[i], vec_eye);
 #else
-              for(int i=0;i<fsize;i++)
-                  frag.whichEye[i] = eye;
+          for(int i=0;i<fsize;i++)
+              frag.whichEye[i] = eye;
 #endif
 
-              // Two versions.  If the assignment is narrower than a fragment, we
-              // can enable a few optimizations
-              if(xend-xstart <= Fragment::MaxSize){
-                  // Common case - one packet in X direction
-                  int size = xend-xstart;
+          // Two versions.  If the assignment is narrower than a fragment, we
+          // can enable a few optimizations
+          if(xend-xstart <= Fragment::MaxSize){
+              // Common case - one packet in X direction
+              int size = xend-xstart;
 #ifdef MANTA_SSE
-                  __m128i vec_x = _mm_add_epi32(_mm_set1_epi32(xstart), vec_cascade);
-                  for(int i=0;i<size;i+=4){
-                      // This will spill over by up to 3 pixels
-                      _mm_store_si128((__m128i*)&frag.pixel[0][i], vec_x);
-                      vec_x = _mm_add_epi32(vec_x, vec_4);
-                  }
+              __m128i vec_x = _mm_add_epi32(_mm_set1_epi32(xstart), vec_cascade);
+              for(int i=0;i<size;i+=4){
+                  // This will spill over by up to 3 pixels
+                  _mm_store_si128((__m128i*)&frag.pixel[0][i], vec_x);
+                  vec_x = _mm_add_epi32(vec_x, vec_4);
+              }
 #else
-                  for(int i=0;i<size;i++)
-                      frag.pixel[0][i] = i+xstart;
+              for(int i=0;i<size;i++)
+                  frag.pixel[0][i] = i+xstart;
 #endif
-                  frag.setSize(size);
-                  for(int y = ystart; y<yend; y++){
+              frag.setSize(size);
+              for(int y = ystart; y<yend; y++){
 #ifdef MANTA_SSE
-                      int e = (fsize+3)&(~3);
-                      __m128i vec_y = _mm_set1_epi32(y);
-                      for(int i=0;i<e;i+=4)
-                          _mm_store_si128((__m128i*)&frag.pixel[1][i], vec_y);
+                  int e = (fsize+3)&(~3);
+                  __m128i vec_y = _mm_set1_epi32(y);
+                  for(int i=0;i<e;i+=4)
+                      _mm_store_si128((__m128i*)&frag.pixel[1][i], vec_y);
 #else
-                      for(int i=0;i<fsize;i++)
-                          frag.pixel[1][i] = y;
+                  for(int i=0;i<fsize;i++)
+                      frag.pixel[1][i] = y;
 #endif
-                      context.rng->seed(xstart*xres+y);
-                      context.pixelSampler->renderFragment(context, frag);
-                      image->set(frag);
-                  }
-              } else {
-                  // General case (multiple packets in X direction)
-                  for(int y = ystart; y<yend; y++){
+                  context.rng->seed(xstart*xres+y);
+                  context.pixelSampler->renderFragment(context, frag);
+                  image->set(frag);
+              }
+          } else {
+              // General case (multiple packets in X direction)
+              for(int y = ystart; y<yend; y++){
 #ifdef MANTA_SSE
-                      int e = (fsize+3)&(~3);
-                      __m128i vec_y = _mm_set1_epi32(y);
-                      for(int i=0;i<e;i+=4)
-                          _mm_store_si128((__m128i*)&frag.pixel[1][i], vec_y);
+                  int e = (fsize+3)&(~3);
+                  __m128i vec_y = _mm_set1_epi32(y);
+                  for(int i=0;i<e;i+=4)
+                      _mm_store_si128((__m128i*)&frag.pixel[1][i], vec_y);
 #else
-                      for(int i=0;i<fsize;i++)
-                          frag.pixel[1][i] = y;
+                  for(int i=0;i<fsize;i++)
+                      frag.pixel[1][i] = y;
 #endif
-                      for(int x = xstart; x<xend; x+= Fragment::MaxSize){
-                          // This catches cases where xend-xstart is larger than
-                          // Fragment::MaxSize.
-                          int xnarf = x+Fragment::MaxSize;
-                          if (xnarf > xend) xnarf = xend;
-                          int size = xnarf-x;
+                  for(int x = xstart; x<xend; x+= Fragment::MaxSize){
+                      // This catches cases where xend-xstart is larger than
+                      // Fragment::MaxSize.
+                      int xnarf = x+Fragment::MaxSize;
+                      if (xnarf > xend) xnarf = xend;
+                      int size = xnarf-x;
 #ifdef MANTA_SSE
-                          __m128i vec_x = _mm_add_epi32(_mm_set1_epi32(x), vec_cascade);
-                          for(int i=0;i<size;i+=4){
-                              // This will spill over by up to 3 pixels
-                              _mm_store_si128((__m128i*)&frag.pixel[0][i], vec_x);
-                              vec_x = _mm_add_epi32(vec_x, vec_4);
-                          }
+                      __m128i vec_x = _mm_add_epi32(_mm_set1_epi32(x), vec_cascade);
+                      for(int i=0;i<size;i+=4){
+                          // This will spill over by up to 3 pixels
+                          _mm_store_si128((__m128i*)&frag.pixel[0][i], vec_x);
+                          vec_x = _mm_add_epi32(vec_x, vec_4);
+                      }
 #else
-                          for(int i=0;i<size;i++)
-                              frag.pixel[0][i] = i+x;
+                      for(int i=0;i<size;i++)
+                          frag.pixel[0][i] = i+x;
 #endif
-                          frag.setSize(size);
-                          context.rng->seed(x*xres+y);
-                          context.pixelSampler->renderFragment(context, frag);
-                          image->set(frag);
-                      }
+                      frag.setSize(size);
+                      context.rng->seed(x*xres+y);
+                      context.pixelSampler->renderFragment(context, frag);
+                      image->set(frag);
                   }
               }
           }
       }
-      break;
-      case Fragment::SquareShape:
-      {
-          Fragment frag(Fragment::SquareShape, Fragment::ConstantEye);
+  }
+  break;
+  case Fragment::SquareShape:
+  {
+      Fragment frag(Fragment::SquareShape, Fragment::ConstantEye);
 
-          // Square Shaped fragments of about RayPacket::MaxSize each
-          static const int sqrt_size = static_cast<int>(Sqrt(RayPacket::MaxSize));
-          static const int full_size = sqrt_size * sqrt_size;
+      // Square Shaped fragments of about RayPacket::MaxSize each
+      static const int sqrt_size = static_cast<int>(Sqrt(RayPacket::MaxSize));
+      static const int full_size = sqrt_size * sqrt_size;
 
-          for(int eye = 0; eye < numEyes; eye++){
+      for(int eye = 0; eye < numEyes; eye++){
 
-              for(int i=0;i<full_size;i++)
-                  frag.whichEye[i] = eye;
+          for(int i=0;i<full_size;i++)
+              frag.whichEye[i] = eye;
 
-              for (int y = ystart; y < yend; y += sqrt_size) {
-                  for (int x = xstart; x < xend; x += sqrt_size) {
+          for (int y = ystart; y < yend; y += sqrt_size) {
+              for (int x = xstart; x < xend; x += sqrt_size) {
 
-                      int j_end = Min(yend - y, sqrt_size);
-                      int i_end = Min(xend - x, sqrt_size);
+                  int j_end = Min(yend - y, sqrt_size);
+                  int i_end = Min(xend - x, sqrt_size);
 
-                      for (int j = 0; j < j_end; ++j) {
-                          for (int i = 0; i < i_end; ++i) {
-                              frag.pixel[0][j*i_end + i] = x + i;
-                              frag.pixel[1][j*i_end + i] = y + j;
-                          }
-                      }
-                      // NOTE(boulos): If these get clipped, it's not
-                      // actually Square (but it is a
-                      // Rectangle... maybe we should add that?)
-                      if (i_end != sqrt_size ||
-                          j_end != sqrt_size) {
-                        frag.shape = Fragment::UnknownShape;
+                  for (int j = 0; j < j_end; ++j) {
+                      for (int i = 0; i < i_end; ++i) {
+                          frag.pixel[0][j*i_end + i] = x + i;
+                          frag.pixel[1][j*i_end + i] = y + j;
                       }
-                      frag.setSize(j_end * i_end);
-                      context.rng->seed(x*xres+y);
-                      context.pixelSampler->renderFragment(context, frag);
-
-                      image->set(frag);
                   }
+                  // NOTE(boulos): If these get clipped, it's not
+                  // actually Square (but it is a
+                  // Rectangle... maybe we should add that?)
+                  if (i_end != sqrt_size ||
+                      j_end != sqrt_size) {
+                    frag.shape = Fragment::UnknownShape;
+                  }
+                  frag.setSize(j_end * i_end);
+                  context.rng->seed(x*xres+y);
+                  context.pixelSampler->renderFragment(context, frag);
+
+                  image->set(frag);
               }
           }
       }
+  }
+  break;
+  default:
       break;
-      default:
-          break;
-      }
+  }
+}
+
+TiledImageTraverser::ChannelInfo::ChannelInfo()
+  : xres(0), yres(0), xcells(0), ycells(0), numTiles(0),
+    rendered(false), measured(false)
+{
+}
 
+const vector<float>& TiledImageTraverser::getCostMap(int channel, int& xcells,
+                                                     int& ycells) const
+{
+  const ChannelInfo& ci = channelInfo[channel];
+  xcells = ci.xcells;
+  ycells = ci.ycells;
+  return ci.cost;
+}
+
+const vector<TiledImageTraverser::Tile>&
+TiledImageTraverser::getTiles(int channel) const
+{
+  return channelInfo[channel].tiles;
+}
+
+void TiledImageTraverser::recordCost(ChannelInfo& ci, const Tile& tile,
+                                     double seconds)
+{
+  // Spread the time over the cells of the tile by pixel count.  Tiles are
+  // made of whole cells, so no other thread writes these cells.
+  const float per_pixel = static_cast<float>(seconds /
+    ((tile.xend-tile.xstart)*(tile.yend-tile.ystart)));
+  const int cx0 = tile.xstart/cellsize;
+  const int cx1 = (tile.xend + cellsize-1)/cellsize;
+  const int cy0 = tile.ystart/cellsize;
+  const int cy1 = (tile.yend + cellsize-1)/cellsize;
+  for(int cy = cy0; cy < cy1; cy++){
+    const int pixels_y = Min((cy+1)*cellsize, ci.yres) - cy*cellsize;
+    for(int cx = cx0; cx < cx1; cx++){
+      const int pixels_x = Min((cx+1)*cellsize, ci.xres) - cx*cellsize;
+      const float cost = per_pixel*pixels_x*pixels_y;
+      float& cell = ci.cost[cy*ci.xcells + cx];
+      if(ci.measured)
+        cell += kCostBlend*(cost - cell);
+      else
+        cell = cost;
     }
   }
-  // This can potentially happen before the other procesors are finished
-  // rendering, but that is okay because it won't get displayed until
-  // everyone enters the barrier anyway
-  if(context.proc == 0)
-    image->setValid(true);
+}
+
+void TiledImageTraverser::layoutTiles(ChannelInfo& ci)
+{
+  ci.tiles.clear();
+  ci.tiles.reserve(ci.numTiles);
+  if(ci.numTiles > 0)
+    splitTiles(ci, 0, 0, ci.xcells, ci.ycells, ci.numTiles);
+}
+
+void TiledImageTraverser::splitTiles(ChannelInfo& ci, int cx0, int cy0,
+                                     int cx1, int cy1, int n)
+{
+  if(n == 1){
+    Tile tile;
+    tile.xstart = cx0*cellsize;
+    tile.ystart = cy0*cellsize;
+    tile.xend = Min(cx1*cellsize, ci.xres);
+    tile.yend = Min(cy1*cellsize, ci.yres);
+    ci.tiles.push_back(tile);
+    return;
+  }
+
+  // Cut across the longer side, where the cost on either side best
+  // matches the number of tiles it gets.  Depth first, so neighboring
+  // assignments stay close together in the image.
+  const int nx = cx1-cx0;
+  const int ny = cy1-cy0;
+  const bool xsplit = (nx >= ny && nx > 1) || ny == 1;
+  const int k = xsplit ? nx : ny;
+  const int m = xsplit ? ny : nx;
+
+  vector<double> slice(k, 0.0);
+  double total = 0;
+  for(int cy = cy0; cy < cy1; cy++){
+    for(int cx = cx0; cx < cx1; cx++){
+      const double cost = ci.cost[cy*ci.xcells + cx];
+      slice[xsplit ? cx-cx0 : cy-cy0] += cost;
+      total += cost;
+    }
+  }
+
+  int nleft = n/2;
+  const double target = total*nleft/n;
+  int best = 1;
+  double best_diff = -1;
+  double prefix = 0;
+  for(int p = 1; p < k; p++){
+    prefix += slice[p-1];
+    const double diff = Abs(prefix - target);
+    if(best_diff < 0 || diff < best_diff){
+      best = p;
+      best_diff = diff;
+    }
+  }
+
+  // Each side needs at least one cell per tile.
+  nleft = Max(nleft, Max(1, n - (k-best)*m));
+  nleft = Min(nleft, Min(n-1, best*m));
+
+  if(xsplit){
+    splitTiles(ci, cx0, cy0, cx0+best, cy1, nleft);
+    splitTiles(ci, cx0+best, cy0, cx1, cy1, n-nleft);
+  } else {
+    splitTiles(ci, cx0, cy0, cx1, cy0+best, nleft);
+    splitTiles(ci, cx0, cy0+best, cx1, cy1, n-nleft);
+  }
 }
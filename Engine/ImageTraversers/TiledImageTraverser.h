@@ -54,7 +54,25 @@ namespace Manta {
     // Accessors.
     int getXTileSize() const { return xtilesize; }
     int getYTileSize() const { return ytilesize; }
-    
+
+    // With -adaptive the image is divided into cells of cellsize x
+    // cellsize pixels, and the time spent rendering each cell is kept
+    // across frames.  Before every frame the image is cut into the same
+    // number of tiles as the fixed layout, but of about equal cost, so
+    // that expensive regions get small tiles and cheap regions are merged
+    // into large ones.
+    struct Tile {
+      int xstart, ystart;
+      int xend, yend;
+    };
+    bool isAdaptive() const { return adaptive; }
+    int getCellSize() const { return cellsize; }
+
+    // Seconds per cell (a running average over frames), row major.
+    const vector<float>& getCostMap(int channel, int& xcells, int& ycells) const;
+    // Tiles of the current frame, indexed by assignment.
+    const vector<Tile>& getTiles(int channel) const;
+
   private:
     TiledImageTraverser(const TiledImageTraverser&);
     TiledImageTraverser& operator=(const TiledImageTraverser&);
@@ -66,6 +84,31 @@ namespace Manta {
 
     int xtiles;
     int ytiles;
+
+    struct ChannelInfo {
+      ChannelInfo();
+
+      int xres, yres;
+      int xcells, ycells;
+      int numTiles;
+      vector<float> cost;
+      vector<Tile> tiles;
+      // A frame was rendered with the current tiles.
+      bool rendered;
+      // The cost map holds measured times (and not the initial guess).
+      bool measured;
+    };
+
+    void renderTile(const RenderContext& context, Image* image,
+                    int xstart, int xend, int ystart, int yend,
+                    int xres, int numEyes);
+    void recordCost(ChannelInfo& ci, const Tile& tile, double seconds);
+    void layoutTiles(ChannelInfo& ci);
+    void splitTiles(ChannelInfo& ci, int cx0, int cy0, int cx1, int cy1, int n);
+
+    bool adaptive;
+    int cellsize;
+    vector<ChannelInfo> channelInfo;
   };
 }
 
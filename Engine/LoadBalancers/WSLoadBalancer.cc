@@ -0,0 +1,183 @@
+
+#include <Engine/LoadBalancers/WSLoadBalancer.h>
+#include <Core/Exceptions/IllegalArgument.h>
+#include <Interface/Context.h>
+#include <MantaTypes.h>
+#include <Interface/FrameState.h>
+
+#include <iostream>
+
+using namespace Manta;
+
+LoadBalancer* WSLoadBalancer::create(const vector<string>& args)
+{
+  return new WSLoadBalancer(args);
+}
+
+WSLoadBalancer::WSLoadBalancer(const vector<string>& args)
+  : verbose(false)
+{
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i] == "-verbose") {
+      verbose = true;
+    } else {
+      throw IllegalArgument("WSLoadBalancer", i, args);
+    }
+  }
+}
+
+WSLoadBalancer::~WSLoadBalancer()
+{
+  for(size_t i = 0; i < channelInfo.size(); i++)
+    delete channelInfo[i];
+}
+
+WSLoadBalancer::ProcessorInfo::ProcessorInfo()
+  : lock("WSLoadBalancer deque lock"), begin(0), end(0), steals(0), stolen(0)
+{
+}
+
+WSLoadBalancer::ChannelInfo::ChannelInfo()
+  : numAssignments(0), lastSteals(0), lastStolen(0), lastFrame(-1)
+{
+}
+
+WSLoadBalancer::ChannelInfo::~ChannelInfo()
+{
+  for(size_t i = 0; i < processorInfo.size(); i++)
+    delete processorInfo[i];
+}
+
+void WSLoadBalancer::setupBegin(const SetupContext&, int numChannels)
+{
+  int oldchannels = static_cast<int>(channelInfo.size());
+  for(int i = numChannels; i < oldchannels; i++)
+    delete channelInfo[i];
+  channelInfo.resize(numChannels);
+  for(int i = oldchannels; i < numChannels; i++)
+    channelInfo[i] = new ChannelInfo();
+}
+
+void WSLoadBalancer::setupDisplayChannel(SetupContext& context,
+                                         int numAssignments)
+{
+  ChannelInfo* ci = channelInfo[context.channelIndex];
+  ci->numAssignments = numAssignments;
+}
+
+void WSLoadBalancer::setupFrame(const RenderContext& context)
+{
+  // Nobody renders between setupFrame and the barrier that follows it,
+  // so proc 0 can safely collect the statistics and refill every deque.
+  if(context.proc != 0)
+    return;
+
+  ChannelInfo* ci = channelInfo[context.channelIndex];
+  const int numProcs = context.numProcs;
+  const int oldprocs = static_cast<int>(ci->processorInfo.size());
+  if(numProcs > oldprocs){
+    ci->processorInfo.resize(numProcs);
+    for(int i = oldprocs; i < numProcs; i++)
+      ci->processorInfo[i] = new ProcessorInfo();
+  }
+
+  // setupFrame can be called twice for the same frame when the pipeline
+  // is set up again, only the first call ends a rendered frame.
+  const long frame = context.frameState->frameSerialNumber;
+  if(frame != ci->lastFrame){
+    int steals = 0;
+    int stolen = 0;
+    for(size_t i = 0; i < ci->processorInfo.size(); i++){
+      ProcessorInfo* pi = ci->processorInfo[i];
+      steals += pi->steals;
+      stolen += pi->stolen;
+    }
+    ci->lastSteals = steals;
+    ci->lastStolen = stolen;
+    if(verbose && ci->lastFrame >= 0)
+      std::cerr << "WSLoadBalancer: channel " << context.channelIndex
+                << ", frame " << ci->lastFrame << ": " << steals
+                << " steals, " << stolen << " of " << ci->numAssignments
+                << " assignments stolen\n";
+    ci->lastFrame = frame;
+  }
+
+  for(int i = 0; i < static_cast<int>(ci->processorInfo.size()); i++){
+    ProcessorInfo* pi = ci->processorInfo[i];
+    if(i < numProcs){
+      pi->begin = static_cast<int>(static_cast<long>(ci->numAssignments)*i/numProcs);
+      pi->end = static_cast<int>(static_cast<long>(ci->numAssignments)*(i+1)/numProcs);
+    } else {
+      pi->begin = pi->end = 0;
+    }
+    pi->steals = 0;
+    pi->stolen = 0;
+  }
+}
+
+bool WSLoadBalancer::getNextAssignment(const RenderContext& context,
+                                       int& s, int& e)
+{
+  ChannelInfo* ci = channelInfo[context.channelIndex];
+  ProcessorInfo* pi = ci->processorInfo[context.proc];
+
+  pi->lock.lock();
+  if(pi->begin < pi->end){
+    s = pi->begin++;
+    e = s+1;
+    pi->lock.unlock();
+    return true;
+  }
+  pi->lock.unlock();
+
+  return steal(ci, context.proc, context.numProcs, s, e);
+}
+
+bool WSLoadBalancer::steal(ChannelInfo* ci, int proc, int numProcs,
+                           int& s, int& e)
+{
+  ProcessorInfo* pi = ci->processorInfo[proc];
+
+  // Neighbors own the neighboring parts of the image, so try them first:
+  // proc+1, proc-1, proc+2, proc-2, ...
+  for(int dist = 1; dist < numProcs; dist++){
+    int victim = proc + ((dist & 1) ? (dist+1)/2 : -(dist/2));
+    victim = (victim + numProcs) % numProcs;
+    ProcessorInfo* vi = ci->processorInfo[victim];
+
+    vi->lock.lock();
+    const int remaining = vi->end - vi->begin;
+    if(remaining <= 0){
+      vi->lock.unlock();
+      continue;
+    }
+    const int take = (remaining+1)/2;
+    const int end = vi->end;
+    vi->end -= take;
+    vi->lock.unlock();
+
+    pi->steals++;
+    pi->stolen += take;
+
+    // Keep the first of the stolen assignments and make the rest our own
+    // deque, where the other threads can steal them back.
+    s = end - take;
+    e = s+1;
+    pi->lock.lock();
+    pi->begin = e;
+    pi->end = end;
+    pi->lock.unlock();
+    return true;
+  }
+  return false;
+}
+
+int WSLoadBalancer::getStealCount(int channelIndex) const
+{
+  return channelInfo[channelIndex]->lastSteals;
+}
+
+int WSLoadBalancer::getStolenAssignments(int channelIndex) const
+{
+  return channelInfo[channelIndex]->lastStolen;
+}
@@ -0,0 +1,75 @@
+
+#ifndef Manta_Engine_WSLoadBalancer_h
+#define Manta_Engine_WSLoadBalancer_h
+
+#include <Interface/LoadBalancer.h>
+#include <Parameters.h>
+#include <Core/Thread/Mutex.h>
+#include <string>
+#include <vector>
+
+namespace Manta {
+
+  using namespace std;
+
+  // Work stealing load balancer.  At the start of each frame every
+  // thread is given its own contiguous range of assignments (which for
+  // the tiled traversers is a contiguous band of the image).  Threads
+  // take assignments off the front of their own range, and when it runs
+  // dry they steal the back half of a neighbor's range, trying the
+  // closest threads first.  There is no shared counter, so threads only
+  // contend when they steal.
+  class WSLoadBalancer : public LoadBalancer {
+  public:
+    WSLoadBalancer(const vector<string>& args);
+    virtual ~WSLoadBalancer();
+
+    virtual void setupBegin(const SetupContext&, int numChannels);
+    virtual void setupDisplayChannel(SetupContext& context,
+                                     int numAssignments);
+    virtual void setupFrame(const RenderContext& context);
+    virtual bool getNextAssignment(const RenderContext& context,
+                                   int& start, int& end);
+
+    // Number of successful steals and the number of assignments they
+    // moved, for the last frame rendered on the channel.
+    int getStealCount(int channelIndex) const;
+    int getStolenAssignments(int channelIndex) const;
+
+    static LoadBalancer* create(const vector<string>& args);
+  private:
+    WSLoadBalancer(const WSLoadBalancer&);
+    WSLoadBalancer& operator=(const WSLoadBalancer&);
+
+    struct ProcessorInfo {
+      ProcessorInfo();
+
+      char pad0[MAXCACHELINESIZE];
+      Mutex lock;
+      // Assignments [begin, end) have not been handed out yet.
+      int begin;
+      int end;
+      // Only written by the owning thread.
+      int steals;
+      int stolen;
+      char pad1[MAXCACHELINESIZE];
+    };
+    struct ChannelInfo {
+      ChannelInfo();
+      ~ChannelInfo();
+
+      vector<ProcessorInfo*> processorInfo;
+      int numAssignments;
+      int lastSteals;
+      int lastStolen;
+      long lastFrame;
+    };
+
+    bool steal(ChannelInfo* ci, int proc, int numProcs, int& s, int& e);
+
+    vector<ChannelInfo*> channelInfo;
+    bool verbose;
+  };
+}
+
+#endif
@@ -11,6 +11,7 @@
 #include <Interface/Fragment.h>
 #include <Interface/Object.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/Scene.h>
@@ -118,11 +119,11 @@ void ClusterSampler::renderFragment(const RenderContext& context,
     flags |= RayPacket::ConstantEye;
 
   int depth = 0;
-  RayPacketData raydata;
-  RayPacket rays(raydata, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
+  ScopedRayPacketData raydata(context);
+  RayPacket rays(*raydata, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
 
-  RayPacketData shade_data;
-  RayPacket shading_rays(shade_data, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
+  ScopedRayPacketData shade_data(context);
+  RayPacket shading_rays(*shade_data, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
 
   Real inx = (Real)1/nx;
   Real iny = (Real)1/ny;
@@ -3,6 +3,7 @@
 #include <Interface/Context.h>
 #include <Interface/Fragment.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 using namespace Manta;
@@ -67,8 +68,8 @@ void FastSampler::renderFragment(const RenderContext& context,
       size = fragment.end()-f;
     // Create a ray packet
     int depth = 0;
-    RayPacketData raydata;
-    RayPacket rays(raydata, RayPacket::UnknownShape, 0, size, depth, flags);
+    ScopedRayPacketData raydata(context);
+    RayPacket rays(*raydata, RayPacket::UnknownShape, 0, size, depth, flags);
 
     // Check to see if the fragment is consecutive in x.
     if(fragment.getFlag(Fragment::ConsecutiveX|Fragment::ConstantEye)){
@@ -102,7 +103,7 @@ void FastSampler::renderFragment(const RenderContext& context,
     for(int i=0;i<size;i++)
     {
         for ( int c = 0; c < Color::NumComponents; c++ )
-            fragment.color[c][i] = raydata.color[c][i];
+            fragment.color[c][i] = raydata->color[c][i];
     }
   }
 }
@@ -5,6 +5,7 @@
 #include <Interface/Context.h>
 #include <Interface/Fragment.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <Core/Math/CheapRNG.h>
@@ -147,8 +148,8 @@ void JitterSampler::renderFragment(const RenderContext& context,
     rng.seed(0); //need to initialize rng.
 
   int depth = 0;
-  RayPacketData raydata;
-  RayPacket rays(raydata, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
+  ScopedRayPacketData raydata(context);
+  RayPacket rays(*raydata, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
 
   Real inx = (Real)1/nx;
   Real iny = (Real)1/ny;
@@ -4,6 +4,7 @@
 #include <Interface/Context.h>
 #include <Interface/Fragment.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <Core/Math/CheapRNG.h>
@@ -126,8 +127,8 @@ void RegularSampler::renderFragment(const RenderContext& context,
     flags |= RayPacket::ConstantEye;
 
   int depth = 0;
-  RayPacketData raydata;
-  RayPacket rays(raydata, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
+  ScopedRayPacketData raydata(context);
+  RayPacket rays(*raydata, RayPacket::UnknownShape, 0, RayPacket::MaxSize, depth, flags);
 
   Real inx = (Real)1/nx;
   Real iny = (Real)1/ny;
@@ -3,6 +3,7 @@
 #include <Interface/Context.h>
 #include <Interface/Fragment.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <MantaSSE.h>
@@ -67,8 +68,8 @@ void SingleSampler::renderFragment(const RenderContext& context,
       size = fragment.end()-f;
     // Create a ray packet
     int depth = 0;
-    RayPacketData raydata;
-    RayPacket rays(raydata, RayPacket::UnknownShape, 0, size, depth, flags);
+    ScopedRayPacketData raydata(context);
+    RayPacket rays(*raydata, RayPacket::UnknownShape, 0, size, depth, flags);
 
     // Check to see if the fragment is consecutive in x.
     if(fragment.getFlag(Fragment::ConsecutiveX|Fragment::ConstantEye)){
@@ -173,18 +174,18 @@ void SingleSampler::renderFragment(const RenderContext& context,
 #if MANTA_SSE
     int e = size&(~3);
     for(int i=0;i<e;i+=4){
-      _mm_store_ps(&fragment.color[0][f+i], _mm_load_ps(&raydata.color[0][i]));
-      _mm_store_ps(&fragment.color[1][f+i], _mm_load_ps(&raydata.color[1][i]));
-      _mm_store_ps(&fragment.color[2][f+i], _mm_load_ps(&raydata.color[2][i]));
-      _mm_store_ps(&fragment.depth[f+i], _mm_load_ps(&raydata.minT[i]));
+      _mm_store_ps(&fragment.color[0][f+i], _mm_load_ps(&raydata->color[0][i]));
+      _mm_store_ps(&fragment.color[1][f+i], _mm_load_ps(&raydata->color[1][i]));
+      _mm_store_ps(&fragment.color[2][f+i], _mm_load_ps(&raydata->color[2][i]));
+      _mm_store_ps(&fragment.depth[f+i], _mm_load_ps(&raydata->minT[i]));
     }
 #else
     int e = 0;
 #endif
     for(int i=e;i<size;i++) {
       for ( int c = 0; c < Color::NumComponents; c++ )
-        fragment.color[c][f+i] = raydata.color[c][i];
-      fragment.depth[f+i] = raydata.minT[i];
+        fragment.color[c][f+i] = raydata->color[c][i];
+      fragment.depth[f+i] = raydata->minT[i];
     }
   }
 }
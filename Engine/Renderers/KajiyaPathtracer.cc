@@ -7,13 +7,16 @@
 #include <Interface/Material.h>
 #include <Interface/Object.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/Scene.h>
 #include <Interface/ShadowAlgorithm.h>
+#include <Core/Exceptions/IllegalArgument.h>
 #include <Core/Math/MiscMath.h>
+#include <Core/Util/Args.h>
 #include <Core/Util/Assert.h>
-#include <Core/Util/NotFinished.h>
 #include <Core/Color/ColorSpace_fancy.h>
+#include <algorithm>
 #include <iostream>
 using namespace std;
 
@@ -24,12 +27,50 @@ Renderer* KajiyaPathtracer::create(const vector<string>& args)
   return new KajiyaPathtracer(args);
 }
 
-KajiyaPathtracer::KajiyaPathtracer(const vector<string>& /*args*/)
+KajiyaPathtracer::KajiyaPathtracer(const vector<string>& args)
 {
   ambient_only_sa = new NoDirect();
   override_maxdepth = -1;
-  // No presorting, since none are implemented yet.
+  // No presorting by default.  Eye rays are coherent already.
   presort_mode.push_back(PreSortNone);
+  presort_curve = CurveMorton;
+
+  // Each -presort sets the mode for the next depth, the last one is used
+  // for all deeper bounces.
+  bool have_presort = false;
+  for(size_t i=0;i<args.size();i++){
+    string arg = args[i];
+    if(arg == "-presort"){
+      string mode;
+      if(!getStringArg(i, args, mode))
+        throw IllegalArgument("KajiyaPathtracer -presort", i, args);
+      if(!have_presort)
+        presort_mode.clear();
+      have_presort = true;
+      if(mode == "none")
+        presort_mode.push_back(PreSortNone);
+      else if(mode == "origin")
+        presort_mode.push_back(PreSortOrigin);
+      else if(mode == "direction")
+        presort_mode.push_back(PreSortDirection);
+      else if(mode == "5d")
+        presort_mode.push_back(PreSort5D);
+      else
+        throw IllegalArgument("KajiyaPathtracer -presort (none, origin, direction or 5d)", i, args);
+    } else if(arg == "-curve"){
+      string curve;
+      if(!getStringArg(i, args, curve))
+        throw IllegalArgument("KajiyaPathtracer -curve", i, args);
+      if(curve == "morton")
+        presort_curve = CurveMorton;
+      else if(curve == "hilbert")
+        presort_curve = CurveHilbert;
+      else
+        throw IllegalArgument("KajiyaPathtracer -curve (morton or hilbert)", i, args);
+    } else {
+      throw IllegalArgument("KajiyaPathtracer", i, args);
+    }
+  }
 
   // Full sort on materials
   matlsort_mode.push_back(MatlSortBackgroundSweep);
@@ -83,9 +124,10 @@ static inline void swapInArray(T* array, int i, int j)
     1. Pre-sort rays in the packet according to some criteria
        Options for each depth
        a. No sort
-       b. Sort using a space filling curve on origin (not implemented yet)
-       c. Sort using a space filling curve on direction (not implemented yet)
-       d. Sort using a space filling curve in 5D
+       b. Sort using a space filling curve on origin
+       c. Sort using a space filling curve on direction
+       d. Sort using a space filling curve in 5D (origin and direction)
+       The curve (Morton or Hilbert) is the same for all depths.
     2. intersect
     3. Sort on materials, separating background rays
        Options for each depth
@@ -204,8 +246,8 @@ void KajiyaPathtracer::traceEyeRays(const RenderContext& context, RayPacket& ray
     // 5. compute direct light
     ShadowAlgorithm::StateBuffer shadowState;
     do {
-      RayPacketData shadowData;
-      RayPacket shadowRays(shadowData, RayPacket::UnknownShape, 0, 0, depth, false);
+      ScopedRayPacketData shadowData(context);
+      RayPacket shadowRays(*shadowData, RayPacket::UnknownShape, 0, 0, depth, false);
 
       // Call the shadowalgorithm(sa) to generate shadow rays.  We may not be
       // able to compute all of them, so we pass along a buffer for the sa
@@ -319,7 +361,7 @@ void KajiyaPathtracer::matlsort_full(const RenderContext& context, RayPacket& ra
         swapInArray(data->hitPrim, i, j);
         swapInArray(data->hitMatl, i, j);
         swapInArray(data->hitTex, i, j);
-        swapInArray(data->ignoreEmittedLight, i, j);
+        swapInArray(&data->ignoreEmittedLight[0], i, j);
         for(int k=0;k<3;k++)
           swapInArray(data->origin[k], i, j);
         for(int k=0;k<3;k++)
@@ -361,8 +403,8 @@ void KajiyaPathtracer::matlsort_full(const RenderContext& context, RayPacket& ra
           swapInArray(data->importance[k], i, j);
 
         // Move sample_id, region_id
-        swapInArray(data->sample_id, i, j);
-        swapInArray(data->region_id, i, j);
+        swapInArray(&data->sample_id[0], i, j);
+        swapInArray(&data->region_id[0], i, j);
 
         //Move scratchpad
         for (int k=0; k < RayPacketData::MaxScratchpad4; ++k)
@@ -434,8 +476,8 @@ void KajiyaPathtracer::russian_roulette_full(const RenderContext& context, RayPa
 
       // Move sample_id, region_id
       // Look at one-way move optimization
-      swapInArray(data->sample_id, i, newEnd);
-      swapInArray(data->region_id, i, newEnd);
+      swapInArray(&data->sample_id[0], i, newEnd);
+      swapInArray(&data->region_id[0], i, newEnd);
 
       //Move scratchpad
       for (int k=0; k < RayPacketData::MaxScratchpad4; ++k)
@@ -477,9 +519,21 @@ void KajiyaPathtracer::russian_roulette_full(const RenderContext& context, RayPa
   rays.resize(rays.begin(), newEnd+1);
 }
 
-void KajiyaPathtracer::presort_origin(const RenderContext&, RayPacket&, Packet<Color>&, Packet<int>&)
+void KajiyaPathtracer::presort_origin(const RenderContext&, RayPacket& rays,
+                                      Packet<Color>& result,
+                                      Packet<int>& permute)
 {
-  NOT_FINISHED("KajiyaPathtracer::traceEyeRays");
+  // All rays would get the same key
+  if(rays.getFlag(RayPacket::ConstantOrigin))
+    return;
+
+  Real coords[3][RayPacket::MaxSize];
+  RayPacketData* data = rays.data;
+  for(int i=rays.begin();i<rays.end();i++){
+    for(int k=0;k<3;k++)
+      coords[k][i] = data->origin[k][i];
+  }
+  presort_curve_order(rays, result, permute, coords, 3);
 }
 
 void KajiyaPathtracer::matlsort_sweep(const RenderContext& context, RayPacket& rays,
@@ -554,8 +608,8 @@ void KajiyaPathtracer::matlsort_sweep(const RenderContext& context, RayPacket& r
           swapInArray(data->importance[k], i, j);
 
         // Move sample_id, region_id
-        swapInArray(data->sample_id, i, j);
-        swapInArray(data->region_id, i, j);
+        swapInArray(&data->sample_id[0], i, j);
+        swapInArray(&data->region_id[0], i, j);
 
         //Move scratchpad
         for (int k=0; k < RayPacketData::MaxScratchpad4; ++k)
@@ -581,14 +635,176 @@ void KajiyaPathtracer::matlsort_sweep(const RenderContext& context, RayPacket& r
   }
 }
 
-void KajiyaPathtracer::presort_direction(const RenderContext&, RayPacket&, Packet<Color>&, Packet<int>&)
+// Maps a direction onto the unit square by projecting it onto the
+// octahedron |x|+|y|+|z| = 1 and folding the lower half outwards.
+// Neighboring directions stay neighbors, which is all the presort needs.
+static inline void octahedralCoords(const Vector& dir, Real& u, Real& v)
+{
+  Real sum = Abs(dir[0]) + Abs(dir[1]) + Abs(dir[2]);
+  Real inv = sum > 0 ? 1/sum : 0;
+  u = dir[0] * inv;
+  v = dir[1] * inv;
+  if(dir[2] < 0){
+    Real fu = (1 - Abs(v)) * (u < 0 ? -1 : 1);
+    Real fv = (1 - Abs(u)) * (v < 0 ? -1 : 1);
+    u = fu;
+    v = fv;
+  }
+}
+
+void KajiyaPathtracer::presort_direction(const RenderContext&, RayPacket& rays,
+                                         Packet<Color>& result,
+                                         Packet<int>& permute)
+{
+  Real coords[2][RayPacket::MaxSize];
+  for(int i=rays.begin();i<rays.end();i++)
+    octahedralCoords(rays.getDirection(i), coords[0][i], coords[1][i]);
+  presort_curve_order(rays, result, permute, coords, 2);
+}
+
+void KajiyaPathtracer::presort_5d(const RenderContext&, RayPacket& rays,
+                                  Packet<Color>& result,
+                                  Packet<int>& permute)
+{
+  Real coords[5][RayPacket::MaxSize];
+  RayPacketData* data = rays.data;
+  for(int i=rays.begin();i<rays.end();i++){
+    for(int k=0;k<3;k++)
+      coords[k][i] = data->origin[k][i];
+    octahedralCoords(rays.getDirection(i), coords[3][i], coords[4][i]);
+  }
+  presort_curve_order(rays, result, permute, coords, 5);
+}
+
+// Interleaves the bits of the coordinates, most significant first.
+static inline unsigned long long mortonKey(const unsigned int* coords,
+                                           int dims, int bits)
 {
-  NOT_FINISHED("KajiyaPathtracer::presort_direction");
+  unsigned long long key = 0;
+  for(int b=bits-1;b>=0;b--){
+    for(int d=0;d<dims;d++)
+      key = (key << 1) | ((coords[d] >> b) & 1);
+  }
+  return key;
 }
 
-void KajiyaPathtracer::presort_5d(const RenderContext&, RayPacket&, Packet<Color>&, Packet<int>&)
+// Turns the coordinates into the "transposed" Hilbert index, whose
+// interleaved bits are the index along the curve.  See John Skilling,
+// "Programming the Hilbert curve", AIP Conf. Proc. 707 (2004).
+static inline unsigned long long hilbertKey(unsigned int* x, int dims, int bits)
 {
-  NOT_FINISHED("KajiyaPathtracer::presort_5d");
+  const unsigned int M = 1u << (bits-1);
+  for(unsigned int Q = M; Q > 1; Q >>= 1){
+    const unsigned int P = Q - 1;
+    for(int i=0;i<dims;i++){
+      if(x[i] & Q){
+        x[0] ^= P;
+      } else {
+        unsigned int t = (x[0] ^ x[i]) & P;
+        x[0] ^= t;
+        x[i] ^= t;
+      }
+    }
+  }
+  // Gray encode
+  for(int i=1;i<dims;i++)
+    x[i] ^= x[i-1];
+  unsigned int t = 0;
+  for(unsigned int Q = M; Q > 1; Q >>= 1){
+    if(x[dims-1] & Q)
+      t ^= Q - 1;
+  }
+  for(int i=0;i<dims;i++)
+    x[i] ^= t;
+  return mortonKey(x, dims, bits);
+}
+
+template<class T>
+static inline void gatherArray(T* array, const int* order, int begin, int end)
+{
+  T tmp[RayPacket::MaxSize];
+  for(int i=begin;i<end;i++)
+    tmp[i] = array[order[i]];
+  for(int i=begin;i<end;i++)
+    array[i] = tmp[i];
+}
+
+void KajiyaPathtracer::presort_curve_order(RayPacket& rays,
+                                           Packet<Color>& result,
+                                           Packet<int>& permute,
+                                           Real coords[][RayPacket::MaxSize],
+                                           int dims)
+{
+  // 10 bits per dimension is plenty to separate a packet's worth of rays
+  // and keeps the 5D key within 64 bits.
+  const int bits = 10;
+  const Real maxCoord = (1 << bits) - 1;
+  const int begin = rays.begin();
+  const int end = rays.end();
+  if(end - begin < 2)
+    return;
+
+  // Quantize relative to the bounds of this packet's coordinates.
+  Real scale[5];
+  Real offset[5];
+  for(int d=0;d<dims;d++){
+    Real lo = coords[d][begin];
+    Real hi = lo;
+    for(int i=begin+1;i<end;i++){
+      lo = Min(lo, coords[d][i]);
+      hi = Max(hi, coords[d][i]);
+    }
+    offset[d] = lo;
+    scale[d] = hi > lo ? maxCoord / (hi - lo) : 0;
+  }
+
+  pair<unsigned long long, int> keys[RayPacket::MaxSize];
+  for(int i=begin;i<end;i++){
+    unsigned int q[5];
+    for(int d=0;d<dims;d++)
+      q[d] = static_cast<unsigned int>((coords[d][i] - offset[d]) * scale[d]);
+    unsigned long long key = presort_curve == CurveHilbert ?
+      hilbertKey(q, dims, bits) : mortonKey(q, dims, bits);
+    keys[i] = make_pair(key, i);
+  }
+  std::sort(keys+begin, keys+end);
+
+  int order[RayPacket::MaxSize];
+  bool identity = true;
+  for(int i=begin;i<end;i++){
+    order[i] = keys[i].second;
+    identity = identity && order[i] == i;
+  }
+  if(identity)
+    return;
+
+  // Move everything that survives to the next intersection.  The hit
+  // information gets reset right after the presort.
+  RayPacketData* data = rays.data;
+  for(int k=0;k<3;k++)
+    gatherArray(data->origin[k], order, begin, end);
+  for(int k=0;k<3;k++)
+    gatherArray(data->direction[k], order, begin, end);
+  gatherArray(data->time, order, begin, end);
+  for(int k=0;k<Color::NumComponents;k++)
+    gatherArray(data->importance[k], order, begin, end);
+  gatherArray(&data->ignoreEmittedLight[0], order, begin, end);
+  gatherArray(&data->whichEye[0], order, begin, end);
+  gatherArray(&data->sample_depth[0], order, begin, end);
+  gatherArray(&data->sample_id[0], order, begin, end);
+  gatherArray(&data->region_id[0], order, begin, end);
+  for (int k=0; k < RayPacketData::MaxScratchpad4; ++k)
+    gatherArray(data->scratchpad4[k], order, begin, end);
+  for (int k=0; k < RayPacketData::MaxScratchpad8; ++k)
+    gatherArray(data->scratchpad8[k], order, begin, end);
+  for(int k=0;k<Color::NumComponents;k++)
+    gatherArray(result.colordata[k], order, begin, end);
+  gatherArray(permute.data, order, begin, end);
+
+  // Derived per-ray data and the image space shape no longer match.
+  rays.flags &= ~(RayPacket::HaveImageCoordinates | RayPacket::HaveCornerRays |
+                  RayPacket::HaveInverseDirections | RayPacket::HaveSigns);
+  rays.shape = RayPacket::UnknownShape;
 }
 
 void KajiyaPathtracer::matlsort_bgsweep(const RenderContext&, RayPacket& rays,
@@ -650,8 +866,8 @@ void KajiyaPathtracer::matlsort_bgsweep(const RenderContext&, RayPacket& rays,
         swapInArray(data->importance[k], i, newBegin);
 
       // Move sample_id, region_id
-      swapInArray(data->sample_id, i, newBegin);
-      swapInArray(data->region_id, i, newBegin);
+      swapInArray(&data->sample_id[0], i, newBegin);
+      swapInArray(&data->region_id[0], i, newBegin);
 
       //Move scratchpad
       for (int k=0; k < RayPacketData::MaxScratchpad4; ++k)
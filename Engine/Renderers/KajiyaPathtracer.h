@@ -4,6 +4,7 @@
 
 #include <Interface/Renderer.h>
 #include <Interface/Packet.h>
+#include <Interface/RayPacket.h>
 #include <string>
 #include <vector>
 
@@ -16,6 +17,9 @@ namespace Manta {
     enum PreSortMode {
       PreSortNone, PreSortDirection, PreSortOrigin, PreSort5D
     };
+    enum PreSortCurve {
+      CurveMorton, CurveHilbert
+    };
     enum MatlSortMode {
       MatlSortBackgroundSweep, MatlSortSweep, MatlSortFull
     };
@@ -40,6 +44,7 @@ namespace Manta {
     KajiyaPathtracer& operator=(const KajiyaPathtracer&);
 
     std::vector<PreSortMode> presort_mode;
+    PreSortCurve presort_curve;
     std::vector<MatlSortMode> matlsort_mode;
     std::vector<RussianRouletteMode> russian_roulette_mode;
     ShadowAlgorithm* ambient_only_sa;
@@ -52,6 +57,8 @@ namespace Manta {
                            Packet<int>& permute);
     void presort_5d(const RenderContext& context, RayPacket& rays, Packet<Color>& result,
                     Packet<int>& permute);
+    void presort_curve_order(RayPacket& rays, Packet<Color>& result, Packet<int>& permute,
+                             Real coords[][RayPacket::MaxSize], int dims);
 
     void matlsort_sweep(const RenderContext& context, RayPacket& rays, Packet<Color>& result,
                         Packet<Color>& reflectance, Packet<int>& permute);
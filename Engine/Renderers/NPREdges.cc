@@ -128,6 +128,7 @@ void NPREdges::traceRays(const RenderContext& context, RayPacket& rays)
                            context.storage_allocator,
                            context.rng,
                            context.sample_generator);
+  subContext.packetArena = context.packetArena;
   raytracer->traceRays(subContext, rays);
 
   if(noshade)
@@ -6,9 +6,13 @@
 #include <Interface/Material.h>
 #include <Interface/Object.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Scene.h>
+#include <Core/Exceptions/IllegalArgument.h>
+#include <Core/Util/Args.h>
 #include <Core/Util/Assert.h>
 #include <iostream>
+#include <string.h>
 using namespace std;
 
 using namespace Manta;
@@ -18,8 +22,27 @@ Renderer* Raytracer::create(const vector<string>& args)
   return new Raytracer(args);
 }
 
-Raytracer::Raytracer(const vector<string>& /*args*/)
+Raytracer::Raytracer(const vector<string>& args)
 {
+  reorder = ReorderAuto;
+  for(size_t i=0;i<args.size();i++){
+    string arg = args[i];
+    if(arg == "-reorder"){
+      string mode;
+      if(!getStringArg(i, args, mode))
+        throw IllegalArgument("Raytracer -reorder", i, args);
+      if(mode == "never")
+        reorder = ReorderNever;
+      else if(mode == "auto")
+        reorder = ReorderAuto;
+      else if(mode == "always")
+        reorder = ReorderAlways;
+      else
+        throw IllegalArgument("Raytracer -reorder (never, auto or always)", i, args);
+    } else {
+      throw IllegalArgument("Raytracer", i, args);
+    }
+  }
 }
 
 Raytracer::~Raytracer()
@@ -48,10 +71,20 @@ void Raytracer::traceEyeRays(const RenderContext& context, RayPacket& rays)
 
 void Raytracer::traceRays(const RenderContext& context, RayPacket& rays)
 {
-  int debugFlag = rays.getAllFlags() & RayPacket::DebugPacket;
   rays.resetHits();
   context.scene->getObject()->intersect(context, rays);
 
+  // Debug packets keep their order so that the printed ray indices match.
+  if(reorder != ReorderNever && !rays.getFlag(RayPacket::DebugPacket) &&
+     shadeReordered(context, rays))
+    return;
+  shadeRuns(context, rays);
+}
+
+void Raytracer::shadeRuns(const RenderContext& context, RayPacket& rays)
+{
+  int debugFlag = rays.getAllFlags() & RayPacket::DebugPacket;
+
   // Go through the ray packet and shade them.  Group rays that hit the
   // same object and material to shade with a single shade call
   for(int i = rays.begin();i<rays.end();){
@@ -96,6 +129,143 @@ void Raytracer::traceRays(const RenderContext& context, RayPacket& rays)
   }
 }
 
+// Copies ray s of a shading array into ray d.  An array the source
+// packet never touched holds nothing worth copying, and reading it would
+// allocate it, so it is skipped.
+template<class T, int Rows>
+static inline void copyCold(RayPacketColdArray<T, Rows>& dst, int d,
+                            const RayPacketColdArray<T, Rows>& src, int s)
+{
+  if(src.isAllocated())
+    for(int k=0;k<Rows;k++)
+      dst[k][d] = src[k][s];
+}
+
+template<class T>
+static inline void copyCold(RayPacketColdVector<T>& dst, int d,
+                            const RayPacketColdVector<T>& src, int s)
+{
+  if(src.isAllocated())
+    dst[d] = src[s];
+}
+
+// Copies everything a material or background may read about ray s of src
+// into ray d of dst.  Derived values are copied whether or not a flag says
+// they have been computed, because some primitives fill them in while
+// intersecting (Parallelogram writes the texture coordinates, for
+// instance).
+static void copyRay(RayPacketData* dst, int d, const RayPacketData* src, int s)
+{
+  dst->hitPrim[d] = src->hitPrim[s];
+  dst->hitMatl[d] = src->hitMatl[s];
+  dst->hitTex[d] = src->hitTex[s];
+  for(int k=0;k<3;k++){
+    dst->origin[k][d] = src->origin[k][s];
+    dst->direction[k][d] = src->direction[k][s];
+    dst->inverseDirection[k][d] = src->inverseDirection[k][s];
+    dst->signs[k][d] = src->signs[k][s];
+  }
+  dst->minT[d] = src->minT[s];
+  dst->time[d] = src->time[s];
+
+  copyCold(dst->normal, d, src->normal, s);
+  copyCold(dst->ffnormal, d, src->ffnormal, s);
+  copyCold(dst->geometricNormal, d, src->geometricNormal, s);
+  copyCold(dst->ffgeometricNormal, d, src->ffgeometricNormal, s);
+  copyCold(dst->hitPosition, d, src->hitPosition, s);
+  copyCold(dst->texCoords, d, src->texCoords, s);
+  copyCold(dst->dPdu, d, src->dPdu, s);
+  copyCold(dst->dPdv, d, src->dPdv, s);
+  copyCold(dst->image, d, src->image, s);
+  copyCold(dst->importance, d, src->importance, s);
+  copyCold(dst->whichEye, d, src->whichEye, s);
+  copyCold(dst->sample_depth, d, src->sample_depth, s);
+  copyCold(dst->sample_id, d, src->sample_id, s);
+  copyCold(dst->region_id, d, src->region_id, s);
+  copyCold(dst->ignoreEmittedLight, d, src->ignoreEmittedLight, s);
+
+  // Primitives leave whatever they need to compute normals and texture
+  // coordinates here.
+  for(int k=0;k<RayPacketData::MaxScratchpad4;k++)
+    dst->scratchpad4[k][d] = src->scratchpad4[k][s];
+  for(int k=0;k<RayPacketData::MaxScratchpad8;k++)
+    dst->scratchpad8[k][d] = src->scratchpad8[k][s];
+  memcpy(dst->scratchpad_data[d], src->scratchpad_data[s],
+         RayPacketData::MaxScratchpadSize);
+}
+
+// Groups the rays by the material they hit, with the misses as one more
+// group, and shades each group as a single packet.  The rays are gathered
+// into a second RayPacketData in group order (keeping their relative
+// order within a group) and the colors are scattered back afterwards, so
+// rays is left as it was apart from the colors.  Returns false, without
+// shading anything, if the groups are already contiguous or, for
+// ReorderAuto, if they are split into too few runs to be worth the copy.
+bool Raytracer::shadeReordered(const RenderContext& context, RayPacket& rays)
+{
+  const Material* groupMatl[RayPacket::MaxSize];
+  int groupStart[RayPacket::MaxSize];
+  int groupSize[RayPacket::MaxSize];
+  int rayGroup[RayPacket::MaxSize];
+  int numGroups = 0;
+  int numRuns = 0;
+
+  int group = -1;
+  for(int i = rays.begin(); i < rays.end(); i++){
+    const Material* matl = rays.getHitMaterial(i);
+    if(group < 0 || matl != groupMatl[group]){
+      numRuns++;
+      group = 0;
+      while(group < numGroups && groupMatl[group] != matl)
+        group++;
+      if(group == numGroups){
+        groupMatl[numGroups] = matl;
+        groupSize[numGroups] = 0;
+        numGroups++;
+      }
+    }
+    rayGroup[i] = group;
+    groupSize[group]++;
+  }
+
+  if(numRuns == numGroups)
+    return false;
+  if(reorder == ReorderAuto && numRuns < 2*numGroups)
+    return false;
+
+  // Counting sort of the ray indices by group.
+  int next[RayPacket::MaxSize];
+  int start = 0;
+  for(int g = 0; g < numGroups; g++){
+    groupStart[g] = next[g] = start;
+    start += groupSize[g];
+  }
+  int order[RayPacket::MaxSize];
+  for(int i = rays.begin(); i < rays.end(); i++)
+    order[next[rayGroup[i]]++] = i;
+
+  // The corner rays describe the shape of the original packet.
+  int flags = rays.getAllFlags() & ~RayPacket::HaveCornerRays;
+  ScopedRayPacketData sortedData(context);
+  int size = rays.end() - rays.begin();
+  for(int k = 0; k < size; k++)
+    copyRay(sortedData.get(), k, rays.data, order[k]);
+  RayPacket sorted(*sortedData, RayPacket::UnknownShape, 0, size,
+                   rays.getDepth(), flags);
+
+  for(int g = 0; g < numGroups; g++){
+    RayPacket subPacket(sorted, groupStart[g], groupStart[g]+groupSize[g]);
+    if(groupMatl[g])
+      groupMatl[g]->shade(context, subPacket);
+    else
+      context.scene->getBackground()->shade(context, subPacket);
+  }
+
+  for(int k = 0; k < size; k++)
+    rays.setColor(order[k], sorted.getColor(k));
+  return true;
+}
+
 void Raytracer::traceRays(const RenderContext& context, RayPacket& rays, Real cutoff)
 {
   for(int i = rays.begin(); i != rays.end();) {
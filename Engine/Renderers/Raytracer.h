@@ -12,7 +12,15 @@ namespace Manta {
 
   class Raytracer : public Renderer {
   public:
-    Raytracer() {}
+    // Before shading, rays can be regrouped so that every material and
+    // the background get one contiguous subpacket instead of one per run
+    // of neighboring rays.  ReorderAuto only does so when the runs are
+    // short enough for it to pay off.
+    enum ReorderMode {
+      ReorderNever, ReorderAuto, ReorderAlways
+    };
+
+    Raytracer() : reorder(ReorderAuto) {}
     Raytracer(const vector<string>& args);
     virtual ~Raytracer();
     virtual void setupBegin(const SetupContext&, int numChannels);
@@ -27,6 +35,11 @@ namespace Manta {
   private:
     Raytracer(const Raytracer&);
     Raytracer& operator=(const Raytracer&);
+
+    void shadeRuns(const RenderContext& context, RayPacket& rays);
+    bool shadeReordered(const RenderContext& context, RayPacket& rays);
+
+    ReorderMode reorder;
   };
 }
 
@@ -19,6 +19,7 @@ namespace Manta {
   class TaskList;
   class XWindow;
   class ThreadStorage;
+  class RayPacketArena;
   class RandomNumberGenerator;
 
   class ReadContext {
@@ -174,7 +175,7 @@ namespace Manta {
         shadowAlgorithm(shadowAlgorithm),
         camera(camera), scene(scene),
         storage_allocator( storage_allocator_ ),
-        rng(rng)
+        rng(rng), packetArena(0)
     {
     }
     MantaInterface* rtrt_int;
@@ -193,6 +194,10 @@ namespace Manta {
     mutable ThreadStorage *storage_allocator;
 
     RandomNumberGenerator* rng;
+
+    // Per-thread temporary ray packets, see ScopedRayPacketData.  May be
+    // null, in which case packets come from the heap.
+    RayPacketArena* packetArena;
   private:
     RenderContext(const RenderContext&);
     RenderContext& operator=(const RenderContext&);
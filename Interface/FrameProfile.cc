@@ -0,0 +1,195 @@
+#include <Interface/FrameProfile.h>
+
+#include <fstream>
+#include <iostream>
+
+using namespace Manta;
+using namespace std;
+
+FrameProfile::FrameProfile(int maxThreads, size_t eventsPerThread)
+  : maxThreads(maxThreads > 0 ? maxThreads : 1),
+    eventsPerThread(eventsPerThread > 0 ? eventsPerThread : 1),
+    startTime(currentTime())
+{
+  threads = new ThreadEvents[this->maxThreads];
+  for(int i = 0; i < this->maxThreads; i++){
+    threads[i].events = new Event[this->eventsPerThread];
+    threads[i].count = 0;
+    threads[i].packetHighWaterMark = 0;
+  }
+}
+
+FrameProfile::~FrameProfile()
+{
+  for(int i = 0; i < maxThreads; i++)
+    delete[] threads[i].events;
+  delete[] threads;
+}
+
+const char* FrameProfile::getStageName(int stage)
+{
+  switch(stage){
+  case Transactions: return "Transactions";
+  case Animation:    return "Animation";
+  case PreRender:    return "PreRender";
+  case Update:       return "Update";
+  case Setup:        return "Setup";
+  case Barrier:      return "Barrier";
+  case Render:       return "Render";
+  case Display:      return "Display";
+  }
+  return "Unknown";
+}
+
+void FrameProfile::reset()
+{
+  for(int i = 0; i < maxThreads; i++){
+    threads[i].count = 0;
+    threads[i].packetHighWaterMark = 0;
+  }
+  startTime = currentTime();
+}
+
+size_t FrameProfile::getNumEvents(int thread) const
+{
+  if(thread < 0 || thread >= maxThreads)
+    return 0;
+  return threads[thread].count;
+}
+
+void FrameProfile::getValidEvents(int thread, size_t& begin, size_t& end) const
+{
+  end = threads[thread].count;
+  begin = end > eventsPerThread ? end - eventsPerThread : 0;
+}
+
+int FrameProfile::getPacketHighWaterMark(int thread) const
+{
+  if(thread < 0 || thread >= maxThreads)
+    return 0;
+  return threads[thread].packetHighWaterMark;
+}
+
+bool FrameProfile::getFrameRange(long& first, long& last) const
+{
+  bool found = false;
+  for(int t = 0; t < maxThreads; t++){
+    size_t begin, end;
+    getValidEvents(t, begin, end);
+    for(size_t i = begin; i < end; i++){
+      long frame = threads[t].events[i % eventsPerThread].frame;
+      if(!found || frame < first)
+        first = frame;
+      if(!found || frame > last)
+        last = frame;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void FrameProfile::getStageTimes(int thread, long frame,
+                                 double times[NumStages]) const
+{
+  for(int s = 0; s < NumStages; s++)
+    times[s] = 0;
+  if(thread < 0 || thread >= maxThreads)
+    return;
+
+  size_t begin, end;
+  getValidEvents(thread, begin, end);
+  for(size_t i = begin; i < end; i++){
+    const Event& event = threads[thread].events[i % eventsPerThread];
+    if(event.frame == frame)
+      times[event.stage] += event.end - event.start;
+  }
+}
+
+void FrameProfile::printSummary(ostream& out) const
+{
+  long first, last;
+  if(!getFrameRange(first, last)){
+    out << "FrameProfile: no frames recorded\n";
+    return;
+  }
+
+  double totals[NumStages];
+  for(int s = 0; s < NumStages; s++)
+    totals[s] = 0;
+  int numThreads = 0;
+  for(int t = 0; t < maxThreads; t++){
+    size_t begin, end;
+    getValidEvents(t, begin, end);
+    if(begin == end)
+      continue;
+    numThreads++;
+    for(size_t i = begin; i < end; i++){
+      const Event& event = threads[t].events[i % eventsPerThread];
+      totals[event.stage] += event.end - event.start;
+    }
+  }
+
+  long numFrames = last - first + 1;
+  double frameTotal = 0;
+  for(int s = 0; s < NumStages; s++)
+    frameTotal += totals[s];
+
+  out << "FrameProfile: frames " << first << " to " << last << ", "
+      << numThreads << " threads, ms per frame and thread:\n";
+  for(int s = 0; s < NumStages; s++){
+    if(totals[s] == 0)
+      continue;
+    out << "  " << getStageName(s) << ": "
+        << totals[s] * 1000 / (numFrames * numThreads)
+        << " (" << 100 * totals[s] / frameTotal << "%)\n";
+  }
+
+  int maxPackets = 0;
+  for(int t = 0; t < maxThreads; t++)
+    if(threads[t].packetHighWaterMark > maxPackets)
+      maxPackets = threads[t].packetHighWaterMark;
+  if(maxPackets > 0)
+    out << "  At most " << maxPackets
+        << " temporary ray packets in use by a thread\n";
+}
+
+void FrameProfile::writeChromeTrace(ostream& out) const
+{
+  out << "{\"traceEvents\":[\n";
+  bool first = true;
+  for(int t = 0; t < maxThreads; t++){
+    size_t begin, end;
+    getValidEvents(t, begin, end);
+    if(begin == end)
+      continue;
+
+    if(!first)
+      out << ",\n";
+    first = false;
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t
+        << ",\"args\":{\"name\":\"RTRT Worker " << t << "\"}}";
+
+    for(size_t i = begin; i < end; i++){
+      const Event& event = threads[t].events[i % eventsPerThread];
+      // Timestamps and durations are in microseconds.
+      out << ",\n{\"name\":\"" << getStageName(event.stage)
+          << "\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":0,\"tid\":" << t
+          << ",\"ts\":" << (event.start - startTime) * 1e6
+          << ",\"dur\":" << (event.end - event.start) * 1e6
+          << ",\"args\":{\"frame\":" << event.frame << "}}";
+    }
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+bool FrameProfile::writeChromeTrace(const string& filename) const
+{
+  ofstream out(filename.c_str());
+  if(!out){
+    cerr << "FrameProfile: cannot write " << filename << '\n';
+    return false;
+  }
+  out.precision(15);
+  writeChromeTrace(out);
+  return out.good();
+}
@@ -0,0 +1,125 @@
+#ifndef Manta_Interface_FrameProfile_h
+#define Manta_Interface_FrameProfile_h
+
+#include <Core/Thread/Time.h>
+#include <Core/Util/Align.h>
+#include <Core/Util/AlignedAllocator.h>
+#include <Parameters.h>
+
+#include <iosfwd>
+#include <string>
+
+namespace Manta {
+
+  // Records how long every render thread spends in each stage of every
+  // frame.  Each thread writes only to its own preallocated ring of
+  // events, so recording takes no locks and never allocates.  Once a
+  // ring is full the oldest events are overwritten.
+  //
+  // The query functions read the rings without synchronization.  Call
+  // them once rendering has stopped, or accept that the events of the
+  // frame being rendered may be incomplete.
+  class FrameProfile {
+  public:
+    enum Stage {
+      Transactions, // Applying queued transactions (proc 0)
+      Animation,    // Serial and parallel animation callbacks
+      PreRender,    // Serial and parallel pre-render callbacks
+      Update,       // Update graph work
+      Setup,        // Image traverser, pipeline and idle mode setup
+      Barrier,      // Waiting for the other threads
+      Render,       // ImageTraverser::renderImage
+      Display,      // ImageDisplay::displayImage
+      NumStages
+    };
+
+    // Threads with an index of maxThreads or more are not recorded.
+    FrameProfile(int maxThreads, size_t eventsPerThread = 65536);
+    ~FrameProfile();
+
+    static const char* getStageName(int stage);
+
+    static double currentTime() {
+      return Time::currentSeconds();
+    }
+
+    // Record that thread spent [start, now) in stage while working on
+    // frame.
+    void record(int thread, int stage, long frame, double start) {
+      if(thread >= maxThreads)
+        return;
+      ThreadEvents& events = threads[thread];
+      Event& event = events.events[events.count % eventsPerThread];
+      event.start = start;
+      event.end = currentTime();
+      event.frame = frame;
+      event.stage = stage;
+      events.count++;
+    }
+
+    // Record the most temporary ray packets (see RayPacketArena) thread
+    // had in use at once.  Render threads report this when they exit.
+    void recordPacketHighWaterMark(int thread, int numPackets) {
+      if(thread < maxThreads)
+        threads[thread].packetHighWaterMark = numPackets;
+    }
+    int getPacketHighWaterMark(int thread) const;
+
+    // Forget everything recorded so far.  Not safe while rendering.
+    void reset();
+
+    int getMaxThreads() const {
+      return maxThreads;
+    }
+
+    // Number of events thread has recorded, including overwritten ones.
+    size_t getNumEvents(int thread) const;
+
+    // The oldest and newest frame that still has events.  Returns false if
+    // nothing has been recorded.
+    bool getFrameRange(long& first, long& last) const;
+
+    // Seconds that thread spent in each stage of frame.
+    void getStageTimes(int thread, long frame, double times[NumStages]) const;
+
+    // Prints, for every stage, the time per frame averaged over the
+    // threads that recorded anything.
+    void printSummary(std::ostream& out) const;
+
+    // Writes every event as a Chrome trace ("Trace Event Format" JSON),
+    // which chrome://tracing and Perfetto can display.  One track is
+    // shown per thread.
+    void writeChromeTrace(std::ostream& out) const;
+    bool writeChromeTrace(const std::string& filename) const;
+
+  private:
+    FrameProfile(const FrameProfile&);
+    FrameProfile& operator=(const FrameProfile&);
+
+    struct Event {
+      double start;
+      double end;
+      long frame;
+      int stage;
+    };
+
+    // One cache line per thread so that recording never shares a line
+    // with another thread.
+    struct MANTA_ALIGN(MAXCACHELINESIZE) ThreadEvents
+      : public AlignedAllocator<ThreadEvents, MAXCACHELINESIZE> {
+      Event* events;
+      size_t count;
+      int packetHighWaterMark;
+    };
+
+    // Index range [begin, end) of the events still in the ring of thread.
+    void getValidEvents(int thread, size_t& begin, size_t& end) const;
+
+    int maxThreads;
+    size_t eventsPerThread;
+    double startTime;
+    ThreadEvents* threads;
+  };
+}
+
+#endif
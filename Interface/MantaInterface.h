@@ -44,6 +44,7 @@ namespace Manta {
   class Barrier;
   class Camera;
   class CameraPath;
+  class FrameProfile;
   class FrameState;
   class Group;
   class IdleMode;
@@ -95,6 +96,13 @@ namespace Manta {
     virtual void setDisplayBeforeRender(bool setting) { cerr << "ignoring pipeline stage command." << endl; };
     virtual bool getDisplayBeforeRender() { return false; }
 
+    // Frame profiling: while a FrameProfile is set, every render thread
+    // records the time it spends in each stage (transactions, animation,
+    // barriers, rendering, display, ...) of every frame.  Set it before
+    // rendering begins.  The profile is not owned; 0 turns it off.
+    virtual void setFrameProfile(FrameProfile* profile) { cerr << "ignoring frame profile." << endl; };
+    virtual FrameProfile* getFrameProfile() const { return 0; }
+
     // Idle modes
     typedef unsigned int IdleModeHandle;
     virtual IdleModeHandle addIdleMode( IdleMode* idle_mode_ ) = 0;
@@ -37,6 +37,7 @@
 #include <Core/Math/Expon.h>
 #include <Core/Util/Assert.h>
 #include <Core/Util/Align.h>
+#include <Core/Util/AlignedAllocator.h>
 #include <Core/Util/StaticCheck.h>
 #include <Interface/Primitive.h>
 #include <Interface/TexCoordMapper.h>
@@ -55,6 +56,67 @@ namespace Manta {
   class Material;
   class RenderContext;
 
+  // A shading array of a RayPacketData, T[Rows][RAYPACKET_MAXSIZE].  The
+  // memory is allocated the first time the array is used, so a packet
+  // that is only traced (shadow rays, the transformed rays of an
+  // instance) never allocates or touches it.  Once allocated it is kept
+  // until the RayPacketData is destroyed; packets taken from a
+  // RayPacketArena therefore allocate each array once per thread.
+  template<class T, int Rows>
+  class RayPacketColdArray {
+  public:
+    RayPacketColdArray() : rows(0) {}
+    ~RayPacketColdArray() { deallocateAligned(rows); }
+
+    T* operator[](int row) const {
+      if(!rows)
+        allocate();
+      return rows[row];
+    }
+    bool isAllocated() const {
+      return rows != 0;
+    }
+
+  private:
+    RayPacketColdArray(const RayPacketColdArray&);
+    RayPacketColdArray& operator=(const RayPacketColdArray&);
+
+    void allocate() const {
+      rows = static_cast<T (*)[RAYPACKET_MAXSIZE]>
+        (allocateAligned(sizeof(T)*Rows*RAYPACKET_MAXSIZE, MAXCACHELINESIZE));
+    }
+
+    mutable T (*rows)[RAYPACKET_MAXSIZE];
+  };
+
+  // The same for the per-ray arrays with a single value per ray.
+  template<class T>
+  class RayPacketColdVector {
+  public:
+    RayPacketColdVector() : values(0) {}
+    ~RayPacketColdVector() { deallocateAligned(values); }
+
+    T& operator[](int which) const {
+      if(!values)
+        allocate();
+      return values[which];
+    }
+    bool isAllocated() const {
+      return values != 0;
+    }
+
+  private:
+    RayPacketColdVector(const RayPacketColdVector&);
+    RayPacketColdVector& operator=(const RayPacketColdVector&);
+
+    void allocate() const {
+      values = static_cast<T*>
+        (allocateAligned(sizeof(T)*RAYPACKET_MAXSIZE, MAXCACHELINESIZE));
+    }
+
+    mutable T* values;
+  };
+
   class MANTA_ALIGN(16) RayPacketData {
   public:
     enum RayPacketDataSizes {
@@ -75,7 +137,13 @@ namespace Manta {
     {
     }
 
-    // Pointer-based arrays
+    // The packet is split into a hot core that traversal and
+    // intersection use, which is stored inline, and cold shading arrays
+    // that are allocated on first use (see RayPacketColdArray).  Each
+    // cold array backs one of the RayPacket::Have* flags (or the
+    // sample, color and importance values filled in by the renderer), so
+    // a packet only carries memory for the attributes that are computed
+    // for it.  Both are accessed the same way, e.g. data->normal[0][i].
 
     // SWIG generated some error prone code when we used the types
     // directly.  Making a typedef seemed to fix it.
@@ -83,50 +151,55 @@ namespace Manta {
     typedef Material const*  MaterialCP;
     typedef TexCoordMapper const* TexCoordMapperCP;
 
-    PrimitiveCP hitPrim[MaxSize];
-    MaterialCP hitMatl[MaxSize];
-    TexCoordMapperCP hitTex[MaxSize];
-
-    // Real-based arrays
+    // Hot: rays and hits
     MANTA_ALIGN(16) Real origin[3][MaxSize];
     MANTA_ALIGN(16) Real direction[3][MaxSize];
     MANTA_ALIGN(16) Real inverseDirection[3][MaxSize];
     MANTA_ALIGN(16) Real minT[MaxSize];
+    MANTA_ALIGN(16) int signs[3][MaxSize]; // 1=negative, 0=zero, positive
     MANTA_ALIGN(16) Real corner_dir[3][4];
     MANTA_ALIGN(16) Real time[MaxSize]; // Time for this ray in [0,1)
 
-    MANTA_ALIGN(16) Real image[2][MaxSize];
-    MANTA_ALIGN(16) Real normal[3][MaxSize];
-    MANTA_ALIGN(16) Real ffnormal[3][MaxSize]; // Forward facing normals
-    MANTA_ALIGN(16) Real geometricNormal[3][MaxSize];
-    MANTA_ALIGN(16) Real ffgeometricNormal[3][MaxSize];
-    MANTA_ALIGN(16) Real hitPosition[3][MaxSize];
-    MANTA_ALIGN(16) Real texCoords[3][MaxSize];
-    MANTA_ALIGN(16) Real dPdu[3][MaxSize];
-    MANTA_ALIGN(16) Real dPdv[3][MaxSize];
-
-    // Color-based arrays
-    MANTA_ALIGN(16) Color::ComponentType color[Manta::Color::NumComponents][MaxSize];
-    MANTA_ALIGN(16) Color::ComponentType importance[Manta::Color::NumComponents][MaxSize];   // 1-attenuation, where eye rays have importance == 1
-
-    // Int-based arrays
-    MANTA_ALIGN(16) int whichEye[MaxSize];
-    MANTA_ALIGN(16) unsigned int sample_depth[MaxSize];
-    MANTA_ALIGN(16) unsigned int sample_id[MaxSize];
-    MANTA_ALIGN(16) unsigned int region_id[MaxSize];
+    // resetHits clears hitMatl with aligned SSE stores.
+    MANTA_ALIGN(16) PrimitiveCP hitPrim[MaxSize];
+    MANTA_ALIGN(16) MaterialCP hitMatl[MaxSize];
+    MANTA_ALIGN(16) TexCoordMapperCP hitTex[MaxSize];
+
+    // Hot: primitives keep per-hit data (e.g. barycentric coordinates)
+    // here during intersection.
+    MANTA_ALIGN(16) float scratchpad4[MaxScratchpad4][MaxSize];
+    MANTA_ALIGN(16) double scratchpad8[MaxScratchpad8][MaxSize];
+    char scratchpad_data[MaxSize][MaxScratchpadSize];
+
+    // Cold: shading attributes
+    RayPacketColdArray<Real, 2> image;             // HaveImageCoordinates
+    RayPacketColdArray<Real, 3> normal;            // HaveNormals
+    RayPacketColdArray<Real, 3> ffnormal;          // HaveFFNormals
+    RayPacketColdArray<Real, 3> geometricNormal;   // HaveGeometricNormals
+    RayPacketColdArray<Real, 3> ffgeometricNormal; // HaveFFGeometricNormals
+    RayPacketColdArray<Real, 3> hitPosition;       // HaveHitPositions
+    RayPacketColdArray<Real, 3> texCoords;         // HaveTexture2/3
+    RayPacketColdArray<Real, 3> dPdu;              // HaveSurfaceDerivatives
+    RayPacketColdArray<Real, 3> dPdv;              // HaveSurfaceDerivatives
+
+    // Cold: color-based arrays
+    RayPacketColdArray<Color::ComponentType, Color::NumComponents> color;
+    RayPacketColdArray<Color::ComponentType, Color::NumComponents> importance;   // 1-attenuation, where eye rays have importance == 1
+
+    // Cold: int-based arrays
+    RayPacketColdVector<int> whichEye;
+    RayPacketColdVector<unsigned int> sample_depth;
+    RayPacketColdVector<unsigned int> sample_id;
+    RayPacketColdVector<unsigned int> region_id;
     // NOTE(boulos): SSE has no good way to do bools. This also allows
     // us to do per-ray flags in the future. I'm also making this
     // ignoreEmittedLight since this will be the default for almost
     // everything, and it can be filled in using setzero
-    MANTA_ALIGN(16) unsigned int ignoreEmittedLight[MaxSize];
-    MANTA_ALIGN(16) int signs[3][MaxSize]; // 1=negative, 0=zero, positive
-
-    // Scratchpad
-    MANTA_ALIGN(16) float scratchpad4[MaxScratchpad4][MaxSize];
-    MANTA_ALIGN(16) double scratchpad8[MaxScratchpad8][MaxSize];
+    RayPacketColdVector<unsigned int> ignoreEmittedLight;
 
-    // Char-based arrays
-    char scratchpad_data[MaxSize][MaxScratchpadSize];
+  private:
+    RayPacketData(const RayPacketData&);
+    RayPacketData& operator=(const RayPacketData&);
   };
 
   class RayPacket {
@@ -0,0 +1,45 @@
+#include <Interface/RayPacketArena.h>
+#include <Interface/Context.h>
+#include <Parameters.h>
+
+#include <new>
+
+using namespace Manta;
+
+RayPacketArena::RayPacketArena()
+  : inUse(0), highWaterMark(0)
+{
+}
+
+RayPacketArena::~RayPacketArena()
+{
+  ASSERT(inUse == 0);
+  for(size_t i = 0; i < slots.size(); i++){
+    slots[i]->~RayPacketData();
+    delete[] memory[i];
+  }
+}
+
+void RayPacketArena::grow()
+{
+  // Start every packet on its own cache line.
+  char* block = new char[sizeof(RayPacketData) + MAXCACHELINESIZE];
+  size_t misalignment = reinterpret_cast<size_t>(block) % MAXCACHELINESIZE;
+  char* aligned = block + (misalignment ? MAXCACHELINESIZE - misalignment : 0);
+  memory.push_back(block);
+  slots.push_back(new (aligned) RayPacketData);
+}
+
+ScopedRayPacketData::ScopedRayPacketData(const RenderContext& context)
+  : arena(context.packetArena)
+{
+  data = arena ? arena->acquire() : new RayPacketData;
+}
+
+ScopedRayPacketData::~ScopedRayPacketData()
+{
+  if(arena)
+    arena->release(data);
+  else
+    delete data;
+}
@@ -0,0 +1,85 @@
+#ifndef Manta_Interface_RayPacketArena_h
+#define Manta_Interface_RayPacketArena_h
+
+#include <Core/Util/Assert.h>
+#include <Interface/RayPacket.h>
+
+#include <vector>
+
+namespace Manta {
+  class RenderContext;
+
+  // Hands out RayPacketData to code that needs a temporary packet, such
+  // as the shadow, reflected and refracted rays spawned while shading.
+  // Packets are taken and given back in LIFO order, so slot n is in use
+  // while n packets are alive further up the call chain.  Slots are
+  // allocated on first use and reused from then on.  Every render thread
+  // owns its own arena (RenderContext::packetArena), so nothing is locked.
+  class RayPacketArena {
+  public:
+    RayPacketArena();
+    ~RayPacketArena();
+
+    RayPacketData* acquire() {
+      if(inUse == static_cast<int>(slots.size()))
+        grow();
+      RayPacketData* data = slots[inUse++];
+      if(inUse > highWaterMark)
+        highWaterMark = inUse;
+      return data;
+    }
+    void release(RayPacketData* data) {
+      ASSERT(inUse > 0 && slots[inUse-1] == data);
+      inUse--;
+    }
+
+    int getNumInUse() const {
+      return inUse;
+    }
+    // The most packets that were in use at once.
+    int getHighWaterMark() const {
+      return highWaterMark;
+    }
+    void resetHighWaterMark() {
+      highWaterMark = inUse;
+    }
+
+  private:
+    RayPacketArena(const RayPacketArena&);
+    RayPacketArena& operator=(const RayPacketArena&);
+
+    void grow();
+
+    std::vector<RayPacketData*> slots;
+    std::vector<char*> memory;
+    int inUse;
+    int highWaterMark;
+  };
+
+  // A RayPacketData taken from the arena of the context for the lifetime
+  // of this object.  Contexts without an arena get one from the heap.
+  class ScopedRayPacketData {
+  public:
+    ScopedRayPacketData(const RenderContext& context);
+    ~ScopedRayPacketData();
+
+    RayPacketData& operator*() const {
+      return *data;
+    }
+    RayPacketData* operator->() const {
+      return data;
+    }
+    RayPacketData* get() const {
+      return data;
+    }
+
+  private:
+    ScopedRayPacketData(const ScopedRayPacketData&);
+    ScopedRayPacketData& operator=(const ScopedRayPacketData&);
+
+    RayPacketArena* arena;
+    RayPacketData* data;
+  };
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <Model/AmbientLights/AmbientOcclusion.h>
 #include <Interface/RayPacket.h>
 #include <Interface/Context.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Scene.h>
 #include <Core/Math/MT_RNG.h>
 #include <Core/Math/Trig.h>
@@ -145,13 +146,13 @@ void AmbientOcclusion::computeAmbient(const RenderContext& context,
   rays.computeHitPositions();
   Color resultingColor = Color::black();
 
-  RayPacketData occlusion_data;
+  ScopedRayPacketData occlusion_data(context);
   int flag = RayPacket::NormalizedDirections | RayPacket::ConstantOrigin;
 
   if (!bounce)
     flag |= RayPacket::AnyHit;
 
-  RayPacket occlusion_rays(occlusion_data, RayPacket::UnknownShape,
+  RayPacket occlusion_rays(*occlusion_data, RayPacket::UnknownShape,
                            0, RayPacket::MaxSize,
                            rays.getDepth()+1,
                            flag);
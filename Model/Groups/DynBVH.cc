@@ -1,6 +1,10 @@
+#include <Core/Exceptions/IllegalValue.h>
 #include <Core/Exceptions/InternalError.h>
 #include <Core/Math/MiscMath.h>
+#include <Core/Thread/Runnable.h>
+#include <Core/Thread/Thread.h>
 #include <Core/Thread/Time.h>
+#include <Core/Util/Callback.h>
 #include <Core/Util/Preprocessor.h>
 #include <Core/Util/UpdateGraph.h>
 #include <Core/Persistent/ArchiveElement.h>
@@ -20,6 +24,7 @@
 #include <limits>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 using namespace Manta;
 using std::cerr;
@@ -96,6 +101,14 @@ DynBVH::printNode(int nodeID, int depth) const {
 DynBVH::~DynBVH()
 {
   //  cerr << MANTA_FUNC << " called.\n";
+  if (rebuild_thread) {
+    rebuild_lock.lock();
+    rebuild_quit = true;
+    rebuild_signal.conditionBroadcast();
+    rebuild_lock.unlock();
+    rebuild_thread->join();
+  }
+  delete rebuilder;
 }
 
 void DynBVH::intersect(const RenderContext& context, RayPacket& rays) const
@@ -122,6 +135,15 @@ void DynBVH::intersect(const RenderContext& context, RayPacket& rays) const
 
   // compute IntervalArithmetic Data
   IAData ia_data;
+  computeIAData(rays, ia_data);
+
+  intersectNode(0,context,rays, ia_data);
+#endif // dynbvh port or not
+}
+
+// Bounds of the reciprocal directions and origins of the unmasked rays.
+void DynBVH::computeIAData(const RayPacket& rays, IAData& ia_data)
+{
   for (int axis = 0; axis < 3; axis++ ) {
       ia_data.min_rcp[axis]     =  std::numeric_limits<float>::max();
       ia_data.max_rcp[axis]     = -std::numeric_limits<float>::max();
@@ -265,10 +287,6 @@ void DynBVH::intersect(const RenderContext& context, RayPacket& rays) const
     }
   }
 #endif
-
-
-  intersectNode(0,context,rays, ia_data);
-#endif // dynbvh port or not
 }
 
 void DynBVH::intersectNode(int nodeID, const RenderContext& context,
@@ -301,83 +319,7 @@ void DynBVH::intersectNode(int nodeID, const RenderContext& context,
       // build a subpacket from firstActive to lastActive (inclusive, hence +1)
       RayPacket subpacket(rays, firstActive, lastActive+1);
 
-      for (int i = 0; i < node.children; i++ ) {
-#ifdef COLLECT_STATS
-        stats[context.proc].nIntersects += (subpacket.end()-subpacket.begin());
-#endif
-
-        const int object_id = object_ids[node.child+i];
-#if 0
-        currGroup->get(object_id)->intersect(context, subpacket);
-#else
-        const bool anyHit = subpacket.getFlag(RayPacket::AnyHit);
-
-        if (anyHit) {
-
-          // Save previous t values/hit points.
-          Real t[RayPacket::MaxSize];
-          for (int r = subpacket.begin(); r < subpacket.end(); ++r)
-            t[r] = subpacket.getMinT(r);
-
-          currGroup->get(object_id)->intersect(context, subpacket);
-
-          bool somethingTerminated = false;
-
-          // This block of code is only required for attenuating materials.
-          // For occluding materials this introduces a (very) small performance
-          // hit and could be safely commented out.
-          for (int i = subpacket.begin(); i < subpacket.end(); ++i) {
-            if (!subpacket.wasHit(i) || subpacket.rayIsMasked(i))
-              continue;
-            int end = i+1;
-            const Material* hit_matl = subpacket.getHitMaterial(i);
-            while (end < subpacket.end() && subpacket.wasHit(end) &&
-                   subpacket.getHitMaterial(end) == hit_matl) {
-              end++;
-            }
-
-            RayPacket shadingPacket(subpacket, i, end);
-            hit_matl->attenuateShadows(context, shadingPacket);
-            for (int j=i; j < end; ++j) {
-              if (shadingPacket.getColor(j) != Color::black()) {
-                shadingPacket.resetHit(j, t[j]);
-              }
-              else {
-                somethingTerminated = true;
-                // Do not allow anything else to count as hit.  Doing so could
-                // replace a previously found occluder with a closer
-                // transparent material and result in a lost early ray
-                // termination optimization.  If there are no transparent
-                // materials, then this is superfluous work.
-                shadingPacket.overrideMinT(j, T_EPSILON); // T_EPSILON should be small enough.
-              }
-            }
-            i=end-1;
-          }
-
-          // Shrink packet. Get rid of terminated (fully occluded) rays on the
-          // ends of the packet.
-          if (somethingTerminated) {
-            int start, end;
-            for (start = subpacket.begin(); start < subpacket.end(); ++start) {
-              if (!subpacket.wasHit(start) && !subpacket.rayIsMasked(start))
-                break;
-            }
-            for (end = subpacket.end()-1; end > start; --end) {
-              if (!subpacket.wasHit(end) && !subpacket.rayIsMasked(end))
-                break;
-            }
-            subpacket.resize(start, end+1);
-            if (end < start) {
-              break;
-            }
-          }
-        }
-        else {
-          currGroup->get(object_id)->intersect(context, subpacket);
-        }
-#endif
-      }
+      intersectObjects(context, subpacket, node.child, node.children);
     }
     else {
       // make a subpacket from the (possibly) new firstActive to the current end
@@ -403,6 +345,100 @@ void DynBVH::intersectNode(int nodeID, const RenderContext& context,
   }
 }
 
+// Intersects the objects of a leaf, object_ids[firstObject] on.
+void DynBVH::intersectObjects(const RenderContext& context,
+                              RayPacket& subpacket,
+                              int firstObject, int numObjects) const
+{
+  for (int i = 0; i < numObjects; i++ ) {
+#ifdef COLLECT_STATS
+    stats[context.proc].nIntersects += (subpacket.end()-subpacket.begin());
+#endif
+
+    const int object_id = object_ids[firstObject+i];
+#if 0
+    currGroup->get(object_id)->intersect(context, subpacket);
+#else
+    const bool anyHit = subpacket.getFlag(RayPacket::AnyHit);
+
+    if (anyHit) {
+
+      // Save previous t values/hit points.
+      Real t[RayPacket::MaxSize];
+      for (int r = subpacket.begin(); r < subpacket.end(); ++r)
+        t[r] = subpacket.getMinT(r);
+
+      currGroup->get(object_id)->intersect(context, subpacket);
+
+      if (!attenuateShadowHits(context, subpacket, t))
+        return;
+    }
+    else {
+      currGroup->get(object_id)->intersect(context, subpacket);
+    }
+#endif
+  }
+}
+
+// Rays that are not fully occluded get their hit reset to t, so that
+// they keep looking for occluders.
+bool DynBVH::attenuateShadowHits(const RenderContext& context,
+                                 RayPacket& subpacket, const Real* t)
+{
+  bool somethingTerminated = false;
+
+  // This block of code is only required for attenuating materials.
+  // For occluding materials this introduces a (very) small performance
+  // hit and could be safely commented out.
+  for (int i = subpacket.begin(); i < subpacket.end(); ++i) {
+    if (!subpacket.wasHit(i) || subpacket.rayIsMasked(i))
+      continue;
+    int end = i+1;
+    const Material* hit_matl = subpacket.getHitMaterial(i);
+    while (end < subpacket.end() && subpacket.wasHit(end) &&
+           subpacket.getHitMaterial(end) == hit_matl) {
+      end++;
+    }
+
+    RayPacket shadingPacket(subpacket, i, end);
+    hit_matl->attenuateShadows(context, shadingPacket);
+    for (int j=i; j < end; ++j) {
+      if (shadingPacket.getColor(j) != Color::black()) {
+        shadingPacket.resetHit(j, t[j]);
+      }
+      else {
+        somethingTerminated = true;
+        // Do not allow anything else to count as hit.  Doing so could
+        // replace a previously found occluder with a closer
+        // transparent material and result in a lost early ray
+        // termination optimization.  If there are no transparent
+        // materials, then this is superfluous work.
+        shadingPacket.overrideMinT(j, T_EPSILON); // T_EPSILON should be small enough.
+      }
+    }
+    i=end-1;
+  }
+
+  // Shrink packet. Get rid of terminated (fully occluded) rays on the
+  // ends of the packet.
+  if (somethingTerminated) {
+    int start, end;
+    for (start = subpacket.begin(); start < subpacket.end(); ++start) {
+      if (!subpacket.wasHit(start) && !subpacket.rayIsMasked(start))
+        break;
+    }
+    for (end = subpacket.end()-1; end > start; --end) {
+      if (!subpacket.wasHit(end) && !subpacket.rayIsMasked(end))
+        break;
+    }
+    subpacket.resize(start, end+1);
+    if (end < start) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // return the first index (between [rays.begin(),rays.end()]) which hits the box
 int DynBVH::firstIntersects(const BBox& box, const RayPacket& rays, const IAData& ia_data)
 {
@@ -905,8 +941,12 @@ int DynBVH::lastIntersects(const BBox& box, const RayPacket& rays)
 }
 
 void DynBVH::setGroup(Group* new_group) {
-  if (new_group != currGroup)
+  if (new_group != currGroup) {
     group_changed = true;
+    bounds_from_file = false;
+    built_cost = 0;
+    generation++;
+  }
   currGroup = new_group;
   mesh = dynamic_cast<Mesh*>(new_group);
 }
@@ -918,6 +958,9 @@ Group* DynBVH::getGroup() const {
 void DynBVH::groupDirty()
 {
   group_changed = true;
+  bounds_from_file = false;
+  built_cost = 0;
+  generation++;
 }
 
 void DynBVH::addToUpdateGraph(ObjectUpdateGraph* graph,
@@ -951,7 +994,10 @@ void DynBVH::preprocess(const PreprocessContext& context)
         context.done();
       }
 
-      rebuild(context.proc, context.numProcs);
+      // A tree loaded from a matching file already has exact bounds.
+      // Refitting it would only touch (and unshare) every mapped page.
+      if (!bounds_from_file)
+        rebuild(context.proc, context.numProcs);
 
     //printNode(0, 0);
     }
@@ -1572,12 +1618,190 @@ void DynBVH::parallelBuildReduction(TaskList* list, int node_id, Task* task) {
 }
 
 void DynBVH::update(int proc, int numProcs) {
+#if USE_LAZY_BUILD == 0
+  // A tree built in the background replaces this one before the refit,
+  // which brings it up to date.  Like the refit, this relies on update
+  // being called between frames by every thread that traces the tree
+  // (RTRT only runs animation callbacks once tracing has stopped), so
+  // the old nodes are published away only after all of them have
+  // reached this barrier.  The other threads only touch the nodes after
+  // the first barrier in parallelUpdateBounds.
+  bool swapped = false;
+  if (rebuilder) {
+    barrier.wait(numProcs);
+    if (proc == 0)
+      swapped = swapInBackgroundRebuild();
+  }
+#endif
+  bounds_from_file = false;
   PreprocessContext context;
   parallelUpdateBounds(context, proc, numProcs);
   // TODO(boulos): Wait until everyone has gone through update to
   // disable group_changed (requires another barrier)
-  if (proc == 0)
+  if (proc == 0) {
     group_changed = false;
+#if USE_LAZY_BUILD == 0
+    updateTreeCost();
+    // The rebuilder reuses the arrays of the tree it replaced, so it
+    // does not start on them before the next frame.
+    if (!swapped && max_cost_ratio > 0 &&
+        tree_cost > max_cost_ratio * built_cost)
+      startBackgroundRebuild(numProcs);
+#endif
+  }
+}
+
+void DynBVH::updateTreeCost()
+{
+  if (nodes.empty()) {
+    tree_cost = 0;
+    return;
+  }
+#if TREE_ROT
+  // The rotations keep the cost of every node up to date.
+  tree_cost = costs[0];
+#else
+  tree_cost = computeCost<false>(0);
+#endif
+  if (built_cost == 0)
+    built_cost = tree_cost;
+}
+
+void DynBVH::setBackgroundRebuild(Real maxCostRatio)
+{
+  if (maxCostRatio != 0 && maxCostRatio <= 1)
+    throw IllegalValue<Real>("DynBVH background rebuild cost ratio must be "
+                             "0 or more than 1", maxCostRatio);
+  max_cost_ratio = maxCostRatio;
+}
+
+bool DynBVH::isRebuildPending() const
+{
+  rebuild_lock.lock();
+  const bool pending = rebuild_state != RebuildIdle;
+  rebuild_lock.unlock();
+  return pending;
+}
+
+void DynBVH::startBackgroundRebuild(int numProcs)
+{
+  if (!currGroup || currGroup->size() == 0 || isRebuildPending())
+    return;
+
+  if (!rebuilder)
+    rebuilder = new DynBVH(false);
+  // The bounds the refit just computed are handed over rather than
+  // copied.  Nothing reads them between updates, and the next update (or
+  // rebuild) computes all of them again.
+  rebuilder->obj_bounds.swap(obj_bounds);
+  obj_bounds.resize(rebuilder->obj_bounds.size());
+  obj_bounds_handed_off = true;
+  rebuilder->mesh = mesh;
+  rebuild_procs = numProcs;
+  rebuild_generation = generation;
+
+  if (!rebuild_thread)
+    rebuild_thread = new Thread(new RunnableCallback
+                                (Callback::create(this,
+                                                  &DynBVH::backgroundRebuildThread)),
+                                "DynBVH rebuild");
+  rebuild_lock.lock();
+  rebuild_state = RebuildRequested;
+  rebuild_signal.conditionSignal();
+  rebuild_lock.unlock();
+}
+
+bool DynBVH::swapInBackgroundRebuild()
+{
+  rebuild_lock.lock();
+  const bool ready = rebuild_state == RebuildReady;
+  rebuild_lock.unlock();
+  if (!ready)
+    return false;
+
+  const bool current = rebuild_generation == generation;
+  if (current) {
+    nodes.swap(rebuilder->nodes);
+    object_ids.swap(rebuilder->object_ids);
+#if TREE_ROT
+    costs.swap(rebuilder->costs);
+    subtree_size.swap(rebuilder->subtree_size);
+#endif
+    num_nodes.set(rebuilder->num_nodes);
+    nextFree.set(rebuilder->nextFree);
+    largeSubtreeSize = rebuilder->largeSubtreeSize;
+    if (print_info)
+      cerr << "DynBVH: swapped in a tree built in the background in "
+           << rebuild_seconds << "s (cost " << tree_cost << " refit, "
+           << rebuilder->built_cost << " rebuilt)\n";
+    built_cost = rebuilder->built_cost;
+    num_background_rebuilds++;
+  }
+
+  rebuild_lock.lock();
+  rebuild_state = RebuildIdle;
+  rebuild_lock.unlock();
+  return current;
+}
+
+void DynBVH::backgroundRebuildThread()
+{
+  rebuild_lock.lock();
+  while (!rebuild_quit) {
+    if (rebuild_state != RebuildRequested) {
+      rebuild_signal.wait(rebuild_lock);
+      continue;
+    }
+    rebuild_lock.unlock();
+    const double start = Time::currentSeconds();
+    rebuilder->buildDetached(rebuild_procs);
+    rebuild_seconds = Time::currentSeconds() - start;
+    rebuild_lock.lock();
+    rebuild_state = RebuildReady;
+  }
+  rebuild_lock.unlock();
+}
+
+void DynBVH::buildDetached(int numProcs)
+{
+  const size_t size = obj_bounds.size();
+  // The storage of a tree swapped out is reused, unless it is a view of
+  // a mapped file.
+  if (nodes.isExternal())
+    nodes.clear();
+  if (object_ids.isExternal())
+    object_ids.clear();
+  nodes.resize(2*size);
+  object_ids.resize(size);
+  obj_centroids.resize(size);
+#if TREE_ROT
+  costs.resize(2*size);
+  subtree_size.resize(2*size);
+#endif
+
+  nodes[0].bounds.reset();
+  for (size_t i = 0; i < size; ++i) {
+    object_ids[i] = i;
+    obj_centroids[i] = obj_bounds[i].center();
+    nodes[0].bounds.extendByBox(obj_bounds[i]);
+  }
+
+  num_nodes.set(0);
+  nextFree.set(1);
+  build(0, 0, size);
+#if !TREE_ROT
+  nodes.resize(num_nodes);
+#endif
+  largeSubtreeSize = nodes.size() / (20 * numProcs);
+  computeSubTreeSizes(0);
+#ifdef RTSAH
+  computeTraversalCost();
+#endif
+#if TREE_ROT
+  computeCost<true>(0);
+#endif
+  built_cost = 0;
+  updateTreeCost();
 }
 
 void DynBVH::computeTraversalCost()
@@ -1672,13 +1896,18 @@ VectorT<float, 2> DynBVH::computeSubTreeTraversalCost(unsigned int nodeID)
      cost[1] = Pjl*Cl[1] + Pjr*Cr[1] + Plr*Cl[1]*Cr[1] + Pe;
      cost[1] = Clamp(cost[1], 0.0f, 1.0f);  // Clean up numerical precision issues.
 
-     node.isLeftCheaper = lCost < rCost;
+     // Avoid dirtying nodes that live in a mapped file.
+     const bool isLeftCheaper = lCost < rCost;
+     if (node.isLeftCheaper != isLeftCheaper)
+       node.isLeftCheaper = isLeftCheaper;
      return cost;
   }
 }
 
 void DynBVH::allocate() const {
- if(2*currGroup->size() > nodes.size()) {
+  // A tree with spatial splits can have more object ids than objects.
+ if(2*currGroup->size() > nodes.size() ||
+    object_ids.size() != currGroup->size()) {
     nodes.resize(2*currGroup->size());
 #if TREE_ROT
     costs.resize(2*currGroup->size());
@@ -1737,6 +1966,8 @@ void DynBVH::rebuild(int proc, int numProcs)
     currGroup->get(i)->computeBounds(serial_context, obj_bounds[i]);
     obj_centroids[i] = obj_bounds[i].center();
   }
+  if (proc == 0)
+    obj_bounds_handed_off = false;
 
 
 #if USE_LAZY_BUILD
@@ -1767,7 +1998,10 @@ void DynBVH::rebuild(int proc, int numProcs)
 
   double build_start = Time::currentSeconds();
 
-  build(0, 0, currGroup->size());
+  if (spatialSplitBudget > 0)
+    buildSpatial();
+  else
+    build(0, 0, currGroup->size());
 
 #if !TREE_ROT
   nodes.resize(num_nodes);
@@ -1796,6 +2030,8 @@ void DynBVH::rebuild(int proc, int numProcs)
 #if TREE_ROT
   computeCost<true>(0);
 #endif
+  built_cost = 0;
+  updateTreeCost();
 
   if (proc == 0 && needToSaveFile)
     saveToFile(saveFileName);
@@ -1808,6 +2044,7 @@ void DynBVH::build(int nodeID, int objectBegin, int objectEnd,
   if (objectEnd <= objectBegin) {
     throw InternalError("Tried building BVH over invalid range");
   }
+  ASSERT(!obj_bounds_handed_off);
 
   BVHNode& node = nodes[nodeID];
 
@@ -1972,8 +2209,10 @@ unsigned int DynBVH::computeSubTreeSizes(size_t nodeID) {
   if (nodes[nodeID].isUninitialized())
     return 0;
 
+  // Only write when something changes so a mapped tree stays shared.
   if ( nodes[nodeID].isLeaf() ) {
-    nodes[nodeID].isLargeSubtree = false;
+    if (nodes[nodeID].isLargeSubtree)
+      nodes[nodeID].isLargeSubtree = false;
 #if TREE_ROT
     subtree_size[nodeID] = 1;
 #endif
@@ -1985,7 +2224,9 @@ unsigned int DynBVH::computeSubTreeSizes(size_t nodeID) {
     const unsigned int leftSize = computeSubTreeSizes(leftID);
     const unsigned int rightSize = computeSubTreeSizes(rightID);
     const unsigned int size = leftSize + rightSize + 1;
-    nodes[nodeID].isLargeSubtree = size > largeSubtreeSize;
+    const bool isLarge = size > largeSubtreeSize;
+    if (nodes[nodeID].isLargeSubtree != isLarge)
+      nodes[nodeID].isLargeSubtree = isLarge;
 
 #if TREE_ROT
     subtree_size[nodeID] = size;
@@ -2029,6 +2270,8 @@ void DynBVH::parallelUpdateBounds(const PreprocessContext& context,
     obj_centroids[i] = obj_bounds[i].center();
 #endif
   }
+  if (proc == 0)
+    obj_bounds_handed_off = false;
   barrier.wait(numProcs);
 
   if (numProcs == 1) {
@@ -2071,6 +2314,7 @@ void DynBVH::updateBounds(int ID)
   // TODO: If a recomputed RTSAH is desired after each update, then that should
   // be folded into this in order to minimize memory accesses.  Also, the
   // BSP approximation should probably be used since that is much faster.
+  ASSERT(!obj_bounds_handed_off);
 
   BVHNode& node = nodes[ID];
 
@@ -2439,34 +2683,611 @@ bool DynBVH::buildEvents(const int parentID,
   return best_eval.event != -1;
 }
 
+namespace Manta {
+  bool ClipTriangle(BBox &clipped,
+                    const Vector &a,const Vector &b,const Vector&c,
+                    const BBox &bounds);
+}
+
+namespace {
+  // Builds a DynBVH with spatial splits (an SBVH, as in Stich et al.,
+  // "Spatial Splits in Bounding Volume Hierarchies").  Every node tries
+  // the best partition of its object references, like partitionSAH, and
+  // when the boxes of the two sides overlap, also splitting space in
+  // kSpatialBins places with the references clipped to either side.  A
+  // reference that straddles a spatial split goes to both children, until
+  // the budget of extra references is spent.
+  class SpatialSplitBuilder {
+  public:
+    SpatialSplitBuilder(const std::vector<BBox>& obj_bounds, const Mesh* mesh,
+                        Real budget)
+      : obj_bounds(obj_bounds), mesh(mesh),
+        maxReferences(static_cast<size_t>(obj_bounds.size()*(1 + budget))),
+        numReferences(obj_bounds.size()), rootArea(0)
+    {
+    }
+
+    void build(std::vector<DynBVH::BVHNode>& nodes, std::vector<int>& ids)
+    {
+      std::vector<Reference> refs(obj_bounds.size());
+      BBox bounds;
+      for (size_t i = 0; i < refs.size(); ++i) {
+        refs[i].bounds = obj_bounds[i];
+        refs[i].object = i;
+        bounds.extendByBox(obj_bounds[i]);
+      }
+      rootArea = bounds.computeArea();
+
+      out = &nodes;
+      outIds = &ids;
+      nodes.clear();
+      nodes.reserve(2*refs.size());
+      ids.clear();
+      ids.reserve(maxReferences);
+      nodes.resize(1);
+      nodes[0].bounds = bounds;
+      buildNode(0, refs, 0);
+    }
+
+  private:
+    // The most levels with spatial splits.  A spatial split does not
+    // always make fewer references, so deeper nodes only get object
+    // splits, which always end.
+    static const int kMaxSpatialDepth = 48;
+    static const int kSpatialBins = 32;
+    static const size_t kMaxLeafSize = 32767;
+
+    struct Reference {
+      BBox bounds;
+      int object;
+    };
+
+    struct Split {
+      Real cost;
+      int axis;
+      // The number of (sorted) references on the left of an object
+      // split, or the bin plane of a spatial split.
+      int position;
+      bool spatial;
+      BBox bounds_l, bounds_r;
+    };
+
+    struct CompareCentroids {
+      int axis;
+      explicit CompareCentroids(int axis) : axis(axis) {}
+      bool operator()(const Reference& a, const Reference& b) const
+      {
+        const Real ca = a.bounds.getMin()[axis] + a.bounds.getMax()[axis];
+        const Real cb = b.bounds.getMin()[axis] + b.bounds.getMax()[axis];
+        return ca < cb || (ca == cb && a.object < b.object);
+      }
+    };
+
+    static Real cost(const BBox& left, size_t numLeft,
+                     const BBox& right, size_t numRight, Real invArea)
+    {
+      // An empty box has an infinite area.
+      const Real leftArea = numLeft ? left.computeArea() : 0;
+      const Real rightArea = numRight ? right.computeArea() : 0;
+      return BVH_C_trav +
+        (leftArea*numLeft + rightArea*numRight)*invArea*BVH_C_isec;
+    }
+
+    void findObjectSplit(std::vector<Reference>& refs, Real invArea,
+                         Split& best) const
+    {
+      std::vector<BBox> rightBounds(refs.size());
+      for (int axis = 0; axis < 3; ++axis) {
+        std::sort(refs.begin(), refs.end(), CompareCentroids(axis));
+        BBox right;
+        for (size_t i = refs.size()-1; i > 0; --i) {
+          right.extendByBox(refs[i].bounds);
+          rightBounds[i] = right;
+        }
+        BBox left;
+        for (size_t i = 1; i < refs.size(); ++i) {
+          left.extendByBox(refs[i-1].bounds);
+          const Real c = cost(left, i, rightBounds[i], refs.size()-i,
+                              invArea);
+          if (c < best.cost) {
+            best.cost = c;
+            best.axis = axis;
+            best.position = i;
+            best.spatial = false;
+            best.bounds_l = left;
+            best.bounds_r = rightBounds[i];
+          }
+        }
+      }
+      // Leave the references sorted along the best axis.
+      if (best.axis >= 0 && best.axis < 2)
+        std::sort(refs.begin(), refs.end(), CompareCentroids(best.axis));
+    }
+
+    // The box of the part of a reference inside bounds, which is empty
+    // if nothing is.
+    BBox clip(const Reference& ref, const BBox& bounds) const
+    {
+      BBox region = ref.bounds;
+      region.intersection(bounds);
+      for (int axis = 0; axis < 3; ++axis)
+        if (region.getMin()[axis] > region.getMax()[axis])
+          return BBox();
+      if (!mesh)
+        return region;
+
+      BBox clipped;
+      if (!ClipTriangle(clipped, mesh->getVertex(ref.object, 0),
+                        mesh->getVertex(ref.object, 1),
+                        mesh->getVertex(ref.object, 2), region))
+        return BBox();
+      clipped.intersection(region);
+      return clipped;
+    }
+
+    Real binPlane(const BBox& bounds, int axis, int plane) const
+    {
+      if (plane == kSpatialBins)
+        return bounds.getMax()[axis];
+      const Real extent = bounds.getMax()[axis] - bounds.getMin()[axis];
+      return bounds.getMin()[axis] + extent*plane/kSpatialBins;
+    }
+
+    int bin(const BBox& bounds, int axis, Real x) const
+    {
+      const Real extent = bounds.getMax()[axis] - bounds.getMin()[axis];
+      const int b = static_cast<int>((x - bounds.getMin()[axis])*
+                                     kSpatialBins/extent);
+      return Max(0, Min(b, kSpatialBins-1));
+    }
+
+    BBox slab(const BBox& bounds, int axis, Real lo, Real hi) const
+    {
+      Vector min = bounds.getMin();
+      Vector max = bounds.getMax();
+      min[axis] = lo;
+      max[axis] = hi;
+      return BBox(min, max);
+    }
+
+    void findSpatialSplit(const std::vector<Reference>& refs,
+                          const BBox& bounds, Real invArea,
+                          Split& best) const
+    {
+      for (int axis = 0; axis < 3; ++axis) {
+        if (!(bounds.getMax()[axis] > bounds.getMin()[axis]))
+          continue;
+
+        BBox binBounds[kSpatialBins];
+        int entries[kSpatialBins] = { 0 };
+        int exits[kSpatialBins] = { 0 };
+        for (size_t i = 0; i < refs.size(); ++i) {
+          const Reference& ref = refs[i];
+          const int first = bin(bounds, axis, ref.bounds.getMin()[axis]);
+          const int last = bin(bounds, axis, ref.bounds.getMax()[axis]);
+          entries[first]++;
+          exits[last]++;
+          if (first == last) {
+            binBounds[first].extendByBox(ref.bounds);
+            continue;
+          }
+          for (int b = first; b <= last; ++b) {
+            const BBox part = clip(ref, slab(bounds, axis,
+                                             binPlane(bounds, axis, b),
+                                             binPlane(bounds, axis, b+1)));
+            if (!part.isDefault())
+              binBounds[b].extendByBox(part);
+          }
+        }
+
+        BBox rightBounds[kSpatialBins];
+        int rightCounts[kSpatialBins];
+        BBox right;
+        int numRight = 0;
+        for (int b = kSpatialBins-1; b > 0; --b) {
+          right.extendByBox(binBounds[b]);
+          numRight += exits[b];
+          rightBounds[b] = right;
+          rightCounts[b] = numRight;
+        }
+        BBox left;
+        int numLeft = 0;
+        for (int plane = 1; plane < kSpatialBins; ++plane) {
+          left.extendByBox(binBounds[plane-1]);
+          numLeft += entries[plane-1];
+          if (numLeft == 0 || rightCounts[plane] == 0)
+            continue;
+          const size_t duplicates = numLeft + rightCounts[plane] - refs.size();
+          if (numReferences + duplicates > maxReferences)
+            continue;
+          const Real c = cost(left, numLeft, rightBounds[plane],
+                              rightCounts[plane], invArea);
+          if (c < best.cost) {
+            best.cost = c;
+            best.axis = axis;
+            best.position = plane;
+            best.spatial = true;
+            best.bounds_l = left;
+            best.bounds_r = rightBounds[plane];
+          }
+        }
+      }
+    }
+
+    void splitSpatially(std::vector<Reference>& refs, const BBox& bounds,
+                        const Split& split, std::vector<Reference>& left,
+                        std::vector<Reference>& right)
+    {
+      const int axis = split.axis;
+      const Real plane = binPlane(bounds, axis, split.position);
+      const BBox leftSlab = slab(bounds, axis, bounds.getMin()[axis], plane);
+      const BBox rightSlab = slab(bounds, axis, plane, bounds.getMax()[axis]);
+      for (size_t i = 0; i < refs.size(); ++i) {
+        const Reference& ref = refs[i];
+        // The same bins as findSpatialSplit, so that the counts match.
+        const int first = bin(bounds, axis, ref.bounds.getMin()[axis]);
+        const int last = bin(bounds, axis, ref.bounds.getMax()[axis]);
+        if (last < split.position) {
+          left.push_back(ref);
+        } else if (first >= split.position) {
+          right.push_back(ref);
+        } else {
+          Reference l = ref;
+          Reference r = ref;
+          l.bounds = clip(ref, leftSlab);
+          r.bounds = clip(ref, rightSlab);
+          // Clipping can lose a sliver of a triangle that just touches
+          // the plane, so an empty side keeps the whole reference.
+          if (l.bounds.isDefault() || r.bounds.isDefault()) {
+            (l.bounds.isDefault() ? right : left).push_back(ref);
+            continue;
+          }
+          left.push_back(l);
+          right.push_back(r);
+          numReferences++;
+        }
+      }
+    }
+
+    void makeLeaf(int nodeID, const std::vector<Reference>& refs)
+    {
+      DynBVH::BVHNode& node = (*out)[nodeID];
+      node.makeLeaf(outIds->size(), refs.size());
+      const size_t first = outIds->size();
+      for (size_t i = 0; i < refs.size(); ++i)
+        outIds->push_back(refs[i].object);
+      std::sort(outIds->begin()+first, outIds->end());
+    }
+
+    void buildNode(int nodeID, std::vector<Reference>& refs, int depth)
+    {
+      const BBox bounds = (*out)[nodeID].bounds;
+      Split best;
+      best.cost = BVH_C_isec*refs.size();
+      best.axis = -1;
+      const Real area = bounds.computeArea();
+      if (refs.size() > 1 && area > 0) {
+        const Real invArea = 1/area;
+        findObjectSplit(refs, invArea, best);
+        // Spatial splits only pay where the object split leaves boxes
+        // that overlap.
+        BBox overlap = best.bounds_l;
+        overlap.intersection(best.bounds_r);
+        const Vector d = overlap.getMax() - overlap.getMin();
+        if (depth < kMaxSpatialDepth && numReferences < maxReferences &&
+            (best.axis < 0 ||
+             (d.x() >= 0 && d.y() >= 0 && d.z() >= 0 &&
+              overlap.computeArea() > kMinOverlap*rootArea)))
+          findSpatialSplit(refs, bounds, invArea, best);
+      }
+
+      if (best.axis < 0) {
+        if (refs.size() <= kMaxLeafSize) {
+          makeLeaf(nodeID, refs);
+          return;
+        }
+        // The object count of a leaf has to fit in a short.
+        best.axis = 0;
+        best.position = refs.size()/2;
+        best.spatial = false;
+      }
+
+      std::vector<Reference> left, right;
+      if (best.spatial) {
+        splitSpatially(refs, bounds, best, left, right);
+      } else {
+        left.assign(refs.begin(), refs.begin()+best.position);
+        right.assign(refs.begin()+best.position, refs.end());
+      }
+      std::vector<Reference>().swap(refs);
+
+      const int child = out->size();
+      out->resize(out->size()+2);
+      (*out)[nodeID].makeInternal(child, best.axis);
+      BBox leftBounds, rightBounds;
+      for (size_t i = 0; i < left.size(); ++i)
+        leftBounds.extendByBox(left[i].bounds);
+      for (size_t i = 0; i < right.size(); ++i)
+        rightBounds.extendByBox(right[i].bounds);
+      (*out)[child].bounds = leftBounds;
+      (*out)[child+1].bounds = rightBounds;
+      buildNode(child, left, depth+1);
+      buildNode(child+1, right, depth+1);
+    }
+
+    // The smallest overlap of the children of an object split, relative
+    // to the root, for which spatial splits are tried.
+    static const Real kMinOverlap;
+
+    const std::vector<BBox>& obj_bounds;
+    const Mesh* mesh;
+    size_t maxReferences;
+    size_t numReferences;
+    Real rootArea;
+    std::vector<DynBVH::BVHNode>* out;
+    std::vector<int>* outIds;
+  };
+
+  const Real SpatialSplitBuilder::kMinOverlap = 1e-5;
+}
+
+void DynBVH::buildSpatial()
+{
+  const double start = Time::currentSeconds();
+  std::vector<BVHNode> built;
+  std::vector<int> ids;
+  SpatialSplitBuilder builder(obj_bounds, mesh, spatialSplitBudget);
+  builder.build(built, ids);
+  nodes.swapIn(built);
+  object_ids.swapIn(ids);
+  num_nodes.set(nodes.size());
+#if TREE_ROT
+  costs.resize(nodes.size());
+#endif
+
+  if (print_info)
+    cerr << "DynBVH: spatial splits made " << object_ids.size() << " references to "
+         << currGroup->size() << " objects in "
+         << Time::currentSeconds() - start << " seconds\n";
+}
+
+namespace {
+  const char kBVHFileMagic[8] = { 'M', 'A', 'N', 'T', 'A', 'B', 'V', 'H' };
+
+  inline size_t alignFileOffset(size_t offset)
+  {
+    return (offset + MAXCACHELINESIZE-1) & ~size_t(MAXCACHELINESIZE-1);
+  }
+
+  // 64 bit FNV-1a
+  inline uint64_t hashBytes(uint64_t hash, const void* data, size_t bytes)
+  {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < bytes; ++i) {
+      hash ^= p[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  // FNV-1a over 64 bit words, with a shift to fold the high bits of
+  // every word back into the low ones.  The tail is zero padded.
+  uint64_t hashWords(const char* data, size_t bytes)
+  {
+    uint64_t hash = 14695981039346656037ULL ^ bytes;
+    const size_t words = bytes/sizeof(uint64_t);
+    for (size_t i = 0; i < words; ++i) {
+      uint64_t word;
+      memcpy(&word, data + i*sizeof(word), sizeof(word));
+      hash = (hash ^ word) * 1099511628211ULL;
+      hash ^= hash >> 32;
+    }
+    if (bytes % sizeof(uint64_t)) {
+      uint64_t word = 0;
+      memcpy(&word, data + words*sizeof(word), bytes % sizeof(word));
+      hash = (hash ^ word) * 1099511628211ULL;
+      hash ^= hash >> 32;
+    }
+    return hash;
+  }
+
+  // Hashes a list of arrays on several threads.  The arrays are cut into
+  // fixed size blocks that are hashed independently and then combined
+  // in order, so the result does not depend on the number of threads
+  // (a cache file may well be written and read by different machines).
+  class GroupHasher {
+  public:
+    GroupHasher() : numBlocks(0) {}
+
+    void add(const void* data, size_t bytes)
+    {
+      if (bytes == 0)
+        return;
+      Span span = { static_cast<const char*>(data), bytes, numBlocks };
+      spans.push_back(span);
+      numBlocks += (bytes + kBlockSize-1)/kBlockSize;
+    }
+
+    uint64_t hash(uint64_t seed)
+    {
+      blockHashes.resize(numBlocks);
+      const int numThreads =
+        static_cast<int>(std::min(numBlocks, size_t(Thread::numProcessors())));
+      if (numThreads > 1)
+        Thread::parallel(this, &GroupHasher::hashBlocks, numThreads);
+      else if (numBlocks > 0)
+        hashRange(0, numBlocks);
+      if (!blockHashes.empty())
+        seed = hashBytes(seed, &blockHashes[0],
+                         sizeof(blockHashes[0])*blockHashes.size());
+      return seed;
+    }
+
+  private:
+    struct Span {
+      const char* data;
+      size_t bytes;
+      size_t firstBlock;
+    };
+
+    void hashBlocks(int proc)
+    {
+      const int numThreads =
+        static_cast<int>(std::min(numBlocks, size_t(Thread::numProcessors())));
+      hashRange(numBlocks*proc/numThreads, numBlocks*(proc+1)/numThreads);
+    }
+
+    void hashRange(size_t first, size_t last)
+    {
+      for (size_t s = 0; s < spans.size(); ++s) {
+        const Span& span = spans[s];
+        const size_t spanBlocks = (span.bytes + kBlockSize-1)/kBlockSize;
+        const size_t begin = std::max(first, span.firstBlock);
+        const size_t end = std::min(last, span.firstBlock + spanBlocks);
+        for (size_t block = begin; block < end; ++block) {
+          const size_t offset = (block - span.firstBlock)*kBlockSize;
+          blockHashes[block] = hashWords(span.data + offset,
+                                         std::min(kBlockSize, span.bytes - offset));
+        }
+      }
+    }
+
+    static const size_t kBlockSize = 1 << 20;
+
+    std::vector<Span> spans;
+    size_t numBlocks;
+    std::vector<uint64_t> blockHashes;
+  };
+
+  const size_t GroupHasher::kBlockSize;
+}
+
+uint64_t DynBVH::computeGroupHash() const
+{
+  uint64_t hash = 14695981039346656037ULL;
+  if (!currGroup)
+    return hash;
+
+  const uint64_t size = currGroup->size();
+  hash = hashBytes(hash, &size, sizeof(size));
+
+  GroupHasher hasher;
+  vector<BBox> bounds;
+  if (mesh) {
+    if (!mesh->vertices.empty())
+      hasher.add(&mesh->vertices[0],
+                 sizeof(mesh->vertices[0])*mesh->vertices.size());
+    if (!mesh->vertex_indices.empty())
+      hasher.add(&mesh->vertex_indices[0],
+                 sizeof(mesh->vertex_indices[0])*mesh->vertex_indices.size());
+  } else {
+    // Without a mesh the best we can do is hash the object bounds.
+    PreprocessContext serial_context;
+    bounds.resize(currGroup->size());
+    for (size_t i = 0; i < currGroup->size(); ++i)
+      currGroup->get(i)->computeBounds(serial_context, bounds[i]);
+    if (!bounds.empty())
+      hasher.add(&bounds[0], sizeof(bounds[0])*bounds.size());
+  }
+  return hasher.hash(hash);
+}
+
+size_t DynBVH::getMemoryUse() const
+{
+  size_t bytes = nodes.size()*sizeof(BVHNode) + object_ids.size()*sizeof(int)
+    + obj_bounds.capacity()*sizeof(BBox)
+    + obj_centroids.capacity()*sizeof(Vector);
+#if TREE_ROT
+  bytes += costs.capacity()*sizeof(Real)
+    + subtree_size.capacity()*sizeof(unsigned int);
+#endif
+#if USE_LAZY_BUILD
+  bytes += build_records.capacity()*sizeof(BVHBuildRecord);
+#endif
+  return bytes;
+}
+
 bool DynBVH::buildFromFile(const string &file)
 {
   nodes.clear();
+  object_ids.clear();
+  cache_file.close();
+  bounds_from_file = false;
 
   //Something's wrong, let's bail.
   if (!currGroup)
     return false;
 
-  ifstream in(file.c_str(), ios::binary | ios::in);
-  if (!in)
+  // If the file turns out to be missing or stale, write a fresh one once
+  // the tree has been built.
+  needToSaveFile = true;
+  saveFileName = file;
+
+  // Copy-on-write so that refitting the loaded tree does not need a
+  // separate copy of the nodes that are never modified.
+  if (!cache_file.open(file, MappedFile::CopyOnWrite))
     return false;
 
-  group_changed = false;
+  const char* data = cache_file.data();
+  const size_t size = cache_file.size();
+
+  BVHFileHeader header;
+  bool valid = size >= sizeof(header);
+  if (valid) {
+    memcpy(&header, data, sizeof(header));
+    valid = (memcmp(header.magic, kBVHFileMagic, sizeof(header.magic)) == 0 &&
+             header.version == kFileVersion &&
+             header.endian_tag == kFileEndianTag &&
+             header.real_size == sizeof(Real) &&
+             header.node_size == sizeof(BVHNode) &&
+             header.num_objects == currGroup->size() &&
+             header.spatial_split_budget == spatialSplitBudget &&
+             header.num_object_ids >= currGroup->size() &&
+             header.num_nodes > 0 &&
+             header.object_ids_offset % MAXCACHELINESIZE == 0 &&
+             header.nodes_offset % MAXCACHELINESIZE == 0 &&
+             header.object_ids_offset +
+               header.num_object_ids*sizeof(int) <= size &&
+             header.nodes_offset +
+               header.num_nodes*sizeof(BVHNode) <= size);
+  }
+  if (valid && header.group_hash != computeGroupHash()) {
+    if (print_info)
+      cerr << "DynBVH: " << file << " was built for a different mesh\n";
+    valid = false;
+  }
+  if (!valid) {
+    cache_file.close();
+    return false;
+  }
 
-  unsigned int object_ids_size;
-  in.read((char*)&object_ids_size, sizeof(object_ids_size));
-  object_ids.resize(object_ids_size);
+  object_ids.setExternal(reinterpret_cast<int*>(cache_file.data() +
+                                                header.object_ids_offset),
+                         header.num_object_ids);
+  nodes.setExternal(reinterpret_cast<BVHNode*>(cache_file.data() +
+                                               header.nodes_offset),
+                    header.num_nodes);
+  num_nodes.set(nodes.size());
 
-  in.read((char*) &object_ids[0], sizeof(object_ids[0])*object_ids.size());
+  cache_file.advise(MappedFile::AdviseRandom);
 
-  unsigned int nodes_size;
-  in.read((char*)&nodes_size, sizeof(nodes_size));
-  nodes.resize(nodes_size);
+  // Needed by update() if the mesh later deforms.
+  obj_bounds.resize(currGroup->size());
+  obj_centroids.resize(currGroup->size());
+#if TREE_ROT
+  costs.resize(nodes.size());
+  subtree_size.resize(nodes.size());
+  computeCost<true>(0);
+#endif
+  built_cost = 0;
+  updateTreeCost();
 
-  in.read((char*) &nodes[0], sizeof(nodes[0])*nodes.size());
-  num_nodes.set(nodes.size());
+  group_changed = false;
+  bounds_from_file = true;
+  needToSaveFile = false;
 
-  in.close();
+  if (print_info)
+    cerr << "DynBVH: mapped " << nodes.size() << " nodes from " << file << endl;
 
 #ifdef RTSAH
   computeTraversalCost();
@@ -2486,17 +3307,49 @@ bool DynBVH::saveToFile(const string &file)
   }
   needToSaveFile = false;
 
-  ofstream out(file.c_str(), ios::out | ios::binary);
+  // Nothing to do if we are tracing straight out of this file.
+  if (nodes.isExternal() && cache_file.filename() == file)
+    return true;
+
+  BVHFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kBVHFileMagic, sizeof(header.magic));
+  header.version = kFileVersion;
+  header.endian_tag = kFileEndianTag;
+  header.real_size = sizeof(Real);
+  header.node_size = sizeof(BVHNode);
+  header.num_objects = currGroup->size();
+  header.group_hash = computeGroupHash();
+  header.spatial_split_budget = spatialSplitBudget;
+  header.num_object_ids = object_ids.size();
+  header.object_ids_offset = alignFileOffset(sizeof(header));
+  header.num_nodes = nodes.size();
+  header.nodes_offset = alignFileOffset(header.object_ids_offset +
+                                        header.num_object_ids*sizeof(int));
+
+  // Write to a temporary and rename it into place so that a process
+  // that currently has the old file mapped keeps a valid mapping.
+  const string tmp_file = file + ".tmp";
+  ofstream out(tmp_file.c_str(), ios::out | ios::binary);
   if (!out) return false;
 
-  const unsigned int object_ids_size = object_ids.size();
-  const unsigned int nodes_size = nodes.size();
-  out.write((char*) &object_ids_size, sizeof(object_ids_size));
-  out.write((char*) &object_ids[0], sizeof(object_ids[0])*object_ids_size);
-  out.write((char*) &nodes_size, sizeof(nodes_size));
-  out.write((char*) &nodes[0], sizeof(nodes[0])*nodes_size);
+  const char padding[MAXCACHELINESIZE] = { 0 };
+  out.write((char*) &header, sizeof(header));
+  out.write(padding, header.object_ids_offset - sizeof(header));
+  out.write((char*) &object_ids[0], sizeof(object_ids[0])*header.num_object_ids);
+  out.write(padding, header.nodes_offset -
+            (header.object_ids_offset + header.num_object_ids*sizeof(int)));
+  out.write((char*) &nodes[0], sizeof(nodes[0])*header.num_nodes);
 
   out.close();
+  if (!out) {
+    remove(tmp_file.c_str());
+    return false;
+  }
+  if (rename(tmp_file.c_str(), file.c_str()) != 0) {
+    remove(tmp_file.c_str());
+    return false;
+  }
   return true;
 }
 
@@ -3437,8 +4290,18 @@ void DynBVH::BVHNode::readwrite(ArchiveElement* archive) {
 void DynBVH::readwrite(ArchiveElement* archive) {
   MantaRTTI<AccelerationStructure>::readwrite(archive, *this);
   archive->readwrite("group", currGroup);
-  archive->readwrite("object_ids", object_ids);
-  archive->readwrite("nodes", nodes);
+  vector<int> object_ids_copy;
+  vector<BVHNode> nodes_copy;
+  if (!archive->reading()) {
+    object_ids.copyTo(object_ids_copy);
+    nodes.copyTo(nodes_copy);
+  }
+  archive->readwrite("object_ids", object_ids_copy);
+  archive->readwrite("nodes", nodes_copy);
+  if (archive->reading()) {
+    object_ids.swapIn(object_ids_copy);
+    nodes.swapIn(nodes_copy);
+  }
   if (archive->reading()) {
     int num_nodes_nonatomic;
     archive->readwrite("num_nodes", num_nodes_nonatomic);
@@ -3,6 +3,7 @@
 
 #include <Model/Groups/Group.h>
 #include <Model/Groups/TreeTraversalProbability.h>
+#include <Core/Containers/MappedArray.h>
 #include <Core/Geometry/BBox.h>
 #include <Interface/RayPacket.h>
 #include <Interface/AccelerationStructure.h>
@@ -11,13 +12,16 @@
 #include <Core/Thread/ConditionVariable.h>
 #include <Core/Thread/Mutex.h>
 #include <Core/Util/AlignedAllocator.h>
+#include <Core/Util/MappedFile.h>
 #include <Core/Util/SpinLock.h>
 #include <Model/Groups/Mesh.h>
 #include <stdio.h>
+#include <stdint.h>
 namespace Manta
 {
   class Task;
   class TaskList;
+  class Thread;
 
   class MANTA_ALIGN(MAXCACHELINESIZE)
   DynBVH : public AccelerationStructure,
@@ -81,12 +85,38 @@ namespace Manta
       int objectEnd;
     };
 
+    // Header of the file written by saveToFile.  The object ids and
+    // the nodes follow at the given offsets (both cache line aligned)
+    // so that buildFromFile can map the file and traverse the nodes in
+    // place.  A file is only accepted if every field matches what this
+    // build would have produced.
+    struct BVHFileHeader {
+      char magic[8];          // "MANTABVH"
+      uint32_t version;       // kFileVersion
+      uint32_t endian_tag;    // kFileEndianTag in the writer's byte order
+      uint32_t real_size;     // sizeof(Real)
+      uint32_t node_size;     // sizeof(BVHNode)
+      uint64_t num_objects;   // currGroup->size()
+      uint64_t group_hash;    // computeGroupHash()
+      uint64_t num_object_ids;
+      uint64_t object_ids_offset;
+      uint64_t num_nodes;
+      uint64_t nodes_offset;
+      double spatial_split_budget; // getSpatialSplitBudget()
+    };
+
+    static const uint32_t kFileVersion = 4;
+    static const uint32_t kFileEndianTag = 0x01020304;
+
   protected:
     // NOTE(boulos): Because intersect is const, lazy build requires
     // that almost everything in here become mutable and that almost
     // all functions become const. How sad.
-    mutable vector<BVHNode> nodes;
-    mutable vector<int> object_ids;
+    //
+    // nodes and object_ids either own their data or point into cache_file.
+    mutable MappedArray<BVHNode> nodes;
+    mutable MappedArray<int> object_ids;
+    MappedFile cache_file;
     mutable vector<BVHBuildRecord> build_records;
 
     vector<unsigned int> subtreeList; // for load balancing parallel update
@@ -98,6 +128,10 @@ namespace Manta
     Group* currGroup;
     Mesh* mesh; // NULL if there is no mesh.
     bool group_changed;
+    // Set when the node bounds were loaded from a file that matches the
+    // current group, so the first update can be skipped (and the mapped
+    // pages stay shared).
+    bool bounds_from_file;
     Barrier barrier;
     SpinLock taskpool_mutex;
 
@@ -134,18 +168,57 @@ namespace Manta
     size_t CurFiveArgCallback;
 
     bool print_info;
+    Real spatialSplitBudget;
 
     TreeTraversalProb ttp;
+
+    // The SAH cost of the tree as of the last build or update, and the
+    // cost it had when it was built (0 until it is known).
+    Real tree_cost;
+    Real built_cost;
+
+    // Background rebuilds (see setBackgroundRebuild).  rebuilder holds
+    // the tree being built; the rebuild thread only touches it while
+    // rebuild_state is RebuildRequested, and proc 0 only otherwise.
+    enum RebuildState { RebuildIdle, RebuildRequested, RebuildReady };
+    Real max_cost_ratio;
+    DynBVH* rebuilder;
+    Thread* rebuild_thread;
+    mutable Mutex rebuild_lock;
+    ConditionVariable rebuild_signal;
+    RebuildState rebuild_state;
+    bool rebuild_quit;
+    int rebuild_procs;
+    // Bumped when the group changes, so that a tree built in the
+    // background for the old group is thrown away.
+    unsigned int generation;
+    unsigned int rebuild_generation;
+    // Set while the object bounds of the last update are handed to the
+    // rebuilder.  obj_bounds holds garbage then, and nothing may read it
+    // before the next update or rebuild computes it again.
+    bool obj_bounds_handed_off;
+    size_t num_background_rebuilds;
+    double rebuild_seconds;
   public:
     DynBVH(bool print = true) : subtreeListMutex("subtreeList"), subtreeListFilled(false),
                                 num_nodes("DynBVH Num Nodes", 0), currGroup(NULL), mesh(NULL),
-                                group_changed(false), barrier("DynBVH barrier"),
+                                group_changed(false), bounds_from_file(false),
+                                barrier("DynBVH barrier"),
                                 nextFree("DynBVH Next Free", 0), TaskListMemory(0),
                                 CurTaskList(0), TaskMemory(0), CurTask(0),
                                 TwoArgCallbackMemory(0), CurTwoArgCallback(0),
                                 FourArgCallbackMemory(0), CurFourArgCallback(0),
                                 FiveArgCallbackMemory(0), CurFiveArgCallback(0),
-                                print_info(print)
+                                print_info(print), spatialSplitBudget(0),
+                                tree_cost(0), built_cost(0), max_cost_ratio(0),
+                                rebuilder(0), rebuild_thread(0),
+                                rebuild_lock("DynBVH rebuild"),
+                                rebuild_signal("DynBVH rebuild"),
+                                rebuild_state(RebuildIdle), rebuild_quit(false),
+                                rebuild_procs(1), generation(0),
+                                rebuild_generation(0), obj_bounds_handed_off(false),
+                                num_background_rebuilds(0),
+                                rebuild_seconds(0)
     {}
     virtual ~DynBVH();
 
@@ -198,13 +271,27 @@ namespace Manta
     }
 
 
+    // compute the interval arithmetic data of rays for firstIntersects
+    static void computeIAData(const RayPacket& rays, IAData& ia_data);
     // return the first index (between [rays.begin(),rays.end()]) which hits the box
     static int firstIntersects(const BBox& box, const RayPacket& rays, const IAData& ia_data);
     // return the last index which hits the box
     static int lastIntersects(const BBox& box, const RayPacket& rays);
 
+    // Lets the materials hit by the shadow rays of subpacket attenuate
+    // them, after an object was intersected.  t holds the minT of every
+    // ray from before the intersection.  Fully occluded rays are
+    // dropped from the ends of subpacket; returns false if none is left.
+    static bool attenuateShadowHits(const RenderContext& context,
+                                    RayPacket& subpacket, const Real* t);
+
   protected:
     void intersectNode(int nodeID, const RenderContext& context, RayPacket& rays, const IAData& ia_data) const;
+    // Intersects the rays of subpacket with the objects of a leaf,
+    // stopping shadow rays that are fully occluded.  The subpacket may be
+    // shrunk.
+    void intersectObjects(const RenderContext& context, RayPacket& subpacket,
+                          int firstObject, int numObjects) const;
 
   public:
     void computeBounds(const PreprocessContext& context,
@@ -216,6 +303,40 @@ namespace Manta
     void update(int proc=0, int numProcs=1);
     void rebuild(int proc=0, int numProcs=1);
 
+    // Lets rebuild split space as well as objects (an SBVH), which pays
+    // for long, thin or diagonal triangles whose boxes overlap a lot.  A
+    // triangle split in two is clipped to either side.  budget is the
+    // number of extra object references the tree can have, as a fraction
+    // of the number of objects; 0 (the default) builds with object
+    // splits only.  update refits such a tree with unclipped boxes, and
+    // the parallel preprocess always builds with object splits.
+    void setSpatialSplitBudget(Real budget) { spatialSplitBudget = budget; }
+    Real getSpatialSplitBudget() const { return spatialSplitBudget; }
+
+    // Keeps refitting the tree in update, and builds a new one on a
+    // background thread once the SAH cost of the refit tree has grown
+    // past maxCostRatio times the cost it had when it was built.  The
+    // new tree is built over the object bounds of the update that asked
+    // for it, and replaces the old one at the start of the first update
+    // after it is done, which refits it to the current frame.  Updates
+    // never wait for it, but as for the refit, all threads that trace
+    // the tree have to take part in update and nobody may trace it
+    // meanwhile.  0 (the default) turns this off.  Background
+    // builds only split objects, and are not done with lazy builds.
+    void setBackgroundRebuild(Real maxCostRatio);
+    Real getBackgroundRebuild() const { return max_cost_ratio; }
+
+    // The SAH cost of the tree as of the last build or update, and the
+    // cost it had when it was built.  setBackgroundRebuild compares
+    // their ratio.
+    Real getTreeCost() const { return tree_cost; }
+    Real getBuiltTreeCost() const { return built_cost; }
+
+    // Whether a tree is being built in the background (or waits to be
+    // swapped in), and how many have been swapped in.
+    bool isRebuildPending() const;
+    size_t getNumBackgroundRebuilds() const { return num_background_rebuilds; }
+
     void build(int nodeID, int objectBegin, int objectEnd,
                const bool useApproximateBuild=false,
                const bool nodeAlreadyExists=false);
@@ -235,6 +356,14 @@ namespace Manta
     virtual bool buildFromFile(const string &file);
     virtual bool saveToFile(const string &file);
 
+    // The bytes held by the tree and by the data kept to update and
+    // rebuild it.  A tree mapped from a file is counted as well.
+    virtual size_t getMemoryUse() const;
+
+    // Hash of the geometry the tree is built over.  Used to reject cache
+    // files written for a different (or modified) mesh.
+    uint64_t computeGroupHash() const;
+
   protected:
 
     void computeTraversalCost();
@@ -246,6 +375,19 @@ namespace Manta
       int split;
     };
 
+    // Builds the whole tree with spatial splits.
+    void buildSpatial();
+
+    // Sets tree_cost from the tree (and built_cost if it is not known).
+    void updateTreeCost();
+
+    void startBackgroundRebuild(int numProcs);
+    // Returns true if a tree was swapped in.
+    bool swapInBackgroundRebuild();
+    void backgroundRebuildThread();
+    // Builds the tree of a rebuilder over its obj_bounds.
+    void buildDetached(int numProcs);
+
     inline PartitionData partition2Objs(int nodeID, int objBegin) const;
 
     PartitionData partitionSAH(int nodeID, int objBegin, int objEnd) const;
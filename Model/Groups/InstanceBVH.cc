@@ -0,0 +1,476 @@
+#include <Model/Groups/InstanceBVH.h>
+#include <Core/Thread/Time.h>
+#include <Core/Util/UpdateGraph.h>
+#include <Interface/Context.h>
+#include <Interface/Material.h>
+#include <Interface/Packet.h>
+#include <Interface/RayPacketArena.h>
+#include <Model/Groups/Group.h>
+#include <Model/Instances/Instance.h>
+#include <Model/Instances/MPT.h>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <string.h>
+
+using namespace Manta;
+using namespace std;
+
+namespace {
+  // The number of planes the top level tries along an axis.
+  const int kNumBins = 16;
+
+  // Copies the ray and the hit of slot i, along with whatever the
+  // primitive that was hit left in the scratchpads.
+  inline void copyHit(RayPacketData& to, const RayPacketData& from, int i)
+  {
+    for (int c = 0; c < 3; ++c) {
+      to.origin[c][i] = from.origin[c][i];
+      to.direction[c][i] = from.direction[c][i];
+    }
+    to.minT[i] = from.minT[i];
+    to.hitPrim[i] = from.hitPrim[i];
+    to.hitMatl[i] = from.hitMatl[i];
+    to.hitTex[i] = from.hitTex[i];
+    for (int s = 0; s < RayPacketData::MaxScratchpad4; ++s)
+      to.scratchpad4[s][i] = from.scratchpad4[s][i];
+    for (int s = 0; s < RayPacketData::MaxScratchpad8; ++s)
+      to.scratchpad8[s][i] = from.scratchpad8[s][i];
+    memcpy(to.scratchpad_data[i], from.scratchpad_data[i],
+           RayPacketData::MaxScratchpadSize);
+  }
+}
+
+InstanceBVH::InstanceBVH(bool print)
+  : currGroup(NULL), group_changed(false), print_info(print)
+{
+}
+
+InstanceBVH::~InstanceBVH()
+{
+  for (map<Object*, DynBVH*>::iterator it = owned_bvhs.begin();
+       it != owned_bvhs.end(); ++it)
+    delete it->second;
+}
+
+void InstanceBVH::setGroup(Group* new_group)
+{
+  if (new_group != currGroup)
+    group_changed = true;
+  currGroup = new_group;
+}
+
+Group* InstanceBVH::getGroup() const
+{
+  return currGroup;
+}
+
+void InstanceBVH::groupDirty()
+{
+  group_changed = true;
+}
+
+void InstanceBVH::addToUpdateGraph(ObjectUpdateGraph* graph,
+                                   ObjectUpdateGraphNode* parent)
+{
+  ObjectUpdateGraphNode* node = graph->insert(this, parent);
+  getGroup()->addToUpdateGraph(graph, node);
+}
+
+Interpolable::InterpErr
+InstanceBVH::parallelInterpolate(const std::vector<keyframe_t>& keyframes,
+                                 int proc, int numProc)
+{
+  return currGroup->parallelInterpolate(keyframes, proc, numProc);
+}
+
+void InstanceBVH::preprocess(const PreprocessContext& context)
+{
+  if (!currGroup)
+    return;
+
+  if (context.proc == 0 && group_changed)
+    gatherInstances();
+  context.done();
+
+  // Every object is preprocessed once, however many instances show it.
+  // The serial ones are split among the threads as by Group.
+  PreprocessContext serialContext(context);
+  serialContext.proc = 0;
+  serialContext.numProcs = 1;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    if (objects[i]->isParallel())
+      objects[i]->preprocess(context);
+    else if (static_cast<int>(i % context.numProcs) == context.proc)
+      objects[i]->preprocess(serialContext);
+  }
+  for (size_t i = 0; i < override_materials.size(); ++i) {
+    if (static_cast<int>(i % context.numProcs) == context.proc)
+      override_materials[i]->preprocess(serialContext);
+  }
+
+  if (context.isInitialized()) {
+    context.done();
+    if (context.proc == 0)
+      rebuild();
+    context.done();
+  }
+}
+
+void InstanceBVH::gatherInstances()
+{
+  entries.clear();
+  objects.clear();
+  override_materials.clear();
+
+  map<Object*, int> object_index;
+  for (size_t i = 0; i < currGroup->size(); ++i) {
+    Object* object = currGroup->get(i);
+
+    Entry entry;
+    entry.instance = NULL;
+    entry.material = NULL;
+    entry.transform_inv.initWithIdentity();
+    Instance* instance = dynamic_cast<Instance*>(object);
+    if (instance) {
+      entry.instance = instance;
+      Material* material = instance->getOverrideMaterial();
+      if (material) {
+        entry.material = material;
+        if (find(override_materials.begin(), override_materials.end(),
+                 material) == override_materials.end())
+          override_materials.push_back(material);
+      }
+
+      object = instance->getInstance();
+      Group* group = dynamic_cast<Group*>(object);
+      if (group) {
+        DynBVH*& bvh = owned_bvhs[group];
+        if (!bvh) {
+          bvh = new DynBVH(print_info);
+          bvh->setGroup(group);
+        }
+        object = bvh;
+      }
+    }
+
+    map<Object*, int>::iterator it = object_index.find(object);
+    if (it == object_index.end()) {
+      it = object_index.insert(make_pair(object, static_cast<int>(objects.size()))).first;
+      objects.push_back(object);
+    }
+    entry.object = it->second;
+    entries.push_back(entry);
+  }
+
+  group_changed = false;
+}
+
+void InstanceBVH::updateInstances()
+{
+  PreprocessContext context;
+  object_bounds.resize(objects.size());
+  for (size_t i = 0; i < objects.size(); ++i) {
+    object_bounds[i].reset();
+    objects[i]->computeBounds(context, object_bounds[i]);
+  }
+
+  entry_bounds.resize(entries.size());
+  entry_centroids.resize(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    Entry& entry = entries[i];
+    const BBox& bounds = object_bounds[entry.object];
+    BBox& box = entry_bounds[i];
+    if (entry.instance) {
+      entry.transform_inv = entry.instance->getInverseTransform();
+      const AffineTransform& transform = entry.instance->getTransform();
+      box.reset();
+      if (!bounds.isDefault()) {
+        for (int c = 0; c < 8; ++c)
+          box.extendByPoint(transform.multiply_point(bounds.getCorner(c)));
+      }
+    } else {
+      box = bounds;
+    }
+    entry_centroids[i] = box.center();
+  }
+}
+
+void InstanceBVH::rebuild(int proc, int numProcs)
+{
+  if (proc != 0 || !currGroup)
+    return;
+
+  const double start = Time::currentSeconds();
+  if (group_changed)
+    gatherInstances();
+  updateInstances();
+  buildTopLevel();
+
+  if (print_info)
+    cerr << "InstanceBVH: " << entries.size() << " instances of "
+         << objects.size() << " objects, top level of " << nodes.size()
+         << " nodes built in " << (Time::currentSeconds() - start)*1000
+         << "ms\n";
+}
+
+void InstanceBVH::update(int proc, int numProcs)
+{
+  if (proc != 0 || !currGroup)
+    return;
+
+  if (group_changed) {
+    rebuild(proc, numProcs);
+    return;
+  }
+  updateInstances();
+  buildTopLevel();
+}
+
+void InstanceBVH::buildTopLevel()
+{
+  nodes.clear();
+  entry_ids.resize(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i)
+    entry_ids[i] = static_cast<int>(i);
+  if (entries.empty())
+    return;
+
+  // Every leaf holds a single entry, so the tree never needs more.
+  nodes.reserve(2*entries.size() - 1);
+  nodes.resize(1);
+  buildNode(0, 0, static_cast<int>(entries.size()));
+}
+
+// Splits at the cheapest by SAH of kNumBins planes along the longest
+// axis of the centroids, or in the middle if they do not spread out.
+void InstanceBVH::buildNode(int nodeID, int begin, int end)
+{
+  BBox bounds, centroid_bounds;
+  for (int i = begin; i < end; ++i) {
+    bounds.extendByBox(entry_bounds[entry_ids[i]]);
+    centroid_bounds.extendByPoint(entry_centroids[entry_ids[i]]);
+  }
+  nodes[nodeID].bounds = bounds;
+
+  if (end - begin == 1) {
+    nodes[nodeID].makeLeaf(begin, 1);
+    return;
+  }
+
+  const int axis = centroid_bounds.longestAxis();
+  const Real low = centroid_bounds[0][axis];
+  const Real extent = centroid_bounds[1][axis] - low;
+  int middle = begin + (end - begin)/2;
+  if (extent > 0 && extent <= numeric_limits<Real>::max()) {
+    const Real scale = kNumBins/extent;
+    BBox bin_bounds[kNumBins];
+    int bin_count[kNumBins] = { 0 };
+    for (int i = begin; i < end; ++i) {
+      const int id = entry_ids[i];
+      int bin = static_cast<int>((entry_centroids[id][axis] - low)*scale);
+      bin = min(bin, kNumBins - 1);
+      bin_bounds[bin].extendByBox(entry_bounds[id]);
+      ++bin_count[bin];
+    }
+
+    // right_cost[b] is the cost of the bins from b on.
+    double right_cost[kNumBins];
+    BBox right;
+    int right_count = 0;
+    for (int b = kNumBins - 1; b > 0; --b) {
+      right.extendByBox(bin_bounds[b]);
+      right_count += bin_count[b];
+      right_cost[b] = right_count ? right.computeArea()*right_count : 0;
+    }
+
+    BBox left;
+    int left_count = 0;
+    int best_split = 0;
+    double best_cost = numeric_limits<double>::max();
+    for (int b = 1; b < kNumBins; ++b) {
+      left.extendByBox(bin_bounds[b - 1]);
+      left_count += bin_count[b - 1];
+      if (left_count == 0 || left_count == end - begin)
+        continue;
+      const double cost = left.computeArea()*left_count + right_cost[b];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_split = b;
+      }
+    }
+
+    if (best_split > 0) {
+      int left_end = begin;
+      int right_begin = end;
+      while (left_end < right_begin) {
+        const int id = entry_ids[left_end];
+        int bin = static_cast<int>((entry_centroids[id][axis] - low)*scale);
+        if (min(bin, kNumBins - 1) < best_split)
+          ++left_end;
+        else
+          swap(entry_ids[left_end], entry_ids[--right_begin]);
+      }
+      middle = left_end;
+    }
+  }
+
+  const int child = static_cast<int>(nodes.size());
+  nodes[nodeID].makeInternal(child, static_cast<unsigned char>(axis));
+  nodes.resize(child + 2);
+  buildNode(child, begin, middle);
+  buildNode(child + 1, middle, end);
+}
+
+void InstanceBVH::computeBounds(const PreprocessContext& context,
+                                BBox& bbox) const
+{
+  if (!nodes.empty())
+    bbox.extendByBox(nodes[0].bounds);
+  else if (currGroup)
+    currGroup->computeBounds(context, bbox);
+}
+
+void InstanceBVH::intersect(const RenderContext& context, RayPacket& rays) const
+{
+  if (nodes.empty())
+    return;
+
+  rays.computeInverseDirections();
+  rays.computeSigns();
+  DynBVH::IAData ia_data;
+  DynBVH::computeIAData(rays, ia_data);
+
+  ScopedRayPacketData instanceData(context);
+  ScopedRayPacketData hitData(context);
+  TraversalData data;
+  data.instanceData = instanceData.get();
+  data.hitData = hitData.get();
+  for (int i = rays.begin(); i < rays.end(); ++i)
+    data.hitEntry[i] = -1;
+
+  intersectNode(0, context, rays, ia_data, data);
+
+  // Shadow rays are shaded as they hit, for the materials to attenuate
+  // them.
+  if (!rays.getFlag(RayPacket::AnyHit))
+    shadeHits(context, rays, rays.begin(), rays.end(), data);
+}
+
+void InstanceBVH::intersectNode(int nodeID, const RenderContext& context,
+                                RayPacket& rays,
+                                const DynBVH::IAData& ia_data,
+                                TraversalData& data) const
+{
+  const DynBVH::BVHNode& node = nodes[nodeID];
+  int firstActive = DynBVH::firstIntersects(node.bounds, rays, ia_data);
+  if (firstActive == rays.end())
+    return;
+
+  if (node.isLeaf()) {
+    int lastActive = DynBVH::lastIntersects(node.bounds, rays);
+    RayPacket subpacket(rays, firstActive, lastActive+1);
+
+    const int id = entry_ids[node.child];
+    const Entry& entry = entries[id];
+    const bool anyHit = subpacket.getFlag(RayPacket::AnyHit);
+    Real t[RayPacket::MaxSize];
+    if (anyHit) {
+      for (int r = subpacket.begin(); r < subpacket.end(); ++r)
+        t[r] = subpacket.getMinT(r);
+    }
+
+    if (entry.instance)
+      intersectInstance(context, subpacket, id, data);
+    else
+      objects[entry.object]->intersect(context, subpacket);
+
+    if (anyHit) {
+      shadeHits(context, subpacket, subpacket.begin(), subpacket.end(), data);
+      DynBVH::attenuateShadowHits(context, subpacket, t);
+    }
+  } else {
+    RayPacket subpacket(rays, firstActive, rays.end());
+    int front_son = subpacket.getDirection(subpacket.begin(),
+                                           static_cast<int>(node.axis)) > 0 ? 0 : 1;
+    intersectNode(node.child+front_son, context, subpacket, ia_data, data);
+    intersectNode(node.child+1-front_son, context, subpacket, ia_data, data);
+  }
+}
+
+void InstanceBVH::intersectInstance(const RenderContext& context,
+                                    RayPacket& rays, int id,
+                                    TraversalData& data) const
+{
+  const Entry& entry = entries[id];
+
+  // As for Instance, the rays are normalized in the space of the
+  // instance so that nothing underneath rescales them.
+  RayPacket instance_rays(*data.instanceData, RayPacket::UnknownShape,
+                          rays.begin(), rays.end(), rays.getDepth(),
+                          RayPacket::NormalizedDirections |
+                          (rays.getAllFlags() & (RayPacket::ConstantOrigin |
+                                                 RayPacket::DebugPacket)));
+  instance_rays.resetHits();
+  Packet<Real> scales;
+  Instance::transformRays(entry.transform_inv, rays, instance_rays, scales);
+
+  objects[entry.object]->intersect(context, instance_rays);
+
+  for (int i = rays.begin(); i < rays.end(); ++i) {
+    if (!instance_rays.wasHit(i) || rays.rayIsMasked(i))
+      continue;
+    const Material* material =
+      entry.material ? entry.material : instance_rays.getHitMaterial(i);
+    if (rays.hit(i, instance_rays.getMinT(i)*scales.get(i), material,
+                 entry.instance, entry.instance)) {
+      copyHit(*data.hitData, *data.instanceData, i);
+      data.hitEntry[i] = id;
+    }
+  }
+}
+
+void InstanceBVH::shadeHits(const RenderContext& context, RayPacket& rays,
+                            int begin, int end, TraversalData& data) const
+{
+  // Drop the instance hits that something closer has replaced since.
+  bool any = false;
+  for (int i = begin; i < end; ++i) {
+    const int id = data.hitEntry[i];
+    if (id < 0)
+      continue;
+    if (rays.getHitPrimitive(i) != entries[id].instance)
+      data.hitEntry[i] = -1;
+    else
+      any = true;
+  }
+  if (!any)
+    return;
+
+  RayPacket hits(*data.hitData, RayPacket::UnknownShape, begin, end,
+                 rays.getDepth(), RayPacket::NormalizedDirections);
+  for (int i = begin; i < end; ++i) {
+    if (data.hitEntry[i] < 0)
+      continue;
+    int stop = i+1;
+    while (stop < end && data.hitEntry[stop] >= 0)
+      stop++;
+
+    RayPacket sub_packet(hits, i, stop);
+    sub_packet.computeNormals<true>(context);
+    sub_packet.computeGeometricNormals<true>(context);
+    sub_packet.computeTextureCoordinates2(context);
+    sub_packet.computeSurfaceDerivatives(context);
+    for (int j = i; j < stop; ++j) {
+      rays.scratchpad<InstanceShadingData>(j) =
+        InstanceShadingData(sub_packet.getNormal(j),
+                            sub_packet.getGeometricNormal(j),
+                            sub_packet.getTexCoords2(j),
+                            sub_packet.getSurfaceDerivativeU(j),
+                            sub_packet.getSurfaceDerivativeV(j));
+      data.hitEntry[j] = -1;
+    }
+    i = stop;
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef Manta_Model_InstanceBVH_h
+#define Manta_Model_InstanceBVH_h
+
+#include <Model/Groups/DynBVH.h>
+#include <Interface/AccelerationStructure.h>
+#include <Interface/RayPacket.h>
+#include <Core/Geometry/AffineTransform.h>
+#include <Core/Geometry/BBox.h>
+
+#include <map>
+#include <vector>
+
+namespace Manta
+{
+  class Instance;
+  class Material;
+
+  // A two level acceleration structure for groups of Instances.  The
+  // top level is a small BVH over the world space boxes of the
+  // instances, and each of its leaves points at the (bottom level)
+  // acceleration structure of the object an instance shows.  Instances
+  // of the same object share it: an instanced Group is given a single
+  // DynBVH, built once, however many times it is instanced.  Objects of
+  // the group that are not Instances are kept in the top level as they
+  // are.
+  //
+  // A packet is only transformed into the space of an instance, over
+  // the rays that reach its leaf, and into one packet kept for the
+  // whole traversal.  The normals and texture coordinates of a hit are
+  // computed once the closest instance hit of the ray is known, rather
+  // than for every instance the ray hits on the way.  Hits are reported
+  // on the Instance objects, which shade as they do on their own.
+  //
+  // update only reads the transforms of the instances again and builds
+  // the top level over them, so instances can be moved every frame
+  // without touching the bottom levels.  rebuild also gathers the
+  // instances from the group again.  Both are done by proc 0 alone.
+  class InstanceBVH : public AccelerationStructure {
+  public:
+    InstanceBVH(bool print = true);
+    virtual ~InstanceBVH();
+
+    void setGroup(Group* new_group);
+    Group* getGroup() const;
+    void groupDirty();
+
+    virtual void addToUpdateGraph(ObjectUpdateGraph* graph,
+                                  ObjectUpdateGraphNode* parent);
+
+    void preprocess(const PreprocessContext& context);
+    void intersect(const RenderContext& context, RayPacket& rays) const;
+    void computeBounds(const PreprocessContext& context, BBox& bbox) const;
+
+    void update(int proc=0, int numProcs=1);
+    void rebuild(int proc=0, int numProcs=1);
+
+    Interpolable::InterpErr
+      parallelInterpolate(const std::vector<keyframe_t>& keyframes,
+                          int proc, int numProc);
+
+    size_t getNumInstances() const { return entries.size(); }
+    // The number of distinct objects the top level points at.
+    size_t getNumBottomLevels() const { return objects.size(); }
+
+  protected:
+    struct Entry {
+      // NULL for an object of the group that is not an Instance.
+      const Instance* instance;
+      const Material* material;
+      // The index of the object in objects.
+      int object;
+      AffineTransform transform_inv;
+    };
+
+    // The rays of a packet in the space of the instance being
+    // intersected, and a copy of the closest instance hit of every ray,
+    // kept until its normals and texture coordinates are computed.
+    // Both come from the packet arena so that the arrays they fill are
+    // allocated once per thread rather than per packet.
+    struct TraversalData {
+      RayPacketData* instanceData;
+      RayPacketData* hitData;
+      // The entry of the hit in hitData, or -1.
+      int hitEntry[RayPacket::MaxSize];
+    };
+
+    // Fills entries and objects from the group.
+    void gatherInstances();
+    // Reads the transforms of the instances and computes their boxes.
+    void updateInstances();
+    void buildTopLevel();
+    void buildNode(int nodeID, int begin, int end);
+
+    void intersectNode(int nodeID, const RenderContext& context,
+                       RayPacket& rays, const DynBVH::IAData& ia_data,
+                       TraversalData& data) const;
+    void intersectInstance(const RenderContext& context, RayPacket& rays,
+                           int entry, TraversalData& data) const;
+    // Computes the shading data of the rays of [begin, end) whose closest
+    // hit is still the instance hit kept in data.
+    void shadeHits(const RenderContext& context, RayPacket& rays,
+                   int begin, int end, TraversalData& data) const;
+
+    Group* currGroup;
+    bool group_changed;
+    bool print_info;
+
+    std::vector<Entry> entries;
+    // The distinct objects of the entries, with their own bounds.
+    std::vector<Object*> objects;
+    std::vector<BBox> object_bounds;
+    // The DynBVHs made for instanced Groups.
+    std::map<Object*, DynBVH*> owned_bvhs;
+    std::vector<Material*> override_materials;
+
+    std::vector<BBox> entry_bounds;
+    std::vector<Vector> entry_centroids;
+    std::vector<DynBVH::BVHNode> nodes;
+    // The entries of the leaves.
+    std::vector<int> entry_ids;
+
+  private:
+    InstanceBVH(const InstanceBVH&);
+    InstanceBVH& operator=(const InstanceBVH&);
+  };
+}
+
+#endif
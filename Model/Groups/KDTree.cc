@@ -4,7 +4,11 @@
 #include <Core/Math/MinMax.h>
 #include <Interface/Context.h>
 #include <Core/Thread/Time.h>
+#include <Core/Util/AlignedAllocator.h>
 #include <Interface/MantaInterface.h>
+#include <Interface/Task.h>
+#include <Interface/TaskQueue.h>
+#include <Parameters.h>
 
 #include <fstream>
 #include <iostream>
@@ -54,8 +58,14 @@ void KDTree::preprocess(const PreprocessContext &context)
     // In this way we ensure that the initial build only occurs once.
     // Secondly, don't build if we already have it built, possibly because it
     // was loaded from file...
-    if (context.isInitialized() && nodes.empty())
-      rebuild(context.proc, context.numProcs);
+    if (context.isInitialized()) {
+      // Every thread takes part in the build, so they all have to see the
+      // same nodes before proc 0 starts filling them in.
+      bool needsBuild = nodes.empty();
+      barrier.wait(context.numProcs);
+      if (needsBuild)
+        rebuild(context.proc, context.numProcs);
+    }
   }
 
 #ifdef COLLECT_STATS
@@ -73,6 +83,11 @@ void KDTree::setGroup(Group* new_group)
 
 void KDTree::rebuild(int proc, int numProcs)
 {
+  if (buildMode == SortedEventBuild) {
+    sortedEventRebuild(proc, numProcs);
+    return;
+  }
+
   if (proc != 0)
     return;
 
@@ -112,8 +127,8 @@ void KDTree::rebuild(int proc, int numProcs)
   build(0, primitives, bounds, totalCost);
 
   cout << "done building" << endl << flush;
-  double buildTime = Time::currentSeconds() - startTime;
-  printf("KDTree tree built in %f seconds\n", buildTime);
+  buildTime = Time::currentSeconds() - startTime;
+  buildThreads = 1;
   printStats();
   cout <<"SAH cost of tree is: " <<totalCost<<endl;
 
@@ -359,6 +374,526 @@ void KDTree::build(unsigned int nodeID,
 };
 
 
+// The sorted event build follows Wald and Havran, "On building fast kd-Trees
+// for Ray Tracing, and on doing that in O(N log N)".  The events of a node
+// are sorted once and then partitioned into the (still sorted) events of its
+// children.  Only the primitives straddling the split plane are clipped
+// again; their new events are sorted and merged into the others.  Since the
+// events, the sweep and the classification match build(), the resulting
+// tree does too, up to round-off in clipping primitives that build() clips
+// again below the split.
+
+typedef vector<Event> EventList;
+
+// A part of the tree whose node and item indices start at 0.
+struct KDTreeFragment
+{
+  vector<KDTree::Node> nodes;
+  vector<int> items;
+
+  void makeLeaf(unsigned int nodeID, const vector<int> &prim)
+  {
+    nodes[nodeID].isLeaf = 1;
+    nodes[nodeID].childIdx = items.size();
+    nodes[nodeID].numPrimitives = prim.size();
+    items.insert(items.end(), prim.begin(), prim.end());
+  }
+  void makeInner(unsigned int nodeID, int dim, float pos)
+  {
+    nodes[nodeID].isLeaf = 0;
+    nodes[nodeID].childIdx = nodes.size();
+    nodes[nodeID].planePos = pos;
+    nodes[nodeID].planeDim = dim;
+    nodes.push_back(KDTree::Node());
+    nodes.push_back(KDTree::Node());
+  }
+};
+
+// A node of the top of the tree whose subtree is built by a task.
+struct KDTreeSubtree
+{
+  unsigned int nodeID;
+  int depth;
+  double weight; // probability of reaching the node from the root
+  BBox bounds;
+  vector<int> primitives;
+  EventList events[3];
+
+  KDTreeFragment fragment;
+  double cost;
+
+};
+
+static bool hasMorePrimitives(const KDTreeSubtree *a, const KDTreeSubtree *b)
+{
+  return a->primitives.size() > b->primitives.size();
+}
+
+struct KDTreeSplit
+{
+  KDTreeSplit()
+    : dim(-1), pos(0), commonToTheLeft(false), lProb(0), rProb(0)
+  {
+  }
+
+  int dim;
+  Real pos;
+  bool commonToTheLeft;
+  Real lProb;
+  Real rProb;
+};
+
+static BBox clipPrimitive(Group *group, Mesh *mesh, int prim,
+                          const BBox &bounds)
+{
+  BBox box;
+  if (mesh)
+    box = clipTri(mesh->get(prim), bounds);
+  else {
+    PreprocessContext context;
+    group->get(prim)->computeBounds(context, box);
+    box.intersection(bounds);
+  }
+  return box;
+}
+
+// Did clipping fail or is the box degenerate (no area)?
+static inline bool isDegenerate(const BBox &box)
+{
+  return box.isDefault() || box.computeArea()==0;
+}
+
+static inline bool isSplittable(const BBox &bounds, int depth)
+{
+  return bounds.computeArea() > T_EPSILON*T_EPSILON &&
+         depth < MAX_TREE_HEIGHT-1;
+}
+
+static void addEvents(EventList event[3], const BBox &box, int i)
+{
+  for (int k=0;k<3;k++) {
+    if (box.getMin()[k] == box.getMax()[k])
+      event[k].push_back(Event(Event::tri_planar,box.getMin()[k],i));
+    else {
+      event[k].push_back(Event(Event::tri_begin,box.getMin()[k],i));
+      event[k].push_back(Event(Event::tri_end,  box.getMax()[k],i));
+    }
+  }
+}
+
+// The SAH sweep of build() over already sorted events.  Returns false if no
+// split is cheaper than a leaf.
+static bool findSplit(const EventList event[3], int numPrimitives,
+                      const BBox &bounds, KDTreeSplit &best)
+{
+  Real bestCost = numPrimitives * ISEC_COST;
+  best.dim = -1;
+
+  const Real boundsArea = bounds.computeArea();
+  for (int k=0;k<3;k++) {
+    BBox lBounds = bounds;
+    BBox rBounds = bounds;
+
+    int Nl = 0;
+    int Nr = numPrimitives;
+    int Np = 0;
+
+    size_t seqStart = 0;
+    while (seqStart < event[k].size()) {
+      size_t idx = seqStart;
+      const Real pos = event[k][seqStart].pos;
+
+      int numEnding = 0;
+      while (idx < event[k].size() && event[k][idx].pos == pos &&
+             event[k][idx].type == Event::tri_end)
+        { ++idx; ++numEnding; }
+
+      int numPlanar = 0;
+      while (idx < event[k].size() && event[k][idx].pos == pos &&
+             event[k][idx].type == Event::tri_planar)
+        { ++idx; ++numPlanar; }
+
+      int numStarting = 0;
+      while (idx < event[k].size() && event[k][idx].pos == pos &&
+             event[k][idx].type == Event::tri_begin)
+        { ++idx; ++numStarting; }
+
+      lBounds[1][k] = pos;
+      rBounds[0][k] = pos;
+
+      Real lProb = lBounds.computeArea() / boundsArea;
+      Real rProb = rBounds.computeArea() / boundsArea;
+
+      Nr -= numEnding;
+      Nr -= numPlanar;
+
+      Np =  numPlanar;
+
+      {
+        // try putting common on the left
+        Real cost = TRAV_COST + ISEC_COST * (lProb * (Nl+Np) + rProb * Nr);
+        if (cost < bestCost) {
+          bestCost = cost;
+          best.commonToTheLeft = true;
+          best.dim = k;
+          best.pos = pos;
+          best.lProb = lProb;
+          best.rProb = rProb;
+        }
+      }
+      {
+        // try putting common on the right
+        Real cost = TRAV_COST + ISEC_COST * (lProb * Nl + rProb * (Nr+Np));
+        if (cost < bestCost) {
+          bestCost = cost;
+          best.commonToTheLeft = false;
+          best.dim = k;
+          best.pos = pos;
+          best.lProb = lProb;
+          best.rProb = rProb;
+        }
+      }
+
+      Nl += numPlanar;
+      Nl += numStarting;
+
+      seqStart = idx;
+    }
+  }
+
+  return best.dim != -1;
+}
+
+// The task queue is cache line aligned, so the state has to be allocated
+// with that alignment as well.
+struct KDTree::BuildState
+  : public AlignedAllocator<KDTree::BuildState, MAXCACHELINESIZE>
+{
+  BuildState(Group *group, Mesh *mesh, int numProcs)
+    : group(group), mesh(mesh), maxSubtreeSize(0),
+      keep(group->size()), procEvents(3*numProcs)
+  {
+  }
+
+  ~BuildState()
+  {
+    for (size_t i=0; i < tasks.tasks.size(); ++i) {
+      delete tasks.tasks[i]->task_function;
+      delete tasks.tasks[i];
+    }
+    for (size_t i=0; i < subtrees.size(); ++i)
+      delete subtrees[i];
+  }
+
+  // Builds the tree below nodeID of fragment.  Consumes primitives and
+  // event, whose events refer to indices into primitives, and returns the
+  // SAH cost of the subtree.  If defer is set, nodes with at most
+  // maxSubtreeSize primitives are left as placeholders and added to
+  // subtrees instead.
+  double build(KDTreeFragment &fragment, unsigned int nodeID,
+               vector<int> &primitives, EventList event[3],
+               const BBox &bounds, int depth, double weight,
+               bool splittable, bool defer);
+
+  Group *group;
+  Mesh *mesh;
+  size_t maxSubtreeSize;
+
+  // Root setup: which primitives survive clipping to the root bounds and
+  // the events each thread generated for its range of primitives.
+  vector<char> keep;
+  vector<EventList> procEvents;
+  vector<int> localID;
+  vector<int> rootPrimitives;
+  EventList rootEvents[3];
+
+  KDTreeFragment top;
+  double topCost;
+  vector<KDTreeSubtree*> subtrees;
+
+  TaskList tasks;
+  TaskQueue queue;
+};
+
+double KDTree::BuildState::build(KDTreeFragment &fragment,
+                                 unsigned int nodeID,
+                                 vector<int> &primitives,
+                                 EventList event[3],
+                                 const BBox &bounds, int depth,
+                                 double weight, bool splittable, bool defer)
+{
+  if (defer && primitives.size() <= maxSubtreeSize) {
+    KDTreeSubtree *subtree = new KDTreeSubtree;
+    subtree->nodeID = nodeID;
+    subtree->depth = depth;
+    subtree->weight = weight;
+    subtree->bounds = bounds;
+    subtree->primitives.swap(primitives);
+    for (int k=0;k<3;k++)
+      subtree->events[k].swap(event[k]);
+    subtree->cost = 0;
+    subtrees.push_back(subtree);
+    return 0;
+  }
+
+  KDTreeSplit split;
+  if (!splittable || !findSplit(event, primitives.size(), bounds, split)) {
+    fragment.makeLeaf(nodeID, primitives);
+    return primitives.size()*ISEC_COST;
+  }
+
+  const int dim = split.dim;
+  const int n = primitives.size();
+
+  // Classify the primitives exactly like build() does.
+  enum { Left = 1, Right = 2, Both = Left|Right };
+  vector<char> side(n, Both);
+  for (size_t i=0;i<event[dim].size();i++) {
+    const Event &e = event[dim][i];
+    switch (e.type) {
+    case Event::tri_planar:
+      if ((e.pos == split.pos && split.commonToTheLeft) || e.pos < split.pos)
+        side[e.tri] &= ~Right;
+      else
+        side[e.tri] &= ~Left;
+      break;
+    case Event::tri_begin:
+      if (e.pos >= split.pos)
+        side[e.tri] &= ~Left;
+      break;
+    case Event::tri_end:
+      if (e.pos <= split.pos)
+        side[e.tri] &= ~Right;
+      break;
+    };
+  }
+
+  BBox childBounds[2] = { bounds, bounds };
+  childBounds[0][1][dim] = split.pos;
+  childBounds[1][0][dim] = split.pos;
+  const bool childSplittable[2] = { isSplittable(childBounds[0], depth+1),
+                                    isSplittable(childBounds[1], depth+1) };
+
+  // Children that will become leaves anyway keep their straddling
+  // primitives unclipped and need no events, just like in build().
+  vector<int> childPrimitives[2];
+  vector<int> childID[2];
+  EventList childEvents[2][3];
+  EventList clippedEvents[2][3];
+  for (int c=0;c<2;c++) {
+    const int mask = c == 0 ? Left : Right;
+    childID[c].resize(n, -1);
+    for (int i=0;i<n;i++) {
+      if (!(side[i] & mask))
+        continue;
+      if (side[i] == Both && childSplittable[c]) {
+        BBox box = clipPrimitive(group, mesh, primitives[i], childBounds[c]);
+        if (isDegenerate(box))
+          continue;
+        addEvents(clippedEvents[c], box, childPrimitives[c].size());
+      }
+      childID[c][i] = childPrimitives[c].size();
+      childPrimitives[c].push_back(primitives[i]);
+    }
+  }
+  vector<int>().swap(primitives);
+
+  for (int k=0;k<3;k++) {
+    EventList kept[2];
+    for (size_t i=0;i<event[k].size();i++) {
+      const Event &e = event[k][i];
+      const int s = side[e.tri];
+      if (s == Left && childSplittable[0])
+        kept[0].push_back(Event(e.type, e.pos, childID[0][e.tri]));
+      else if (s == Right && childSplittable[1])
+        kept[1].push_back(Event(e.type, e.pos, childID[1][e.tri]));
+    }
+    EventList().swap(event[k]);
+
+    for (int c=0;c<2;c++) {
+      if (!childSplittable[c])
+        continue;
+      std::sort(clippedEvents[c][k].begin(), clippedEvents[c][k].end());
+      childEvents[c][k].resize(kept[c].size() + clippedEvents[c][k].size(),
+                               Event(Event::tri_end, 0, 0));
+      std::merge(kept[c].begin(), kept[c].end(),
+                 clippedEvents[c][k].begin(), clippedEvents[c][k].end(),
+                 childEvents[c][k].begin());
+      EventList().swap(clippedEvents[c][k]);
+    }
+  }
+
+  fragment.makeInner(nodeID, dim, split.pos);
+  const unsigned int childIdx = fragment.nodes[nodeID].childIdx;
+
+  double lCost = build(fragment, childIdx+0, childPrimitives[0],
+                       childEvents[0], childBounds[0], depth+1,
+                       weight*split.lProb, childSplittable[0], defer);
+  double rCost = build(fragment, childIdx+1, childPrimitives[1],
+                       childEvents[1], childBounds[1], depth+1,
+                       weight*split.rProb, childSplittable[1], defer);
+  return split.lProb * lCost + split.rProb * rCost;
+}
+
+void KDTree::buildSubtree(Task *task, int index)
+{
+  KDTreeSubtree &subtree = *buildState->subtrees[index];
+  subtree.fragment.nodes.push_back(Node());
+  subtree.cost = buildState->build(subtree.fragment, 0, subtree.primitives,
+                                   subtree.events, subtree.bounds,
+                                   subtree.depth, subtree.weight,
+                                   true, false);
+  task->finished();
+}
+
+void KDTree::sortedEventRebuild(int proc, int numProcs)
+{
+  //Something's wrong, let's bail. Since we reset the bounds, this KDTree
+  //should never get intersected.
+  if (!currGroup) {
+    if (proc == 0)
+      bounds.reset();
+    return;
+  }
+
+  double startTime = Time::currentSeconds();
+
+  if (proc == 0) {
+    bounds.reset();
+    PreprocessContext context;
+    currGroup->computeBounds(context, bounds);
+
+    mesh = dynamic_cast<Mesh*>(currGroup);
+    buildState = new BuildState(currGroup, mesh, numProcs);
+
+    cout <<"bounds are: "<<bounds[0] <<"  ,  " <<bounds[1]<<endl;
+
+#ifdef COLLECT_STATS
+    stats.resize(numProcs);
+#endif
+  }
+  barrier.wait(numProcs);
+
+  BuildState &state = *buildState;
+  const size_t numPrimitives = currGroup->size();
+  const bool rootSplittable = isSplittable(bounds, 0);
+
+  // Clip every primitive to the root bounds and create its events.  The
+  // events refer to primitive indices for now.
+  if (rootSplittable) {
+    const size_t begin = proc*numPrimitives/numProcs;
+    const size_t end = (proc+1)*numPrimitives/numProcs;
+    EventList *event = &state.procEvents[3*proc];
+    for (size_t i=begin; i < end; ++i) {
+      BBox box = clipPrimitive(currGroup, mesh, i, bounds);
+      state.keep[i] = !isDegenerate(box);
+      if (state.keep[i])
+        addEvents(event, box, i);
+    }
+  }
+  barrier.wait(numProcs);
+
+  if (proc == 0) {
+    state.localID.resize(numPrimitives, -1);
+    state.rootPrimitives.reserve(numPrimitives);
+    for (size_t i=0; i < numPrimitives; ++i) {
+      if (!rootSplittable || state.keep[i]) {
+        state.localID[i] = state.rootPrimitives.size();
+        state.rootPrimitives.push_back(i);
+      }
+    }
+    vector<char>().swap(state.keep);
+  }
+  barrier.wait(numProcs);
+
+  // Gather and sort the events of each dimension on its own thread.
+  if (rootSplittable) {
+    for (int k=proc; k < 3; k+=numProcs) {
+      size_t numEvents = 0;
+      for (int p=0; p < numProcs; ++p)
+        numEvents += state.procEvents[3*p+k].size();
+
+      EventList &event = state.rootEvents[k];
+      event.reserve(numEvents);
+      for (int p=0; p < numProcs; ++p) {
+        EventList &procEvent = state.procEvents[3*p+k];
+        for (size_t i=0; i < procEvent.size(); ++i)
+          event.push_back(Event(procEvent[i].type, procEvent[i].pos,
+                                state.localID[procEvent[i].tri]));
+        EventList().swap(procEvent);
+      }
+      std::sort(event.begin(), event.end());
+    }
+  }
+  barrier.wait(numProcs);
+
+  // Build the top of the tree and hand the subtrees below it out as tasks,
+  // largest first.  With a single thread the whole tree is built here.
+  if (proc == 0) {
+    vector<int>().swap(state.localID);
+    if (numProcs > 1)
+      state.maxSubtreeSize =
+        std::max(state.rootPrimitives.size()/(numProcs*16), size_t(1024));
+    state.top.nodes.push_back(Node());
+    state.topCost = state.build(state.top, 0, state.rootPrimitives,
+                                state.rootEvents, bounds, 0, 1,
+                                rootSplittable, numProcs > 1);
+
+    std::sort(state.subtrees.begin(), state.subtrees.end(),
+              hasMorePrimitives);
+    for (size_t i=0; i < state.subtrees.size(); ++i)
+      state.tasks.push_back(new Task(Callback::create(this,
+                                                      &KDTree::buildSubtree,
+                                                      int(i))));
+    if (!state.subtrees.empty())
+      state.queue.insert(&state.tasks);
+  }
+  barrier.wait(numProcs);
+
+  while (Task *task = state.queue.grabWork())
+    task->run();
+  barrier.wait(numProcs);
+
+  if (proc != 0)
+    return;
+
+  // Append the subtrees to the top of the tree.  Their roots replace the
+  // placeholders and all other indices are offset.
+  nodes.swap(state.top.nodes);
+  itemList.swap(state.top.items);
+  double totalCost = state.topCost;
+  for (size_t i=0; i < state.subtrees.size(); ++i) {
+    KDTreeSubtree &subtree = *state.subtrees[i];
+    vector<Node> &subNodes = subtree.fragment.nodes;
+    const unsigned int nodeBase = nodes.size() - 1;
+    const unsigned int itemBase = itemList.size();
+    for (size_t j=0; j < subNodes.size(); ++j) {
+      if (subNodes[j].isLeaf)
+        subNodes[j].childIdx += itemBase;
+      else
+        subNodes[j].childIdx += nodeBase;
+    }
+    nodes[subtree.nodeID] = subNodes[0];
+    nodes.insert(nodes.end(), subNodes.begin()+1, subNodes.end());
+    itemList.insert(itemList.end(), subtree.fragment.items.begin(),
+                    subtree.fragment.items.end());
+    totalCost += subtree.weight * subtree.cost;
+  }
+
+  delete buildState;
+  buildState = NULL;
+
+  cout << "done building" << endl << flush;
+  buildTime = Time::currentSeconds() - startTime;
+  buildThreads = numProcs;
+  printStats();
+  cout <<"SAH cost of tree is: " <<totalCost<<endl;
+
+  if (needToSaveFile)
+    saveToFile(saveFileName);
+}
+
+
 void KDTree::intersect(const RenderContext& context, RayPacket& rays) const
 {
 
@@ -1203,8 +1738,10 @@ bool KDTree::buildFromFile(const string &file)
 
   in.close();
 
-  double buildTime = Time::currentSeconds() - startTime;
-  printf("KDTree tree loaded in %f seconds\n", buildTime);
+  double loadTime = Time::currentSeconds() - startTime;
+  printf("KDTree tree loaded in %f seconds\n", loadTime);
+  buildTime = 0;
+  buildThreads = 0;
   printStats();
 
   return true;
@@ -1270,6 +1807,9 @@ void KDTree::printStats()
   printf(" - %d primitive references\n", (int)itemList.size());
   printf(" - %d max depth\n", treeStats.maxDepth);
   printf(" - %d max objects in a leaf\n", treeStats.maxObjectsInLeaf);
+  if (buildThreads > 0)
+    printf(" - built in %f seconds by %d thread%s\n", buildTime, buildThreads,
+           buildThreads == 1 ? "" : "s");
 
   for (int i=0; i<1024; ++i)
     if (treeStats.childrenLeafHist[i] > 0)
@@ -17,6 +17,8 @@
 
 namespace Manta
 {
+  class Task;
+  class TaskQueue;
 
   class KDTree : public AccelerationStructure
   {
@@ -167,7 +169,9 @@ namespace Manta
 #endif
     }
 
-    KDTree() : currGroup(NULL), mesh(NULL), barrier("KDTreer barrier")
+    KDTree() : currGroup(NULL), mesh(NULL), barrier("KDTreer barrier"),
+               buildMode(SortedEventBuild), buildTime(0), buildThreads(0),
+               buildState(NULL)
     {
 #ifdef COLLECT_STATS
       stats.resize(1);
@@ -218,6 +222,16 @@ namespace Manta
     virtual void addToUpdateGraph(ObjectUpdateGraph* graph,
                                   ObjectUpdateGraphNode* parent) { }
 
+    // SortedEventBuild creates the split candidates once, sorts them once
+    // and keeps them sorted while splitting (O(N log N)).  The top of the
+    // tree is built by proc 0 and the subtrees below it by every thread
+    // that calls rebuild.  SweepBuild recreates and sorts the candidates
+    // of every node (O(N log^2 N)) on proc 0 only.  Both use the same SAH
+    // and build the same tree.
+    enum BuildMode { SortedEventBuild, SweepBuild };
+    void setBuildMode(BuildMode mode) { buildMode = mode; }
+    BuildMode getBuildMode() const { return buildMode; }
+
     void rebuild(int proc=0, int numProcs=1);
 
     void build(unsigned int nodeID,
@@ -225,6 +239,10 @@ namespace Manta
                const BBox &bounds,
                double &totalCost, int depth=0);
 
+#ifndef SWIG
+    void buildSubtree(Task* task, int subtree);
+#endif
+
     bool buildFromFile(const string &file);
     bool saveToFile(const string &file);
 
@@ -232,6 +250,16 @@ namespace Manta
 
   protected:
 
+    void sortedEventRebuild(int proc, int numProcs);
+
+    BuildMode buildMode;
+    double buildTime;
+    int buildThreads;
+
+    // Shared by the threads of a SortedEventBuild, defined in KDTree.cc.
+    struct BuildState;
+    BuildState* buildState;
+
     void computeTraversalCost();
     VectorT<float, 2> computeSubTreeTraversalCost(unsigned int nodeID,
                                                   const BBox& nodeBounds,
@@ -0,0 +1,600 @@
+#include <Model/Groups/MBVH.h>
+#include <Core/Exceptions/IllegalValue.h>
+#include <Core/Math/MinMax.h>
+#include <Core/Thread/Time.h>
+#include <Core/Util/AlignedAllocator.h>
+#include <DynBVH_Parameters.h>
+#include <Interface/Context.h>
+
+#include <float.h>
+#include <iostream>
+#include <math.h>
+#include <string.h>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+using namespace Manta;
+using namespace std;
+
+namespace {
+  // The most children that can be waiting on the traversal stack.
+  const int kMaxStackSize = 1024;
+
+  // Node boxes are stored as floats, rounded outwards if Real is double
+  // so that no hits are lost.
+  inline float roundDown(Real x)
+  {
+    float f = static_cast<float>(x);
+    return f > x ? nextafterf(f, -FLT_MAX) : f;
+  }
+
+  inline float roundUp(Real x)
+  {
+    float f = static_cast<float>(x);
+    return f < x ? nextafterf(f, FLT_MAX) : f;
+  }
+
+  inline float dequantize(float origin, float scale, int q)
+  {
+    return origin + static_cast<float>(q)*scale;
+  }
+
+  // The largest q that dequantizes to value or below.
+  inline unsigned char quantizeDown(float origin, float scale, float value)
+  {
+    if (scale == 0)
+      return 0;
+    int q = static_cast<int>(floorf((value - origin)/scale));
+    q = Max(0, Min(q, 255));
+    while (q > 0 && dequantize(origin, scale, q) > value)
+      --q;
+    return static_cast<unsigned char>(q);
+  }
+
+  // The smallest q that dequantizes to value or above.
+  inline unsigned char quantizeUp(float origin, float scale, float value)
+  {
+    if (scale == 0)
+      return 0;
+    int q = static_cast<int>(ceilf((value - origin)/scale));
+    q = Max(0, Min(q, 255));
+    while (q < 255 && dequantize(origin, scale, q) < value)
+      ++q;
+    return static_cast<unsigned char>(q);
+  }
+
+  struct WideRay {
+    float org[3];
+    float rcp[3];
+    // Which side of a box (0 for min, 1 for max) a ray enters along
+    // each axis.
+    int near[3];
+  };
+
+  // Tests a ray against all of the children of a node, returning a bit
+  // for every child it hits before tmax, and the distances it enters
+  // them at.
+  template<int Width>
+  inline int intersectChildren(const MBVH::WideNode<Width>& node,
+                               const WideRay& ray, float tmax, float* tnear)
+  {
+    int mask = 0;
+#ifdef MANTA_SSE
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 tfar0 = _mm_set1_ps(tmax);
+    for (int lane = 0; lane < Width; lane += 4) {
+      __m128 tn = zero;
+      __m128 tf = tfar0;
+      for (int axis = 0; axis < 3; ++axis) {
+        const __m128 org = _mm_set1_ps(ray.org[axis]);
+        const __m128 rcp = _mm_set1_ps(ray.rcp[axis]);
+        const __m128 n = _mm_load_ps(&node.bounds[ray.near[axis]][axis][lane]);
+        const __m128 f = _mm_load_ps(&node.bounds[1-ray.near[axis]][axis][lane]);
+        // A NaN (from a ray in the plane of a box) is ignored since
+        // max and min return their second operand then.
+        tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(n, org), rcp), tn);
+        tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(f, org), rcp), tf);
+      }
+      _mm_storeu_ps(tnear + lane, tn);
+      mask |= _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << lane;
+    }
+#else
+    for (int lane = 0; lane < Width; ++lane) {
+      float tn = 0;
+      float tf = tmax;
+      for (int axis = 0; axis < 3; ++axis) {
+        const float n = (node.bounds[ray.near[axis]][axis][lane] -
+                         ray.org[axis]) * ray.rcp[axis];
+        const float f = (node.bounds[1-ray.near[axis]][axis][lane] -
+                         ray.org[axis]) * ray.rcp[axis];
+        tn = n > tn ? n : tn;
+        tf = f < tf ? f : tf;
+      }
+      tnear[lane] = tn;
+      if (tn <= tf)
+        mask |= 1 << lane;
+    }
+#endif
+    return mask;
+  }
+
+#ifdef __AVX__
+  template<>
+  inline int intersectChildren<8>(const MBVH::WideNode<8>& node,
+                                  const WideRay& ray, float tmax,
+                                  float* tnear)
+  {
+    __m256 tn = _mm256_setzero_ps();
+    __m256 tf = _mm256_set1_ps(tmax);
+    for (int axis = 0; axis < 3; ++axis) {
+      const __m256 org = _mm256_set1_ps(ray.org[axis]);
+      const __m256 rcp = _mm256_set1_ps(ray.rcp[axis]);
+      const __m256 n = _mm256_load_ps(node.bounds[ray.near[axis]][axis]);
+      const __m256 f = _mm256_load_ps(node.bounds[1-ray.near[axis]][axis]);
+      tn = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(n, org), rcp), tn);
+      tf = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(f, org), rcp), tf);
+    }
+    _mm256_storeu_ps(tnear, tn);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+  }
+#endif
+
+  // The traversal reads both node formats through these.
+  template<int Width>
+  inline const MBVH::WideNode<Width>&
+  decodeBounds(const MBVH::WideNode<Width>& node, MBVH::WideNode<Width>&)
+  {
+    return node;
+  }
+
+  template<int Width>
+  inline const MBVH::WideNode<Width>&
+  decodeBounds(const MBVH::QuantizedNode<Width>& node,
+               MBVH::WideNode<Width>& decoded)
+  {
+    for (int axis = 0; axis < 3; ++axis) {
+#ifdef MANTA_SSE
+      const __m128i zero = _mm_setzero_si128();
+      const __m128 origin = _mm_set1_ps(node.origin[axis]);
+      const __m128 scale = _mm_set1_ps(node.scale[axis]);
+      for (int side = 0; side < 2; ++side) {
+        for (int lane = 0; lane < Width; lane += 4) {
+          int packed;
+          memcpy(&packed, &node.bounds[side][axis][lane], sizeof(packed));
+          __m128i q = _mm_cvtsi32_si128(packed);
+          q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(q, zero), zero);
+          _mm_store_ps(&decoded.bounds[side][axis][lane],
+                       _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(q),
+                                                     scale)));
+        }
+      }
+#else
+      for (int side = 0; side < 2; ++side)
+        for (int lane = 0; lane < Width; ++lane)
+          decoded.bounds[side][axis][lane] =
+            dequantize(node.origin[axis], node.scale[axis],
+                       node.bounds[side][axis][lane]);
+#endif
+    }
+    return decoded;
+  }
+
+  template<int Width>
+  inline void getChild(const MBVH::WideNode<Width>& node, int c,
+                       int& child, int& count)
+  {
+    child = node.child[c];
+    count = node.count[c];
+  }
+
+  template<int Width>
+  inline void getChild(const MBVH::QuantizedNode<Width>& node, int c,
+                       int& child, int& count)
+  {
+    child = node.child[c] >> MBVH::kCountBits;
+    count = node.child[c] & MBVH::kUnusedChild;
+    if (count == static_cast<int>(MBVH::kUnusedChild))
+      count = -1;
+  }
+
+  struct StackEntry {
+    int child;
+    int count;
+    // The rays that hit the child.
+    int firstRay;
+    int lastRay;
+  };
+}
+
+MBVH::MBVH(int width, bool print, NodeFormat format)
+  : DynBVH(print), width(width), format(format), coherentPacketSize(16),
+    releaseBinaryTree(false), wideNodes(0), numWideNodes(0),
+    wideNodeBytes(0), quantized(false), treeReleased(false)
+{
+  if (width != 4 && width != 8)
+    throw IllegalValue<int>("MBVH width must be 4 or 8", width);
+}
+
+MBVH::~MBVH()
+{
+  if (wideNodes)
+    deallocateAligned(wideNodes);
+}
+
+void MBVH::update(int proc, int numProcs)
+{
+  if (treeReleased) {
+    // There is no binary tree left to update.
+    rebuild(proc, numProcs);
+    return;
+  }
+
+  DynBVH::update(proc, numProcs);
+  // The update rotates the binary tree, so the wide tree is collapsed
+  // again rather than refit.  That only takes a pass over the nodes.
+  barrier.wait(numProcs);
+  if (proc == 0)
+    collapse();
+  barrier.wait(numProcs);
+}
+
+void MBVH::rebuild(int proc, int numProcs)
+{
+  // Without a change to the group DynBVH::rebuild calls update, which
+  // collapses the tree.  A released tree is always built again.
+  const bool building = group_changed;
+  DynBVH::rebuild(proc, numProcs);
+  if (building) {
+    if (proc == 0)
+      collapse();
+    barrier.wait(numProcs);
+  }
+}
+
+bool MBVH::buildFromFile(const string &file)
+{
+  // A tree read from a file is not rebuilt in preprocess.
+  if (!DynBVH::buildFromFile(file))
+    return false;
+  collapse();
+  return true;
+}
+
+void MBVH::collapse()
+{
+#if USE_LAZY_BUILD == 0
+  if (width == 8)
+    collapse<8>();
+  else
+    collapse<4>();
+#endif
+}
+
+template<int Width>
+void MBVH::collapse()
+{
+  if (wideNodes) {
+    deallocateAligned(wideNodes);
+    wideNodes = 0;
+    numWideNodes = 0;
+    wideNodeBytes = 0;
+    quantized = false;
+  }
+  treeReleased = false;
+  if (!currGroup || currGroup->size() == 0)
+    return;
+
+  const double start = Time::currentSeconds();
+  std::vector<WideNode<Width> > wide;
+  wide.reserve(nodes.size()/(Width-1) + 1);
+  int maxDepth = 0;
+  collapseNode(wide, 0, 1, maxDepth);
+  if (maxDepth*(Width-1) + 1 > kMaxStackSize) {
+    // The traversal stack could overflow, so the binary tree is used.
+    cerr << "MBVH: the tree is " << maxDepth
+         << " nodes deep, too deep for the wide traversal\n";
+    return;
+  }
+
+  if (format == QuantizedNodes && !quantize(wide))
+    cerr << "MBVH: the tree cannot be quantized, using float nodes\n";
+  if (!quantized) {
+    wideNodeBytes = wide.size()*sizeof(WideNode<Width>);
+    wideNodes = static_cast<char*>(allocateAligned(wideNodeBytes,
+                                                   MAXCACHELINESIZE));
+    memcpy(wideNodes, &wide[0], wideNodeBytes);
+  }
+  numWideNodes = wide.size();
+
+  if (print_info) {
+    size_t used = 0;
+    for (size_t i = 0; i < wide.size(); ++i)
+      for (int c = 0; c < Width; ++c)
+        if (wide[i].count[c] >= 0)
+          used++;
+    cerr << "MBVH: " << Width << " wide tree of " << wide.size()
+         << " nodes (" << 100.0*used/(wide.size()*Width)
+         << "% of the children used, depth " << maxDepth << ", "
+         << (quantized ? "quantized, " : "") << wideNodeBytes/1024
+         << "KB) collapsed in "
+         << (Time::currentSeconds() - start)*1000 << "ms\n";
+  }
+
+  if (releaseBinaryTree)
+    release();
+}
+
+template<int Width>
+bool MBVH::quantize(const std::vector<WideNode<Width> >& wide)
+{
+  std::vector<QuantizedNode<Width> > out(wide.size());
+  for (size_t i = 0; i < wide.size(); ++i) {
+    const WideNode<Width>& node = wide[i];
+    QuantizedNode<Width>& q = out[i];
+    for (int axis = 0; axis < 3; ++axis) {
+      float lo = FLT_MAX;
+      float hi = -FLT_MAX;
+      for (int c = 0; c < Width; ++c) {
+        if (node.count[c] < 0)
+          continue;
+        lo = Min(lo, node.bounds[0][axis][c]);
+        hi = Max(hi, node.bounds[1][axis][c]);
+      }
+      // Stretch the scale until the largest value reaches the top of the
+      // box, after rounding.
+      float scale = (hi - lo)/255;
+      if (!(lo <= hi && scale <= FLT_MAX))
+        return false;
+      while (dequantize(lo, scale, 255) < hi)
+        scale = nextafterf(scale, FLT_MAX);
+      q.origin[axis] = lo;
+      q.scale[axis] = scale;
+
+      for (int c = 0; c < Width; ++c) {
+        if (node.count[c] < 0) {
+          q.bounds[0][axis][c] = 255;
+          q.bounds[1][axis][c] = 0;
+        } else {
+          q.bounds[0][axis][c] = quantizeDown(lo, scale,
+                                              node.bounds[0][axis][c]);
+          q.bounds[1][axis][c] = quantizeUp(lo, scale,
+                                            node.bounds[1][axis][c]);
+        }
+      }
+    }
+
+    for (int c = 0; c < Width; ++c) {
+      if (node.count[c] < 0) {
+        q.child[c] = kUnusedChild;
+        continue;
+      }
+      if (node.count[c] >= static_cast<int>(kUnusedChild) ||
+          static_cast<unsigned int>(node.child[c]) >= 1u << (32-kCountBits))
+        return false;
+      q.child[c] = static_cast<unsigned int>(node.child[c]) << kCountBits |
+        node.count[c];
+    }
+  }
+
+  wideNodeBytes = out.size()*sizeof(QuantizedNode<Width>);
+  wideNodes = static_cast<char*>(allocateAligned(wideNodeBytes,
+                                                 MAXCACHELINESIZE));
+  memcpy(wideNodes, &out[0], wideNodeBytes);
+  quantized = true;
+  return true;
+}
+
+void MBVH::release()
+{
+  nodes.clear();
+  vector<BBox>().swap(obj_bounds);
+  vector<Vector>().swap(obj_centroids);
+#if TREE_ROT
+  vector<Real>().swap(costs);
+  vector<unsigned int>().swap(subtree_size);
+#endif
+  treeReleased = true;
+  // The next update has to build the tree again.
+  group_changed = true;
+}
+
+size_t MBVH::getMemoryUse() const
+{
+  return DynBVH::getMemoryUse() + wideNodeBytes;
+}
+
+template<int Width>
+int MBVH::collapseNode(std::vector<WideNode<Width> >& wide, int nodeID,
+                       int depth, int& maxDepth) const
+{
+  if (depth > maxDepth)
+    maxDepth = depth;
+
+  // Open up the child with the largest box until the node is full, so
+  // that the children of a wide node are about as likely to be hit.
+  int children[Width];
+  int numChildren = 0;
+  const BVHNode& node = nodes[nodeID];
+  if (node.isLeaf()) {
+    children[numChildren++] = nodeID;
+  } else {
+    children[numChildren++] = node.child;
+    children[numChildren++] = node.child+1;
+    while (numChildren < Width) {
+      int largest = -1;
+      Real largestArea = -1;
+      for (int c = 0; c < numChildren; ++c) {
+        const BVHNode& child = nodes[children[c]];
+        if (child.isLeaf())
+          continue;
+        const Real area = child.bounds.computeArea();
+        if (area > largestArea) {
+          largest = c;
+          largestArea = area;
+        }
+      }
+      if (largest < 0)
+        break;
+      const int opened = nodes[children[largest]].child;
+      children[largest] = opened;
+      children[numChildren++] = opened+1;
+    }
+  }
+
+  const int wideID = wide.size();
+  wide.push_back(WideNode<Width>());
+  for (int c = 0; c < Width; ++c) {
+    WideNode<Width>& out = wide[wideID];
+    if (c >= numChildren) {
+      for (int axis = 0; axis < 3; ++axis) {
+        out.bounds[0][axis][c] = FLT_MAX;
+        out.bounds[1][axis][c] = -FLT_MAX;
+      }
+      out.child[c] = 0;
+      out.count[c] = -1;
+      continue;
+    }
+
+    const BVHNode& child = nodes[children[c]];
+    for (int axis = 0; axis < 3; ++axis) {
+      out.bounds[0][axis][c] = roundDown(child.bounds.getMin()[axis]);
+      out.bounds[1][axis][c] = roundUp(child.bounds.getMax()[axis]);
+    }
+    if (child.isLeaf()) {
+      out.child[c] = child.child;
+      out.count[c] = child.children;
+    } else {
+      // The vector may move while the child is collapsed.
+      const int grandchild = collapseNode(wide, children[c], depth+1,
+                                          maxDepth);
+      wide[wideID].child[c] = grandchild;
+      wide[wideID].count[c] = 0;
+    }
+  }
+  return wideID;
+}
+
+void MBVH::intersect(const RenderContext& context, RayPacket& rays) const
+{
+#if USE_LAZY_BUILD
+  DynBVH::intersect(context, rays);
+#else
+  if (!treeReleased &&
+      (!wideNodes ||
+       (coherentPacketSize > 0 &&
+        rays.getFlag(RayPacket::ConstantOrigin) &&
+        rays.end() - rays.begin() >= coherentPacketSize))) {
+    DynBVH::intersect(context, rays);
+    return;
+  }
+
+  rays.computeInverseDirections();
+  for (int begin = rays.begin(); begin < rays.end(); begin += kGroupSize) {
+    const int end = Min(begin + kGroupSize, rays.end());
+    RayPacket group(rays, begin, end);
+    if (width == 8) {
+      if (quantized)
+        traverse<8, QuantizedNode<8> >(context, group);
+      else
+        traverse<8, WideNode<8> >(context, group);
+    } else {
+      if (quantized)
+        traverse<4, QuantizedNode<4> >(context, group);
+      else
+        traverse<4, WideNode<4> >(context, group);
+    }
+  }
+#endif
+}
+
+template<int Width, class Node>
+void MBVH::traverse(const RenderContext& context, RayPacket& rays) const
+{
+  const Node* wide = reinterpret_cast<const Node*>(wideNodes);
+  MANTA_ALIGN(32) WideNode<Width> decoded;
+
+  WideRay wideRays[kGroupSize];
+  int firstRay = rays.end();
+  int lastRay = rays.begin()-1;
+  for (int i = rays.begin(); i < rays.end(); ++i) {
+    if (rays.rayIsMasked(i))
+      continue;
+    WideRay& ray = wideRays[i - rays.begin()];
+    for (int axis = 0; axis < 3; ++axis) {
+      ray.org[axis] = rays.getOrigin(i, axis);
+      ray.rcp[axis] = rays.getInverseDirection(i, axis);
+      ray.near[axis] = ray.rcp[axis] < 0 ? 1 : 0;
+    }
+    if (i < firstRay)
+      firstRay = i;
+    lastRay = i;
+  }
+  if (firstRay > lastRay)
+    return;
+
+  StackEntry stack[kMaxStackSize];
+  int stackSize = 0;
+  StackEntry root = { 0, 0, firstRay, lastRay };
+  stack[stackSize++] = root;
+
+  while (stackSize > 0) {
+    const StackEntry entry = stack[--stackSize];
+    if (entry.count > 0) {
+      RayPacket subpacket(rays, entry.firstRay, entry.lastRay+1);
+      intersectObjects(context, subpacket, entry.child, entry.count);
+      continue;
+    }
+
+    // Test every ray against all of the children, and find the rays
+    // that hit every child.
+    const Node& node = wide[entry.child];
+    const WideNode<Width>& bounds = decodeBounds(node, decoded);
+    float tnear[kGroupSize][Width];
+    int masks[kGroupSize];
+    int hitMask = 0;
+    for (int i = entry.firstRay; i <= entry.lastRay; ++i) {
+      const int r = i - rays.begin();
+      masks[r] = 0;
+      if (rays.rayIsMasked(i))
+        continue;
+      masks[r] = intersectChildren<Width>(bounds, wideRays[r],
+                                          rays.getMinT(i), tnear[r]);
+      hitMask |= masks[r];
+    }
+    if (hitMask == 0)
+      continue;
+
+    // Push the children from the farthest to the nearest, as seen by
+    // the first ray to hit each.
+    StackEntry hits[Width];
+    float distances[Width];
+    int numHits = 0;
+    for (int c = 0; c < Width; ++c) {
+      if (!(hitMask & (1 << c)))
+        continue;
+      StackEntry hit = { 0, 0, -1, -1 };
+      getChild(node, c, hit.child, hit.count);
+      if (hit.count < 0)
+        continue;
+      for (int i = entry.firstRay; i <= entry.lastRay; ++i) {
+        if (masks[i - rays.begin()] & (1 << c)) {
+          if (hit.firstRay < 0)
+            hit.firstRay = i;
+          hit.lastRay = i;
+        }
+      }
+      const float distance = tnear[hit.firstRay - rays.begin()][c];
+      int slot = numHits++;
+      for (; slot > 0 && distances[slot-1] < distance; --slot) {
+        hits[slot] = hits[slot-1];
+        distances[slot] = distances[slot-1];
+      }
+      hits[slot] = hit;
+      distances[slot] = distance;
+    }
+    for (int h = 0; h < numHits; ++h)
+      stack[stackSize++] = hits[h];
+  }
+}
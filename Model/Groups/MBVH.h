@@ -0,0 +1,138 @@
+#ifndef Manta_Model_MBVH_h
+#define Manta_Model_MBVH_h
+
+#include <Model/Groups/DynBVH.h>
+
+namespace Manta
+{
+  // A DynBVH whose binary tree is collapsed into a tree of 4 or 8 wide
+  // nodes after every build and update.  Every wide node keeps the boxes
+  // of its children side by side, so that a ray is tested against all of
+  // them with a few SIMD instructions instead of one box at a time.
+  //
+  // Rays are traced through the wide tree in groups of a few rays, which
+  // keeps the SIMD lanes busy even when the rays of a packet go separate
+  // ways, as secondary and path traced rays do.  Large packets of rays
+  // that share an origin (primary rays) still gain more from culling the
+  // whole packet at once, so by default they are traced through the
+  // binary tree of the DynBVH.
+  //
+  // The wide nodes are either stored with float boxes, or quantized: the
+  // boxes of the children are then stored in 8 bits per side relative to
+  // the box of the node, rounded outwards so that no hit is lost, which
+  // halves the size of a node.  A quantized node is decoded once for all
+  // of the rays that visit it.
+  //
+  // The binary tree is built, updated, saved and loaded as by DynBVH.
+  // For scenes that do not change it can be freed, along with the data
+  // kept to update it, after the wide tree is collapsed.  Every packet
+  // is then traced through the wide tree.
+  //
+  // With a lazily built DynBVH the tree is never complete, so every
+  // packet is traced through the binary tree.
+  class MBVH : public DynBVH {
+  public:
+    // The number of rays traced through the wide tree together.
+    static const int kGroupSize = 4;
+
+    template<int Width>
+    struct WideNode {
+      // The boxes of the children, as bounds[0 for min, 1 for max]
+      // [axis][child].  Unused children have empty (inverted) boxes.
+      float bounds[2][3][Width];
+      // A child with a count is a leaf with the objects from
+      // object_ids[child] on.  A child without is another wide node,
+      // unless count is -1, for an unused child.
+      int child[Width];
+      int count[Width];
+    };
+
+    template<int Width>
+    struct QuantizedNode {
+      // The box of the node is origin to origin + 255*scale.  A side of
+      // a child box is at origin + bounds[..]*scale.
+      float origin[3];
+      float scale[3];
+      unsigned char bounds[2][3][Width];
+      // The index of a child (the first of its objects for a leaf) and
+      // the number of objects in a leaf, packed as index << kCountBits |
+      // count.  The count is 0 for another wide node and kUnusedChild for
+      // an unused child.
+      unsigned int child[Width];
+    };
+
+    static const int kCountBits = 5;
+    static const unsigned int kUnusedChild = (1 << kCountBits) - 1;
+
+    enum NodeFormat {
+      FloatNodes,
+      QuantizedNodes
+    };
+
+    // width is 4 or 8.  8 wide nodes are tested with AVX when it is
+    // enabled at compile time, and as two halves with SSE otherwise.
+    //
+    // Trees with leaves of more than kUnusedChild-1 objects, or with
+    // unbounded objects, cannot be quantized and fall back to float
+    // nodes.
+    MBVH(int width = 4, bool print = true, NodeFormat format = FloatNodes);
+    virtual ~MBVH();
+
+    int getWidth() const { return width; }
+
+    // Packets of at least this many rays (16 by default) that share an
+    // origin are traced through the binary tree.  0 traces every packet
+    // through the wide tree.
+    void setCoherentPacketSize(int size) { coherentPacketSize = size; }
+    int getCoherentPacketSize() const { return coherentPacketSize; }
+
+    // Frees the binary tree after every build, for scenes that are not
+    // updated.  An update then builds the tree again.
+    void setReleaseBinaryTree(bool release) { releaseBinaryTree = release; }
+    bool getReleaseBinaryTree() const { return releaseBinaryTree; }
+
+    size_t getNumWideNodes() const { return numWideNodes; }
+    bool isQuantized() const { return quantized; }
+    size_t getMemoryUse() const;
+
+    void intersect(const RenderContext& context, RayPacket& rays) const;
+
+    void update(int proc=0, int numProcs=1);
+    void rebuild(int proc=0, int numProcs=1);
+    bool buildFromFile(const string &file);
+
+  protected:
+    // Replaces the wide tree with one collapsed from the binary tree.
+    void collapse();
+    template<int Width>
+    void collapse();
+    template<int Width>
+    int collapseNode(std::vector<WideNode<Width> >& wide, int nodeID,
+                     int depth, int& maxDepth) const;
+
+    template<int Width>
+    bool quantize(const std::vector<WideNode<Width> >& wide);
+    // Frees the binary tree and the data kept to update it.
+    void release();
+
+    template<int Width, class Node>
+    void traverse(const RenderContext& context, RayPacket& rays) const;
+
+    int width;
+    NodeFormat format;
+    int coherentPacketSize;
+    bool releaseBinaryTree;
+    char* wideNodes;
+    size_t numWideNodes;
+    size_t wideNodeBytes;
+    bool quantized;
+    // Set while the binary tree is released.
+    bool treeReleased;
+
+  private:
+    MBVH(const MBVH&);
+    MBVH& operator=(const MBVH&);
+  };
+}
+
+#endif
@@ -92,6 +92,18 @@ namespace Manta
     //the vertices, materials, etc. to the mesh.
     void addTriangle(MeshTriangle *tri);
 
+    // Adds the count triangles of an array, such as one allocated with
+    // new[], at once.  The triangles get the ids that follow the ones
+    // already in the mesh.
+    template<class Triangle>
+    void addTriangles(Triangle *tris, size_t count) {
+      objs.reserve(objs.size() + count);
+      for (size_t i = 0; i < count; ++i) {
+        tris[i].attachMesh(this, objs.size());
+        objs.push_back(&tris[i]);
+      }
+    }
+
     virtual void computeBounds(const PreprocessContext& context, BBox& bbox) const {
       Group::computeBounds(context, bbox);
     }
@@ -5,6 +5,7 @@
 #include <Core/Color/ColorSpace.h>
 #include <Core/Exceptions/InternalError.h>
 #include <Model/Groups/ObjGroup.h>
+#include <Model/Textures/CachedImageTexture.h>
 #include <Model/Textures/Constant.h>
 #include <Model/Textures/ImageTexture.h>
 #include <Model/Textures/NormalTexture.h>
@@ -28,8 +29,12 @@ using namespace Glm;
 static Texture<Color> *check_for_texture( const string &path_name,
                                    const string &file_name,
                                    const Color &constant_color,
-                                   const float* map_scaling ) {
-  static std::map<string, Texture<Color>*> texture_cache;
+                                   const float* map_scaling,
+                                   TextureCache* cache ) {
+  static std::map<string, Texture<Color>*> image_textures;
+  static std::map<string, Texture<Color>*> cached_textures;
+  std::map<string, Texture<Color>*>& texture_cache =
+    cache ? cached_textures : image_textures;
 
   string tex_name = path_name + file_name;
   map<string, Texture<Color>*>::iterator iter = texture_cache.find(tex_name);
@@ -38,7 +43,26 @@ static Texture<Color> *check_for_texture( const string &path_name,
 
     Texture<Color> *texture = 0;
 
-    if (file_name.size()) {
+    if (file_name.size() && cache) {
+        // Leave the image to the texture cache, which reads it when it
+        // is first used.
+        try {
+          CachedImageTexture* it = LoadCachedColorImageTexture( tex_name, cache,
+                                                                &cerr);
+          if (map_scaling[0] != 0) {
+            it->setScale(map_scaling[0], map_scaling[1]);
+          }
+          it->setInterpolationMethod(CachedImageTexture::Trilinear);
+          texture = it;
+          texture_cache[tex_name] = texture;
+        }
+        catch (Exception &e) {
+            std::cerr << "Could not load diffuse map: "
+                      << file_name
+                      << ": " << e.message() << std::endl;
+        }
+    }
+    else if (file_name.size()) {
         // Load the image texture.
         try {
           ImageTexture<Color>* it = LoadColorImageTexture( tex_name , &cerr);
@@ -126,7 +150,8 @@ void ObjGroup::create_materials( GLMmodel *model ) {
         Texture<Color> *diffuse_map  = check_for_texture(model_path,
                                                          diffuse_map_name,
                                                          diffuse,
-                                                         diffuse_map_scaling);
+                                                         diffuse_map_scaling,
+                                                         textureCache);
 
         //////////////////////////////////////////////////////////////////////
         // Check for a dielectric.
@@ -161,7 +186,8 @@ void ObjGroup::create_materials( GLMmodel *model ) {
           Texture<Color> *specular_map = check_for_texture(model_path,
                                                            specular_map_name,
                                                            specular,
-                                                           specular_map_scaling );
+                                                           specular_map_scaling,
+                                                           textureCache );
           Texture<ColorComponent> *reflection =
             new Constant<ColorComponent>( reflectivity );
 
@@ -183,7 +209,9 @@ void ObjGroup::create_materials( GLMmodel *model ) {
 
 ObjGroup::ObjGroup( const char *filename,
                     Material *defaultMaterial,
-                    MeshTriangle::TriangleType triangleType) throw (InputError)
+                    MeshTriangle::TriangleType triangleType,
+                    TextureCache* textureCache) throw (InputError)
+  : textureCache(textureCache)
 {
 
   // Load the model.
@@ -195,6 +223,12 @@ ObjGroup::ObjGroup( const char *filename,
   // Allocate storage for primitives and materials.
   create_materials( model );
 
+  vertices.reserve(model->numvertices);
+  vertexNormals.reserve(model->numnormals);
+  texCoords.reserve(model->numtexcoords);
+  vertex_indices.reserve(3*model->numtriangles);
+  face_material.reserve(model->numtriangles);
+
   for (unsigned int i=1; i <= model->numvertices; ++i)
     vertices.push_back(Vector(model->vertices[i*3+0],
                               model->vertices[i*3+1],
@@ -296,24 +330,25 @@ ObjGroup::ObjGroup( const char *filename,
 //       }
 
       face_material.push_back(material_index);
-
-      switch (triangleType) {
-      case MeshTriangle::WALD_TRI:
-        addTriangle(&wald_triangles[objs.size()]);
-        break;
-      case MeshTriangle::KENSLER_SHIRLEY_TRI:
-        addTriangle(&KS_triangles[objs.size()]);
-        break;
-      case MeshTriangle::MOVING_KS_TRI:
-        addTriangle(&MovingKS_triangles[objs.size()]);
-        break;
-      }
     }
 
     // Move to the next group.
     group = group->next;
   }
 
+  // The groups hold every triangle once, so all of the triangles are used.
+  switch (triangleType) {
+  case MeshTriangle::WALD_TRI:
+    addTriangles(wald_triangles, face_material.size());
+    break;
+  case MeshTriangle::KENSLER_SHIRLEY_TRI:
+    addTriangles(KS_triangles, face_material.size());
+    break;
+  case MeshTriangle::MOVING_KS_TRI:
+    addTriangles(MovingKS_triangles, face_material.size());
+    break;
+  }
+
   // std::cerr << "Total triangles added: " << tri << std::endl;
   removeDegenerateTriangles();
 }
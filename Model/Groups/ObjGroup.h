@@ -10,18 +10,23 @@
 namespace Manta {
 
   class Material;
+  class TextureCache;
   
   class ObjGroup : public Mesh {
   public:
+    // Texture maps are read into ImageTextures, unless textureCache is
+    // given, in which case they are CachedImageTextures in that cache.
     ObjGroup( const char *filename,
               Material *defaultMaterial=NULL,
-              MeshTriangle::TriangleType triangleType = MeshTriangle::KENSLER_SHIRLEY_TRI)
+              MeshTriangle::TriangleType triangleType = MeshTriangle::KENSLER_SHIRLEY_TRI,
+              TextureCache* textureCache = NULL)
       throw (InputError);
     virtual ~ObjGroup();
 
   protected:
     virtual void create_materials( Glm::GLMmodel *model );
 
+    TextureCache* textureCache;
     Material **material_array;
     unsigned material_array_size;
   };
@@ -4,29 +4,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
 #include <float.h>
-#include <unistd.h>
 
-#include <rfut/CullMode.h>
-#include <rfut/ModelType.h>
-#include <rfut/Target.h>
-
-#include <rfut/Buffer.t>
-#include <rfut/Context.h>
-#include <rfut/Device.t>
-#include <rfut/Model.h>
-#include <rfut/Object.h>
-#include <rfut/Scene.t>
+#include <iostream>
 
+#include "Interface/Context.h"
 #include "Interface/RayPacket.h"
 #include "Interface/Primitive.h"
 #include "Interface/TexCoordMapper.h"
 #include "Core/Color/Color.h"
+#include "Core/Math/SSEDefs.h"
 #include "Core/Geometry/BBox.h"
+#include "Core/Thread/Time.h"
+#include "Core/Util/UpdateGraph.h"
 #include "Model/Materials/Lambertian.h"
 #include "Model/Groups/Mesh.h"
 #include "Model/Groups/Group.h"
@@ -77,22 +67,575 @@
 //#define DEBUG_OUTPUT
 
 using namespace Manta;
+using std::cerr;
+
+static inline bool insideGraph(const rff *graphedge, const float *point)
+{
+  return point[0] >= graphedge[RF_EDGE_MINX] &&
+         point[0] <= graphedge[RF_EDGE_MAXX] &&
+         point[1] >= graphedge[RF_EDGE_MINY] &&
+         point[1] <= graphedge[RF_EDGE_MAXY] &&
+         point[2] >= graphedge[RF_EDGE_MINZ] &&
+         point[2] <= graphedge[RF_EDGE_MAXZ];
+}
+
+// Point where a ray starting outside of the graph enters it, false if
+// the ray misses the graph entirely.
+static inline bool enterGraph(const rff *graphedge, const float *origin,
+                              const rff *vector, rff *entry)
+{
+  rff tnear = 0, tfar = RFF_MAX;
+  for(int axis = 0; axis < 3; ++axis)
+  {
+    const rff emin = graphedge[RF_AXIS_TO_EDGE(axis, RF_EDGE_MIN)];
+    const rff emax = graphedge[RF_AXIS_TO_EDGE(axis, RF_EDGE_MAX)];
+    if(vector[axis] == (rff)0.0)
+    {
+      if(origin[axis] < emin || origin[axis] > emax)
+        return false;
+      continue;
+    }
+    const rff inv = (rff)1.0 / vector[axis];
+    rff t0 = (emin - origin[axis]) * inv;
+    rff t1 = (emax - origin[axis]) * inv;
+    if(t0 > t1)
+    {
+      const rff t = t0;
+      t0 = t1;
+      t1 = t;
+    }
+    if(t0 > tnear)
+      tnear = t0;
+    if(t1 < tfar)
+      tfar = t1;
+    if(tnear > tfar)
+      return false;
+  }
+
+  entry[0] = origin[0] + tnear * vector[0];
+  entry[1] = origin[1] + tnear * vector[1];
+  entry[2] = origin[2] + tnear * vector[2];
+  return true;
+}
+
+static inline bool insideSector(const void *sector, const rff *point)
+{
+  return point[0] >= RF_SECTOR(sector)->edge[RF_EDGE_MINX] &&
+         point[0] <  RF_SECTOR(sector)->edge[RF_EDGE_MAXX] &&
+         point[1] >= RF_SECTOR(sector)->edge[RF_EDGE_MINY] &&
+         point[1] <  RF_SECTOR(sector)->edge[RF_EDGE_MAXY] &&
+         point[2] >= RF_SECTOR(sector)->edge[RF_EDGE_MINZ] &&
+         point[2] <  RF_SECTOR(sector)->edge[RF_EDGE_MAXZ];
+}
+
+// Find the sector a ray starts in and where in it the ray starts.
+// Returns 0 if the ray misses the graph.  Neighboring rays usually
+// start in the same sector, so hint (the sector of the previous ray, or
+// 0) is tried before resolving the start point.
+static inline void *startRay(void *graph, const rff *graphedge,
+                             void *constroot, void *hint,
+                             const rff origin[3], const rff vector[3],
+                             rff src[3])
+{
+  if(constroot || insideGraph(graphedge, origin))
+  {
+    src[0] = origin[0];
+    src[1] = origin[1];
+    src[2] = origin[2];
+  }
+  else if(!enterGraph(graphedge, origin, vector, src))
+    return 0;
+
+  if(constroot)
+    return constroot;
+  if(hint && insideSector(hint, src))
+    return hint;
+  return resolve(graph, src);
+}
+
+// Walk down from a node to the sector containing point.
+static inline void *descendNodes(void *root, const rff point[3])
+{
+  for( ; ; )
+  {
+    int linkflags, nodeside;
+    linkflags = RF_NODE(root)->flags;
+    // [info]
+    // Figure out which half-space we are traversing through the
+    // diambiguation plane.
+    nodeside = RF_NODE_MORE;
+    if( point[RF_NODE_GET_AXIS(linkflags)] < RF_NODE(root)->plane )
+      nodeside = RF_NODE_LESS;
+    root = RF_ADDRESS(root,
+                      (rfssize)RF_NODE(root)->link[nodeside] << RF_LINKSHIFT);
+    if( linkflags & ((RF_LINK_SECTOR<<RF_NODE_LINKFLAGS_SHIFT) << nodeside))
+      return root;
+    // [/info]
+  }
+}
+
+// Walk one ray through the graph, starting in the sector root at src.
+// Returns the triangle hit (0 for none) and sets hitdist to its distance
+// from origin.
+static inline rfTri *traceRay(void *root, rff src[3], const rff origin[3],
+                              const rff vector[3], rff &hitdist)
+{
+  int nredge;
+  rfssize slink;
+  rff RF_ALIGN16 vectinv[4];
+  int edgeindex[3];
+  rff dst[3], dist, mindist;
+  rfTri *trihit = 0;
+  int axisindex;
+
+  RF_ELEM_PREPARE_AXIS(0);
+  RF_ELEM_PREPARE_AXIS(1);
+  RF_ELEM_PREPARE_AXIS(2);
+
+  for( ; ; )
+  {
+#ifdef DEBUG_OUTPUT
+    fprintf(stderr, "traversing sector\n");
+#endif
+    /* Sector traversal */
+    int tricount;
+
+    // [info]
+    // Ray box intersection to determine endpoint of the line segment to
+    // intersect with triangles. (faster than raw ray intersection, we think)
+    nredge = edgeindex[0];
+    mindist = (RF_SECTOR(root)->edge[edgeindex[0]] - src[0]) * vectinv[0];
+    dist = (RF_SECTOR(root)->edge[edgeindex[1]] - src[1]) * vectinv[1];
+    if( dist < mindist )
+    {
+      nredge = edgeindex[1];
+      mindist = dist;
+    }
+    dist = (RF_SECTOR(root)->edge[edgeindex[2]] - src[2]) * vectinv[2];
+    if( dist < mindist )
+    {
+      nredge = edgeindex[2];
+      mindist = dist;
+    }
+    // [/info]
+
+    tricount = RF_SECTOR_GET_PRIMCOUNT(RF_SECTOR(root));
+    trihit = 0;
+    if( tricount )
+    {
+      RF_TRILIST_TYPE *trilist;// addressing type
+
+      // [info]
+      // Calculating the endpoint using the entry (resolved origin)
+      // and ray info
+      dst[0] = src[0] + ( mindist * vector[0] );
+      dst[1] = src[1] + ( mindist * vector[1] );
+      dst[2] = src[2] + ( mindist * vector[2] );
+      // [/info]
+
+      // [info]
+      // Triangle intersection!
+      trilist = RF_TRILIST( RF_SECTOR(root) );
+      do
+      {
+        rff dstdist, srcdist, uv[2], f, vray[3];
+        rfTri *tri;
+
+        tri = (rfTri *)RF_ADDRESS(root,
+                                  (rfssize)(*trilist++) << RF_LINKSHIFT);
+
+        // Intersect the triangle, with no back/front face culling
+        dstdist = rfMathPlanePoint( tri->plane, dst );
+        srcdist = rfMathPlanePoint( tri->plane, src );
+        if( dstdist * srcdist > (rff)0.0 )
+          continue;
+        f = srcdist / ( srcdist - dstdist );
+        vray[0] = src[0] + f * ( dst[0] - src[0] );
+        vray[1] = src[1] + f * ( dst[1] - src[1] );
+        vray[2] = src[2] + f * ( dst[2] - src[2] );
+        uv[0] = ( rfMathVectorDotProduct( &tri->edpu[0], vray ) + tri->edpu[3] );
+        if( !( uv[0] >= (rff)0.0 ) || ( uv[0] > (rff)1.0 ) )
+          continue;
+        uv[1] = ( rfMathVectorDotProduct( &tri->edpv[0], vray ) + tri->edpv[3] );
+        if( ( uv[1] < (rff)0.0 ) || ( ( uv[0] + uv[1] ) > (rff)1.0 ) )
+          continue;
+        dst[0] = vray[0];
+        dst[1] = vray[1];
+        dst[2] = vray[2];
+
+        trihit = tri;
+      } while( --tricount );
+
+      axisindex = nredge >> 1;
+      hitdist = (dst[axisindex] - origin[axisindex]) * vectinv[axisindex];
+
+#ifdef DEBUG_OUTPUT
+      fprintf(stderr, "hit triangle: %p\n", trihit);
+#endif
+
+      if(trihit && hitdist > T_EPSILON)
+        break;
+
+      // A hit behind the origin doesn't count, even if the ray leaves
+      // the graph from this sector
+      trihit = 0;
+    }
+#ifdef DEBUG_OUTPUT
+    else
+        fprintf(stderr, "no triangles...\n");
+#endif
+    // [/info]
+
+    // [info]
+    // If the neiboring node is a sector, just go straight to it and move on
+    /* Traverse through the sector's edge */
+    if(RF_SECTOR(root)->flags &
+       ((RF_LINK_SECTOR<<RF_SECTOR_LINKFLAGS_SHIFT) << nredge))
+    {
+#ifdef DEBUG_OUTPUT
+      fprintf(stderr, "neighbor is a sector\n");
+#endif
+      /* Neighbor is sector */
+      slink = (rfssize)RF_SECTOR(root)->link[nredge];
+      if(!(slink))
+      {
+#ifdef DEBUG_OUTPUT
+        fprintf(stderr, "goto tracevoid\n");
+#endif
+        break;//CHECKME:-->may be incorrect? was 'goto tracevoid;'
+      }
+      root = RF_ADDRESS(root, slink << RF_LINKSHIFT);
+      continue;
+    }
+    // [/info]
+
+    // [info]
+    // We have to do some kind of disambiguation of the neighbors to figure
+    // out what sector we need to traverse to next.
+    /* Neighbor is node */
+    src[0] += mindist * vector[0];
+    src[1] += mindist * vector[1];
+    src[2] += mindist * vector[2];
+    root = descendNodes(RF_ADDRESS(root, (rfssize)RF_SECTOR(root)->link[nredge]
+                                   << RF_LINKSHIFT), src);
+    // [/info]
+  }
+
+  return trihit;
+}
+
+#ifdef MANTA_SSE
+// Finish the active rays of a group one at a time, each starting in its
+// own sector.
+static inline void finishRays(void *next[4], int active,
+                              const rff src[3][4], const rff origin[3][4],
+                              const rff vector[3][4],
+                              rfTri *trihit[4], rff hitdist[4])
+{
+  for(int lane = 0; lane < 4; ++lane)
+  {
+    if(!(active & (1 << lane)))
+      continue;
+    rff raysrc[3], rayorigin[3], rayvector[3];
+    for(int axis = 0; axis < 3; ++axis)
+    {
+      raysrc[axis] = src[axis][lane];
+      rayorigin[axis] = origin[axis][lane];
+      rayvector[axis] = vector[axis][lane];
+    }
+    trihit[lane] = traceRay(next[lane], raysrc, rayorigin, rayvector,
+                            hitdist[lane]);
+  }
+}
 
-// Per-triangle data
-typedef struct
+// Walk four rays together while they stay in the same sector.  The rays
+// have to start in root at src and must have the same direction signs,
+// so that they share edgeindex.  Sector exits and triangle tests are
+// done for all four rays at once; as soon as the rays head for different
+// sectors each one is finished on its own with traceRay.  Lanes not set
+// in active are ignored.
+static inline void traceRay4(void *root, int active, sse_t src[3],
+                             const sse_t origin[3], const sse_t vector[3],
+                             const sse_t vectinv[3], const int edgeindex[3],
+                             rfTri *trihit[4], rff hitdist[4])
 {
-  size_t triID;
-  int    matID;
-} rfTriangleData;
+  MANTA_ALIGN(16) rff lanesrc[3][4];
+  MANTA_ALIGN(16) rff lanedist[4];
+  MANTA_ALIGN(16) rff lanehitdist[4];
+  MANTA_ALIGN(16) rff laneorigin[3][4];
+  MANTA_ALIGN(16) rff lanevector[3][4];
+  void *next[4];
+
+  for(int axis = 0; axis < 3; ++axis)
+  {
+    store44(laneorigin[axis], origin[axis]);
+    store44(lanevector[axis], vector[axis]);
+  }
+
+  for(int lane = 0; lane < 4; ++lane)
+    trihit[lane] = 0;
+
+  const sse_t eps = set4(T_EPSILON);
+
+  for( ; ; )
+  {
+    const rfSector32 *sector = RF_SECTOR(root);
+
+    // Exit distance and edge, with the same tie breaking as traceRay
+    const sse_t dist0 = mul4(sub4(set4(sector->edge[edgeindex[0]]), src[0]),
+                             vectinv[0]);
+    const sse_t dist1 = mul4(sub4(set4(sector->edge[edgeindex[1]]), src[1]),
+                             vectinv[1]);
+    const sse_t dist2 = mul4(sub4(set4(sector->edge[edgeindex[2]]), src[2]),
+                             vectinv[2]);
+    const sse_t exit1 = cmp4_lt(dist1, dist0);
+    const sse_t mindist01 = min4(dist0, dist1);
+    const sse_t exit2 = cmp4_lt(dist2, mindist01);
+    const sse_t mindist = mask4(exit2, dist2, mindist01);
+    const int exit1mask = getmask4(exit1);
+    const int exit2mask = getmask4(exit2);
+
+    int tricount = RF_SECTOR_GET_PRIMCOUNT(sector);
+    if( tricount )
+    {
+      sse_t dst[3];
+      dst[0] = add4(src[0], mul4(mindist, vector[0]));
+      dst[1] = add4(src[1], mul4(mindist, vector[1]));
+      dst[2] = add4(src[2], mul4(mindist, vector[2]));
+
+      const sse_t activemask = cast4_i2f(set44i(active & 8 ? -1 : 0,
+                                                active & 4 ? -1 : 0,
+                                                active & 2 ? -1 : 0,
+                                                active & 1 ? -1 : 0));
+      int hitmask = 0;
+
+      RF_TRILIST_TYPE *trilist = RF_TRILIST(sector);
+      do
+      {
+        rfTri *tri = (rfTri *)RF_ADDRESS(root,
+                                         (rfssize)(*trilist++) << RF_LINKSHIFT);
+
+        const sse_t px = set4(tri->plane[0]);
+        const sse_t py = set4(tri->plane[1]);
+        const sse_t pz = set4(tri->plane[2]);
+        const sse_t pw = set4(tri->plane[3]);
+        const sse_t dstdist = add4(dot4(px, py, pz, dst[0], dst[1], dst[2]), pw);
+        const sse_t srcdist = add4(dot4(px, py, pz, src[0], src[1], src[2]), pw);
+
+        // Same tests as traceRay, written so that NaNs go the same way
+        sse_t pass = andnot4(cmp4_gt(mul4(dstdist, srcdist), _mm_zero),
+                             activemask);
+        if(!getmask4(pass))
+          continue;
+
+        const sse_t f = _mm_div_ps(srcdist, sub4(srcdist, dstdist));
+        sse_t vray[3];
+        vray[0] = add4(src[0], mul4(f, sub4(dst[0], src[0])));
+        vray[1] = add4(src[1], mul4(f, sub4(dst[1], src[1])));
+        vray[2] = add4(src[2], mul4(f, sub4(dst[2], src[2])));
+
+        const sse_t u = add4(dot4(set4(tri->edpu[0]), set4(tri->edpu[1]),
+                                  set4(tri->edpu[2]),
+                                  vray[0], vray[1], vray[2]),
+                             set4(tri->edpu[3]));
+        pass = and4(pass, andnot4(cmp4_gt(u, _mm_one), cmp4_ge(u, _mm_zero)));
+        if(!getmask4(pass))
+          continue;
+
+        const sse_t v = add4(dot4(set4(tri->edpv[0]), set4(tri->edpv[1]),
+                                  set4(tri->edpv[2]),
+                                  vray[0], vray[1], vray[2]),
+                             set4(tri->edpv[3]));
+        pass = andnot4(or4(cmp4_lt(v, _mm_zero), cmp4_gt(add4(u, v), _mm_one)),
+                       pass);
+        const int passmask = getmask4(pass);
+        if(!passmask)
+          continue;
+
+        dst[0] = mask4(pass, vray[0], dst[0]);
+        dst[1] = mask4(pass, vray[1], dst[1]);
+        dst[2] = mask4(pass, vray[2], dst[2]);
+        for(int lane = 0; lane < 4; ++lane)
+          if(passmask & (1 << lane))
+            trihit[lane] = tri;
+        hitmask |= passmask;
+      } while( --tricount );
+
+      if(hitmask)
+      {
+        // Distance along the exit axis, like traceRay
+        const sse_t hit0 = mul4(sub4(dst[0], origin[0]), vectinv[0]);
+        const sse_t hit1 = mul4(sub4(dst[1], origin[1]), vectinv[1]);
+        const sse_t hit2 = mul4(sub4(dst[2], origin[2]), vectinv[2]);
+        const sse_t hit = mask4(exit2, hit2, mask4(exit1, hit1, hit0));
+        store44(lanehitdist, hit);
+        const int farmask = getmask4(cmp4_gt(hit, eps));
+
+        for(int lane = 0; lane < 4; ++lane)
+        {
+          if(!(hitmask & (1 << lane)))
+            continue;
+          if(farmask & (1 << lane))
+          {
+            hitdist[lane] = lanehitdist[lane];
+            active &= ~(1 << lane);
+          }
+          else
+          {
+            trihit[lane] = 0;
+          }
+        }
+        if(!active)
+          return;
+      }
+    }
+
+    // Usually all the rays leave through the same edge, and then they also
+    // walk down the nodes behind it together
+    const int exit2lanes = exit2mask & active;
+    const int exit1lanes = exit1mask & ~exit2mask & active;
+    int sharedaxis = -1;
+    if(exit2lanes == active)
+      sharedaxis = 2;
+    else if(exit1lanes == active)
+      sharedaxis = 1;
+    else if(!exit2lanes && !exit1lanes)
+      sharedaxis = 0;
+
+    if(sharedaxis >= 0)
+    {
+      const int nredge = edgeindex[sharedaxis];
+      if(sector->flags & ((RF_LINK_SECTOR<<RF_SECTOR_LINKFLAGS_SHIFT) << nredge))
+      {
+        const rfssize slink = (rfssize)sector->link[nredge];
+        if(!slink)
+          return;
+        root = RF_ADDRESS(root, slink << RF_LINKSHIFT);
+        continue;
+      }
+
+      src[0] = add4(src[0], mul4(mindist, vector[0]));
+      src[1] = add4(src[1], mul4(mindist, vector[1]));
+      src[2] = add4(src[2], mul4(mindist, vector[2]));
+
+      void *node = RF_ADDRESS(root,
+                              (rfssize)sector->link[nredge] << RF_LINKSHIFT);
+      for( ; ; )
+      {
+        const int linkflags = RF_NODE(node)->flags;
+        const int less =
+          getmask4(cmp4_lt(src[RF_NODE_GET_AXIS(linkflags)],
+                           set4(RF_NODE(node)->plane))) & active;
+        if(less && less != active)
+          break;
+        const int nodeside = less ? RF_NODE_LESS : RF_NODE_MORE;
+        node = RF_ADDRESS(node,
+                          (rfssize)RF_NODE(node)->link[nodeside] << RF_LINKSHIFT);
+        if(linkflags & ((RF_LINK_SECTOR<<RF_NODE_LINKFLAGS_SHIFT) << nodeside))
+        {
+          root = node;
+          node = 0;
+          break;
+        }
+      }
+      if(!node)
+        continue;
+
+      // The rays are on different sides of this node
+      store44(lanesrc[0], src[0]);
+      store44(lanesrc[1], src[1]);
+      store44(lanesrc[2], src[2]);
+      for(int lane = 0; lane < 4; ++lane)
+      {
+        if(!(active & (1 << lane)))
+          continue;
+        rff raysrc[3];
+        raysrc[0] = lanesrc[0][lane];
+        raysrc[1] = lanesrc[1][lane];
+        raysrc[2] = lanesrc[2][lane];
+        next[lane] = descendNodes(node, raysrc);
+      }
+      finishRays(next, active, lanesrc, laneorigin, lanevector, trihit, hitdist);
+      return;
+    }
+
+    // Find the next sector of every ray still going
+    store44(lanedist, mindist);
+    store44(lanesrc[0], src[0]);
+    store44(lanesrc[1], src[1]);
+    store44(lanesrc[2], src[2]);
+    MANTA_ALIGN(16) int advance[4];
+    void *common = 0;
+    bool coherent = true;
+    for(int lane = 0; lane < 4; ++lane)
+    {
+      advance[lane] = 0;
+      next[lane] = 0;
+      if(!(active & (1 << lane)))
+        continue;
+
+      const int axis = (exit2mask & (1 << lane)) ? 2 :
+                       (exit1mask & (1 << lane)) ? 1 : 0;
+      const int nredge = edgeindex[axis];
+
+      if(sector->flags & ((RF_LINK_SECTOR<<RF_SECTOR_LINKFLAGS_SHIFT) << nredge))
+      {
+        const rfssize slink = (rfssize)sector->link[nredge];
+        if(!slink)
+        {
+          // Leaving the graph
+          active &= ~(1 << lane);
+          continue;
+        }
+        next[lane] = RF_ADDRESS(root, slink << RF_LINKSHIFT);
+      }
+      else
+      {
+        rff exitpt[3];
+        exitpt[0] = lanesrc[0][lane] + lanedist[lane] * lanevector[0][lane];
+        exitpt[1] = lanesrc[1][lane] + lanedist[lane] * lanevector[1][lane];
+        exitpt[2] = lanesrc[2][lane] + lanedist[lane] * lanevector[2][lane];
+        next[lane] = descendNodes(RF_ADDRESS(root, (rfssize)sector->link[nredge]
+                                             << RF_LINKSHIFT), exitpt);
+        advance[lane] = -1;
+      }
+
+      if(!common)
+        common = next[lane];
+      else if(next[lane] != common)
+        coherent = false;
+    }
+
+    if(!active)
+      return;
+
+    // Rays that go through a node continue from where they left the sector
+    const sse_t advancemask = cast4_i2f(load44i((const sse_int_t*)advance));
+    src[0] = mask4(advancemask, add4(src[0], mul4(mindist, vector[0])), src[0]);
+    src[1] = mask4(advancemask, add4(src[1], mul4(mindist, vector[1])), src[1]);
+    src[2] = mask4(advancemask, add4(src[2], mul4(mindist, vector[2])), src[2]);
 
+    if(coherent)
+    {
+      root = common;
+      continue;
+    }
+
+    // The rays went separate ways
+    store44(lanesrc[0], src[0]);
+    store44(lanesrc[1], src[1]);
+    store44(lanesrc[2], src[2]);
+    finishRays(next, active, lanesrc, laneorigin, lanevector, trihit, hitdist);
+    return;
+  }
+}
+#endif // MANTA_SSE
 
-RFGraph::RFGraph() :
+
+RFGraph::RFGraph(LoadMode mode) :
   graph(0),
-  context(0),
-  object(0),
-  model(0),
-  scene(0),
-  device(0),
+  graphsize(0),
+  loadMode(mode),
   saveToFileName(""),
   currMesh(0)
 
@@ -103,321 +646,289 @@ RFGraph::RFGraph() :
 RFGraph::~RFGraph()
 {
   // Free the graph if it exists
-  if(graph)
-    free(graph);
-
-  cleanup();
+  releaseGraph();
 }
 
 bool RFGraph::buildFromFile(const std::string &fileName)
 {
   fprintf(stderr, "buildFromFile()\n");
 
-  /////////////////////////////////////////////////////////////////////////////
-  // Code imported from Rayforce //////////////////////////////////////////////
-  /////////////////////////////////////////////////////////////////////////////
-
   // Load the Rayforce graph cache file ///////////////////////////////////////
 
-  void *cache;
-  size_t cachesize;
-#ifdef __unix__
-  int fd;
-  struct stat filestat;
-#else
-  FILE *file;
-#endif
+  releaseGraph();
 
-#ifdef __unix__
-  if((fd = open(fileName.c_str(), O_RDONLY)) == -1)
-    return false;
-  if(fstat(fd, &filestat))
-  {
-    close( fd );
+  if(!cache_file.open(fileName, MappedFile::ReadOnlyShared))
     return false;
-  }
-  cachesize = filestat.st_size;
-  if((cache = mmap( 0, cachesize, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+
+  const size_t cachesize = cache_file.size();
+  const rfGraphHeader *header = (const rfGraphHeader *)cache_file.data();
+  if(cachesize < RF_GRAPHHEADER_SIZE ||
+     header->headersize != RF_GRAPHHEADER_SIZE ||
+     header->graphdatasize > cachesize)
   {
-    close( fd );
+    cerr << "RFGraph: " << fileName << " is not a graph cache\n";
+    cache_file.close();
     return false;
   }
-#else
-  if( !( file = fopen( filename, "r" ) ) )
-    return 0;
-  fseek( file, 0, SEEK_END );
-  cachesize = ftell( file );
-  fseek( file, 0, SEEK_SET );
-  if( !( cache = malloc( cachesize ) ) )
+
+  if(loadMode == LoadMapped)
   {
-    fclose( file );
-    return 0;
+    // Trace straight from the mapping, which every process mapping the
+    // same file shares.  Start reading the whole graph in the background,
+    // the traversal touches it all over the place.
+    cache_file.advise(MappedFile::AdviseHugePages);
+    cache_file.advise(MappedFile::AdviseWillNeed);
+
+    graph = cache_file.data();
+    graphsize = cachesize;
+
+    cerr << "RFGraph: mapped " << header->sectorcount << " sectors from "
+         << fileName << "\n";
+    return true;
   }
-  cachesize = fread( cache, 1, cachesize, file );
-#endif
 
   // Allocate the graph and copy from the loaded cache file ///////////////////
 
-  this->graph = malloc(cachesize);
-  memcpy(this->graph, cache, cachesize);
+  cache_file.advise(MappedFile::AdviseSequential);
 
-#ifdef __unix__
-  munmap( cache, cachesize );
-  close( fd );
-#else
-  free( cache );
-  fclose( file );
-#endif
+  graph = malloc(cachesize);
+  if(!graph)
+  {
+    cache_file.close();
+    return false;
+  }
+  graphsize = cachesize;
+  memcpy(graph, cache_file.data(), cachesize);
+
+  cache_file.close();
 
   // Finished loading the graph cache, return success
   return true;
 }
 
+void RFGraph::setLoadMode(LoadMode mode)
+{
+  loadMode = mode;
+}
+
+void RFGraph::releaseGraph()
+{
+  // A mapped graph goes away with the mapping
+  if(graph && graph != cache_file.data())
+    free(graph);
+  cache_file.close();
+
+  graph = 0;
+  graphsize = 0;
+}
+
 bool RFGraph::saveToFile(const string &fileName)
 {
   fprintf(stderr, "saveToFile()\n");
 
+  // A graph that is already built (or loaded) can be written right away,
+  // otherwise it is written once preprocess has built it.
+  if(graph)
+    return writeGraph(fileName);
+
   saveToFileName = fileName;
 
   return true;
 }
 
-void RFGraph::intersect(const RenderContext& /*context*/, RayPacket& rays) const
+bool RFGraph::writeGraph(const std::string &fileName) const
 {
-  //fprintf(stderr, "intersect()\n");
-
-  int nredge;
-  rfssize slink;
-  rff vector[3];
-  rff RF_ALIGN16 vectinv[4];
-  int edgeindex[3];
-  rff src[3], dst[3], dist, mindist;
-  rff hitdist;
-  void *root, *rayroot;// rayroot --> Keep the original root address for the ray
-                       //             because 'root' will not be the same for
-                       //             each iteration of the outer ray loop
-  rfTri *trihit;
-  int axisindex;
-
-  float origin[3]; //original origin (for calculating hitdist at the end of
-                   //                 triangle intersection)
-
-  if(rays.getFlag(RayPacket::ConstantOrigin))
+  // Nothing to do if we are tracing straight out of this file
+  if(graph == cache_file.data() && cache_file.filename() == fileName)
+    return true;
+
+  // Write to a temporary and rename it into place so that a process
+  // that currently has the old file mapped keeps a valid mapping
+  const std::string tmpName = fileName + ".tmp";
+  FILE *file = fopen(tmpName.c_str(), "wb");
+  if(!file)
   {
-    Manta::Ray ray = rays.getRay(rays.begin());
-    origin[0] = ray.origin()[0];
-    origin[1] = ray.origin()[1];
-    origin[2] = ray.origin()[2];
-    rayroot = resolve(graph, origin);
+    cerr << "RFGraph: could not open " << tmpName << " for writing\n";
+    return false;
   }
 
-  for(int i = rays.begin(); i < rays.end(); ++i)
+  const bool ok = fwrite(graph, 1, graphsize, file) == graphsize;
+  if(fclose(file) || !ok || rename(tmpName.c_str(), fileName.c_str()))
   {
-    Manta::Ray ray = rays.getRay(i);
+    cerr << "RFGraph: could not write " << fileName << "\n";
+    remove(tmpName.c_str());
+    return false;
+  }
 
-    vector[0] = ray.direction()[0];
-    vector[1] = ray.direction()[1];
-    vector[2] = ray.direction()[2];
+  return true;
+}
 
-    if(!rays.getFlag(RayPacket::ConstantOrigin))
-    {
-      origin[0] = ray.origin()[0];
-      origin[1] = ray.origin()[1];
-      origin[2] = ray.origin()[2];
-      rayroot = resolve(graph, origin);
-    }
+void RFGraph::intersect(const RenderContext& /*context*/, RayPacket& rays) const
+{
+  //fprintf(stderr, "intersect()\n");
 
-    // Reset the root for the ray (may have changed if
-    // RayPacket::ConstantOrigin is 'true')
-    root = rayroot;
+  if(!graph)
+    return;
 
-    src[0] = origin[0];
-    src[1] = origin[1];
-    src[2] = origin[2];
+  // Rays starting outside of the graph are moved up to where they enter
+  // it, resolve() only finds sectors for points inside.
+  const rff *graphedge = ((const rfGraphHeader *)graph)->edge;
 
-    RF_ELEM_PREPARE_AXIS(0);
-    RF_ELEM_PREPARE_AXIS(1);
-    RF_ELEM_PREPARE_AXIS(2);
+  // A common origin inside the graph only has to be resolved once
+  void *constroot = 0;
+  if(rays.getFlag(RayPacket::ConstantOrigin))
+  {
+    rff origin[3];
+    origin[0] = rays.getOrigin(rays.begin(), 0);
+    origin[1] = rays.getOrigin(rays.begin(), 1);
+    origin[2] = rays.getOrigin(rays.begin(), 2);
+    if(insideGraph(graphedge, origin))
+      constroot = resolve(graph, origin);
+  }
 
-    for( ; ; )
+  void *hint = 0;
+  for(int i = rays.begin(); i < rays.end(); )
+  {
+#ifdef MANTA_SSE
+    // Aligned groups of four rays are traced together
+    if(!(i & 3) && i + 4 <= rays.end())
     {
-#ifdef DEBUG_OUTPUT
-      fprintf(stderr, "traversing sector\n");
-#endif
-      /* Sector traversal */
-      int tricount;
-
-      // [info]
-      // Ray box intersection to determine endpoint of the line segment to
-      // intersect with triangles. (faster than raw ray intersection, we think)
-      nredge = edgeindex[0];
-      mindist = (RF_SECTOR(root)->edge[edgeindex[0]] - src[0]) * vectinv[0];
-      dist = (RF_SECTOR(root)->edge[edgeindex[1]] - src[1]) * vectinv[1];
-      if( dist < mindist )
+      MANTA_ALIGN(16) rff src[3][4];
+      rff origin[3], vector[3];
+      void *root[4];
+      rfTri *trihit[4];
+      rff hitdist[4];
+      int active = 0;
+
+      for(int lane = 0; lane < 4; ++lane)
       {
-        nredge = edgeindex[1];
-        mindist = dist;
+        rff lanesrc[3];
+        for(int axis = 0; axis < 3; ++axis)
+        {
+          origin[axis] = rays.getOrigin(i + lane, axis);
+          vector[axis] = rays.getDirection(i + lane, axis);
+        }
+        root[lane] = startRay(graph, graphedge, constroot, hint, origin,
+                              vector, lanesrc);
+        trihit[lane] = 0;
+        if(!root[lane])
+          continue;
+        active |= 1 << lane;
+        hint = root[lane];
+        for(int axis = 0; axis < 3; ++axis)
+          src[axis][lane] = lanesrc[axis];
       }
-      dist = (RF_SECTOR(root)->edge[edgeindex[2]] - src[2]) * vectinv[2];
-      if( dist < mindist )
+
+      // The rays can only go together if they start in the same sector and
+      // leave every sector through the same three edges
+      bool coherent = active != 0;
+      void *common = 0;
+      for(int lane = 0; lane < 4; ++lane)
       {
-        nredge = edgeindex[2];
-        mindist = dist;
+        if(!(active & (1 << lane)))
+          continue;
+        if(!common)
+          common = root[lane];
+        else if(root[lane] != common)
+          coherent = false;
       }
-      // [/info]
 
-      tricount = RF_SECTOR_GET_PRIMCOUNT(RF_SECTOR(root));
-      trihit = 0;
-      if( tricount )
+      sse_t origin4[3], vector4[3], vectinv4[3];
+      int edgeindex[3];
+      for(int axis = 0; axis < 3; ++axis)
       {
-        RF_TRILIST_TYPE *trilist;// addressing type
-
-        // [info]
-        // Calculating the endpoint using the entry (resolved origin)
-        // and ray info
-        dst[0] = src[0] + ( mindist * vector[0] );
-        dst[1] = src[1] + ( mindist * vector[1] );
-        dst[2] = src[2] + ( mindist * vector[2] );
-        // [/info]
-
-        // [info]
-        // Triangle intersection!
-        trilist = RF_TRILIST( RF_SECTOR(root) );
-        do
-        {
-          rff dstdist, srcdist, uv[2], f, vray[3];
-          rfTri *tri;
-
-          tri = (rfTri *)RF_ADDRESS(root,
-                                    (rfssize)(*trilist++) << RF_LINKSHIFT);
-
-          // Intersect the triangle, with no back/front face culling
-          dstdist = rfMathPlanePoint( tri->plane, dst );
-          srcdist = rfMathPlanePoint( tri->plane, src );
-          if( dstdist * srcdist > (rff)0.0 )
-            continue;
-          f = srcdist / ( srcdist - dstdist );
-          vray[0] = src[0] + f * ( dst[0] - src[0] );
-          vray[1] = src[1] + f * ( dst[1] - src[1] );
-          vray[2] = src[2] + f * ( dst[2] - src[2] );
-          uv[0] = ( rfMathVectorDotProduct( &tri->edpu[0], vray ) + tri->edpu[3] );
-          if( !( uv[0] >= (rff)0.0 ) || ( uv[0] > (rff)1.0 ) )
-            continue;
-          uv[1] = ( rfMathVectorDotProduct( &tri->edpv[0], vray ) + tri->edpv[3] );
-          if( ( uv[1] < (rff)0.0 ) || ( ( uv[0] + uv[1] ) > (rff)1.0 ) )
-            continue;
-          dst[0] = vray[0];
-          dst[1] = vray[1];
-          dst[2] = vray[2];
-
-          trihit = tri;
-        } while( --tricount );
-
-        axisindex = nredge >> 1;
-        hitdist = (dst[axisindex] - origin[axisindex]) * vectinv[axisindex];
-
-#ifdef DEBUG_OUTPUT
-        fprintf(stderr, "hit triangle: %p\n", trihit);
-#endif
+        origin4[axis] = load44(&rays.data->origin[axis][i]);
+        vector4[axis] = load44(&rays.data->direction[axis][i]);
+        const int positive =
+          getmask4(cmp4_gt(vector4[axis], _mm_zero)) & active;
+        if(positive && positive != active)
+          coherent = false;
+        edgeindex[axis] = RF_AXIS_TO_EDGE(axis, positive ? RF_EDGE_MAX
+                                                         : RF_EDGE_MIN);
+        // Same as RF_ELEM_PREPARE_AXIS
+        vectinv4[axis] = mask4(cmp4_eq(vector4[axis], _mm_zero),
+                               set4(-RFF_MAX),
+                               _mm_div_ps(_mm_one, vector4[axis]));
+      }
 
-        if(trihit && hitdist > T_EPSILON)
-          break;
+      if(coherent)
+      {
+        sse_t src4[3];
+        src4[0] = load44(src[0]);
+        src4[1] = load44(src[1]);
+        src4[2] = load44(src[2]);
+        traceRay4(common, active, src4, origin4, vector4,
+                  vectinv4, edgeindex, trihit, hitdist);
       }
-#ifdef DEBUG_OUTPUT
       else
-          fprintf(stderr, "no triangles...\n");
-#endif
-      // [/info]
-
-      // [info]
-      // If the neiboring node is a sector, just go straight to it and move on
-      /* Traverse through the sector's edge */
-      if(RF_SECTOR(root)->flags &
-         ((RF_LINK_SECTOR<<RF_SECTOR_LINKFLAGS_SHIFT) << nredge))
       {
-#ifdef DEBUG_OUTPUT
-        fprintf(stderr, "neighbor is a sector\n");
-#endif
-        /* Neighbor is sector */
-        slink = (rfssize)RF_SECTOR(root)->link[nredge];
-        if(!(slink))
+        for(int lane = 0; lane < 4; ++lane)
         {
-#ifdef DEBUG_OUTPUT
-          fprintf(stderr, "goto tracevoid\n");
-#endif
-          break;//CHECKME:-->may be incorrect? was 'goto tracevoid;'
+          if(!(active & (1 << lane)))
+            continue;
+          rff lanesrc[3];
+          for(int axis = 0; axis < 3; ++axis)
+          {
+            lanesrc[axis] = src[axis][lane];
+            origin[axis] = rays.getOrigin(i + lane, axis);
+            vector[axis] = rays.getDirection(i + lane, axis);
+          }
+          trihit[lane] = traceRay(root[lane], lanesrc, origin, vector,
+                                  hitdist[lane]);
         }
-        root = RF_ADDRESS(root, slink << RF_LINKSHIFT);
-        continue;
       }
-      // [/info]
 
-      // [info]
-      // We have to do some kind of disambiguation of the neighbors to figure
-      // out what sector we need to traverse to next.
-      /* Neighbor is node */
-      src[0] += mindist * vector[0];
-      src[1] += mindist * vector[1];
-      src[2] += mindist * vector[2];
-      root = RF_ADDRESS(root,
-                        (rfssize)RF_SECTOR(root)->link[nredge] << RF_LINKSHIFT);
-      // [/info]
+      for(int lane = 0; lane < 4; ++lane)
+        if(trihit[lane])
+          hitTriangle(rays, i + lane, trihit[lane], hitdist[lane]);
 
-      /* Node traversal */
-      for( ; ; )
-      {
-#ifdef DEBUG_OUTPUT
-        fprintf(stderr, "node traversal\n");
-#endif
+      i += 4;
+      continue;
+    }
+#endif // MANTA_SSE
 
-        int linkflags;
-        linkflags = RF_NODE(root)->flags;//--> pull out the current traversal
-                                         //    node
-                                         //...links to other nodes or a sector
-        // [info]
-        // Figure out which half-space we are traversing through the
-        // diambiguation plane.
-        if( src[RF_NODE_GET_AXIS(linkflags)] < RF_NODE(root)->plane )
-        {
-          root = RF_ADDRESS(root,
-                            (rfssize)RF_NODE(root)
-                            ->link[RF_NODE_LESS] << RF_LINKSHIFT);
-          if( linkflags & ((RF_LINK_SECTOR<<RF_NODE_LINKFLAGS_SHIFT)
-                           << RF_NODE_LESS))
-            break;
-        }
-        else
-        {
-          root = RF_ADDRESS(root,
-                            (rfssize)RF_NODE(root)->link[RF_NODE_MORE]
-                            << RF_LINKSHIFT);
-          if( linkflags & ((RF_LINK_SECTOR<<RF_NODE_LINKFLAGS_SHIFT)
-                           << RF_NODE_MORE))
-            break;
-        }
-        // [/info]
-      }
+    rff origin[3], vector[3], src[3];
+    for(int axis = 0; axis < 3; ++axis)
+    {
+      origin[axis] = rays.getOrigin(i, axis);
+      vector[axis] = rays.getDirection(i, axis);
     }
 
-    // We have a triangle intersection, go ahead and populate the ray in the
-    // RayPacket accordingly
-    if(trihit)
+    void *root = startRay(graph, graphedge, constroot, hint, origin, vector,
+                          src);
+    if(root)
     {
-      rfTriangleData* data =
-              (rfTriangleData*)(RF_ADDRESS(trihit, sizeof(rfTri)));
-
-      Material *material   = currMesh->materials[data->matID];
-      Primitive *primitive = (Primitive*)currMesh->get(data->triID);
-      rays.hit(i, hitdist - T_EPSILON, material, primitive, this);
-      Vector normal(trihit->plane[0], trihit->plane[1], trihit->plane[2]);
-      normal.normalize();
-      rays.setNormal(i, normal);
+      hint = root;
+      rff hitdist;
+      rfTri *trihit = traceRay(root, src, origin, vector, hitdist);
+      if(trihit)
+        hitTriangle(rays, i, trihit, hitdist);
     }
+    ++i;
   }
 
   rays.setFlag(RayPacket::HaveNormals);
 }
 
+void RFGraph::hitTriangle(RayPacket& rays, int which, const void *trihit,
+                          float hitdist) const
+{
+  // We have a triangle intersection, go ahead and populate the ray in the
+  // RayPacket accordingly
+  const rfTri *tri = (const rfTri *)trihit;
+  const rfTriangleData* data =
+          (const rfTriangleData*)(RF_ADDRESS(tri, sizeof(rfTri)));
+
+  Material *material   = currMesh->materials[data->matID];
+  Primitive *primitive = (Primitive*)currMesh->get(data->triID);
+  if(rays.hit(which, hitdist - T_EPSILON, material, primitive, this))
+  {
+    Vector normal(tri->plane[0], tri->plane[1], tri->plane[2]);
+    normal.normalize();
+    rays.setNormal(which, normal);
+  }
+}
+
 void RFGraph::setGroup(Group* new_group)
 {
   fprintf(stderr, "setGroup()\n");
@@ -432,7 +943,9 @@ void RFGraph::setGroup(Group* new_group)
 void RFGraph::groupDirty()
 {
   fprintf(stderr, "groupDirty()\n");
-  /*no op*/
+
+  // The graph is rebuilt by the next preprocess
+  releaseGraph();
 }
 
 Group* RFGraph::getGroup() const
@@ -441,17 +954,45 @@ Group* RFGraph::getGroup() const
   return currMesh;
 }
 
-void RFGraph::rebuild(int /*proc*/, int /*numProcs*/)
+void RFGraph::rebuild(int proc, int numProcs)
 {
-  fprintf(stderr, "rebuild()\n");
-  /*no op*/
+  if(!currMesh)
+    return;
+
+  double startTime = Time::currentSeconds();
+
+  size_t size;
+  void *newgraph = builder.build(currMesh, proc, numProcs, size);
+
+  // Only proc 0 gets the graph back
+  if(proc != 0)
+    return;
+
+  releaseGraph();
+  graph = newgraph;
+  graphsize = size;
+
+  if(!graph)
+    return;
+
+  const rfGraphHeader *header = (const rfGraphHeader *)graph;
+  cerr << "RFGraph: built " << header->sectorcount << " sectors and "
+       << header->nodecount << " nodes for " << currMesh->size()
+       << " triangles in " << Time::currentSeconds()-startTime
+       << " seconds (" << numProcs << " threads)\n";
+
+  // Save the cache file out if we got a filename from saveToFile()
+  if(!saveToFileName.empty())
+    writeGraph(saveToFileName);
 }
 
-void RFGraph::addToUpdateGraph(ObjectUpdateGraph* /*graph*/,
-                                ObjectUpdateGraphNode* /*parent*/)
+void RFGraph::addToUpdateGraph(ObjectUpdateGraph* graph,
+                                ObjectUpdateGraphNode* parent)
 {
   fprintf(stderr, "addToUpdateGraph()\n");
-  /*no op*/
+
+  ObjectUpdateGraphNode* node = graph->insert(this, parent);
+  getGroup()->addToUpdateGraph(graph, node);
 }
 
 void RFGraph::computeBounds(const PreprocessContext& context, BBox& bbox) const
@@ -466,61 +1007,11 @@ void RFGraph::preprocess(const PreprocessContext &context)
 
   currMesh->preprocess(context);
 
-  Mesh *mesh = currMesh;
-
-  // Check to see if we haven't loaded a graph cache
-  if(mesh && !graph)
-  {
-    // Re-initialize rfut objects
-    initialize();
-
-    // Extract out triangle mesh data into temporary memory for rfut consumption
-    uint ntris = mesh->face_material.size();
-
-    float* vertices = new float[3*mesh->vertices.size()];
-    for(uint i = 0; i < mesh->vertices.size(); ++i)
-    {
-      vertices[3*i+0] = mesh->vertices[i][0];
-      vertices[3*i+1] = mesh->vertices[i][1];
-      vertices[3*i+2] = mesh->vertices[i][2];
-    }
-
-    uint* indices = new uint[mesh->vertex_indices.size()];
-    for(uint i = 0; i < mesh->vertex_indices.size(); ++i)
-      indices[i] = mesh->vertex_indices[i];
-
-    rfTriangleData* tridata = new rfTriangleData[ntris];
-    for(uint i = 0; i < ntris; ++i)
-    {
-      tridata[i].triID = i;
-      tridata[i].matID = mesh->face_material[i];
-    }
-
-    // Set the rfut::Model data using the extracted mesh data
-    model = new rfut::Model(*scene, ModelType::Triangles, 255, 255);
-    model->setData(ntris,
-                   vertices,
-                   indices,
-                   sizeof(rfTriangleData),
-                   sizeof(rfTriangleData),
-                   tridata);
-
-    object->attach(*model);
-    scene->acquire();
-
-    handle = scene->m_handle;
-
-    // Cleanup temporary memory
-    delete vertices;
-    delete indices;
-    delete tridata;
-
-    // Save the cache file out if we got a filename from saveToFile()
-    if(!saveToFileName.empty())
-      model->saveCacheFile(saveToFileName);
-
-    graph = handle->objectgraph;
-  }
+  // Build the graph unless one was loaded with buildFromFile().  All the
+  // threads see the same graph pointer here, since it is only set after
+  // they have all entered the builder.
+  if(context.isInitialized() && !graph)
+    rebuild(context.proc, context.numProcs);
 }
 
 void RFGraph::computeTexCoords2(const RenderContext &, RayPacket &) const
@@ -532,37 +1023,3 @@ void RFGraph::computeTexCoords3(const RenderContext &, RayPacket &) const
 {
   fprintf(stderr, "computeTexCoords3()\n");
 }
-
-void RFGraph::initialize()
-{
-  cleanup();
-
-  context = new rfut::Context;
-  device  = new rfut::Device<Target::System>(*context, 0);
-  scene   = new rfut::Scene<Target::System>(*context, *device);
-  object  = new rfut::Object(*scene, CullMode::None);
-}
-
-void RFGraph::cleanup()
-{
-  delete device;
-
-  // NOTE(cpg) - the order of object destruction matters to Rayforce, at
-  //             least in so far as rfObjects are concerned; from Alexis:
-  //
-  //   Did you already free the scene that contains the object? That would
-  //   destroy the object too. Or if you destroyed the context that contains
-  //   the scene.
-  //
-  //             we'll have to think carefully about how to ensure rfut
-  //             behaves properly if client-side code doesn't observe
-  //             the proper sequence...
-  //
-  //             to fix the issue here, release the instance of rfut::Scene
-  //             after releasing the instance of rfut::Object
-
-  delete model;
-  delete object;
-  delete scene;
-  delete context;
-}
@@ -3,18 +3,9 @@
 
 #include <Interface/AccelerationStructure.h>
 
-#include <rfut/Target.h>
 #include "Interface/TexCoordMapper.h"
-
-namespace rfut
-{
-  class Context;
-  class Object;
-  class Model;
-  template<typename T> class Scene;
-  template<typename T> class Device;
-  template<typename T> class TraceFcn;
-}
+#include "Core/Util/MappedFile.h"
+#include "RFGraphBuilder.h"
 
 namespace Manta
 {
@@ -27,7 +18,17 @@ namespace Manta
 
   public:
 
-    RFGraph();
+    // How buildFromFile() brings in the graph
+    enum LoadMode {
+      // Copy the graph out of the file into memory of its own
+      LoadCopy,
+      // Trace straight from a read-only shared mapping of the file, so
+      // that all the processes loading the file share one copy of it in
+      // the page cache
+      LoadMapped
+    };
+
+    RFGraph(LoadMode mode = LoadCopy);
 
     ~RFGraph();
 
@@ -41,6 +42,9 @@ namespace Manta
     // Save out the Rayforce graph cache
     bool saveToFile(const std::string &fileName);
 
+    // Takes effect on the next buildFromFile()
+    void setLoadMode(LoadMode mode);
+
     // Intersect a packet of rays against the rfgraph
     void intersect(const RenderContext& context, RayPacket& rays) const;
 
@@ -50,10 +54,13 @@ namespace Manta
     // Get the current mesh
     Group* getGroup() const;
 
-    // Not yet implemented //
-
+    // Throw away the graph, the next preprocess builds a new one
     void groupDirty();
+
+    // Build the graph with RFGraphBuilder.  Every one of the numProcs
+    // threads has to call this.
     void rebuild(int proc=0, int numProcs=1);
+
     void addToUpdateGraph(ObjectUpdateGraph* graph,
                           ObjectUpdateGraphNode* parent);
 
@@ -73,22 +80,23 @@ namespace Manta
 
     // Helper functions ///////////////////////////////////////////////////////
 
-    void initialize();
+    bool writeGraph(const std::string &fileName) const;
+
+    void releaseGraph();
 
-    void cleanup();
+    void hitTriangle(RayPacket& rays, int which, const void *trihit,
+                     float hitdist) const;
 
     // Private data members ///////////////////////////////////////////////////
 
     void *graph;
+    size_t graphsize;
 
-    // Rayforce related data
-    rfut::Context*                  context;
-    rfut::Object*                   object;
-    rfut::Model*                    model;
-    rfut::Scene<Target::System>*    scene;
-    rfut::Device<Target::System>*   device;
+    // Holds the graph in LoadMapped mode
+    MappedFile cache_file;
+    LoadMode loadMode;
 
-    rfHandle *handle;
+    RFGraphBuilder builder;
 
     std::string saveToFileName;
 
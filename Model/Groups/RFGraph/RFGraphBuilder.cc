@@ -0,0 +1,675 @@
+#include "RFGraphBuilder.h"
+
+#include <Core/Exceptions/InternalError.h>
+#include <Core/Math/MinMax.h>
+#include <Model/Groups/Mesh.h>
+#include <Model/Intersections/TriangleBBoxOverlap.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+
+#include "rfdefs.h"
+#include "rfgraph.h"
+
+using namespace Manta;
+using namespace std;
+
+// SAH costs, relative to each other.
+static const Real kTraversalCost   = 1;
+static const Real kIntersectCost   = 1.5;
+
+// Number of candidate planes tested per axis is kNumBins-1.
+static const int kNumBins = 32;
+
+// Sectors with this many triangles or fewer are never split.
+static const int kMinSplitTris = 2;
+
+// proc 0 splits the top of the tree until there are about this many
+// subtrees per thread left to build.
+static const int kJobsPerProc = 8;
+
+static const size_t kTriRecordSize =
+  RF_SIZE_ROUND16(sizeof(rfTri) + sizeof(rfTriangleData));
+
+namespace {
+  struct JobCompare {
+    template<class T>
+    bool operator()(const T* a, const T* b) const
+    {
+      return a->tris.size() > b->tris.size();
+    }
+  };
+
+  // Grow a box a little so that triangles lying on one of its faces are
+  // not lost to round off in the overlap test.
+  BBox padded(const BBox& box)
+  {
+    const Vector pad = box.diagonal()*(Real)1e-5 + Vector(1e-7, 1e-7, 1e-7);
+    return BBox(box.getMin() - pad, box.getMax() + pad);
+  }
+}
+
+RFGraphBuilder::RFGraphBuilder()
+  : mesh(0),
+    max_depth(0),
+    next_job("RFGraphBuilder job counter", 0),
+    barrier("RFGraphBuilder barrier")
+{
+}
+
+RFGraphBuilder::~RFGraphBuilder()
+{
+  for (size_t i = 0; i < jobs.size(); ++i)
+    delete jobs[i];
+}
+
+void* RFGraphBuilder::build(Mesh* new_mesh, int proc, int numProcs,
+                            size_t& graphsize)
+{
+  graphsize = 0;
+
+  if (proc == 0) {
+    mesh = new_mesh;
+    tri_bounds.resize(mesh->size());
+    graph_bounds.reset();
+  }
+  barrier.wait(numProcs);
+
+  // Triangle bounds, in parallel.
+  const size_t ntris = tri_bounds.size();
+  const size_t begin = ntris*proc/numProcs;
+  const size_t end = ntris*(proc+1)/numProcs;
+  for (size_t i = begin; i < end; ++i) {
+    BBox& bounds = tri_bounds[i];
+    bounds.reset();
+    bounds.extendByPoint(mesh->getVertex(i, 0));
+    bounds.extendByPoint(mesh->getVertex(i, 1));
+    bounds.extendByPoint(mesh->getVertex(i, 2));
+  }
+  barrier.wait(numProcs);
+
+  if (proc == 0) {
+    buildTopLevels(numProcs);
+    next_job.set(0);
+  }
+  barrier.wait(numProcs);
+
+  processJobs();
+  barrier.wait(numProcs);
+
+  if (proc != 0)
+    return 0;
+
+  stitchJobs();
+
+  void* graph = 0;
+  if (!nodes.empty()) {
+    int ropes[RF_EDGE_COUNT];
+    for (int i = 0; i < RF_EDGE_COUNT; ++i)
+      ropes[i] = -1;
+    setRopes(0, ropes);
+    graph = serialize(graphsize);
+  }
+
+  vector<BBox>().swap(tri_bounds);
+  vector<BuildNode>().swap(nodes);
+  vector<int>().swap(refs);
+  mesh = 0;
+
+  return graph;
+}
+
+void RFGraphBuilder::buildTopLevels(int numProcs)
+{
+  nodes.clear();
+  refs.clear();
+  for (size_t i = 0; i < jobs.size(); ++i)
+    delete jobs[i];
+  jobs.clear();
+
+  // Degenerate triangles can never be hit, leave them out.
+  BuildJob* root = new BuildJob;
+  root->nodeID = 0;
+  root->depth = 0;
+  root->tris.reserve(tri_bounds.size());
+  for (size_t i = 0; i < tri_bounds.size(); ++i) {
+    const Vector e1 = mesh->getVertex(i, 1) - mesh->getVertex(i, 0);
+    const Vector e2 = mesh->getVertex(i, 2) - mesh->getVertex(i, 0);
+    if (Cross(e1, e2).length2() > 0) {
+      root->tris.push_back(i);
+      graph_bounds.extendByBox(tri_bounds[i]);
+    }
+  }
+  if (root->tris.empty()) {
+    delete root;
+    return;
+  }
+
+  // Keep the graph edges away from the geometry so that triangles on the
+  // boundary do not end up on a sector face.
+  graph_bounds = padded(graph_bounds);
+  root->bounds = graph_bounds;
+
+  const size_t n = root->tris.size();
+  max_depth = static_cast<int>(8 + 1.3*log((double)n)/log(2.0));
+
+  nodes.resize(1);
+
+  // Breadth first, so that the jobs end up with similar amounts of work.
+  const size_t target_jobs = kJobsPerProc*numProcs;
+  deque<BuildJob*> queue;
+  queue.push_back(root);
+  while (!queue.empty() && queue.size() < target_jobs) {
+    BuildJob* job = queue.front();
+    queue.pop_front();
+
+    int axis;
+    Real split;
+    if (job->depth >= max_depth ||
+        job->tris.size() <= static_cast<size_t>(kMinSplitTris) ||
+        !findSplit(job->bounds, job->tris, axis, split)) {
+      BuildNode& leaf = nodes[job->nodeID];
+      leaf.bounds = job->bounds;
+      makeLeaf(leaf, refs, job->tris);
+      delete job;
+      continue;
+    }
+
+    BuildJob* left = new BuildJob;
+    BuildJob* right = new BuildJob;
+    partition(job->bounds, axis, split, job->tris,
+              left->tris, right->tris, left->bounds, right->bounds);
+
+    const int child = nodes.size();
+    nodes.resize(child+2);
+    BuildNode& node = nodes[job->nodeID];
+    node.bounds = job->bounds;
+    node.axis = axis;
+    node.split = split;
+    node.child = child;
+
+    left->nodeID = child;
+    left->depth = job->depth+1;
+    right->nodeID = child+1;
+    right->depth = job->depth+1;
+    queue.push_back(left);
+    queue.push_back(right);
+    delete job;
+  }
+
+  jobs.assign(queue.begin(), queue.end());
+  sort(jobs.begin(), jobs.end(), JobCompare());
+}
+
+void RFGraphBuilder::processJobs()
+{
+  const int njobs = jobs.size();
+  for (int i = next_job++; i < njobs; i = next_job++) {
+    BuildJob* job = jobs[i];
+    job->nodes.resize(1);
+    buildSubtree(job->nodes, job->refs, 0, job->bounds, job->tris, job->depth);
+  }
+}
+
+void RFGraphBuilder::buildSubtree(vector<BuildNode>& out, vector<int>& out_refs,
+                                  int nodeID, const BBox& bounds,
+                                  vector<int>& tris, int depth) const
+{
+  int axis;
+  Real split;
+  if (depth >= max_depth ||
+      tris.size() <= static_cast<size_t>(kMinSplitTris) ||
+      !findSplit(bounds, tris, axis, split)) {
+    out[nodeID].bounds = bounds;
+    makeLeaf(out[nodeID], out_refs, tris);
+    return;
+  }
+
+  vector<int> left, right;
+  BBox left_bounds, right_bounds;
+  partition(bounds, axis, split, tris, left, right, left_bounds, right_bounds);
+  vector<int>().swap(tris);
+
+  const int child = out.size();
+  out.resize(child+2);
+  BuildNode& node = out[nodeID];
+  node.bounds = bounds;
+  node.axis = axis;
+  node.split = split;
+  node.child = child;
+
+  buildSubtree(out, out_refs, child, left_bounds, left, depth+1);
+  buildSubtree(out, out_refs, child+1, right_bounds, right, depth+1);
+}
+
+bool RFGraphBuilder::findSplit(const BBox& bounds, const vector<int>& tris,
+                               int& best_axis, Real& best_split) const
+{
+  const Vector extent = bounds.diagonal();
+  const Real inv_area = 1/bounds.computeArea();
+  const Real leaf_cost = kIntersectCost*tris.size();
+
+  Real best_cost = leaf_cost;
+  best_axis = -1;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!(extent[axis] > 0))
+      continue;
+
+    const Real bmin = bounds[0][axis];
+    const Real bmax = bounds[1][axis];
+    const Real bin_width = extent[axis]/kNumBins;
+    const Real bin_scale = kNumBins/extent[axis];
+
+    int starts[kNumBins];
+    int ends[kNumBins];
+    for (int b = 0; b < kNumBins; ++b)
+      starts[b] = ends[b] = 0;
+
+    for (size_t i = 0; i < tris.size(); ++i) {
+      const BBox& tb = tri_bounds[tris[i]];
+      const Real lo = Max(tb[0][axis], bmin);
+      const Real hi = Min(tb[1][axis], bmax);
+      const int blo = Min(kNumBins-1, Max(0, static_cast<int>((lo-bmin)*bin_scale)));
+      const int bhi = Min(kNumBins-1, Max(0, static_cast<int>((hi-bmin)*bin_scale)));
+      ++starts[blo];
+      ++ends[bhi];
+    }
+
+    // Area of a child box as a function of its extent along axis.
+    const int a1 = (axis+1)%3;
+    const int a2 = (axis+2)%3;
+    const Real cap = extent[a1]*extent[a2];
+    const Real side = extent[a1] + extent[a2];
+
+    int nleft = 0;
+    int nright = tris.size();
+    for (int b = 1; b < kNumBins; ++b) {
+      nleft += starts[b-1];
+      nright -= ends[b-1];
+
+      const Real wl = b*bin_width;
+      const Real wr = extent[axis] - wl;
+      const Real area_l = 2*(cap + wl*side);
+      const Real area_r = 2*(cap + wr*side);
+      const Real cost = kTraversalCost +
+        kIntersectCost*(area_l*nleft + area_r*nright)*inv_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = bmin + wl;
+      }
+    }
+  }
+
+  if (best_axis < 0)
+    return false;
+
+  // Round off may put the plane on the node boundary, which would leave
+  // an empty child.
+  if (!(best_split > bounds[0][best_axis] && best_split < bounds[1][best_axis]))
+    return false;
+
+  return true;
+}
+
+void RFGraphBuilder::partition(const BBox& bounds, int axis, Real split,
+                               const vector<int>& tris,
+                               vector<int>& left, vector<int>& right,
+                               BBox& left_bounds, BBox& right_bounds) const
+{
+  left_bounds = bounds;
+  right_bounds = bounds;
+  left_bounds[1][axis] = split;
+  right_bounds[0][axis] = split;
+
+  const BBox left_test = padded(left_bounds);
+  const BBox right_test = padded(right_bounds);
+
+  left.reserve(tris.size()/2);
+  right.reserve(tris.size()/2);
+  for (size_t i = 0; i < tris.size(); ++i) {
+    const int tri = tris[i];
+    const BBox& tb = tri_bounds[tri];
+    if (tb[1][axis] < split) {
+      left.push_back(tri);
+    } else if (tb[0][axis] > split) {
+      right.push_back(tri);
+    } else {
+      // The triangle's box straddles the plane, but the triangle itself
+      // may still miss one of the halves.
+      const MeshTriangle* mtri = mesh->get(tri);
+      if (triBoxOverlap(mtri, left_test))
+        left.push_back(tri);
+      if (triBoxOverlap(mtri, right_test))
+        right.push_back(tri);
+    }
+  }
+}
+
+void RFGraphBuilder::makeLeaf(BuildNode& node, vector<int>& out_refs,
+                              const vector<int>& tris) const
+{
+  node.axis = -1;
+  node.child = -1;
+  node.triBegin = out_refs.size();
+  node.triCount = tris.size();
+  out_refs.insert(out_refs.end(), tris.begin(), tris.end());
+}
+
+void RFGraphBuilder::stitchJobs()
+{
+  // Local node i > 0 of a job goes to base+i-1, local node 0 replaces
+  // the placeholder left by buildTopLevels.
+  for (size_t j = 0; j < jobs.size(); ++j) {
+    BuildJob* job = jobs[j];
+    const int base = nodes.size() - 1;
+    const int ref_base = refs.size();
+
+    for (size_t i = 0; i < job->nodes.size(); ++i) {
+      BuildNode node = job->nodes[i];
+      if (node.axis < 0)
+        node.triBegin += ref_base;
+      else
+        node.child += base;
+      if (i == 0)
+        nodes[job->nodeID] = node;
+      else
+        nodes.push_back(node);
+    }
+    refs.insert(refs.end(), job->refs.begin(), job->refs.end());
+
+    delete job;
+  }
+  jobs.clear();
+}
+
+void RFGraphBuilder::setRopes(int nodeID, const int ropes[6])
+{
+  BuildNode& node = nodes[nodeID];
+  for (int edge = 0; edge < RF_EDGE_COUNT; ++edge)
+    node.rope[edge] = optimizeRope(ropes[edge], edge, node.bounds);
+
+  if (node.axis < 0)
+    return;
+
+  int child_ropes[RF_EDGE_COUNT];
+  const int less = node.child;
+  const int more = node.child+1;
+
+  for (int edge = 0; edge < RF_EDGE_COUNT; ++edge)
+    child_ropes[edge] = node.rope[edge];
+  child_ropes[RF_AXIS_TO_EDGE(node.axis, RF_EDGE_MAX)] = more;
+  setRopes(less, child_ropes);
+
+  // setRopes may not be holding on to node any more.
+  BuildNode& parent = nodes[nodeID];
+  for (int edge = 0; edge < RF_EDGE_COUNT; ++edge)
+    child_ropes[edge] = parent.rope[edge];
+  child_ropes[RF_AXIS_TO_EDGE(parent.axis, RF_EDGE_MIN)] = less;
+  setRopes(more, child_ropes);
+}
+
+int RFGraphBuilder::optimizeRope(int rope, int edge, const BBox& bounds) const
+{
+  // Push the rope down to the smallest node that still contains the
+  // whole face.
+  const int face_axis = RF_EDGE_TO_AXIS(edge);
+  while (rope >= 0) {
+    const BuildNode& node = nodes[rope];
+    if (node.axis < 0)
+      break;
+
+    const int axis = node.axis;
+    const Real split = node.split;
+    if (axis == face_axis) {
+      // Everything just across the face is on one side of the plane.
+      const Real face = bounds[RF_EDGE_IS_MAX(edge) ? 1 : 0][axis];
+      if (RF_EDGE_IS_MAX(edge))
+        rope = (split <= face) ? node.child+1 : node.child;
+      else
+        rope = (split >= face) ? node.child : node.child+1;
+    } else if (split <= bounds[0][axis]) {
+      rope = node.child+1;
+    } else if (split >= bounds[1][axis]) {
+      rope = node.child;
+    } else {
+      break;
+    }
+  }
+  return rope;
+}
+
+int RFGraphBuilder::locate(const Vector& p) const
+{
+  int nodeID = 0;
+  while (nodes[nodeID].axis >= 0) {
+    const BuildNode& node = nodes[nodeID];
+    nodeID = (p[node.axis] < node.split) ? node.child : node.child+1;
+  }
+  return nodeID;
+}
+
+void* RFGraphBuilder::serialize(size_t& graphsize) const
+{
+  // Layout: header, origin table, nodes, sectors, triangles.  Every
+  // item is 16 byte aligned so that links can be stored shifted.
+  const size_t nnodes = nodes.size();
+  vector<size_t> offsets(nnodes);
+
+  size_t sectorcount = 0;
+  size_t nodecount = 0;
+  for (size_t i = 0; i < nnodes; ++i) {
+    if (nodes[i].axis < 0)
+      ++sectorcount;
+    else
+      ++nodecount;
+  }
+
+  int width = static_cast<int>(floor(pow((double)sectorcount, 1.0/3.0) + 0.5));
+  width = Min(Max(width, 1), 64);
+  const size_t origincount = static_cast<size_t>(width)*width*width;
+
+  const size_t origin_offset = RF_GRAPHHEADER_SIZE;
+  size_t offset = origin_offset +
+    RF_SIZE_ROUND64(sizeof(rfOriginTable) + origincount*sizeof(rforigin));
+
+  for (size_t i = 0; i < nnodes; ++i) {
+    if (nodes[i].axis >= 0) {
+      offsets[i] = offset;
+      offset += RF_NODE32_SIZE;
+    }
+  }
+  for (size_t i = 0; i < nnodes; ++i) {
+    if (nodes[i].axis < 0) {
+      offsets[i] = offset;
+      offset += RF_SIZE_ROUND16(sizeof(rfSector32) +
+                                nodes[i].triCount*sizeof(int32_t));
+    }
+  }
+
+  // Only triangles that ended up in a sector get a record.
+  vector<int> tri_record(tri_bounds.size(), -1);
+  vector<int> record_tri;
+  for (size_t i = 0; i < refs.size(); ++i) {
+    if (tri_record[refs[i]] < 0) {
+      tri_record[refs[i]] = record_tri.size();
+      record_tri.push_back(refs[i]);
+    }
+  }
+  const size_t tri_offset = offset;
+  offset += record_tri.size()*kTriRecordSize;
+
+  graphsize = offset;
+  char* graph = static_cast<char*>(malloc(graphsize));
+  if (!graph)
+    throw InternalError("RFGraphBuilder: out of memory for the graph");
+  memset(graph, 0, graphsize);
+
+  // Header.
+  rfGraphHeader* header = reinterpret_cast<rfGraphHeader*>(graph);
+  strncpy(header->identifier, "Manta RFGraph",
+          RF_GRAPH_HEADER_IDENTIFIER_LENGTH);
+  header->graphtype = RF_GRAPHEADER_TYPE_TRIANGLES;
+  header->headersize = RF_GRAPHHEADER_SIZE;
+  header->sectoraddrbits = 32;
+  header->nodeaddrbits = 32;
+  header->trirefaddrbits = 32;
+  header->addrshift = RF_GRAPH_LINK32_SHIFT;
+  header->alignment = 16;
+  header->primdatasize = sizeof(rfTriangleData);
+  header->rffwidth = sizeof(rff);
+  for (int axis = 0; axis < 3; ++axis) {
+    header->edge[RF_AXIS_TO_EDGE(axis, RF_EDGE_MIN)] = graph_bounds[0][axis];
+    header->edge[RF_AXIS_TO_EDGE(axis, RF_EDGE_MAX)] = graph_bounds[1][axis];
+  }
+  header->sectorcount = sectorcount;
+  header->nodecount = nodecount;
+  header->primitivecount = record_tri.size();
+  header->graphdatasize = graphsize;
+
+  // Origin table.  Each cell points at the sector holding its min
+  // corner; resolve() walks up from there to the sector of the origin.
+  rfOriginTable* origins =
+    reinterpret_cast<rfOriginTable*>(graph + origin_offset);
+  const Vector extent = graph_bounds.diagonal();
+  for (int axis = 0; axis < 3; ++axis) {
+    for (int side = 0; side < 2; ++side) {
+      origins->graphedge[RF_AXIS_TO_EDGE(axis, side)] = graph_bounds[side][axis];
+      origins->edge[RF_AXIS_TO_EDGE(axis, side)] = graph_bounds[side][axis];
+    }
+    origins->spacing[axis] = extent[axis]/width;
+    origins->spacinginv[axis] = width/extent[axis];
+  }
+  origins->width = width;
+  origins->max = width-1;
+  origins->totalcount = origincount;
+  origins->factory = width;
+  origins->factorz = width*width;
+
+  rforigin* list = RF_ORIGINTABLE_LIST(origins);
+  for (int z = 0; z < width; ++z) {
+    for (int y = 0; y < width; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const Vector cell(x, y, z);
+        Vector corner = graph_bounds.getMin() + extent*cell/(Real)width;
+        // Stay below the corner so the sector found never starts past it.
+        corner -= extent*(Real)1e-6;
+        for (int axis = 0; axis < 3; ++axis)
+          corner[axis] = Max(corner[axis], graph_bounds[0][axis]);
+        list[x + y*width + z*width*width] = offsets[locate(corner)];
+      }
+    }
+  }
+
+  // Links are stored relative to the item holding them.
+  #define RF_BUILDER_LINK(from, to, link)                                   \
+  {                                                                         \
+    const int64_t diff = (static_cast<int64_t>(to) -                        \
+                          static_cast<int64_t>(from)) >> RF_GRAPH_LINK32_SHIFT; \
+    if (diff > 0x7fffffffLL || diff < -0x7fffffffLL-1)                   \
+      throw InternalError("RFGraphBuilder: graph too large for 32 bit links"); \
+    link = static_cast<int32_t>(diff);                                      \
+  }
+
+  for (size_t i = 0; i < nnodes; ++i) {
+    const BuildNode& node = nodes[i];
+    const size_t from = offsets[i];
+
+    if (node.axis >= 0) {
+      rfNode32* out = reinterpret_cast<rfNode32*>(graph + from);
+      uint32_t flags = RF_NODE_SET_AXIS(node.axis);
+      for (int side = RF_NODE_LESS; side <= RF_NODE_MORE; ++side) {
+        const int child = node.child + side;
+        if (nodes[child].axis < 0)
+          flags |= (RF_LINK_SECTOR<<RF_NODE_LINKFLAGS_SHIFT) << side;
+        RF_BUILDER_LINK(from, offsets[child], out->link[side]);
+      }
+      out->flags = flags;
+      out->plane = node.split;
+      continue;
+    }
+
+    rfSector32* out = reinterpret_cast<rfSector32*>(graph + from);
+    uint32_t flags = 0;
+    for (int edge = 0; edge < RF_EDGE_COUNT; ++edge) {
+      out->edge[edge] = node.bounds[RF_EDGE_IS_MAX(edge) ? 1 : 0][RF_EDGE_TO_AXIS(edge)];
+      const int rope = node.rope[edge];
+      if (rope < 0) {
+        // Leaving the graph.
+        flags |= (RF_LINK_SECTOR<<RF_SECTOR_LINKFLAGS_SHIFT) << edge;
+        out->link[edge] = 0;
+        continue;
+      }
+      if (nodes[rope].axis < 0)
+        flags |= (RF_LINK_SECTOR<<RF_SECTOR_LINKFLAGS_SHIFT) << edge;
+      RF_BUILDER_LINK(from, offsets[rope], out->link[edge]);
+    }
+    RF_SECTOR_SET_FLAGSPRIMCOUNT(out, flags, node.triCount);
+
+    int32_t* trilist = RF_SECTOR32_TRILIST(out);
+    for (int t = 0; t < node.triCount; ++t) {
+      const size_t record = tri_offset + tri_record[refs[node.triBegin+t]]*kTriRecordSize;
+      RF_BUILDER_LINK(from, record, trilist[t]);
+    }
+  }
+
+  #undef RF_BUILDER_LINK
+
+  // Triangles, with the plane and the barycentric edge planes computed
+  // in double precision.
+  for (size_t r = 0; r < record_tri.size(); ++r) {
+    const int tri = record_tri[r];
+    char* record = graph + tri_offset + r*kTriRecordSize;
+    rfTri* out = reinterpret_cast<rfTri*>(record);
+    rfTriangleData* data = reinterpret_cast<rfTriangleData*>(record + sizeof(rfTri));
+
+    double v[3][3];
+    for (int k = 0; k < 3; ++k) {
+      const Vector p = mesh->getVertex(tri, k);
+      v[k][0] = p[0]; v[k][1] = p[1]; v[k][2] = p[2];
+    }
+    double e1[3], e2[3], n[3], eu[3], ev[3];
+    for (int a = 0; a < 3; ++a) {
+      e1[a] = v[1][a] - v[0][a];
+      e2[a] = v[2][a] - v[0][a];
+    }
+    n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+    n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+    n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+    const double n2 = n[0]*n[0] + n[1]*n[1] + n[2]*n[2];
+    const double inv_len = 1/sqrt(n2);
+
+    // u = ((p-v0).(e2 x n))/|n|^2 and v = ((p-v0).(n x e1))/|n|^2.
+    eu[0] = (e2[1]*n[2] - e2[2]*n[1])/n2;
+    eu[1] = (e2[2]*n[0] - e2[0]*n[2])/n2;
+    eu[2] = (e2[0]*n[1] - e2[1]*n[0])/n2;
+    ev[0] = (n[1]*e1[2] - n[2]*e1[1])/n2;
+    ev[1] = (n[2]*e1[0] - n[0]*e1[2])/n2;
+    ev[2] = (n[0]*e1[1] - n[1]*e1[0])/n2;
+
+    double d = 0, du = 0, dv = 0;
+    for (int a = 0; a < 3; ++a) {
+      out->plane[a] = n[a]*inv_len;
+      out->edpu[a] = eu[a];
+      out->edpv[a] = ev[a];
+      d += n[a]*inv_len*v[0][a];
+      du += eu[a]*v[0][a];
+      dv += ev[a]*v[0][a];
+    }
+    out->plane[3] = -d;
+    out->edpu[3] = -du;
+    out->edpv[3] = -dv;
+
+    data->triID = tri;
+    data->matID = mesh->face_material[tri];
+  }
+
+  return graph;
+}
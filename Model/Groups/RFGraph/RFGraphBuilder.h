@@ -0,0 +1,96 @@
+#ifndef Manta_Model_Groups_RFGraphBuilder_h
+#define Manta_Model_Groups_RFGraphBuilder_h
+
+#include <Core/Geometry/BBox.h>
+#include <Core/Thread/AtomicCounter.h>
+#include <Core/Thread/Barrier.h>
+
+#include <stddef.h>
+#include <vector>
+
+namespace Manta
+{
+  class Mesh;
+
+  // Per-triangle data stored right after each rfTri in the graph.
+  typedef struct
+  {
+    size_t triID;
+    int    matID;
+  } rfTriangleData;
+
+  // Builds a Rayforce graph directly from a Mesh, without going through
+  // the Rayforce library.  The graph is a SAH kd-tree whose leaves are
+  // the sectors; every sector face links either straight to the
+  // neighboring sector or to the smallest kd-tree node containing the
+  // whole face (a rope), which is then descended by the traversal.  The
+  // memory layout is the one described in rfgraph.h/rfdefs.h, so the
+  // result can be traced by RFGraph::intersect and written out as a
+  // cache file for buildFromFile.
+  class RFGraphBuilder {
+  public:
+    RFGraphBuilder();
+    ~RFGraphBuilder();
+
+    // Every one of the numProcs threads must call this.  On proc 0 it
+    // returns the graph (allocated with malloc, to be released with
+    // free) and its size in bytes, on every other proc it returns NULL.
+    // NULL is also returned on proc 0 if the mesh has no triangles.
+    void* build(Mesh* mesh, int proc, int numProcs, size_t& graphsize);
+
+  private:
+    struct BuildNode {
+      BBox bounds;
+      int axis;       // -1 for sectors (leaves).
+      Real split;
+      int child;      // First of the two children of an internal node.
+      int triBegin;   // Range in refs for sectors.
+      int triCount;
+      int rope[6];    // Indexed by RF_EDGE_*, -1 for the outside.
+    };
+
+    // A subtree built by one thread into its own arrays.  Local node 0
+    // becomes the global node nodeID when the subtrees are stitched.
+    struct BuildJob {
+      int nodeID;
+      BBox bounds;
+      int depth;
+      std::vector<int> tris;
+      std::vector<BuildNode> nodes;
+      std::vector<int> refs;
+    };
+
+    void buildTopLevels(int numProcs);
+    void processJobs();
+    void buildSubtree(std::vector<BuildNode>& out, std::vector<int>& refs,
+                      int nodeID, const BBox& bounds,
+                      std::vector<int>& tris, int depth) const;
+    bool findSplit(const BBox& bounds, const std::vector<int>& tris,
+                   int& axis, Real& split) const;
+    void partition(const BBox& bounds, int axis, Real split,
+                   const std::vector<int>& tris,
+                   std::vector<int>& left, std::vector<int>& right,
+                   BBox& left_bounds, BBox& right_bounds) const;
+    void makeLeaf(BuildNode& node, std::vector<int>& refs,
+                  const std::vector<int>& tris) const;
+    void stitchJobs();
+    void setRopes(int nodeID, const int ropes[6]);
+    int optimizeRope(int rope, int edge, const BBox& bounds) const;
+    int locate(const Vector& p) const;
+    void* serialize(size_t& graphsize) const;
+
+    Mesh* mesh;
+    BBox graph_bounds;
+    int max_depth;
+
+    std::vector<BBox> tri_bounds;
+    std::vector<BuildNode> nodes;
+    std::vector<int> refs;
+    std::vector<BuildJob*> jobs;
+
+    AtomicCounter next_job;
+    Barrier barrier;
+  };
+}
+
+#endif // Manta_Model_Groups_RFGraphBuilder_h
@@ -1,7 +1,11 @@
 
 #include <Core/Exceptions/InputError.h>
 #include <Core/Exceptions/OutputError.h>
+#include <Interface/Context.h>
+#include <Interface/MantaInterface.h>
+#include <Core/Util/Callback.h>
 #include <Model/Groups/TimeSteppedParticles.h>
+#include <Model/MiscObjects/TimeStepStreamer.h>
 #include <Model/Primitives/GridSpheres.h>
 #include <Model/Readers/ParticleNRRD.h>
 
@@ -11,13 +15,49 @@ using std::ifstream;
 #include <iostream>
 using std::cerr;
 
+#include <vector>
+using std::vector;
+
 using namespace Manta;
 
+namespace {
+  // Reads the particles of one timestep when the streamer asks for it.
+  class ParticleLoader : public TimeStepStreamer::Loader {
+  public:
+    ParticleLoader(const vector<string>& filenames, int ncells, int depth,
+                   Real radius, int ridx, RegularColorMap* cmap, int cidx) :
+      filenames(filenames), ncells(ncells), depth(depth), radius(radius),
+      ridx(ridx), cmap(cmap), cidx(cidx)
+    {
+    }
+
+    Object* load(int step)
+    {
+      ParticleNRRD pnrrd(filenames[step]);
+      return new GridSpheres(pnrrd.getParticleData(), pnrrd.getNParticles(),
+                             pnrrd.getNVars(), ncells, depth, radius, ridx,
+                             cmap, cidx);
+    }
+
+  private:
+    vector<string> filenames;
+    int ncells;
+    int depth;
+    Real radius;
+    int ridx;
+    RegularColorMap* cmap;
+    int cidx;
+  };
+}
+
 TimeSteppedParticles::TimeSteppedParticles(const string& filename, int ncells,
                                            int depth, Real radius, int ridx,
                                            RegularColorMap* cmap, int cidx,
-                                           unsigned int min, unsigned int max) :
-  tstep(0)
+                                           unsigned int min, unsigned int max,
+                                           int window) :
+  tstep(0), streamer(0), current(0),
+  requestLock("TimeSteppedParticles request lock"), requestedOffset(0),
+  haveCallback(false)
 {
   // Check for a single timestep
   string::size_type pos=filename.find(".nrrd", 0);
@@ -38,6 +78,7 @@ TimeSteppedParticles::TimeSteppedParticles(const string& filename, int ncells,
   string fname;
   unsigned int nskipped=0;
   unsigned int nloaded=0;
+  vector<string> fnames;
   while (!in.eof() && min + nloaded < max) {
     // Read the timestep filename
     in>>fname;
@@ -48,6 +89,14 @@ TimeSteppedParticles::TimeSteppedParticles(const string& filename, int ncells,
       continue;
     }
 
+    // Streamed timesteps are loaded as they are needed
+    if (window > 0) {
+      if (in)
+        fnames.push_back(fname);
+      ++nloaded;
+      continue;
+    }
+
     // Load the particle data
     ParticleNRRD pnrrd(fname);
 
@@ -60,18 +109,49 @@ TimeSteppedParticles::TimeSteppedParticles(const string& filename, int ncells,
   }
 
   in.close();
+
+  if (window > 0) {
+    if (fnames.empty())
+      throw InputError("No timesteps found in \"" + filename + "\"\n");
+    streamer=new TimeStepStreamer(new ParticleLoader(fnames, ncells, depth,
+                                                     radius, ridx, cmap, cidx),
+                                  fnames.size(), window);
+  }
 }
 
 TimeSteppedParticles::~TimeSteppedParticles(void)
 {
-  // Do nothing
+  delete streamer;
+}
+
+void TimeSteppedParticles::preprocess(const PreprocessContext& context)
+{
+  if (context.isInitialized() && context.proc == 0 && !haveCallback) {
+    context.manta_interface->registerSerialAnimationCallback
+      (Callback::create(this, &TimeSteppedParticles::update));
+    requestLock.lock();
+    haveCallback=true;
+    requestLock.unlock();
+  }
+
+  if (!streamer) {
+    Group::preprocess(context);
+    return;
+  }
+
+  // The streamer preprocesses the timesteps as it loads them
+  if (context.proc == 0) {
+    streamer->start(context);
+    current=streamer->get(tstep);
+  }
+  context.done();
 }
 
 void TimeSteppedParticles::intersect(const RenderContext& context,
                                      RayPacket& rays) const
 {
   // Fetch the current timestep
-  const Object* obj=get(tstep);
+  const Object* obj=streamer ? current : get(tstep);
   obj->intersect(context, rays);
 }
 
@@ -79,6 +159,60 @@ void TimeSteppedParticles::computeBounds(const PreprocessContext& context,
                                          BBox& bbox) const
 {
   // Fetch the current timestep
-  const Object* obj=get(tstep);
-  obj->computeBounds(context, bbox);
+  const Object* obj=streamer ? current : get(tstep);
+  if (obj)
+    obj->computeBounds(context, bbox);
+}
+
+void TimeSteppedParticles::next(void)
+{
+  requestTimeStep(1);
+}
+
+void TimeSteppedParticles::previous(void)
+{
+  requestTimeStep(-1);
+}
+
+size_t TimeSteppedParticles::getNumTimeSteps(void) const
+{
+  return streamer ? streamer->size() : size();
+}
+
+void TimeSteppedParticles::requestTimeStep(int offset)
+{
+  requestLock.lock();
+  if (haveCallback) {
+    requestedOffset+=offset;
+    requestLock.unlock();
+    return;
+  }
+  requestLock.unlock();
+
+  const size_t n=getNumTimeSteps();
+  setTimeStep((tstep + n + offset)%n, offset);
+}
+
+void TimeSteppedParticles::update(int, int, bool& changed)
+{
+  requestLock.lock();
+  const int offset=requestedOffset;
+  requestedOffset=0;
+  requestLock.unlock();
+  if (offset == 0)
+    return;
+
+  // The offset may be several steps either way
+  const int n=static_cast<int>(getNumTimeSteps());
+  const int step=((static_cast<int>(tstep) + offset)%n + n)%n;
+  setTimeStep(step, offset);
+  changed=true;
+}
+
+void TimeSteppedParticles::setTimeStep(size_t step, int direction)
+{
+  // Switch to the new timestep only once it has been loaded
+  if (streamer)
+    current=streamer->get(step, direction);
+  tstep=step;
 }
@@ -5,6 +5,7 @@
 #include <MantaTypes.h>
 #include <Model/Groups/Group.h>
 #include <Core/Thread/Mailbox.h>
+#include <Core/Thread/Mutex.h>
 
 #include <string>
 using std::string;
@@ -14,24 +15,50 @@ using std::string;
 namespace Manta
 {
   class RegularColorMap;
+  class TimeStepStreamer;
 
   class TimeSteppedParticles : public Group
   {
   public:
+    // With a window of 0 every timestep is loaded up front.  Otherwise
+    // only window timesteps are kept in memory, and the ones after the
+    // current timestep are loaded in the background.
     TimeSteppedParticles(const string& filename, int ncells, int depth,
                          Real radius, int ridx, RegularColorMap* cmap, int cidx,
-                         unsigned int min=0, unsigned int max=UINT_MAX);
+                         unsigned int min=0, unsigned int max=UINT_MAX,
+                         int window=0);
     ~TimeSteppedParticles(void);
 
+    void preprocess(const PreprocessContext& context);
     void intersect(const RenderContext& context, RayPacket& rays) const;
     void computeBounds(const PreprocessContext& context, BBox& bbox) const;
 
-    // GUI interface
-    void next(void) { tstep=(tstep + 1)%size(); }
-    void previous(void) { tstep=(tstep + size() - 1)%size(); }
+    // GUI interface.  These only ask for another timestep; the switch
+    // is made by an animation callback before the next frame is
+    // rendered.  When streaming, that callback waits for the timestep to
+    // be loaded.
+    void next(void);
+    void previous(void);
+
+    size_t getNumTimeSteps(void) const;
+    TimeStepStreamer* getStreamer(void) const { return streamer; }
 
   private:
+    void requestTimeStep(int offset);
+    void setTimeStep(size_t step, int direction);
+    // Serial animation callback that switches to the requested timestep.
+    void update(int proc, int numProcs, bool& changed);
+
     size_t tstep;
+    TimeStepStreamer* streamer;
+    Object* current;
+
+    // The timesteps next and previous have asked to move by since the
+    // last frame.  Without a callback (the particles are not being
+    // rendered) the switch is made right away.
+    Mutex requestLock;
+    int requestedOffset;
+    bool haveCallback;
   };
 }
 
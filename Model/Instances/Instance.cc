@@ -30,6 +30,7 @@
 #include <Model/Instances/MPT.h>
 #include <Interface/Context.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Core/Exceptions/BadPrimitive.h>
 #include <Core/Exceptions/InternalError.h>
 #include <Core/Geometry/BBox.h>
@@ -200,35 +201,11 @@ inline void MultiplyVectorSSE(const AffineTransform& t,
 }
 #endif
 
-void Instance::intersect(const RenderContext& context, RayPacket& rays) const
+void Instance::transformRays(const AffineTransform& transform_inv,
+                             const RayPacket& rays,
+                             RayPacket& instance_rays,
+                             Packet<Real>& scales)
 {
-  bool debugFlag = rays.getFlag(RayPacket::DebugPacket);
-  if (debugFlag) {
-    cerr << MANTA_FUNC << " called\n";
-  }
-  RayPacketData raydata;
-  RayPacket instance_rays(raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
-                          rays.getDepth(), 0);
-  // TODO(boulos): Make this a lot cleaner and try to easily maintain
-  // ray packet properties (probably best to just do so in specialized
-  // instance classes though)
-
-
-  // We setup the instance_rays to be normalized (makes it so we don't
-  // need to worry about someone calling normalize directions for us
-  // underneath us and then requiring a scaling on the end).
-  //
-  // Since we're an affine transform, the constant origin property
-  // should be transferred as well.
-  //
-  // Finally, if the parent is a debug packet, we should be too.
-  instance_rays.setFlag(
-    RayPacket::NormalizedDirections |
-    (rays.getAllFlags() & (RayPacket::ConstantOrigin | RayPacket::DebugPacket)));
-
-  // Clears things for us, so we don't have to reproduce this code everywhere
-  instance_rays.resetHits();
-  Packet<Real> scales;
   Packet<Real> inv_scales;
 
   if(rays.getFlag(RayPacket::ConstantOrigin)){
@@ -345,6 +322,38 @@ void Instance::intersect(const RenderContext& context, RayPacket& rays) const
 #undef SCALAR_KERNEL_NONCONSTANT_ORIGIN
 #undef SSE_KERNEL_CONSTANT_ORIGIN
 #undef SSE_KERNEL_NONCONSTANT_ORIGIN
+}
+
+void Instance::intersect(const RenderContext& context, RayPacket& rays) const
+{
+  bool debugFlag = rays.getFlag(RayPacket::DebugPacket);
+  if (debugFlag) {
+    cerr << MANTA_FUNC << " called\n";
+  }
+  ScopedRayPacketData raydata(context);
+  RayPacket instance_rays(*raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
+                          rays.getDepth(), 0);
+  // TODO(boulos): Make this a lot cleaner and try to easily maintain
+  // ray packet properties (probably best to just do so in specialized
+  // instance classes though)
+
+
+  // We setup the instance_rays to be normalized (makes it so we don't
+  // need to worry about someone calling normalize directions for us
+  // underneath us and then requiring a scaling on the end).
+  //
+  // Since we're an affine transform, the constant origin property
+  // should be transferred as well.
+  //
+  // Finally, if the parent is a debug packet, we should be too.
+  instance_rays.setFlag(
+    RayPacket::NormalizedDirections |
+    (rays.getAllFlags() & (RayPacket::ConstantOrigin | RayPacket::DebugPacket)));
+
+  // Clears things for us, so we don't have to reproduce this code everywhere
+  instance_rays.resetHits();
+  Packet<Real> scales;
+  transformRays(transform_inv, rays, instance_rays, scales);
 
   if (debugFlag) {
     cerr << "After transforming the incoming rays:" << endl;
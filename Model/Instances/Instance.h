@@ -29,6 +29,7 @@
 #ifndef Manta_Model_Instance_h
 #define Manta_Model_Instance_h
 
+#include <Interface/Packet.h>
 #include <Interface/Primitive.h>
 #include <Interface/TexCoordMapper.h>
 #include <Core/Geometry/AffineTransform.h>
@@ -53,6 +54,17 @@ namespace Manta {
     Object* getInstance();
     const Object *getInstance() const;
 
+    const AffineTransform& getTransform() const { return transform; }
+    const AffineTransform& getInverseTransform() const { return transform_inv; }
+
+    // Transforms the rays of rays by transform_inv into the same slots
+    // of instance_rays, normalizing the directions and scaling minT to
+    // match.  scales converts a t of instance_rays back to one of rays.
+    static void transformRays(const AffineTransform& transform_inv,
+                              const RayPacket& rays,
+                              RayPacket& instance_rays,
+                              Packet<Real>& scales);
+
     // Generic
     virtual void preprocess(const PreprocessContext&);
     virtual void computeBounds(const PreprocessContext& context,
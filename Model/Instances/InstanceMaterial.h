@@ -49,6 +49,11 @@ namespace Manta {
                                   RayPacket& shadowRays) const;
 
     void overrideMaterial(Material* material);
+    // The material given to overrideMaterial, or NULL if the instance
+    // keeps the materials of the object it instances.
+    Material* getOverrideMaterial() const {
+      return material != this ? material : 0;
+    }
   protected:
     Material* material;
     
@@ -29,6 +29,7 @@
 #include <Model/Instances/InstanceRT.h>
 #include <Model/Instances/MPT.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Core/Exceptions/BadPrimitive.h>
 #include <Core/Geometry/BBox.h>
 #include <Core/Math/MiscMath.h>
@@ -86,8 +87,8 @@ void InstanceRT::computeBounds(const PreprocessContext& context, BBox& bbox) con
 
 void InstanceRT::intersect(const RenderContext& context, RayPacket& rays) const
 {
-  RayPacketData raydata;
-  RayPacket instance_rays(raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData raydata(context);
+  RayPacket instance_rays(*raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
                           rays.getDepth(), rays.getAllFlags());
 
   if(rays.getFlag(RayPacket::ConstantOrigin)){
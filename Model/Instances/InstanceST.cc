@@ -29,6 +29,7 @@
 #include <Model/Instances/InstanceST.h>
 #include <Model/Instances/MPT.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Core/Geometry/BBox.h>
 
 using namespace Manta;
@@ -65,8 +66,8 @@ void InstanceST::computeBounds(const PreprocessContext& context, BBox& bbox) con
 
 void InstanceST::intersect(const RenderContext& context, RayPacket& rays) const
 {
-  RayPacketData raydata;
-  RayPacket instance_rays(raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData raydata(context);
+  RayPacket instance_rays(*raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
                           rays.getDepth(), rays.getAllFlags());
 
   Real scales[RayPacket::MaxSize];
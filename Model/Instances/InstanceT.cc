@@ -29,6 +29,7 @@
 #include <Model/Instances/InstanceT.h>
 #include <Model/Instances/MPT.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Core/Geometry/BBox.h>
 
 using namespace Manta;
@@ -59,8 +60,8 @@ void InstanceT::computeBounds(const PreprocessContext& context, BBox& bbox) cons
 
 void InstanceT::intersect(const RenderContext& context, RayPacket& rays) const
 {
-  RayPacketData raydata;
-  RayPacket instance_rays(raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData raydata(context);
+  RayPacket instance_rays(*raydata, RayPacket::UnknownShape, rays.begin(), rays.end(),
                           rays.getDepth(), rays.getAllFlags());
 
   if(rays.getFlag(RayPacket::ConstantOrigin)){
@@ -33,6 +33,7 @@
 #include <Interface/RayPacket.h>
 #include <Interface/AmbientLight.h>
 #include <Interface/Context.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/ShadowAlgorithm.h>
 #include <Core/Math/Expon.h>
@@ -86,8 +87,8 @@ void Lambertian::shade(const RenderContext& context, RayPacket& rays) const
 
   ShadowAlgorithm::StateBuffer shadowState;
   do {
-    RayPacketData shadowData;
-    RayPacket shadowRays(shadowData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), debugFlag);
+    ScopedRayPacketData shadowData(context);
+    RayPacket shadowRays(*shadowData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), debugFlag);
 
     // Call the shadowalgorithm(sa) to generate shadow rays.  We may not be
     // able to compute all of them, so we pass along a buffer for the sa
@@ -8,6 +8,7 @@
 #include <Interface/LightSet.h>
 #include <Interface/Primitive.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/Scene.h>
@@ -47,8 +48,8 @@ void MetalMaterial::shade(const RenderContext& context, RayPacket& rays) const
     specular_reflectance->mapValues(specular, context, rays);
 
     rays.computeHitPositions();
-    RayPacketData rdata;
-    RayPacket refl_rays(rdata, RayPacket::UnknownShape, rays.begin(), rays.end(),
+    ScopedRayPacketData rdata(context);
+    RayPacket refl_rays(*rdata, RayPacket::UnknownShape, rays.begin(), rays.end(),
                         rays.getDepth()+1, RayPacket::NormalizedDirections);
     for(int i=rays.begin();i<rays.end();i++) {
       Vector rayD = rays.getDirection(i);
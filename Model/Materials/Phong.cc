@@ -39,6 +39,7 @@
 #include <Interface/LightSet.h>
 #include <Interface/Primitive.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/Scene.h>
@@ -161,8 +162,8 @@ void Phong::shade(const RenderContext& context, RayPacket& rays) const
 
   ShadowAlgorithm::StateBuffer shadowState;
   do {
-    RayPacketData shadowData;
-    RayPacket shadowRays(shadowData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), debugFlag);
+    ScopedRayPacketData shadowData(context);
+    RayPacket shadowRays(*shadowData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), debugFlag);
 
     // Call the shadowalgorithm(sa) to generate shadow rays.  We may not be
     // able to compute all of them, so we pass along a buffer for the sa
@@ -441,8 +442,8 @@ void Phong::shade(const RenderContext& context, RayPacket& rays) const
     refltex->mapValues(refl, context, rays);
 
     rays.computeHitPositions();
-    RayPacketData rdata;
-    RayPacket refl_rays(rdata, RayPacket::UnknownShape,
+    ScopedRayPacketData rdata(context);
+    RayPacket refl_rays(*rdata, RayPacket::UnknownShape,
                         rays.begin(), rays.end(),
                         rays.getDepth()+1,
                         RayPacket::NormalizedDirections | debugFlag);
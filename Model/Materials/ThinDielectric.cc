@@ -38,6 +38,7 @@
 #include <Interface/LightSet.h>
 #include <Interface/Primitive.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/Scene.h>
@@ -96,12 +97,12 @@ void ThinDielectric::shade(const RenderContext& context, RayPacket& rays) const
   eta->mapValues(eta_values, context, rays);
   sigma_a->mapValues(sigma_a_values, context, rays);
 
-  RayPacketData reflected_data;
-  RayPacketData refracted_data;
+  ScopedRayPacketData reflected_data(context);
+  ScopedRayPacketData refracted_data(context);
 
-  RayPacket reflected_rays(reflected_data, RayPacket::UnknownShape,
+  RayPacket reflected_rays(*reflected_data, RayPacket::UnknownShape,
                            0, 0, rays.getDepth()+1, RayPacket::NormalizedDirections | debugFlag);
-  RayPacket refracted_rays(refracted_data, RayPacket::UnknownShape,
+  RayPacket refracted_rays(*refracted_data, RayPacket::UnknownShape,
                            0, 0, rays.getDepth()+1, RayPacket::NormalizedDirections | debugFlag);
 
   Color results[RayPacket::MaxSize];
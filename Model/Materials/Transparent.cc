@@ -34,6 +34,7 @@
 #include <Interface/LightSet.h>
 #include <Interface/Primitive.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/Renderer.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/ShadowAlgorithm.h>
@@ -85,8 +86,8 @@ void Transparent::shade(const RenderContext& context, RayPacket& rays) const {
 
   ShadowAlgorithm::StateBuffer shadowState;
   do {
-    RayPacketData shadowData;
-    RayPacket shadowRays(shadowData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), 0);
+    ScopedRayPacketData shadowData(context);
+    RayPacket shadowRays(*shadowData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), 0);
 
     // Call the shadowalgorithm(sa) to generate shadow rays.  We may not be
     // able to compute all of them, so we pass along a buffer for the sa
@@ -126,8 +127,8 @@ void Transparent::shade(const RenderContext& context, RayPacket& rays) const {
   Packet<ColorComponent> alpha_values;
   alpha->mapValues( alpha_values, context, rays );
 
-  RayPacketData secondaryData;
-  RayPacket secondaryRays(secondaryData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), 0);
+  ScopedRayPacketData secondaryData(context);
+  RayPacket secondaryRays(*secondaryData, RayPacket::UnknownShape, 0, 0, rays.getDepth(), 0);
   int map[RayPacket::MaxSize];
 
   // Shoot a secondary ray for all non 1.0 alpha values.
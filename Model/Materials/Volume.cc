@@ -211,6 +211,8 @@ namespace Manta
         oldTInc = 0.01;
         scaleAlphas(tInc);
       }
+    // The volumes skip the values that the new colors make transparent.
+    computeHash();
   }
 
   void RGBAColorMap::SetMinMax(float min, float max)
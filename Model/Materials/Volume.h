@@ -9,14 +9,22 @@
 #ifndef VOLUME_H
 #define VOLUME_H
 
+#include <MantaSSE.h>
+#include <Core/Containers/BrickedGridArray3.h>
 #include <Core/Containers/GridArray3.h>
 #include <Core/Geometry/BBox.h>
 #include <Core/Geometry/Vector.h>
+#include <Core/Math/MinMax.h>
+#include <Core/Util/Align.h>
+#ifdef MANTA_SSE
+#include <Core/Math/SSEDefs.h>
+#endif
 
 #include <Interface/Context.h>
 #include <Interface/Material.h>
 #include <Interface/Renderer.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/SampleGenerator.h>
 #include <Interface/Scene.h>
 #include <Model/Primitives/PrimitiveCommon.h>
@@ -142,6 +150,9 @@ namespace Manta
     VMCell cell;
   };
 
+#define RAY_TERMINATION_THRESHOLD 0.9
+#define RAY_TERMINATION 0.98
+
   template<class T>
     class Volume : public PrimitiveCommon, public Material
     {
@@ -168,6 +179,11 @@ namespace Manta
       Volume(GridArray3<T>* data, RGBAColorMap* colorMap, const BBox& bounds,
              double cellStepSize, int depth,
              double forceDataMin = -FLT_MAX, double forceDataMax = -FLT_MAX);
+      // A volume that is read from a brick file as it is rendered.  The
+      // bricks take the place of the macrocells.
+      Volume(BrickedGridArray3<T>* data, RGBAColorMap* colorMap,
+             const BBox& bounds, double cellStepSize,
+             double forceDataMin = -FLT_MAX, double forceDataMax = -FLT_MAX);
       virtual ~Volume();
       void setBounds(BBox bounds);
       void setColorMap(RGBAColorMap* map) { _colorMap = map; }
@@ -179,9 +195,6 @@ namespace Manta
       virtual void intersect(const RenderContext& context, RayPacket& rays) const
       {
         const bool anyHit = rays.getFlag(RayPacket::AnyHit);
-        if (anyHit)
-          return; // For now, we make the incorrect assumption that volumes do
-                  // not cast shadows.  TODO: Make volumes cast correct shadows...
 
           // This is so our t values have the same scale as other prims, e.g., TexTriangle
           rays.normalizeDirections();
@@ -194,6 +207,39 @@ namespace Manta
           enlargedBBox[0]=_bbox[0] - _bbox.diagonal().length()*T_EPSILON*.1;
           enlargedBBox[1]=_bbox[1] + _bbox.diagonal().length()*T_EPSILON*.1;
 
+          if (anyHit) {
+            // Shadow rays are blocked where the volume becomes opaque
+            // before the light.
+            Real tMins[RayPacket::MaxSize];
+            Real tMaxs[RayPacket::MaxSize];
+            float alphas[RayPacket::MaxSize];
+            Color totals[RayPacket::MaxSize];
+            for (int i=rays.begin();i<rays.end();++i) {
+              Real tmin, tmax;
+              tMins[i] = 0;
+              tMaxs[i] = -1;
+              if (intersectAaBox( enlargedBBox, tmin, tmax, rays.getRay(i),
+                                  rays.getSigns(i),
+                                  rays.getInverseDirection(i))) {
+                tMins[i] = Max(tmin, (Real)0);
+                tMaxs[i] = Min(tmax, rays.getMinT(i));
+              }
+              totals[i] = Color::black();
+              alphas[i] = 0;
+            }
+            marchRays(rays, rays.begin(), rays.end(), tMins, tMaxs,
+                      totals, alphas);
+            for (int i=rays.begin();i<rays.end();++i) {
+              // Any point of the segment will do for an any hit ray.
+              const Real distanceLeft = rays.getMinT(i);
+              if (alphas[i] >= RAY_TERMINATION_THRESHOLD &&
+                  rays.hit( i, tMins[i] > T_EPSILON ? tMins[i] : tMaxs[i]*(Real)0.5,
+                            this, this, getTexCoordMapper() ))
+                rays.scratchpad<Real>(i) = distanceLeft;
+            }
+            return;
+          }
+
 
           // Iterate over each ray.
           for (int i=rays.begin();i<rays.end();++i) {
@@ -205,12 +251,18 @@ namespace Manta
                                               rays.getRay(i),
                                               rays.getSigns(i),
                                               rays.getInverseDirection(i))){
+              // attenuateShadows must not march past where the ray was
+              // headed before it hit the volume (e.g. the light).
+              const Real distanceLeft = rays.getMinT(i);
+              bool hit;
               // Check to see if we are inside the box.
               if (tmin > T_EPSILON)
-                rays.hit( i, tmin, this, this, getTexCoordMapper() );
+                hit = rays.hit( i, tmin, this, this, getTexCoordMapper() );
               // And use the max intersection if we are.
               else
-                rays.hit( i, tmax, this, this, getTexCoordMapper() );
+                hit = rays.hit( i, tmax, this, this, getTexCoordMapper() );
+              if (hit)
+                rays.scratchpad<Real>(i) = distanceLeft;
             }
           }
           return;
@@ -253,8 +305,13 @@ namespace Manta
         {
           _stepSize = stepSize;
         }
+      // Only one of these is set.
       GridArray3<T>* _data;
+      BrickedGridArray3<T>* _bricks;
       float getValue(int x, int y, int z);
+      // The values at the corners of cell (x, y, z), in the order of
+      // BrickedGridArray3::getCell.
+      void getCell(int x, int y, int z, float rhos[8]) const;
       GridArray3<VMCell>* macrocells;
       void calc_mcell(int depth, int ix, int iy, int iz, VMCell& mcell);
       void parallel_calc_mcell(int cell);
@@ -265,9 +322,30 @@ namespace Manta
                  const int startx, const int starty, const int startz,
                  const Vector& cellcorner, const Vector& celldir,
                  HVIsectContext &isctx) const;
+
+      // Composites the samples of rays [begin, end) from tMins to tMaxs
+      // into totals and alphas.  With SSE the rays are marched four at a
+      // time, skipping the macrocells the transfer function makes
+      // transparent; otherwise each ray goes through isect.
+      void marchRays(const RayPacket& rays, int begin, int end,
+                     const Real* tMins, const Real* tMaxs,
+                     Color* totals, float* alphas) const;
+      void marchRay(const Ray& ray, Real t_min, Real t_max,
+                    Color& total, float& alpha) const;
+
+      // The value range of every block of _mcSize^3 cells, for the empty
+      // space skipping of marchRays.  Bricked volumes use their bricks.
+      enum { MacrocellSize = 8 };
+      int _mcSize;
+      GridArray3<VMCell> _mcGrid;
+      void buildMacrocellGrid();
+
       Vector diag;
       Vector inv_diag;
     protected:
+      void initialize(const BBox& bounds, double cellStepSize, int depth,
+                      float min, float max);
+
       int _nx,_ny,_nz;
       RGBAColorMap* _colorMap;
       BBox _bounds;
@@ -292,22 +370,12 @@ namespace Manta
                       const BBox& bounds, double cellStepSize,
                       int depth,
                       double forceDataMin, double forceDataMax)
-    : _data(data), _colorMap(colorMap)
+    : _data(data), _bricks(0), _colorMap(colorMap)
     {
-      _bbox = bounds; // store the actual bounds.
-      //slightly expand the bounds.
-      _bounds[0] = bounds[0] - bounds.diagonal().length()*T_EPSILON;
-      _bounds[1] = bounds[1] + bounds.diagonal().length()*T_EPSILON;
-
-      Vector diag = _bounds.diagonal();
-
-      _cellSize = diag*Vector( 1.0 / (double)(_data->getNx()-1),
-                               1.0 / (double)(_data->getNy()-1),
-                               1.0 / (double)(_data->getNz()-1));
-
-      //_stepSize = cellStepSize*_cellSize.length()/sqrt(3.0);
-      _stepSize = cellStepSize;
-      _maxDistance = diag.length();
+      _nx = _data->getNx();
+      _ny = _data->getNy();
+      _nz = _data->getNz();
+      _mcSize = MacrocellSize;
 
       float min = 0,max = 0;
       //_data->getMinMax(&min, &max);
@@ -325,6 +393,50 @@ namespace Manta
           min = forceDataMin;
           max = forceDataMax;
         }
+      initialize(bounds, cellStepSize, depth, min, max);
+    }
+
+  template<class T>
+    Volume<T>::Volume(BrickedGridArray3<T>* data, RGBAColorMap* colorMap,
+                      const BBox& bounds, double cellStepSize,
+                      double forceDataMin, double forceDataMax)
+    : _data(0), _bricks(data), _colorMap(colorMap)
+    {
+      _nx = _bricks->getNx();
+      _ny = _bricks->getNy();
+      _nz = _bricks->getNz();
+      _mcSize = _bricks->getBrickSize();
+
+      // The range is in the brick file, so no voxels are read here.
+      float min = _bricks->getDataMin();
+      float max = _bricks->getDataMax();
+      if (forceDataMin != -FLT_MAX || forceDataMax != -FLT_MAX)
+        {
+          min = forceDataMin;
+          max = forceDataMax;
+        }
+      initialize(bounds, cellStepSize, 1, min, max);
+    }
+
+  template<class T>
+    void Volume<T>::initialize(const BBox& bounds, double cellStepSize,
+                               int depth, float min, float max)
+    {
+      _bbox = bounds; // store the actual bounds.
+      //slightly expand the bounds.
+      _bounds[0] = bounds[0] - bounds.diagonal().length()*T_EPSILON;
+      _bounds[1] = bounds[1] + bounds.diagonal().length()*T_EPSILON;
+
+      Vector diag = _bounds.diagonal();
+
+      _cellSize = diag*Vector( 1.0 / (double)(_nx-1),
+                               1.0 / (double)(_ny-1),
+                               1.0 / (double)(_nz-1));
+
+      //_stepSize = cellStepSize*_cellSize.length()/sqrt(3.0);
+      _stepSize = cellStepSize;
+      _maxDistance = diag.length();
+
       _dataMin = min;
       _dataMax = max;
       _colorScalar = 1.0f/(_dataMax - _dataMin);
@@ -334,9 +446,6 @@ namespace Manta
       if (_depth <= 0)
         _depth=1;
       _datadiag = diag;
-      _nx = _data->getNx();
-      _ny = _data->getNy();
-      _nz = _data->getNz();
       _sdiag = _datadiag/Vector(_nx-1,_ny-1,_nz-1);
       inv_diag  = diag.inverse();
 
@@ -423,6 +532,7 @@ namespace Manta
         calc_mcell(depth-1,0,0,0,top);
         cerr << "done\n";
       }
+      buildMacrocellGrid();
       //cerr << "**************************************************\n";
       //print(cerr);
       //cerr << "**************************************************\n";
@@ -455,9 +565,9 @@ namespace Manta
       Vector diag = _bounds.diagonal();
       _bbox = bounds;
 
-      _cellSize = diag*Vector( 1.0 / (double)(_data->getNx()-1),
-                               1.0 / (double)(_data->getNy()-1),
-                               1.0 / (double)(_data->getNz()-1));
+      _cellSize = diag*Vector( 1.0 / (double)(_nx-1),
+                               1.0 / (double)(_ny-1),
+                               1.0 / (double)(_nz-1));
 
       //_stepSize = cellStepSize*_cellSize.length()/sqrt(3.0);
       _maxDistance = diag.length();
@@ -509,21 +619,13 @@ namespace Manta
       if(depth==0){
         // We are at the data level.  Loop over each voxel and compute the
         // mcell for this group of voxels.
-        GridArray3<T>& data = *_data;
         float data_min = _dataMin;
         float data_max = _dataMax;
         for(int ix=startx;ix<endx;ix++){
           for(int iy=starty;iy<endy;iy++){
             for(int iz=startz;iz<endz;iz++){
               float rhos[8];
-              rhos[0]=data(ix, iy, iz);
-              rhos[1]=data(ix, iy, iz+1);
-              rhos[2]=data(ix, iy+1, iz);
-              rhos[3]=data(ix, iy+1, iz+1);
-              rhos[4]=data(ix+1, iy, iz);
-              rhos[5]=data(ix+1, iy, iz+1);
-              rhos[6]=data(ix+1, iy+1, iz);
-              rhos[7]=data(ix+1, iy+1, iz+1);
+              getCell(ix, iy, iz, rhos);
               float minr=rhos[0];
               float maxr=rhos[0];
               for(int i=1;i<8;i++){
@@ -559,6 +661,78 @@ namespace Manta
       }
     }
 
+  template<class T>
+    void Volume<T>::buildMacrocellGrid()
+    {
+      // Macrocell (mx, my, mz) holds the cells starting at voxel
+      // (mx, my, mz)*_mcSize, so it needs the data up to the voxels of
+      // the next macrocell.
+      const int msize = _mcSize;
+      const int mx = (_nx-2)/msize+1;
+      const int my = (_ny-2)/msize+1;
+      const int mz = (_nz-2)/msize+1;
+      _mcGrid.resize(mx, my, mz);
+      if(_bricks){
+        // The bricks cover the same cells as the macrocells.
+        for(int x=0;x<mx;x++){
+          for(int y=0;y<my;y++){
+            for(int z=0;z<mz;z++){
+              float minr, maxr;
+              _bricks->getBrickRange(x, y, z, minr, maxr);
+              VMCell cell;
+              cell.turn_on_bits(minr, maxr, _dataMin, _dataMax);
+              _mcGrid(x, y, z) = cell;
+            }
+          }
+        }
+        return;
+      }
+      GridArray3<T>& data = *_data;
+      for(int x=0;x<mx;x++){
+        for(int y=0;y<my;y++){
+          for(int z=0;z<mz;z++){
+            float minr = FLT_MAX;
+            float maxr = -FLT_MAX;
+            int endx = Min((x+1)*msize, _nx-1);
+            int endy = Min((y+1)*msize, _ny-1);
+            int endz = Min((z+1)*msize, _nz-1);
+            for(int ix=x*msize;ix<=endx;ix++){
+              for(int iy=y*msize;iy<=endy;iy++){
+                for(int iz=z*msize;iz<=endz;iz++){
+                  float rho = data(ix, iy, iz);
+                  if(rho<minr)
+                    minr=rho;
+                  if(rho>maxr)
+                    maxr=rho;
+                }
+              }
+            }
+            VMCell cell;
+            cell.turn_on_bits(minr, maxr, _dataMin, _dataMax);
+            _mcGrid(x, y, z) = cell;
+          }
+        }
+      }
+    }
+
+  template<class T>
+    void Volume<T>::getCell(int x, int y, int z, float rhos[8]) const
+    {
+      if(_bricks){
+        _bricks->getCell(x, y, z, rhos);
+        return;
+      }
+      GridArray3<T>& data = *_data;
+      rhos[0]=data(x, y, z);
+      rhos[1]=data(x, y, z+1);
+      rhos[2]=data(x, y+1, z);
+      rhos[3]=data(x, y+1, z+1);
+      rhos[4]=data(x+1, y, z);
+      rhos[5]=data(x+1, y, z+1);
+      rhos[6]=data(x+1, y+1, z);
+      rhos[7]=data(x+1, y+1, z+1);
+    }
+
   template<class T>
     void Volume<T>::preprocess(const PreprocessContext& context)
     {
@@ -566,7 +740,6 @@ namespace Manta
     }
 
 
-#define RAY_TERMINATION_THRESHOLD 0.9
   template<class T>
     void Volume<T>::isect(const int depth, double t_sample,
                           const double dtdx, const double dtdy, const double dtdz,
@@ -580,8 +753,6 @@ namespace Manta
       int cy=_ysize[depth];
       int cz=_zsize[depth];
 
-      GridArray3<T>& data = *_data;
-
       if(depth==0){
         int nx = _nx;
         int ny = _ny;
@@ -596,14 +767,7 @@ namespace Manta
           // If we have valid samples
           if(gx<nx-1 && gy<ny-1 && gz<nz-1){
             float rhos[8];
-            rhos[0]=data(gx, gy, gz);
-            rhos[1]=data(gx, gy, gz+1);
-            rhos[2]=data(gx, gy+1, gz);
-            rhos[3]=data(gx, gy+1, gz+1);
-            rhos[4]=data(gx+1, gy, gz);
-            rhos[5]=data(gx+1, gy, gz+1);
-            rhos[6]=data(gx+1, gy+1, gz);
-            rhos[7]=data(gx+1, gy+1, gz+1);
+            getCell(gx, gy, gz, rhos);
 
             ////////////////////////////////////////////////////////////
             // get the weights
@@ -846,18 +1010,336 @@ namespace Manta
       }
     }
 
-#define RAY_TERMINATION 0.98
+  template<class T>
+    void Volume<T>::marchRay(const Ray& ray, Real t_min, Real t_max,
+                             Color& total, float& alpha) const
+    {
+      Real t_inc = _stepSize;
+
+      const Vector dir(ray.direction());
+      const Vector orig(ray.origin());
+      int dix_dx;
+      int ddx;
+      if(dir.x() >= 0){
+        dix_dx=1;
+        ddx=1;
+      } else {
+        dix_dx=-1;
+        ddx=0;
+      }
+      int diy_dy;
+      int ddy;
+      if(dir.y() >= 0){
+        diy_dy=1;
+        ddy=1;
+      } else {
+        diy_dy=-1;
+        ddy=0;
+      }
+      int diz_dz;
+      int ddz;
+      if(dir.z() >= 0){
+        diz_dz=1;
+        ddz=1;
+      } else {
+        diz_dz=-1;
+        ddz=0;
+      }
+
+      Vector start_p(orig+dir*t_min);
+      Vector s((start_p-_bounds.getMin())*_ihierdiag);
+      int cx=_xsize[_depth-1];
+      int cy=_ysize[_depth-1];
+      int cz=_zsize[_depth-1];
+      int ix=(int)(s.x()*cx);
+      int iy=(int)(s.y()*cy);
+      int iz=(int)(s.z()*cz);
+      if(ix>=cx)
+        ix--;
+      if(iy>=cy)
+        iy--;
+      if(iz>=cz)
+        iz--;
+      if(ix<0)
+        ix++;
+      if(iy<0)
+        iy++;
+      if(iz<0)
+        iz++;
+
+
+      double next_x, next_y, next_z;
+      double dtdx, dtdy, dtdz;
+
+      double icx=_ixsize[_depth-1];
+      double x=_bounds.getMin().x()+_hierdiag.x()*double(ix+ddx)*icx;
+      double xinv_dir=1./dir.x();
+      next_x=Abs((x-orig.x())*xinv_dir); //take Abs so we don't get -inf
+      dtdx=dix_dx*_hierdiag.x()*icx*xinv_dir; //this is +inf when dir.x == 0
+
+      double icy=_iysize[_depth-1];
+      double y=_bounds.getMin().y()+_hierdiag.y()*double(iy+ddy)*icy;
+      double yinv_dir=1./dir.y();
+      next_y=Abs((y-orig.y())*yinv_dir);
+      dtdy=diy_dy*_hierdiag.y()*icy*yinv_dir;
+
+      double icz=_izsize[_depth-1];
+      double z=_bounds.getMin().z()+_hierdiag.z()*double(iz+ddz)*icz;
+      double zinv_dir=1./dir.z();
+      next_z=Abs((z-orig.z())*zinv_dir);
+      dtdz=diz_dz*_hierdiag.z()*icz*zinv_dir;
+
+      Vector cellsize(cx,cy,cz);
+      // cellcorner and celldir can be used to get the location in terms
+      // of the metacell in index space.
+      //
+      // For example if you wanted to get the location at time t (world
+      // space units) in terms of indexspace you would do the following
+      // computation:
+      //
+      // Vector pos = cellcorner + celldir * t + Vector(startx, starty, startz);
+      //
+      // If you wanted to get how far you are inside a given cell you
+      // could use the following code:
+      //
+      // Vector weights = cellcorner + celldir * t - Vector(ix, iy, iz);
+      Vector cellcorner((orig-_bounds.getMin())*_ihierdiag*cellsize);
+      Vector celldir(dir*_ihierdiag*cellsize);
+
+      HVIsectContext isctx;
+      isctx.total = total;
+      isctx.alpha = alpha;
+      isctx.dix_dx = dix_dx;
+      isctx.diy_dy = diy_dy;
+      isctx.diz_dz = diz_dz;
+      isctx.transfunct.course_hash = _colorMap->course_hash;
+      isctx.t_inc = t_inc;
+      isctx.t_min = t_min;
+      isctx.t_max = t_max;
+      isctx.t_inc_inv = 1/isctx.t_inc;
+      isctx.ray = ray;
+
+      isect(_depth-1, t_min, dtdx, dtdy, dtdz, next_x, next_y, next_z,
+            ix, iy, iz, 0, 0, 0,
+            cellcorner, celldir,
+            isctx);
+
+      alpha = isctx.alpha;
+      total = isctx.total;
+    }
+
+  template<class T>
+    void Volume<T>::marchRays(const RayPacket& rays, int begin, int end,
+                              const Real* tMins, const Real* tMaxs,
+                              Color* totals, float* alphas) const
+    {
+#ifdef MANTA_SSE
+      // The in-core voxels are read straight from the grid.
+      const GridArray3<T>* data = _data;
+      int xstride = 0, ystride = 0, zstride = 0;
+      if(data){
+        xstride = data->getIndex(1,0,0) - data->getIndex(0,0,0);
+        ystride = data->getIndex(0,1,0) - data->getIndex(0,0,0);
+        zstride = data->getIndex(0,0,1) - data->getIndex(0,0,0);
+      }
+      const int msize = _mcSize;
+      VMCell transfunct;
+      transfunct.course_hash = _colorMap->course_hash;
+
+      // The rays are marched in voxel space, where voxel (x,y,z) is at
+      // (x,y,z) and t still has the units of the rays.
+      const Vector bmin = _bounds.getMin();
+      const Vector toVoxel = Vector(1,1,1)/_sdiag;
+      const float t_inc = _stepSize;
+      const sse_t threshold4 = set4(RAY_TERMINATION_THRESHOLD);
+      const sse_t minContribution4 = set4(0.001f);
+      const sse_t one4 = set4(1.f);
+      const sse_t lastx4 = set4(_nx-1);
+      const sse_t lasty4 = set4(_ny-1);
+      const sse_t lastz4 = set4(_nz-1);
+      const sse_t dataMin4 = set4(_dataMin);
+      const sse_t colorScalar4 = set4(_colorScalar);
+
+      for(int first = begin; first < end; first += 4){
+        const int count = Min(4, end-first);
+        MANTA_ALIGN(16) float ox[4], oy[4], oz[4];
+        MANTA_ALIGN(16) float dx[4], dy[4], dz[4];
+        MANTA_ALIGN(16) float t_start[4], t[4], t_end[4];
+        MANTA_ALIGN(16) float r[4], g[4], b[4], a[4];
+        for(int k = 0; k < 4; k++){
+          if(k < count){
+            const int i = first+k;
+            const Vector o((rays.getOrigin(i)-bmin)*toVoxel);
+            const Vector d(rays.getDirection(i)*toVoxel);
+            ox[k] = o.x(); oy[k] = o.y(); oz[k] = o.z();
+            dx[k] = d.x(); dy[k] = d.y(); dz[k] = d.z();
+            t_start[k] = t[k] = tMins[i];
+            t_end[k] = tMaxs[i];
+            r[k] = totals[i][0];
+            g[k] = totals[i][1];
+            b[k] = totals[i][2];
+            a[k] = alphas[i];
+          } else {
+            ox[k] = oy[k] = oz[k] = dx[k] = dy[k] = dz[k] = 0;
+            t_start[k] = t[k] = 0;
+            t_end[k] = -1;
+            r[k] = g[k] = b[k] = a[k] = 0;
+          }
+        }
+        const sse_t ox4 = load44(ox), oy4 = load44(oy), oz4 = load44(oz);
+        const sse_t dx4 = load44(dx), dy4 = load44(dy), dz4 = load44(dz);
+        const sse_t t_end4 = load44(t_end);
+        sse_t r4 = load44(r), g4 = load44(g), b4 = load44(b);
+        sse_t alpha4 = load44(a);
+
+        for(;;){
+          const sse_t t4 = load44(t);
+          const int active = getmask4(and4(cmp4_lt(t4, t_end4),
+                                           cmp4_lt(alpha4, threshold4)));
+          if(!active)
+            break;
+
+          const sse_t px = add4(ox4, mul4(dx4, t4));
+          const sse_t py = add4(oy4, mul4(dy4, t4));
+          const sse_t pz = add4(oz4, mul4(dz4, t4));
+          const sse_t fx = floorSSE(px);
+          const sse_t fy = floorSSE(py);
+          const sse_t fz = floorSSE(pz);
+          // Only samples with all eight neighbors inside the data count.
+          const sse_t inside =
+            and4(and4(and4(cmp4_ge(fx, zero4()), cmp4_lt(fx, lastx4)),
+                      and4(cmp4_ge(fy, zero4()), cmp4_lt(fy, lasty4))),
+                 and4(cmp4_ge(fz, zero4()), cmp4_lt(fz, lastz4)));
+          int sampled = active & getmask4(inside);
+
+          MANTA_ALIGN(16) float cellx[4], celly[4], cellz[4];
+          store44(cellx, fx);
+          store44(celly, fy);
+          store44(cellz, fz);
+          MANTA_ALIGN(16) float rhos[8][4];
+          for(int k = 0; k < 4; k++){
+            if(!(active & (1<<k)))
+              continue;
+            if(!(sampled & (1<<k))){
+              t[k] += t_inc;
+              continue;
+            }
+            const int ix = (int)cellx[k];
+            const int iy = (int)celly[k];
+            const int iz = (int)cellz[k];
+            const int mx = ix/msize;
+            const int my = iy/msize;
+            const int mz = iz/msize;
+            VMCell cell = _mcGrid(mx, my, mz);
+            if(!(cell & transfunct)){
+              // Nothing in this macrocell is visible, so go on with the
+              // first sample past it.
+              float t_exit = t_end[k];
+              if(dx[k] > 0)
+                t_exit = Min(t_exit, ((mx+1)*msize-ox[k])/dx[k]);
+              else if(dx[k] < 0)
+                t_exit = Min(t_exit, (mx*msize-ox[k])/dx[k]);
+              if(dy[k] > 0)
+                t_exit = Min(t_exit, ((my+1)*msize-oy[k])/dy[k]);
+              else if(dy[k] < 0)
+                t_exit = Min(t_exit, (my*msize-oy[k])/dy[k]);
+              if(dz[k] > 0)
+                t_exit = Min(t_exit, ((mz+1)*msize-oz[k])/dz[k]);
+              else if(dz[k] < 0)
+                t_exit = Min(t_exit, (mz*msize-oz[k])/dz[k]);
+              float next = t_start[k] + ceilf((t_exit-t_start[k])/t_inc)*t_inc;
+              t[k] = next > t[k] ? next : t[k]+t_inc;
+              sampled &= ~(1<<k);
+              continue;
+            }
+            if(!data){
+              float corners[8];
+              _bricks->getCell(ix, iy, iz, corners);
+              for(int j = 0; j < 8; j++)
+                rhos[j][k] = corners[j];
+              t[k] += t_inc;
+              continue;
+            }
+            const T* p = &(*data)[data->getIndex(ix, iy, iz)];
+            rhos[0][k] = p[0];
+            rhos[1][k] = p[zstride];
+            rhos[2][k] = p[ystride];
+            rhos[3][k] = p[ystride+zstride];
+            rhos[4][k] = p[xstride];
+            rhos[5][k] = p[xstride+zstride];
+            rhos[6][k] = p[xstride+ystride];
+            rhos[7][k] = p[xstride+ystride+zstride];
+            t[k] += t_inc;
+          }
+          if(!sampled)
+            continue;
+          for(int k = 0; k < 4; k++){
+            if(!(sampled & (1<<k)))
+              for(int j = 0; j < 8; j++)
+                rhos[j][k] = 0;
+          }
+
+          // Trilinear interpolation, four samples at a time.
+          const sse_t wx = sub4(px, fx);
+          const sse_t wy = sub4(py, fy);
+          const sse_t wz = sub4(pz, fz);
+          const sse_t lz1 = lerp4(wz, load44(rhos[0]), load44(rhos[1]));
+          const sse_t lz2 = lerp4(wz, load44(rhos[2]), load44(rhos[3]));
+          const sse_t lz3 = lerp4(wz, load44(rhos[4]), load44(rhos[5]));
+          const sse_t lz4 = lerp4(wz, load44(rhos[6]), load44(rhos[7]));
+          const sse_t ly1 = lerp4(wy, lz1, lz2);
+          const sse_t ly2 = lerp4(wy, lz3, lz4);
+          const sse_t value4 = mul4(sub4(lerp4(wx, ly1, ly2), dataMin4),
+                                    colorScalar4);
+
+          MANTA_ALIGN(16) float value[4];
+          MANTA_ALIGN(16) float cr[4], cg[4], cb[4], ca[4];
+          store44(value, value4);
+          for(int k = 0; k < 4; k++){
+            if(sampled & (1<<k)){
+              RGBAColor color = _colorMap->GetColor(value[k]);
+              cr[k] = color.color[0];
+              cg[k] = color.color[1];
+              cb[k] = color.color[2];
+              ca[k] = color.a;
+            } else {
+              cr[k] = cg[k] = cb[k] = ca[k] = 0;
+            }
+          }
+
+          // Front to back compositing.
+          sse_t alpha_factor = mul4(load44(ca), sub4(one4, alpha4));
+          alpha_factor = and4(alpha_factor,
+                              cmp4_gt(alpha_factor, minContribution4));
+          r4 = add4(r4, mul4(load44(cr), alpha_factor));
+          g4 = add4(g4, mul4(load44(cg), alpha_factor));
+          b4 = add4(b4, mul4(load44(cb), alpha_factor));
+          alpha4 = add4(alpha4, alpha_factor);
+        }
+
+        store44(r, r4);
+        store44(g, g4);
+        store44(b, b4);
+        store44(a, alpha4);
+        for(int k = 0; k < count; k++){
+          totals[first+k] = Color(RGB(r[k], g[k], b[k]));
+          alphas[first+k] = a[k];
+        }
+      }
+#else
+      for(int i = begin; i < end; i++)
+        marchRay(rays.getRay(i), tMins[i], tMaxs[i], totals[i], alphas[i]);
+#endif
+    }
+
   template<class T>
     void Volume<T>::shade(const RenderContext & context, RayPacket& rays) const
     {
       rays.normalizeDirections();
       rays.computeHitPositions();
 
-
-      Real t_inc = _stepSize;
-
-      RayPacketData rpData1;
-      RayPacket lRays1(rpData1, RayPacket::UnknownShape, rays.begin(), rays.end(), rays.getDepth()+1,
+      ScopedRayPacketData rpData1(context);
+      RayPacket lRays1(*rpData1, RayPacket::UnknownShape, rays.begin(), rays.end(), rays.getDepth()+1,
                        RayPacket::NormalizedDirections);
       Real tMins[rays.end()]; //rays.ray start of volume
       Real tMaxs[rays.end()]; //rays.ray end of volume or hit something in volume
@@ -910,122 +1392,7 @@ namespace Manta
         totals[i] = Color(RGB(0,0,0));
       }
 
-      for(int rayIndex = rays.begin(); rayIndex < rays.end(); rayIndex++) {
-        Ray ray = rays.getRay(rayIndex);
-        Real t_min = tMins[rayIndex];
-        Real t_max = tMaxs[rayIndex];
-
-        const Vector dir(ray.direction());
-        const Vector orig(ray.origin());
-        int dix_dx;
-        int ddx;
-        if(dir.x() >= 0){
-          dix_dx=1;
-          ddx=1;
-        } else {
-          dix_dx=-1;
-          ddx=0;
-        }
-        int diy_dy;
-        int ddy;
-        if(dir.y() >= 0){
-          diy_dy=1;
-          ddy=1;
-        } else {
-          diy_dy=-1;
-          ddy=0;
-        }
-        int diz_dz;
-        int ddz;
-        if(dir.z() >= 0){
-          diz_dz=1;
-          ddz=1;
-        } else {
-          diz_dz=-1;
-          ddz=0;
-        }
-
-        Vector start_p(orig+dir*t_min);
-        Vector s((start_p-_bounds.getMin())*_ihierdiag);
-        int cx=_xsize[_depth-1];
-        int cy=_ysize[_depth-1];
-        int cz=_zsize[_depth-1];
-        int ix=(int)(s.x()*cx);
-        int iy=(int)(s.y()*cy);
-        int iz=(int)(s.z()*cz);
-        if(ix>=cx)
-          ix--;
-        if(iy>=cy)
-          iy--;
-        if(iz>=cz)
-          iz--;
-        if(ix<0)
-          ix++;
-        if(iy<0)
-          iy++;
-        if(iz<0)
-          iz++;
-
-
-        double next_x, next_y, next_z;
-        double dtdx, dtdy, dtdz;
-
-        double icx=_ixsize[_depth-1];
-        double x=_bounds.getMin().x()+_hierdiag.x()*double(ix+ddx)*icx;
-        double xinv_dir=1./dir.x();
-        next_x=Abs((x-orig.x())*xinv_dir); //take Abs so we don't get -inf
-        dtdx=dix_dx*_hierdiag.x()*icx*xinv_dir; //this is +inf when dir.x == 0
-
-        double icy=_iysize[_depth-1];
-        double y=_bounds.getMin().y()+_hierdiag.y()*double(iy+ddy)*icy;
-        double yinv_dir=1./dir.y();
-        next_y=Abs((y-orig.y())*yinv_dir);
-        dtdy=diy_dy*_hierdiag.y()*icy*yinv_dir;
-
-        double icz=_izsize[_depth-1];
-        double z=_bounds.getMin().z()+_hierdiag.z()*double(iz+ddz)*icz;
-        double zinv_dir=1./dir.z();
-        next_z=Abs((z-orig.z())*zinv_dir);
-        dtdz=diz_dz*_hierdiag.z()*icz*zinv_dir;
-
-        Vector cellsize(cx,cy,cz);
-        // cellcorner and celldir can be used to get the location in terms
-        // of the metacell in index space.
-        //
-        // For example if you wanted to get the location at time t (world
-        // space units) in terms of indexspace you would do the following
-        // computation:
-        //
-        // Vector pos = cellcorner + celldir * t + Vector(startx, starty, startz);
-        //
-        // If you wanted to get how far you are inside a given cell you
-        // could use the following code:
-        //
-        // Vector weights = cellcorner + celldir * t - Vector(ix, iy, iz);
-        Vector cellcorner((orig-_bounds.getMin())*_ihierdiag*cellsize);
-        Vector celldir(dir*_ihierdiag*cellsize);
-
-        HVIsectContext isctx;
-        isctx.total = totals[rayIndex];
-        isctx.alpha = alphas[rayIndex];
-        isctx.dix_dx = dix_dx;
-        isctx.diy_dy = diy_dy;
-        isctx.diz_dz = diz_dz;
-        isctx.transfunct.course_hash = _colorMap->course_hash;
-        isctx.t_inc = t_inc;
-        isctx.t_min = t_min;
-        isctx.t_max = t_max;
-        isctx.t_inc_inv = 1/isctx.t_inc;
-        isctx.ray = ray;
-
-        isect(_depth-1, t_min, dtdx, dtdy, dtdz, next_x, next_y, next_z,
-              ix, iy, iz, 0, 0, 0,
-              cellcorner, celldir,
-              isctx);
-
-        alphas[rayIndex] = isctx.alpha;
-        totals[rayIndex] = isctx.total;
-      }
+      marchRays(rays, rays.begin(), rays.end(), tMins, tMaxs, totals, alphas);
       const bool depth = (rays.getDepth() < context.scene->getRenderParameters().maxDepth);
       int start = -1;
       for(int i = rays.begin(); i < rays.end(); i++) {
@@ -1085,23 +1452,25 @@ namespace Manta
     {
       float dataMin = _dataMin;
       float dataMax = _dataMax;
-      int nx = _data->getNx()-1;
-      int ny = _data->getNy()-1;
-      int nz = _data->getNz()-1;
+      int nx = _nx-1;
+      int ny = _ny-1;
+      int nz = _nz-1;
       float scale = (numBuckets-1)/(dataMax-dataMin);
       for(int i =0; i<numBuckets;i++)
         histValues[i] = 0;
       for(int ix=0;ix<nx;ix++){
         for(int iy=0;iy<ny;iy++){
           for(int iz=0;iz<nz;iz++){
-            float p000=(*_data)(ix,iy,iz);
-            float p001=(*_data)(ix,iy,iz+1);
-            float p010=(*_data)(ix,iy+1,iz);
-            float p011=(*_data)(ix,iy+1,iz+1);
-            float p100=(*_data)(ix+1,iy,iz);
-            float p101=(*_data)(ix+1,iy,iz+1);
-            float p110=(*_data)(ix+1,iy+1,iz);
-            float p111=(*_data)(ix+1,iy+1,iz+1);
+            float rhos[8];
+            getCell(ix, iy, iz, rhos);
+            float p000=rhos[0];
+            float p001=rhos[1];
+            float p010=rhos[2];
+            float p011=rhos[3];
+            float p100=rhos[4];
+            float p101=rhos[5];
+            float p110=rhos[6];
+            float p111=rhos[7];
             float min=std::min(std::min(std::min(p000, p001), std::min(p010, p011)), std::min(std::min(p100, p101), std::min(p110, p111)));
             float max=std::max(std::max(std::max(p000, p001), std::max(p010, p011)), std::max(std::max(p100, p101), std::max(p110, p111)));
             int nmin=(int)((min-dataMin)*scale);
@@ -1121,13 +1490,47 @@ namespace Manta
   template<class T>
     void Volume<T>::attenuateShadows(const RenderContext& context, RayPacket& shadowRays) const
     {
+      shadowRays.normalizeDirections();
+      shadowRays.computeInverseDirections();
+      shadowRays.computeSigns();
 
+      Real tMins[RayPacket::MaxSize];
+      Real tMaxs[RayPacket::MaxSize];
+      float alphas[RayPacket::MaxSize];
+      Color totals[RayPacket::MaxSize];
+      for(int i = shadowRays.begin(); i < shadowRays.end(); i++) {
+        Real tmin, tmax;
+        tMins[i] = 0;
+        tMaxs[i] = -1;
+        if (intersectAaBox( _bounds, tmin, tmax, shadowRays.getRay(i),
+                            shadowRays.getSigns(i),
+                            shadowRays.getInverseDirection(i))) {
+          // Only the part of the volume in front of the light (or
+          // whatever else the shadow ray was cast to) attenuates it.
+          tMins[i] = Max(tmin, (Real)0);
+          tMaxs[i] = Min(tmax, shadowRays.scratchpad<Real>(i));
+        }
+        totals[i] = Color::black();
+        alphas[i] = 0;
+      }
+      marchRays(shadowRays, shadowRays.begin(), shadowRays.end(),
+                tMins, tMaxs, totals, alphas);
+
+      for(int i = shadowRays.begin(); i < shadowRays.end(); i++) {
+        shadowRays.setColor(i, shadowRays.getColor(i)*(1-alphas[i]));
+        // The whole volume has been accounted for, so the shadow ray
+        // goes on from where it leaves the volume.
+        if (tMaxs[i] > shadowRays.getMinT(i))
+          shadowRays.overrideMinT(i, tMaxs[i]);
+      }
     }
 
   template<class T>
     float Volume<T>::getValue(int x, int y, int z)
     {
-      return _data(x, y, z);
+      if(_bricks)
+        return (*_bricks)(x, y, z);
+      return (*_data)(x, y, z);
     }
 }//namespace manta
 
@@ -1,5 +1,6 @@
 
 #include <Interface/Context.h>
+#include <Interface/RayPacketArena.h>
 #include <Model/MiscObjects/CuttingPlane.h>
 #include <Model/Intersections/AxisAlignedBox.h>
 #include <Model/Intersections/Plane.h>
@@ -43,8 +44,8 @@ void CuttingPlane::preprocess( const PreprocessContext &context )
 void CuttingPlane::intersect(const RenderContext& context, RayPacket& rays) const {
 
   // Send a new ray packet with new ray origins.
-  RayPacketData new_data;
-  RayPacket     new_rays( new_data, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData new_data(context);
+  RayPacket     new_rays( *new_data, RayPacket::UnknownShape, rays.begin(), rays.end(),
                           rays.getDepth(), rays.getAllFlags());
 
   rays.normalizeDirections();
@@ -1,6 +1,7 @@
 
 #include <Model/MiscObjects/Difference.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Core/Exceptions/InternalError.h>
 
 using namespace Manta;
@@ -28,11 +29,11 @@ void Difference::computeBounds(const PreprocessContext& context, BBox& bbox) con
 
 void Difference::intersect(const RenderContext& context, RayPacket& rays) const
 {
-  RayPacketData raydata1;
-  RayPacket object1_rays(raydata1, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData raydata1(context);
+  RayPacket object1_rays(*raydata1, RayPacket::UnknownShape, rays.begin(), rays.end(),
                          rays.getDepth(), rays.getAllFlags());
-  RayPacketData raydata2;
-  RayPacket object2_rays(raydata2, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData raydata2(context);
+  RayPacket object2_rays(*raydata2, RayPacket::UnknownShape, rays.begin(), rays.end(),
                          rays.getDepth(), rays.getAllFlags());
 
   for(int i = rays.begin();i<rays.end();i++){
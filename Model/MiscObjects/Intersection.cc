@@ -1,6 +1,7 @@
 
 #include <Model/MiscObjects/Intersection.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Core/Geometry/BBox.h>
 
 using namespace Manta;
@@ -32,11 +33,11 @@ void Intersection::computeBounds(const PreprocessContext& context, BBox& bbox) c
 
 void Intersection::intersect(const RenderContext& context, RayPacket& rays) const
 {
-  RayPacketData raydata1;
-  RayPacket object1_rays(raydata1, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData raydata1(context);
+  RayPacket object1_rays(*raydata1, RayPacket::UnknownShape, rays.begin(), rays.end(),
                          rays.getDepth(), rays.getAllFlags());
-  RayPacketData raydata2;
-  RayPacket object2_rays(raydata2, RayPacket::UnknownShape, rays.begin(), rays.end(),
+  ScopedRayPacketData raydata2(context);
+  RayPacket object2_rays(*raydata2, RayPacket::UnknownShape, rays.begin(), rays.end(),
                          rays.getDepth(), rays.getAllFlags());
 
   for(int i = rays.begin();i<rays.end();i++){
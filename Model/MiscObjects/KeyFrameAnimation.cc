@@ -1,4 +1,5 @@
 #include <Model/MiscObjects/KeyFrameAnimation.h>
+#include <Model/MiscObjects/TimeStepStreamer.h>
 #include <Interface/Context.h>
 #include <Interface/MantaInterface.h>
 #include <Core/Thread/Time.h>
@@ -14,7 +15,8 @@ using namespace std;
 KeyFrameAnimation::KeyFrameAnimation(InterpolationMode interpolation) :
   as(NULL), interpolation(interpolation), spareGroup(NULL),
   currGroup(NULL), currTime(-1), updateToCurrTime(false),
-  paused(false), barrier("keyframe animation barrier"), duration(1),
+  paused(false), barrier("keyframe animation barrier"),
+  streamer(NULL), currStep(NULL), duration(1),
   lockedFrames(false), startFrame(0), endFrame(0), numFrames(0),
   framesClipped(false),
   loop(true), repeatLastFrame(0.0), repeating(false), forceUpdate(false)
@@ -24,6 +26,7 @@ KeyFrameAnimation::KeyFrameAnimation(InterpolationMode interpolation) :
 KeyFrameAnimation::~KeyFrameAnimation()
 {
   delete spareGroup;
+  delete streamer;
 }
 
 void KeyFrameAnimation::push_back(Group *objects)
@@ -42,8 +45,44 @@ void KeyFrameAnimation::push_back(Group *objects)
   }
 }
 
+void KeyFrameAnimation::useStreamer(TimeStepStreamer* newStreamer)
+{
+  streamer = newStreamer;
+  interpolation = truncate;
+  startFrame = 0;
+  endFrame = streamer->size() - 1;
+  numFrames = streamer->size();
+  framesClipped = false;
+  updatePlaybackRate();
+}
+
+void KeyFrameAnimation::setDuration(float time)
+{
+  duration = time;
+  updatePlaybackRate();
+}
+
+int KeyFrameAnimation::getNumKeyFrames() const
+{
+  return streamer ? streamer->size() : frames.size();
+}
+
+void KeyFrameAnimation::updatePlaybackRate()
+{
+  if (!streamer)
+    return;
+  //locked frames are played as fast as they can be rendered, which the
+  //streamer measures itself.
+  if (lockedFrames || interpolation == fixed || duration <= 0)
+    streamer->setPlaybackRate(0);
+  else
+    streamer->setPlaybackRate(numFrames/duration);
+}
+
 void KeyFrameAnimation::setInterpolation(InterpolationMode mode)
 {
+  if (streamer)
+    return;
   if (mode != truncate) {
     if (spareGroup == NULL && !frames.empty())
       spareGroup = frames[0]->clone(shallow);
@@ -92,13 +131,16 @@ void KeyFrameAnimation::resumeAnimation()
 
 void KeyFrameAnimation::update(Temp_Callback context)
 {
-  if (frames.empty())
+  if (getNumKeyFrames() == 0)
         return;
   if (context.proc == 0) {
       if (forceUpdate)
       {
         forceUpdate = false;
-        currGroup = frames[startFrame];
+        if (streamer)
+          currStep = streamer->get(startFrame);
+        else
+          currGroup = frames[startFrame];
       }
     }
 
@@ -210,10 +252,15 @@ void KeyFrameAnimation::update(Temp_Callback context)
     else if (interpolation == truncate) {
       // NOTE(boulos): Only proc 0 should change the currGroup pointer
       if (context.proc == 0) {
-        currGroup = frames[(int) frame+startFrame];
-        // TODO(boulos): Who should check for identical pointers?
-        if (as)
-          as->setGroup(currGroup);
+        if (streamer) {
+          //waits (and reports the wait) if the timestep is not loaded yet.
+          currStep = streamer->get((int) frame+startFrame);
+        } else {
+          currGroup = frames[(int) frame+startFrame];
+          // TODO(boulos): Who should check for identical pointers?
+          if (as)
+            as->setGroup(currGroup);
+        }
       }
       //make sure the as->setGroup has occured before all the threads
       //go do an update.
@@ -221,7 +268,8 @@ void KeyFrameAnimation::update(Temp_Callback context)
 
     }
 
-    if (as)
+    //streamed timesteps come with their acceleration structures built.
+    if (as && !streamer)
       as->rebuild(context.proc, context.numProcs);
   }
 }
@@ -230,11 +278,12 @@ void KeyFrameAnimation::update(Temp_Callback context)
 void KeyFrameAnimation::lockFrames(bool st)
 {
     lockedFrames = st;
+    updatePlaybackRate();
 }
 
 void KeyFrameAnimation::clipFrames(int start, int end)
 {
-    if (start < 0 || end >= int(frames.size()) || end < start)
+    if (start < 0 || end >= getNumKeyFrames() || end < start)
     {
         cerr << "clipFrames out of bounds\n";
         return;
@@ -244,6 +293,7 @@ void KeyFrameAnimation::clipFrames(int start, int end)
     numFrames = end - start + 1;
     framesClipped = true;
     forceUpdate = true;
+    updatePlaybackRate();
 }
 
 void KeyFrameAnimation::repeatLastFrameForSeconds(float time)
@@ -277,7 +327,7 @@ bool KeyFrameAnimation::setTime(float time)
 {
   updateToCurrTime = true;
 
-  if (frames.empty())
+  if (getNumKeyFrames() == 0)
     return true;
 
   differentFrame = isDifferentFrame(time);
@@ -292,7 +342,7 @@ bool KeyFrameAnimation::setTime(float time)
 
 bool KeyFrameAnimation::isDifferentFrame(float time) const
 {
-  if (currGroup == NULL) return true;
+  if (currGroup == NULL && currStep == NULL) return true;
 
   time = wrapTime(time);
 
@@ -321,7 +371,11 @@ void KeyFrameAnimation::temporaryUpdate(int proc, int numProcs, bool &changed)
 
 void KeyFrameAnimation::intersect(const RenderContext& context, RayPacket& rays) const
 {
-  if (as)
+  if (streamer) {
+    if (currStep)
+      currStep->intersect(context, rays);
+  }
+  else if (as)
     as->intersect(context, rays);
   else if (currGroup)
     currGroup->intersect(context, rays);
@@ -338,6 +392,12 @@ void KeyFrameAnimation::preprocess(const PreprocessContext& context)
   if (as)
     as->preprocess(context);
 
+  //the streamer preprocesses the timesteps as it loads them.
+  if (streamer && context.proc == 0) {
+    streamer->start(context);
+    currStep = streamer->get(startFrame);
+  }
+
   if (context.isInitialized() && context.proc == 0) {
     context.manta_interface->registerParallelAnimationCallback
       (Callback::create(this, &KeyFrameAnimation::temporaryUpdate));
@@ -348,7 +408,9 @@ void KeyFrameAnimation::preprocess(const PreprocessContext& context)
 
 void KeyFrameAnimation::computeBounds(const PreprocessContext& context, BBox& bbox) const
 {
-  if (currGroup)
+  if (currStep)
+    currStep->computeBounds(context, bbox);
+  else if (currGroup)
     currGroup->computeBounds(context, bbox);
   else if (!frames.empty())
     frames[0]->computeBounds(context, bbox);
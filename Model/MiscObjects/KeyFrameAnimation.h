@@ -6,6 +6,8 @@
 #include <Core/Thread/Barrier.h>
 
 namespace Manta {
+  class TimeStepStreamer;
+
   struct Temp_Callback {int proc, numProcs;
     float time;};//temporary so I can get code to compile
 
@@ -19,8 +21,16 @@ namespace Manta {
     //add a keyframe
     void push_back(Group *objects);
 
+    //play the timesteps of a streamer instead of the added keyframes, so
+    //that only a window of them is in memory.  Each timestep is an
+    //object that is ready to render (the loader builds its acceleration
+    //structure), so the animation is truncated rather than interpolated.
+    //The animation owns the streamer.
+    void useStreamer(TimeStepStreamer* streamer);
+    TimeStepStreamer* getStreamer() const { return streamer; }
+
     //number of seconds the animation takes from start to end
-    void setDuration(float time) { duration = time; };
+    void setDuration(float time);
     float getDuration() const { return duration; }
 
     void startAnimation();
@@ -73,6 +83,9 @@ namespace Manta {
   private:
 
     float wrapTime(float time) const;
+    int getNumKeyFrames() const;
+    //tells the streamer how fast the timesteps are played.
+    void updatePlaybackRate();
 
     InterpolationMode interpolation;
 
@@ -95,6 +108,8 @@ namespace Manta {
     bool differentFrame; //used by setTime()
 
     vector<Group*> frames;
+    TimeStepStreamer* streamer;
+    Object* currStep;   //the streamed timestep for the current frame
     float duration; //how many seconds long
 
     bool lockedFrames; // make sure that no frames are skipped when setting time, each frame will be shown at least once
@@ -0,0 +1,284 @@
+#include <Model/MiscObjects/TimeStepStreamer.h>
+#include <Core/Exceptions/IllegalValue.h>
+#include <Core/Exceptions/InternalError.h>
+#include <Core/Math/MinMax.h>
+#include <Core/Thread/Runnable.h>
+#include <Core/Thread/Thread.h>
+#include <Core/Thread/Time.h>
+#include <Core/Util/Callback.h>
+#include <Interface/Context.h>
+#include <Interface/Object.h>
+
+#include <iostream>
+#include <math.h>
+
+using namespace Manta;
+using namespace std;
+
+void TimeStepStreamer::Loader::unload(int, Object* object)
+{
+  delete object;
+}
+
+TimeStepStreamer::TimeStepStreamer(Loader* loader, int numSteps, int window)
+  : loader(loader), numSteps(numSteps), window(Max(window, 3)),
+    context(0), thread(0),
+    lock("TimeStepStreamer lock"),
+    loadedSignal("TimeStepStreamer loaded"),
+    wantedSignal("TimeStepStreamer wanted"),
+    steps(numSteps, static_cast<Object*>(0)), loading(numSteps, 0),
+    resident(0), current(-1), previous(-1), direction(1),
+    restarting(false), quit(false),
+    playbackRate(0), measuredRate(0), lastStepTime(0),
+    averageLoadSeconds(0), reportWaits(true),
+    loads(0), unloads(0), waits(0), waitSeconds(0), maxWaitSeconds(0)
+{
+  if (numSteps <= 0)
+    throw IllegalValue<int>("TimeStepStreamer needs at least one timestep",
+                            numSteps);
+}
+
+TimeStepStreamer::~TimeStepStreamer()
+{
+  lock.lock();
+  quit = true;
+  wantedSignal.conditionBroadcast();
+  lock.unlock();
+  if (thread)
+    thread->join();
+
+  for (int i = 0; i < numSteps; ++i)
+    if (steps[i])
+      loader->unload(i, steps[i]);
+  delete loader;
+  delete context;
+}
+
+void TimeStepStreamer::start(const PreprocessContext& preprocessContext)
+{
+  if (!thread) {
+    context = new PreprocessContext(preprocessContext);
+    context->proc = 0;
+    context->numProcs = 1;
+    thread = new Thread(new RunnableCallback
+                        (Callback::create(this,
+                                          &TimeStepStreamer::streamingThread)),
+                        "TimeStepStreamer");
+    return;
+  }
+
+  // Only this thread changes the context, so it can be read unlocked.
+  if (context->isInitialized() || !preprocessContext.isInitialized())
+    return;
+
+  // Let the load in progress finish with the old context, then
+  // preprocess what has been loaded with the new one.
+  lock.lock();
+  restarting = true;
+  while (isLoading())
+    loadedSignal.wait(lock);
+  delete context;
+  context = new PreprocessContext(preprocessContext);
+  context->proc = 0;
+  context->numProcs = 1;
+  for (int i = 0; i < numSteps; ++i)
+    if (steps[i])
+      steps[i]->preprocess(*context);
+  restarting = false;
+  wantedSignal.conditionSignal();
+  lock.unlock();
+}
+
+Object* TimeStepStreamer::get(int step, int newDirection)
+{
+  if (!thread)
+    throw InternalError("TimeStepStreamer::get called before start");
+
+  step = (step%numSteps + numSteps)%numSteps;
+  lock.lock();
+  if (step != current) {
+    // Measure the playback rate from how often the timestep changes.
+    const double now = Time::currentSeconds();
+    if (lastStepTime > 0 && now > lastStepTime) {
+      const double rate = 1/(now - lastStepTime);
+      measuredRate = measuredRate > 0 ? 0.75*measuredRate + 0.25*rate : rate;
+    }
+    lastStepTime = now;
+    previous = current;
+    current = step;
+  }
+  direction = newDirection < 0 ? -1 : 1;
+  wantedSignal.conditionSignal();
+
+  if (!steps[step]) {
+    const double start = Time::currentSeconds();
+    while (!steps[step])
+      loadedSignal.wait(lock);
+    const double seconds = Time::currentSeconds() - start;
+    waits++;
+    waitSeconds += seconds;
+    if (seconds > maxWaitSeconds)
+      maxWaitSeconds = seconds;
+    if (reportWaits)
+      cerr << "TimeStepStreamer: waited " << seconds
+           << " seconds for timestep " << step << '\n';
+  }
+  Object* object = steps[step];
+  lock.unlock();
+  return object;
+}
+
+void TimeStepStreamer::setPlaybackRate(double stepsPerSecond)
+{
+  lock.lock();
+  playbackRate = stepsPerSecond;
+  wantedSignal.conditionSignal();
+  lock.unlock();
+}
+
+bool TimeStepStreamer::isLoading() const
+{
+  for (int i = 0; i < numSteps; ++i)
+    if (loading[i])
+      return true;
+  return false;
+}
+
+int TimeStepStreamer::getPrefetch() const
+{
+  // Look ahead as many timesteps as are played while one is loaded, and
+  // one more so that the next load starts before the window runs out.
+  const double rate = playbackRate > 0 ? playbackRate : measuredRate;
+  int prefetch = 1;
+  if (rate > 0 && averageLoadSeconds > 0)
+    prefetch = static_cast<int>(ceil(rate*averageLoadSeconds)) + 1;
+  // The current and the previous timesteps take two places in the window.
+  return Max(1, Min(Min(prefetch, window-2), numSteps-1));
+}
+
+int TimeStepStreamer::findStepToLoad() const
+{
+  if (current < 0)
+    return -1;
+  const int prefetch = getPrefetch();
+  for (int i = 0; i <= prefetch; ++i) {
+    const int step = ((current + direction*i)%numSteps + numSteps)%numSteps;
+    if (!steps[step] && !loading[step])
+      return step;
+  }
+  return -1;
+}
+
+int TimeStepStreamer::findStepToUnload() const
+{
+  // Unload the timestep that will be played last, which is usually the
+  // one played longest ago.
+  const int prefetch = getPrefetch();
+  int best = -1;
+  int bestDistance = prefetch;
+  for (int step = 0; step < numSteps; ++step) {
+    if (!steps[step] || step == current || step == previous)
+      continue;
+    const int distance =
+      (((step - current)*direction)%numSteps + numSteps)%numSteps;
+    if (distance > bestDistance) {
+      best = step;
+      bestDistance = distance;
+    }
+  }
+  return best;
+}
+
+Object* TimeStepStreamer::loadStep(int step)
+{
+  Object* object = loader->load(step);
+  object->preprocess(*context);
+  return object;
+}
+
+void TimeStepStreamer::streamingThread()
+{
+  lock.lock();
+  while (!quit) {
+    if (restarting) {
+      wantedSignal.wait(lock);
+      continue;
+    }
+    const int step = findStepToLoad();
+    if (step < 0) {
+      wantedSignal.wait(lock);
+      continue;
+    }
+    if (resident >= window) {
+      const int victim = findStepToUnload();
+      if (victim < 0) {
+        wantedSignal.wait(lock);
+        continue;
+      }
+      Object* object = steps[victim];
+      steps[victim] = 0;
+      resident--;
+      unloads++;
+      lock.unlock();
+      loader->unload(victim, object);
+      lock.lock();
+      continue;
+    }
+
+    loading[step] = 1;
+    resident++;
+    lock.unlock();
+    const double start = Time::currentSeconds();
+    Object* object = loadStep(step);
+    const double seconds = Time::currentSeconds() - start;
+    lock.lock();
+    loading[step] = 0;
+    steps[step] = object;
+    loads++;
+    averageLoadSeconds = loads == 1 ? seconds :
+      0.75*averageLoadSeconds + 0.25*seconds;
+    loadedSignal.conditionBroadcast();
+  }
+  lock.unlock();
+}
+
+TimeStepStreamer::Statistics TimeStepStreamer::getStatistics() const
+{
+  Statistics stats;
+  lock.lock();
+  stats.loads = loads;
+  stats.unloads = unloads;
+  stats.waits = waits;
+  stats.waitSeconds = waitSeconds;
+  stats.maxWaitSeconds = maxWaitSeconds;
+  stats.loadSeconds = averageLoadSeconds;
+  stats.playbackRate = playbackRate > 0 ? playbackRate : measuredRate;
+  stats.prefetch = getPrefetch();
+  stats.resident = resident;
+  lock.unlock();
+  return stats;
+}
+
+void TimeStepStreamer::resetStatistics()
+{
+  lock.lock();
+  loads = 0;
+  unloads = 0;
+  waits = 0;
+  waitSeconds = 0;
+  maxWaitSeconds = 0;
+  lock.unlock();
+}
+
+void TimeStepStreamer::printStatistics(std::ostream& out) const
+{
+  const Statistics stats = getStatistics();
+  out << "TimeStepStreamer: " << stats.loads << " loads ("
+      << stats.loadSeconds << " seconds each), "
+      << stats.unloads << " unloads, "
+      << stats.resident << " of " << numSteps << " timesteps resident, "
+      << "looking " << stats.prefetch << " ahead at "
+      << stats.playbackRate << " timesteps per second, "
+      << stats.waits << " waits (" << stats.waitSeconds << " seconds, "
+      << stats.maxWaitSeconds << " longest)\n";
+}
@@ -0,0 +1,130 @@
+#ifndef Manta_Model_TimeStepStreamer_h
+#define Manta_Model_TimeStepStreamer_h
+
+#include <Core/Thread/ConditionVariable.h>
+#include <Core/Thread/Mutex.h>
+
+#include <iosfwd>
+#include <vector>
+
+namespace Manta {
+  class Object;
+  class PreprocessContext;
+  class Thread;
+
+  // Keeps a window of the timesteps of an animation in memory while the
+  // animation plays.  A background thread loads and preprocesses (which
+  // builds their acceleration structures) the timesteps that come after
+  // the one being rendered, and unloads the ones that have been played
+  // to keep no more than the window in memory.
+  //
+  // The thread looks far enough ahead to load the timesteps before they
+  // are needed at the rate they are played.  When a timestep is needed
+  // before it has been loaded the renderer waits for it, and the wait is
+  // reported.
+  class TimeStepStreamer {
+  public:
+    class Loader {
+    public:
+      virtual ~Loader() {}
+      // Returns the objects of a timestep.  They are preprocessed by the
+      // streamer.  This is called on the streaming thread.
+      virtual Object* load(int step) = 0;
+      // Frees the objects load returned.
+      virtual void unload(int step, Object* object);
+    };
+
+    // The streamer owns the loader.  At most window (at least 3)
+    // timesteps are kept in memory.
+    TimeStepStreamer(Loader* loader, int numSteps, int window = 4);
+    ~TimeStepStreamer();
+
+    int size() const { return numSteps; }
+    int getWindow() const { return window; }
+
+    // Starts the streaming thread.  The timesteps are preprocessed with
+    // a one processor copy of context.  Scenes often preprocess their
+    // objects with an empty context (to find their bounds) before the
+    // renderer does, so when start is called again with an initialized
+    // context after an empty one, the timesteps already loaded are
+    // preprocessed again with it.
+    void start(const PreprocessContext& context);
+
+    // Returns a timestep, waiting for it if it has not been loaded yet.
+    // It stays in memory until get has been called for two other
+    // timesteps, so the renderer can finish with it after moving on.
+    // The timesteps from step on in the given direction are loaded next.
+    // Only one thread at a time may call this.
+    Object* get(int step, int direction = 1);
+
+    // The rate the timesteps are played at, in timesteps per second.  0
+    // (the default) measures the rate from the calls to get.
+    void setPlaybackRate(double stepsPerSecond);
+
+    // Whether every wait for a timestep is printed to cerr (on by
+    // default).
+    void setReportWaits(bool report) { reportWaits = report; }
+
+    struct Statistics {
+      size_t loads;
+      size_t unloads;
+      size_t waits;          // Calls to get that had to wait
+      double waitSeconds;    // Time spent in those waits
+      double maxWaitSeconds;
+      double loadSeconds;    // Average time to load and preprocess a step
+      double playbackRate;   // Timesteps per second
+      int prefetch;          // Timesteps loaded ahead of the current one
+      int resident;
+    };
+    Statistics getStatistics() const;
+    void resetStatistics();
+    void printStatistics(std::ostream& out) const;
+
+  private:
+    TimeStepStreamer(const TimeStepStreamer&);
+    TimeStepStreamer& operator=(const TimeStepStreamer&);
+
+    void streamingThread();
+    Object* loadStep(int step);
+    // These expect the lock to be held.
+    bool isLoading() const;
+    int getPrefetch() const;
+    int findStepToLoad() const;
+    int findStepToUnload() const;
+
+    Loader* loader;
+    int numSteps;
+    int window;
+    PreprocessContext* context;
+    Thread* thread;
+
+    mutable Mutex lock;
+    // Signaled when a timestep has been loaded, and when the timesteps
+    // that are wanted change.
+    ConditionVariable loadedSignal;
+    ConditionVariable wantedSignal;
+    std::vector<Object*> steps;
+    std::vector<char> loading;
+    int resident;
+    int current;
+    int previous;
+    int direction;
+    // Set while start replaces the context; nothing is loaded meanwhile.
+    bool restarting;
+    bool quit;
+
+    double playbackRate;
+    double measuredRate;
+    double lastStepTime;
+    double averageLoadSeconds;
+    bool reportWaits;
+
+    size_t loads;
+    size_t unloads;
+    size_t waits;
+    double waitSeconds;
+    double maxWaitSeconds;
+  };
+}
+
+#endif
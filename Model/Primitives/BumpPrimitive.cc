@@ -1,5 +1,6 @@
 #include <Model/Primitives/BumpPrimitive.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Core/Geometry/BBox.h>
 #include <Core/Geometry/Vector.h>
 #include <Core/Math/Noise.h>
@@ -40,8 +41,8 @@ void BumpPrimitive::computeBounds(const PreprocessContext& context, BBox& bbox)
 void BumpPrimitive::intersect(const RenderContext& context, RayPacket& rays) const
 {
  	 
-	RayPacketData raydata;
-  	RayPacket object_rays(raydata, RayPacket::UnknownShape, rays.begin(), rays.end(), rays.getDepth(), rays.getAllFlags());
+	ScopedRayPacketData raydata(context);
+  	RayPacket object_rays(*raydata, RayPacket::UnknownShape, rays.begin(), rays.end(), rays.getDepth(), rays.getAllFlags());
 
   	for(int i = rays.begin();i<rays.end();i++){
     	object_rays.setRay(i, rays.getRay(i));
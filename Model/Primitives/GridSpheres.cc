@@ -8,6 +8,7 @@
 #include <Interface/Primitive.h>
 #include <Interface/Packet.h>
 #include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
 #include <Interface/AmbientLight.h>
 #include <Interface/Context.h>
 #include <Interface/ShadowAlgorithm.h>
@@ -573,8 +574,8 @@ void GridSpheres::lambertianShade(const RenderContext& context, RayPacket& rays,
 
   ShadowAlgorithm::StateBuffer shadowState;
   do {
-    RayPacketData shadowData;
-    RayPacket shadowRays(shadowData, RayPacket::UnknownShape, 0, 0,
+    ScopedRayPacketData shadowData(context);
+    RayPacket shadowRays(*shadowData, RayPacket::UnknownShape, 0, 0,
                          rays.getDepth(), 0);
 
     // Call the shadow algorithm (SA) to generate shadow rays.  We may not be
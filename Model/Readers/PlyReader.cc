@@ -8,10 +8,14 @@
 #include <Core/Color/Color.h>
 #include <Core/Color/RGBColor.h>
 #include <Core/Exceptions/FileNotFound.h>
+#include <Core/Thread/Thread.h>
+#include <Core/Util/MappedFile.h>
 #include <Model/Readers/rply/rply.h>
 #include <sstream>
+#include <vector>
 
 #include <stdlib.h>
+#include <string.h>
 
 //TODO: normals?
 
@@ -67,21 +71,13 @@ static int vertex_cb(p_ply_argument argument) {
      return 1;
 }
 
-struct face_cb_data {
-  Mesh *mesh;
-  WaldTriangle *WaldTris;
-  KenslerShirleyTriangle *KSTris;
-  size_t nextFreeTri;
-  face_cb_data() : mesh(NULL), WaldTris(NULL), KSTris(NULL), nextFreeTri(0) {}
-};
-
 long firstVertexIndex, prevVertexIndex;
 static int face_cb(p_ply_argument argument) {
      long length;
      long currVertexIndex;
 
-     face_cb_data *data;
-     ply_get_argument_user_data(argument, (void**) &data, NULL);
+     Mesh *mesh;
+     ply_get_argument_user_data(argument, (void**) &mesh, NULL);
 
      long polyIndex, polyVertex;
      ply_get_argument_element(argument, NULL, &polyIndex);
@@ -90,7 +86,7 @@ static int face_cb(p_ply_argument argument) {
 
      //do this once only to add last vertex.
      if (polyIndex == 0 && polyVertex == -1) {
-       addVertex(data->mesh);
+       addVertex(mesh);
      }
 
      currVertexIndex = static_cast<long>(ply_get_argument_value(argument));
@@ -104,17 +100,11 @@ static int face_cb(p_ply_argument argument) {
      case 1: prevVertexIndex = currVertexIndex;
        break;
      default:
-       data->mesh->vertex_indices.push_back(vertices_start+firstVertexIndex);
-       data->mesh->vertex_indices.push_back(vertices_start+prevVertexIndex);
-       data->mesh->vertex_indices.push_back(vertices_start+currVertexIndex);
-
-       data->mesh->face_material.push_back(data->mesh->materials.size()-1);
-
-       if (data->WaldTris)
-         data->mesh->addTriangle(&data->WaldTris[data->nextFreeTri++]);
-       else if (data->KSTris)
-         data->mesh->addTriangle(&data->KSTris[data->nextFreeTri++]);
+       mesh->vertex_indices.push_back(vertices_start+firstVertexIndex);
+       mesh->vertex_indices.push_back(vertices_start+prevVertexIndex);
+       mesh->vertex_indices.push_back(vertices_start+currVertexIndex);
 
+       mesh->face_material.push_back(mesh->materials.size()-1);
 
        if (coloredTriangleMode) {
          //TODO: handle colored triangles.
@@ -134,12 +124,634 @@ static int face_cb(p_ply_argument argument) {
 
 }
 
+namespace {
+
+  // The fast path of readPlyFile.  Files whose first two elements are
+  // the vertices and the faces, with the faces in a vertex_indices list,
+  // are mapped into memory and parsed by several threads straight into
+  // the arrays of the mesh.  The vertices of a binary file are all the
+  // same size, so every thread decodes a range of them; the faces are
+  // found with one quick pass over their lengths and then decoded the
+  // same way.  An ASCII file is cut into chunks of whole lines, and every
+  // thread parses the lines of one chunk.  Anything else is left to rply.
+
+  enum PlyFormat {
+    PlyAscii,
+    PlyBinaryLittleEndian,
+    PlyBinaryBigEndian
+  };
+
+  enum PlyType {
+    PlyNoType,
+    PlyInt8, PlyUint8, PlyInt16, PlyUint16,
+    PlyInt32, PlyUint32, PlyFloat32, PlyFloat64
+  };
+
+  struct PlyProperty {
+    string name;
+    PlyType type;
+    // The type of the length of a list property, PlyNoType otherwise.
+    PlyType countType;
+  };
+
+  struct PlyElement {
+    string name;
+    size_t count;
+    vector<PlyProperty> properties;
+  };
+
+  struct PlyHeader {
+    PlyFormat format;
+    vector<PlyElement> elements;
+    size_t dataOffset;
+  };
+
+  PlyType parseType(const string& name)
+  {
+    if (name == "char" || name == "int8") return PlyInt8;
+    if (name == "uchar" || name == "uint8") return PlyUint8;
+    if (name == "short" || name == "int16") return PlyInt16;
+    if (name == "ushort" || name == "uint16") return PlyUint16;
+    if (name == "int" || name == "int32") return PlyInt32;
+    if (name == "uint" || name == "uint32") return PlyUint32;
+    if (name == "float" || name == "float32") return PlyFloat32;
+    if (name == "double" || name == "float64") return PlyFloat64;
+    return PlyNoType;
+  }
+
+  int typeSize(PlyType type)
+  {
+    switch (type) {
+    case PlyInt8: case PlyUint8: return 1;
+    case PlyInt16: case PlyUint16: return 2;
+    case PlyInt32: case PlyUint32: case PlyFloat32: return 4;
+    case PlyFloat64: return 8;
+    default: return 0;
+    }
+  }
+
+  bool isIntegral(PlyType type)
+  {
+    return type != PlyNoType && type != PlyFloat32 && type != PlyFloat64;
+  }
+
+  bool parseHeader(const char* data, size_t size, PlyHeader& header)
+  {
+    const char* end = data + size;
+    const char* line = data;
+    header.elements.clear();
+    bool haveFormat = false;
+    while (line < end) {
+      const char* lineEnd =
+        static_cast<const char*>(memchr(line, '\n', end - line));
+      if (!lineEnd)
+        return false;
+      istringstream in(string(line, lineEnd));
+      line = lineEnd + 1;
+
+      string keyword;
+      in >> keyword;
+      if (keyword == "ply" && header.elements.empty() && !haveFormat) {
+        continue;
+      } else if (keyword == "format") {
+        string format;
+        in >> format;
+        if (format == "ascii")
+          header.format = PlyAscii;
+        else if (format == "binary_little_endian")
+          header.format = PlyBinaryLittleEndian;
+        else if (format == "binary_big_endian")
+          header.format = PlyBinaryBigEndian;
+        else
+          return false;
+        haveFormat = true;
+      } else if (keyword == "element") {
+        PlyElement element;
+        if (!(in >> element.name >> element.count))
+          return false;
+        header.elements.push_back(element);
+      } else if (keyword == "property") {
+        if (header.elements.empty())
+          return false;
+        PlyProperty property;
+        string type;
+        in >> type;
+        if (type == "list") {
+          string countType;
+          in >> countType >> type;
+          property.countType = parseType(countType);
+          if (!isIntegral(property.countType))
+            return false;
+        } else {
+          property.countType = PlyNoType;
+        }
+        property.type = parseType(type);
+        if (property.type == PlyNoType || !(in >> property.name))
+          return false;
+        header.elements.back().properties.push_back(property);
+      } else if (keyword == "end_header") {
+        header.dataOffset = line - data;
+        return haveFormat;
+      } else if (keyword != "comment" && keyword != "obj_info" &&
+                 !keyword.empty()) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // Reads a value of a binary file, swapping its bytes when the file and
+  // this machine do not agree on their order.
+  inline double readValue(const char* p, PlyType type, bool swap)
+  {
+    char bytes[8] = { 0 };
+    const int size = typeSize(type);
+    if (swap)
+      for (int i = 0; i < size; ++i)
+        bytes[i] = p[size-1-i];
+    else
+      memcpy(bytes, p, size);
+
+    switch (type) {
+    case PlyInt8: { signed char v; memcpy(&v, bytes, 1); return v; }
+    case PlyUint8: { unsigned char v; memcpy(&v, bytes, 1); return v; }
+    case PlyInt16: { short v; memcpy(&v, bytes, 2); return v; }
+    case PlyUint16: { unsigned short v; memcpy(&v, bytes, 2); return v; }
+    case PlyInt32: { int v; memcpy(&v, bytes, 4); return v; }
+    case PlyUint32: { unsigned int v; memcpy(&v, bytes, 4); return v; }
+    case PlyFloat32: { float v; memcpy(&v, bytes, 4); return v; }
+    case PlyFloat64: { double v; memcpy(&v, bytes, 8); return v; }
+    default: return 0;
+    }
+  }
+
+  // Returns the start of the next token of a line, or 0 at its end.
+  inline const char* nextToken(const char* p)
+  {
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+      ++p;
+    return *p ? p : 0;
+  }
+
+  inline const char* skipToken(const char* p)
+  {
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r')
+      ++p;
+    return p;
+  }
+
+  class PlyLoader {
+  public:
+    PlyLoader(const char* data, size_t size, const PlyHeader& header,
+              Mesh* mesh, const AffineTransform& t, int numThreads)
+      : data(data), end(data + size), header(header),
+        vertexElement(header.elements[0]), faceElement(header.elements[1]),
+        mesh(mesh), t(t), numThreads(numThreads),
+        verticesStart(mesh->vertices.size()),
+        indicesStart(mesh->vertex_indices.size())
+    {
+      const int one = 1;
+      const bool littleEndian = *reinterpret_cast<const char*>(&one) == 1;
+      swap = (header.format == PlyBinaryLittleEndian) != littleEndian;
+    }
+
+    // Returns false, with the arrays of the mesh left longer than before
+    // and partly filled, if the file is not what the header says.
+    bool load()
+    {
+      if (!findProperties())
+        return false;
+      chunks.resize(numThreads);
+      mesh->vertices.resize(verticesStart + vertexElement.count);
+      if (header.format == PlyAscii) {
+        if (!splitLines())
+          return false;
+        Thread::parallel(this, &PlyLoader::parseLines, numThreads);
+        if (failed())
+          return false;
+        joinFaces();
+      } else {
+        if (!findFaces())
+          return false;
+        mesh->vertex_indices.resize(indicesStart + 3*numTriangles);
+        Thread::parallel(this, &PlyLoader::decodeVertices, numThreads);
+        Thread::parallel(this, &PlyLoader::decodeFaces, numThreads);
+        if (failed())
+          return false;
+      }
+      return true;
+    }
+
+    size_t getNumTriangles() const { return numTriangles; }
+
+  private:
+    struct Chunk {
+      const char* begin;
+      const char* end;
+      size_t firstItem;     // First line (ASCII) or face (binary)
+      size_t numItems;
+      size_t firstTriangle;
+      // The vertex indices of the faces of an ASCII chunk, which are
+      // only counted once the chunk has been parsed.
+      vector<unsigned int> indices;
+      bool failed;
+    };
+
+    bool findProperties()
+    {
+      if (vertexElement.name != "vertex" || faceElement.name != "face")
+        return false;
+
+      // The vertices have to be all scalars, so that they are all the
+      // same size.
+      vertexSize = 0;
+      for (int i = 0; i < 3; ++i)
+        xyz[i] = -1;
+      for (size_t i = 0; i < vertexElement.properties.size(); ++i) {
+        const PlyProperty& property = vertexElement.properties[i];
+        if (property.countType != PlyNoType)
+          return false;
+        const int axis = (property.name == "x" ? 0 :
+                          property.name == "y" ? 1 :
+                          property.name == "z" ? 2 : -1);
+        if (axis >= 0) {
+          xyz[axis] = i;
+          xyzOffset[axis] = vertexSize;
+        }
+        vertexSize += typeSize(property.type);
+      }
+      if (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)
+        return false;
+
+      indicesProperty = -1;
+      for (size_t i = 0; i < faceElement.properties.size(); ++i) {
+        const PlyProperty& property = faceElement.properties[i];
+        if (property.name == "vertex_indices" &&
+            property.countType != PlyNoType && isIntegral(property.type))
+          indicesProperty = i;
+      }
+      return indicesProperty >= 0;
+    }
+
+    bool failed() const
+    {
+      for (size_t i = 0; i < chunks.size(); ++i)
+        if (chunks[i].failed)
+          return true;
+      return false;
+    }
+
+    void range(int proc, size_t count, size_t& first, size_t& last) const
+    {
+      first = count*proc/numThreads;
+      last = count*(proc+1)/numThreads;
+    }
+
+    // Walks the properties of the binary face at p, calling emit with the
+    // triangles of its vertex_indices list (if emit is not 0).  Returns
+    // the end of the face, or 0 if it runs past the end of the file.
+    const char* walkFace(const char* p, size_t& triangles,
+                         unsigned int* emit) const
+    {
+      for (size_t i = 0; i < faceElement.properties.size(); ++i) {
+        const PlyProperty& property = faceElement.properties[i];
+        const int valueSize = typeSize(property.type);
+        if (property.countType == PlyNoType) {
+          p += valueSize;
+          continue;
+        }
+        const int countSize = typeSize(property.countType);
+        if (p + countSize > end)
+          return 0;
+        const double length = readValue(p, property.countType, swap);
+        p += countSize;
+        if (length < 0 || p + size_t(length)*valueSize > end)
+          return 0;
+        const size_t count = size_t(length);
+        if (static_cast<int>(i) == indicesProperty && count >= 3) {
+          if (emit) {
+            // Triangulate the polygon as a fan, like the rply path does.
+            const unsigned int first = verticesStart +
+              static_cast<long>(readValue(p, property.type, swap));
+            unsigned int prev = verticesStart +
+              static_cast<long>(readValue(p + valueSize, property.type, swap));
+            for (size_t v = 2; v < count; ++v) {
+              const unsigned int curr = verticesStart +
+                static_cast<long>(readValue(p + v*valueSize, property.type,
+                                            swap));
+              unsigned int* tri = emit + 3*(triangles + v-2);
+              tri[0] = first;
+              tri[1] = prev;
+              tri[2] = curr;
+              prev = curr;
+            }
+          }
+          triangles += count-2;
+        }
+        p += count*valueSize;
+      }
+      return p <= end ? p : 0;
+    }
+
+    // Finds where the faces of every thread start, and how many
+    // triangles come before them.
+    bool findFaces()
+    {
+      const char* vertices = data + header.dataOffset;
+      if (size_t(end - vertices) < vertexElement.count*vertexSize)
+        return false;
+      const char* p = vertices + vertexElement.count*vertexSize;
+      numTriangles = 0;
+      for (int proc = 0; proc < numThreads; ++proc) {
+        Chunk& chunk = chunks[proc];
+        size_t last;
+        range(proc, faceElement.count, chunk.firstItem, last);
+        chunk.numItems = last - chunk.firstItem;
+        chunk.begin = p;
+        chunk.firstTriangle = numTriangles;
+        chunk.failed = false;
+        for (size_t i = 0; i < chunk.numItems; ++i) {
+          p = walkFace(p, numTriangles, 0);
+          if (!p)
+            return false;
+        }
+      }
+      return true;
+    }
+
+    void decodeVertices(int proc)
+    {
+      size_t first, last;
+      range(proc, vertexElement.count, first, last);
+      const char* vertex = data + header.dataOffset + first*vertexSize;
+      Vector* out = &mesh->vertices[verticesStart];
+      PlyType types[3];
+      for (int axis = 0; axis < 3; ++axis)
+        types[axis] = vertexElement.properties[xyz[axis]].type;
+      for (size_t i = first; i < last; ++i, vertex += vertexSize) {
+        const Vector point(readValue(vertex + xyzOffset[0], types[0], swap),
+                           readValue(vertex + xyzOffset[1], types[1], swap),
+                           readValue(vertex + xyzOffset[2], types[2], swap));
+        out[i] = t.multiply_point(point);
+      }
+    }
+
+    void decodeFaces(int proc)
+    {
+      Chunk& chunk = chunks[proc];
+      if (chunk.numItems == 0)
+        return;
+      unsigned int* out = &mesh->vertex_indices[indicesStart];
+      const char* p = chunk.begin;
+      size_t triangles = chunk.firstTriangle;
+      for (size_t i = 0; i < chunk.numItems && p; ++i)
+        p = walkFace(p, triangles, out);
+      chunk.failed = p == 0;
+    }
+
+    // Cuts the data of an ASCII file into one chunk of whole lines per
+    // thread, and numbers the lines.
+    bool splitLines()
+    {
+      const char* begin = data + header.dataOffset;
+      const size_t size = end - begin;
+      const char* p = begin;
+      size_t lines = 0;
+      for (int proc = 0; proc < numThreads; ++proc) {
+        Chunk& chunk = chunks[proc];
+        chunk.begin = p;
+        const char* chunkEnd = begin + size*(proc+1)/numThreads;
+        if (chunkEnd < p)
+          chunkEnd = p;
+        if (chunkEnd < end) {
+          const char* newline = static_cast<const char*>
+            (memchr(chunkEnd, '\n', end - chunkEnd));
+          chunkEnd = newline ? newline + 1 : end;
+        }
+        chunk.end = chunkEnd;
+        chunk.failed = false;
+        p = chunkEnd;
+      }
+      // Counting the lines is much quicker than parsing them, so it is
+      // done in one go.
+      for (int proc = 0; proc < numThreads; ++proc) {
+        Chunk& chunk = chunks[proc];
+        chunk.firstItem = lines;
+        chunk.numItems = 0;
+        for (const char* q = chunk.begin; q < chunk.end; ++chunk.numItems) {
+          const char* newline = static_cast<const char*>
+            (memchr(q, '\n', chunk.end - q));
+          q = newline ? newline + 1 : chunk.end;
+        }
+        lines += chunk.numItems;
+      }
+      return lines >= vertexElement.count + faceElement.count;
+    }
+
+    void parseLines(int proc)
+    {
+      Chunk& chunk = chunks[proc];
+      chunk.indices.clear();
+      const size_t firstFace = vertexElement.count;
+      const size_t endLines = firstFace + faceElement.count;
+      Vector* vertices = &mesh->vertices[verticesStart];
+      string line;
+      vector<unsigned int> polygon;
+      size_t index = chunk.firstItem;
+      for (const char* p = chunk.begin; p < chunk.end && index < endLines;
+           ++index) {
+        const char* newline = static_cast<const char*>
+          (memchr(p, '\n', chunk.end - p));
+        const char* lineEnd = newline ? newline : chunk.end;
+        // The copy ends the line with a 0 for strtod.
+        line.assign(p, lineEnd);
+        p = newline ? newline + 1 : chunk.end;
+
+        bool ok;
+        if (index < firstFace)
+          ok = parseVertex(line.c_str(), vertices[index]);
+        else
+          ok = parseFace(line.c_str(), polygon, chunk.indices);
+        if (!ok) {
+          chunk.failed = true;
+          return;
+        }
+      }
+    }
+
+    bool parseVertex(const char* p, Vector& vertex) const
+    {
+      double point[3];
+      for (size_t i = 0; i < vertexElement.properties.size(); ++i) {
+        p = nextToken(p);
+        if (!p)
+          return false;
+        int axis = 0;
+        while (axis < 3 && xyz[axis] != static_cast<int>(i))
+          ++axis;
+        if (axis < 3) {
+          char* tokenEnd;
+          point[axis] = strtod(p, &tokenEnd);
+          if (tokenEnd == p)
+            return false;
+          p = tokenEnd;
+        } else {
+          p = skipToken(p);
+        }
+      }
+      vertex = t.multiply_point(Vector(point[0], point[1], point[2]));
+      return true;
+    }
+
+    bool parseFace(const char* p, vector<unsigned int>& polygon,
+                   vector<unsigned int>& indices) const
+    {
+      for (size_t i = 0; i < faceElement.properties.size(); ++i) {
+        const PlyProperty& property = faceElement.properties[i];
+        p = nextToken(p);
+        if (!p)
+          return false;
+        if (property.countType == PlyNoType) {
+          p = skipToken(p);
+          continue;
+        }
+        char* tokenEnd;
+        const long count = strtol(p, &tokenEnd, 10);
+        if (tokenEnd == p || count < 0)
+          return false;
+        p = tokenEnd;
+        const bool keep = static_cast<int>(i) == indicesProperty;
+        polygon.clear();
+        for (long v = 0; v < count; ++v) {
+          p = nextToken(p);
+          if (!p)
+            return false;
+          if (keep) {
+            polygon.push_back(verticesStart + strtol(p, &tokenEnd, 10));
+            if (tokenEnd == p)
+              return false;
+            p = tokenEnd;
+          } else {
+            p = skipToken(p);
+          }
+        }
+        for (size_t v = 2; keep && v < polygon.size(); ++v) {
+          indices.push_back(polygon[0]);
+          indices.push_back(polygon[v-1]);
+          indices.push_back(polygon[v]);
+        }
+      }
+      return true;
+    }
+
+    void joinFaces()
+    {
+      numTriangles = 0;
+      for (int proc = 0; proc < numThreads; ++proc) {
+        chunks[proc].firstTriangle = numTriangles;
+        numTriangles += chunks[proc].indices.size()/3;
+      }
+      mesh->vertex_indices.resize(indicesStart + 3*numTriangles);
+      for (int proc = 0; proc < numThreads; ++proc) {
+        vector<unsigned int>& indices = chunks[proc].indices;
+        if (!indices.empty())
+          memcpy(&mesh->vertex_indices[indicesStart +
+                                       3*chunks[proc].firstTriangle],
+                 &indices[0], indices.size()*sizeof(unsigned int));
+        vector<unsigned int>().swap(indices);
+      }
+    }
+
+    const char* data;
+    const char* end;
+    const PlyHeader& header;
+    const PlyElement& vertexElement;
+    const PlyElement& faceElement;
+    Mesh* mesh;
+    const AffineTransform& t;
+    int numThreads;
+    bool swap;
+
+    size_t verticesStart;
+    size_t indicesStart;
+    int xyz[3];           // Property of every coordinate
+    size_t xyzOffset[3];  // and its offset in a binary vertex
+    size_t vertexSize;
+    int indicesProperty;
+
+    vector<Chunk> chunks;
+    size_t numTriangles;
+  };
+
+  // Reads the file with the fast path, leaving the mesh as it was if it
+  // cannot be.  Returns the number of triangles added, or -1.
+  long readPlyFast(const string& fileName, const AffineTransform& t,
+                   Mesh* mesh, int numThreads)
+  {
+    MappedFile file;
+    if (!file.open(fileName, MappedFile::ReadOnlyShared))
+      return -1;
+    PlyHeader header;
+    if (!parseHeader(file.data(), file.size(), header) ||
+        header.elements.size() < 2)
+      return -1;
+    file.advise(MappedFile::AdviseSequential);
+
+    const size_t verticesStart = mesh->vertices.size();
+    const size_t indicesStart = mesh->vertex_indices.size();
+    PlyLoader loader(file.data(), file.size(), header, mesh, t, numThreads);
+    if (!loader.load()) {
+      mesh->vertices.resize(verticesStart);
+      mesh->vertex_indices.resize(indicesStart);
+      return -1;
+    }
+    return loader.getNumTriangles();
+  }
+
+  void addTriangles(Mesh* mesh, MeshTriangle::TriangleType triangleType,
+                    size_t count)
+  {
+    // Note(thiago): By allocating all the triangles in an array instead of
+    // one at a time, we can lower the memory overhead and allow for triangle
+    // data to be contiguous in memory instead of having gaps. Lower memory
+    // usage is obviously good; getting rid of the gaps between triangles is
+    // also good since it can lead to more efficient cache usage and better
+    // performance.  The gaps occur because new will often try to allocate
+    // memory in chunks.  For instance, calling new twice to allocate a 4B
+    // struct might place the second object 16B to 32B away from the first
+    // instead of 4B.  The in between space is wasted.  I've verified this
+    // exact behavior in test code.
+    if (count == 0)
+      return;
+    switch (triangleType) {
+    case MeshTriangle::WALD_TRI:
+      mesh->addTriangles(new WaldTriangle[count], count);
+      break;
+    case MeshTriangle::KENSLER_SHIRLEY_TRI:
+    default:
+      mesh->addTriangles(new KenslerShirleyTriangle[count], count);
+    }
+  }
+}
+
 bool
 Manta::readPlyFile(const string fileName, const AffineTransform &_t,
                    Mesh *mesh, Material *m,
-                   MeshTriangle::TriangleType triangleType) {
-     long nVertices, nTriangles;
-     size_t objs_start = mesh->size();
+                   MeshTriangle::TriangleType triangleType,
+                   int numThreads) {
+     if (numThreads <= 0)
+       numThreads = Thread::numProcessors();
+     const long fastTriangles = readPlyFast(fileName, _t, mesh, numThreads);
+     if (fastTriangles >= 0) {
+       mesh->materials.push_back(m ? m : new Lambertian(Color(RGBColor(1,1,1))));
+       mesh->face_material.resize(mesh->face_material.size() + fastTriangles,
+                                  mesh->materials.size()-1);
+       addTriangles(mesh, triangleType, fastTriangles);
+       mesh->removeDegenerateTriangles();
+       return true;
+     }
+
+     size_t face_material_start = mesh->face_material.size();
      unsigned int vertex_indices_start = mesh->vertex_indices.size();
      vertices_start = mesh->vertices.size();
 
@@ -156,7 +768,7 @@ Manta::readPlyFile(const string fileName, const AffineTransform &_t,
 
      if (!ply_read_header(ply)) return false;
 
-     nVertices = ply_set_read_cb(ply, "vertex", "x", vertex_cb, mesh, 0);
+     ply_set_read_cb(ply, "vertex", "x", vertex_cb, mesh, 0);
 
      ply_set_read_cb(ply, "vertex", "y", vertex_cb,
                      mesh, 0);
@@ -212,31 +824,7 @@ Manta::readPlyFile(const string fileName, const AffineTransform &_t,
        */
      }
 
-     face_cb_data face_data;
-     face_data.mesh = mesh;
-
-     nTriangles = ply_set_read_cb(ply, "face", "vertex_indices", face_cb, &face_data, 0);
-
-     // Note(thiago): By allocating all the triangles in an array instead of
-     // one at a time, we can lower the memory overhead and allow for triangle
-     // data to be contiguous in memory instead of having gaps. Lower memory
-     // usage is obviously good; getting rid of the gaps between triangles is
-     // also good since it can lead to more efficient cache usage and better
-     // performance.  The gaps occur because new will often try to allocate
-     // memory in chunks.  For instance, calling new twice to allocate a 4B
-     // struct might place the second object 16B to 32B away from the first
-     // instead of 4B.  The in between space is wasted.  I've verified this
-     // exact behavior in test code.
-     switch (triangleType) {
-     case MeshTriangle::WALD_TRI:
-       face_data.WaldTris = new WaldTriangle[nTriangles];
-       break;
-     case MeshTriangle::KENSLER_SHIRLEY_TRI:
-       face_data.KSTris = new KenslerShirleyTriangle[nTriangles];
-       break;
-     default:
-       face_data.KSTris = new KenslerShirleyTriangle[nTriangles];
-     }
+     ply_set_read_cb(ply, "face", "vertex_indices", face_cb, mesh, 0);
 
      if (defaultMaterial)
      { } //do nothing
@@ -249,20 +837,23 @@ Manta::readPlyFile(const string fileName, const AffineTransform &_t,
 
      if (!ply_read(ply)) {
          //need to clean up group.
-         mesh->shrinkTo(objs_start, false);
          mesh->vertices.resize(vertices_start);
          mesh->vertex_indices.resize(vertex_indices_start);
+         mesh->face_material.resize(face_material_start);
+         mesh->materials.pop_back();
          if (!m && defaultMaterial)
              delete defaultMaterial;
 
-         delete[] face_data.WaldTris;
-         delete[] face_data.KSTris;
-
          return false;
      }
 
      ply_close(ply);
 
+     // The triangles are only made once they have all been read, since
+     // polygons with more than three vertices make more than one.
+     addTriangles(mesh, triangleType,
+                  (mesh->vertex_indices.size() - vertex_indices_start)/3);
+
      mesh->removeDegenerateTriangles();
 
      return true;
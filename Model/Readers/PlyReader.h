@@ -14,9 +14,16 @@ namespace Manta {
   class Material;
   class Group;
   
+  // Adds the triangles of a PLY file to mesh, with the vertices
+  // transformed by t.  Polygons are cut into triangles, which are made
+  // in one array.  Files that start with the vertices and the faces are
+  // mapped into memory and parsed by numThreads threads (one per
+  // processor for 0); other files, and files that cannot be mapped such
+  // as pipes, are read with rply.
   extern "C" bool readPlyFile(const string fileName, const AffineTransform &t, 
                               Mesh *mesh, Material *m=0,
-                              MeshTriangle::TriangleType triangleType = MeshTriangle::KENSLER_SHIRLEY_TRI);
+                              MeshTriangle::TriangleType triangleType = MeshTriangle::KENSLER_SHIRLEY_TRI,
+                              int numThreads = 0);
 }
 
 #endif
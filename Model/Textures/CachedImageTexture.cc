@@ -0,0 +1,210 @@
+/*
+  For more information, please see: http://software.sci.utah.edu
+
+  The MIT License
+
+  Copyright (c) 2005
+  Scientific Computing and Imaging Institue, University of Utah
+
+  License for the specific language governing rights and limitations under
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+#include <Model/Textures/CachedImageTexture.h>
+#include <Model/Textures/TextureCache.h>
+#include <Interface/RayPacket.h>
+
+#include <Core/Exceptions/InputError.h>
+#include <Core/Exceptions/InternalError.h>
+#include <Core/Math/MinMax.h>
+#include <Core/Math/MiscMath.h>
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+using namespace Manta;
+
+namespace {
+  int edgeBehavior(int val, int behavior, int size)
+  {
+    if(behavior == CachedImageTexture::Wrap){
+      val %= size;
+      return val < 0 ? val + size : val;
+    }
+    return val < 0 ? 0 : (val >= size ? size-1 : val);
+  }
+
+  // Bilinear interpolation of level at (s, t), in texels.
+  Color bilinear(TextureCache::Reader& reader, int texture, int level,
+                 int xres, int yres, int u_edge, int v_edge,
+                 Real s, Real t)
+  {
+    s -= (Real)0.5;
+    t -= (Real)0.5;
+    Real fs = Floor(s);
+    Real ft = Floor(t);
+    int x0 = static_cast<int>(fs);
+    int y0 = static_cast<int>(ft);
+    ColorComponent wx = static_cast<ColorComponent>(s - fs);
+    ColorComponent wy = static_cast<ColorComponent>(t - ft);
+    int x1 = edgeBehavior(x0+1, u_edge, xres);
+    int y1 = edgeBehavior(y0+1, v_edge, yres);
+    x0 = edgeBehavior(x0, u_edge, xres);
+    y0 = edgeBehavior(y0, v_edge, yres);
+
+    Color a = (reader.getTexel(texture, level, x0, y0)*(1-wx) +
+               reader.getTexel(texture, level, x1, y0)*wx);
+    Color b = (reader.getTexel(texture, level, x0, y1)*(1-wx) +
+               reader.getTexel(texture, level, x1, y1)*wx);
+    return a*(1-wy) + b*wy;
+  }
+}
+
+CachedImageTexture::CachedImageTexture(TextureCache* cache, int texture)
+  : cache(cache), texture(texture),
+    scale(VectorT<ColorComponent, 2>(1,1)),
+    interpolation_method(Bilinear),
+    u_edge(Wrap), v_edge(Wrap),
+    pixelSpread((Real)0.001)
+{
+}
+
+void CachedImageTexture::mapValues(Packet<Color>& results,
+                                   const RenderContext& context,
+                                   RayPacket& rays) const
+{
+  rays.computeTextureCoordinates2( context );
+
+  int xres, yres;
+  cache->getResolution(texture, xres, yres);
+  TextureCache::Reader reader(cache);
+
+  switch (interpolation_method) {
+  case NearestNeighbor:
+    for( int i = rays.begin(); i < rays.end(); ++i) {
+      Real u = rays.getTexCoords2(i, 0) * scale[0];
+      Real v = rays.getTexCoords2(i, 1) * scale[1];
+      int x = edgeBehavior(static_cast<int>(Floor(u*xres)), u_edge, xres);
+      int y = edgeBehavior(static_cast<int>(Floor(v*yres)), v_edge, yres);
+      results.set(i, reader.getTexel(texture, 0, x, y));
+    }
+    break;
+  case Bilinear:
+    for( int i = rays.begin(); i < rays.end(); ++i) {
+      Real u = rays.getTexCoords2(i, 0) * scale[0];
+      Real v = rays.getTexCoords2(i, 1) * scale[1];
+      results.set(i, bilinear(reader, texture, 0, xres, yres, u_edge, v_edge,
+                              u*xres, v*yres));
+    }
+    break;
+  case Trilinear:
+    {
+      rays.computeSurfaceDerivatives( context );
+      int numLevels = cache->getNumLevels(texture);
+      for( int i = rays.begin(); i < rays.end(); ++i) {
+        Real u = rays.getTexCoords2(i, 0) * scale[0];
+        Real v = rays.getTexCoords2(i, 1) * scale[1];
+
+        // Width of the ray at the hit point, in texels of level 0.
+        Real width = rays.getMinT(i) * rays.getDirection(i).length()
+          * pixelSpread;
+        Real dPdu = rays.getSurfaceDerivativeU(i).length();
+        Real dPdv = rays.getSurfaceDerivativeV(i).length();
+        Real texels = 0;
+        if (dPdu > 0)
+          texels = width / dPdu * scale[0] * xres;
+        if (dPdv > 0)
+          texels = Max(texels, width / dPdv * scale[1] * yres);
+
+        Real lod = texels > 1 ? log(texels) / log((Real)2) : 0;
+        if (lod >= numLevels-1) {
+          int level = numLevels-1;
+          int lx = TextureCache::getLevelSize(xres, level);
+          int ly = TextureCache::getLevelSize(yres, level);
+          results.set(i, bilinear(reader, texture, level, lx, ly,
+                                  u_edge, v_edge, u*lx, v*ly));
+          continue;
+        }
+        int level = static_cast<int>(lod);
+        ColorComponent w = static_cast<ColorComponent>(lod - level);
+        int lx = TextureCache::getLevelSize(xres, level);
+        int ly = TextureCache::getLevelSize(yres, level);
+        Color fine = bilinear(reader, texture, level, lx, ly,
+                              u_edge, v_edge, u*lx, v*ly);
+        if (w > 0) {
+          lx = TextureCache::getLevelSize(xres, level+1);
+          ly = TextureCache::getLevelSize(yres, level+1);
+          Color coarse = bilinear(reader, texture, level+1, lx, ly,
+                                  u_edge, v_edge, u*lx, v*ly);
+          fine = fine*(1-w) + coarse*w;
+        }
+        results.set(i, fine);
+      }
+    }
+    break;
+  }
+}
+
+void CachedImageTexture::setEdgeBehavior(int new_behavior, int& edge)
+{
+  switch (new_behavior) {
+  case Wrap:
+  case Clamp:
+    edge = new_behavior;
+    break;
+  default:
+    throw InternalError( "CachedImageTexture::setEdgeBehavior doesn't support this edge behavior");
+    break;
+  }
+}
+
+void CachedImageTexture::setInterpolationMethod(int new_method)
+{
+  switch (new_method) {
+  case NearestNeighbor:
+  case Bilinear:
+  case Trilinear:
+    interpolation_method = new_method;
+    break;
+  default:
+    throw InternalError( "CachedImageTexture::setInterpolationMethod doesn't support this interpolation method");
+    break;
+  }
+}
+
+namespace Manta {
+  CachedImageTexture* LoadCachedColorImageTexture( const std::string& file_name,
+                                                   TextureCache* cache,
+                                                   std::ostream* stream,
+                                                   bool linearize)
+  {
+    // Only check that the file is there; it is read when it is used.
+    std::ifstream in(file_name.c_str());
+    if (!in)
+      throw InputError("Cannot open texture " + file_name);
+    in.close();
+
+    if (!cache)
+      cache = TextureCache::getDefault();
+    if (stream) (*stream) << "Adding "<<file_name<<" to the texture cache\n";
+    int texture = cache->addTexture(file_name, linearize);
+    return new CachedImageTexture(cache, texture);
+  }
+}
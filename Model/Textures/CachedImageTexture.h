@@ -0,0 +1,124 @@
+/*
+  For more information, please see: http://software.sci.utah.edu
+
+  The MIT License
+
+  Copyright (c) 2005
+  Scientific Computing and Imaging Institue, University of Utah
+
+  License for the specific language governing rights and limitations under
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  An image texture whose texels live in a TextureCache instead of a
+  private copy of the image, so that the image is only read when it is
+  first seen and only the tiles that are used stay in memory.
+
+  The interpolation methods and edge behaviors are the ones of
+  ImageTexture, plus Trilinear, which picks the MIP level from the
+  footprint of the ray: hit distance times the pixel spread (the angle
+  a pixel subtends, in radians), divided by the length of the surface
+  derivatives.  The angle of incidence is ignored, so the estimate is
+  isotropic.  Texel centers are at half integer coordinates, so the
+  levels line up.
+*/
+
+#ifndef Manta_Model_CachedImageTexture_h
+#define Manta_Model_CachedImageTexture_h
+
+#include <Interface/Texture.h>
+#include <Core/Color/Color.h>
+#include <Core/Geometry/VectorT.h>
+
+#include <string>
+#include <iosfwd>
+
+namespace Manta {
+
+  class TextureCache;
+
+  class CachedImageTexture : public Texture<Color> {
+  public:
+    CachedImageTexture(TextureCache* cache, int texture);
+    virtual ~CachedImageTexture() {}
+
+    virtual void mapValues(Packet<Color>& results,
+                           const RenderContext&,
+                           RayPacket& rays) const;
+
+    void setScale(ColorComponent u_scale, ColorComponent v_scale) {
+      scale[0] = u_scale;
+      scale[1] = v_scale;
+    }
+
+    enum {
+      NearestNeighbor,
+      Bilinear,
+      Trilinear
+    };
+
+    enum {
+      Wrap,
+      Clamp
+    };
+
+    void setUEdgeBehavior(int new_behavior) {
+      setEdgeBehavior(new_behavior, u_edge);
+    }
+    void setVEdgeBehavior(int new_behavior) {
+      setEdgeBehavior(new_behavior, v_edge);
+    }
+
+    void setInterpolationMethod(int new_method);
+
+    // Radians per pixel of the rays that hit the texture, for
+    // Trilinear.  The default suits about 1000 pixels over 60 degrees.
+    void setPixelSpread(Real spread) {
+      pixelSpread = spread;
+    }
+
+    TextureCache* getCache() const {
+      return cache;
+    }
+
+  private:
+    void setEdgeBehavior(int new_behavior, int& edge);
+
+    TextureCache* cache;
+    int texture;
+    VectorT<ColorComponent, 2> scale;
+    int interpolation_method;
+    int u_edge, v_edge;
+    Real pixelSpread;
+  };
+
+  // Adds file_name to cache (TextureCache::getDefault() if cache is
+  // null) and returns a texture for it.  The image is not read until it
+  // is used.  This will throw an InputError exception if the file does
+  // not exist.  If stream is non null it will write out chatty stuff to
+  // that.
+  CachedImageTexture* LoadCachedColorImageTexture( const std::string& file_name,
+                                                   TextureCache* cache = 0,
+                                                   std::ostream* stream = 0,
+                                                   bool linearize = false);
+
+} // end namespace Manta
+
+#endif // Manta_Model_CachedImageTexture_h
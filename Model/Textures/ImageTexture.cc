@@ -49,12 +49,10 @@ namespace Manta {
 
   // This will potentially throw a InputError exception if there was a
   // problem.
-  ImageTexture<Color>* LoadColorImageTexture( const std::string& file_name,
-                                              std::ostream* stream,
-                                              bool linearize)
+  Image* LoadTextureImage( const std::string& file_name,
+                           std::ostream* stream )
   {
     if (stream) (*stream) << "Trying to load "<<file_name<<"\n";
-    if (linearize && stream) (*stream) << "Will linearize on input\n";
     Image *image = 0;
 
     // Load the image.
@@ -102,6 +100,18 @@ namespace Manta {
       }
     }
 
+    return image;
+  }
+
+  // This will potentially throw a InputError exception if there was a
+  // problem.
+  ImageTexture<Color>* LoadColorImageTexture( const std::string& file_name,
+                                              std::ostream* stream,
+                                              bool linearize)
+  {
+    if (linearize && stream) (*stream) << "Will linearize on input\n";
+    Image *image = LoadTextureImage( file_name, stream );
+
     // Create the texture.
     ImageTexture<Color> *texture = new ImageTexture<Color>(image, linearize);
 
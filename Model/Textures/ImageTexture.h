@@ -74,6 +74,13 @@ namespace Manta {
 
   template<typename ValueType> class ImageTexture;
 
+  // Reads file_name with whichever reader in Image/ supports it.  This
+  // will potentially throw a InputError exception if there was a
+  // problem.  If stream is non null it will write out chatty stuff to
+  // that.
+  Image* LoadTextureImage( const std::string& file_name,
+                           std::ostream* stream = 0 );
+
   // This will potentially throw a InputError exception if there was a
   // problem.  If stream is non null it will write out chatty stuff to
   // that.
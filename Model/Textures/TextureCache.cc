@@ -0,0 +1,544 @@
+/*
+  For more information, please see: http://software.sci.utah.edu
+
+  The MIT License
+
+  Copyright (c) 2005
+  Scientific Computing and Imaging Institue, University of Utah
+
+  License for the specific language governing rights and limitations under
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+#include <Model/Textures/TextureCache.h>
+#include <Model/Textures/ImageTexture.h>
+#include <Interface/Fragment.h>
+#include <Interface/Image.h>
+#include <Image/SimpleImageBase.h>
+
+#include <Core/Exceptions/InternalError.h>
+#include <Core/Math/MinMax.h>
+#include <Core/Thread/Thread.h>
+#include <Core/Util/AlignedAllocator.h>
+
+#include <iostream>
+
+using namespace Manta;
+using namespace std;
+
+class TextureCache::Tile {
+public:
+  Tile() : texels(0), width(0), height(0), pins(1), ready(false),
+           referenced(true) {}
+  ~Tile() { delete[] texels; }
+
+  Color* texels;
+  int width, height;
+  // Readers using the tile.  Pinned tiles are never evicted.
+  int pins;
+  // False while the thread that missed is still making the tile.
+  bool ready;
+  // Set by every lookup, cleared by the clock hand.
+  bool referenced;
+};
+
+struct TextureCache::Source {
+  Source() : lock("TextureCache source lock"), image(0), linearize(false),
+             xres(0), yres(0), numLevels(0), users(0) {}
+
+  Mutex lock;
+  // Empty for images that were handed to the cache, which cannot be
+  // read again and so are never evicted.
+  string file_name;
+  Image* image;
+  bool linearize;
+  int xres, yres, numLevels;
+  // Threads making level 0 tiles from image.
+  int users;
+};
+
+// Buckets are locked by different threads, so each gets its own cache
+// line; plain new does not honor that alignment.
+struct MANTA_ALIGN(MAXCACHELINESIZE) TextureCache::Bucket
+  : public AlignedAllocator<TextureCache::Bucket, MAXCACHELINESIZE> {
+  Bucket() : lock("TextureCache bucket lock"), hits(0), misses(0) {}
+
+  Mutex lock;
+  map<TileKey, Tile*> tiles;
+  size_t hits, misses;
+};
+
+static size_t imageBytes(const Image* image)
+{
+  bool stereo;
+  int xres, yres;
+  image->getResolution(stereo, xres, yres);
+  const SimpleImageBase* simple = dynamic_cast<const SimpleImageBase*>(image);
+  size_t pixelSize = simple ? simple->pixelSize() : 4;
+  return size_t(xres) * yres * (stereo ? 2 : 1) * pixelSize;
+}
+
+TextureCache::TextureCache(size_t memoryBudget)
+  : memoryBudget(memoryBudget),
+    accountingLock("TextureCache accounting lock"),
+    evictionLock("TextureCache eviction lock"),
+    bytes(0), peakBytes(0), tiles(0), evictions(0), sourceLoads(0),
+    sourceEvictions(0), clockHand(0)
+{
+  buckets.resize(NumBuckets);
+  for(int i = 0; i < NumBuckets; i++)
+    buckets[i] = new Bucket;
+}
+
+TextureCache::~TextureCache()
+{
+  for(int i = 0; i < NumBuckets; i++){
+    map<TileKey, Tile*>& bucketTiles = buckets[i]->tiles;
+    for(map<TileKey, Tile*>::iterator iter = bucketTiles.begin();
+        iter != bucketTiles.end(); ++iter)
+      delete iter->second;
+    delete buckets[i];
+  }
+  for(size_t i = 0; i < sources.size(); i++){
+    delete sources[i]->image;
+    delete sources[i];
+  }
+}
+
+TextureCache* TextureCache::getDefault()
+{
+  static TextureCache* defaultCache = new TextureCache();
+  return defaultCache;
+}
+
+int TextureCache::addTexture(const string& file_name, bool linearize)
+{
+  Source* source = new Source;
+  source->file_name = file_name;
+  source->linearize = linearize;
+  sources.push_back(source);
+  return static_cast<int>(sources.size()) - 1;
+}
+
+int TextureCache::addTexture(Image* image, bool linearize)
+{
+  bool stereo;
+  int xres, yres;
+  image->getResolution(stereo, xres, yres);
+  if (stereo)
+    throw InternalError( "TextureCache doesn't support stereo currently");
+
+  Source* source = new Source;
+  source->image = image;
+  source->linearize = linearize;
+  source->xres = xres;
+  source->yres = yres;
+  source->numLevels = 1;
+  while(getLevelSize(xres, source->numLevels-1) > 1 ||
+        getLevelSize(yres, source->numLevels-1) > 1)
+    source->numLevels++;
+  sources.push_back(source);
+  addBytes(imageBytes(image));
+  return static_cast<int>(sources.size()) - 1;
+}
+
+void TextureCache::getResolution(int texture, int& xres, int& yres)
+{
+  Source* source = sources[texture];
+  if(source->numLevels == 0){
+    loadSource(texture);
+    source->lock.lock();
+    source->users--;
+    source->lock.unlock();
+  }
+  xres = source->xres;
+  yres = source->yres;
+}
+
+int TextureCache::getNumLevels(int texture)
+{
+  int xres, yres;
+  getResolution(texture, xres, yres);
+  return sources[texture]->numLevels;
+}
+
+void TextureCache::setMemoryBudget(size_t bytes)
+{
+  memoryBudget = bytes;
+  evict(true);
+}
+
+TextureCache::Statistics TextureCache::getStatistics() const
+{
+  Statistics stats;
+  stats.hits = 0;
+  stats.misses = 0;
+  for(int i = 0; i < NumBuckets; i++){
+    buckets[i]->lock.lock();
+    stats.hits += buckets[i]->hits;
+    stats.misses += buckets[i]->misses;
+    buckets[i]->lock.unlock();
+  }
+  accountingLock.lock();
+  stats.evictions = evictions;
+  stats.sourceLoads = sourceLoads;
+  stats.sourceEvictions = sourceEvictions;
+  stats.tiles = tiles;
+  stats.bytes = bytes;
+  stats.peakBytes = peakBytes;
+  accountingLock.unlock();
+  return stats;
+}
+
+void TextureCache::resetStatistics()
+{
+  for(int i = 0; i < NumBuckets; i++){
+    buckets[i]->lock.lock();
+    buckets[i]->hits = 0;
+    buckets[i]->misses = 0;
+    buckets[i]->lock.unlock();
+  }
+  accountingLock.lock();
+  evictions = 0;
+  sourceLoads = 0;
+  sourceEvictions = 0;
+  peakBytes = bytes;
+  accountingLock.unlock();
+}
+
+void TextureCache::printStatistics(ostream& out) const
+{
+  Statistics stats = getStatistics();
+  size_t lookups = stats.hits + stats.misses;
+  out << "TextureCache: " << lookups << " tile lookups, "
+      << stats.hits << " hits";
+  if(lookups)
+    out << " (" << 100.0 * stats.hits / lookups << "%)";
+  out << ", " << stats.misses << " misses, "
+      << stats.evictions << " evictions\n"
+      << "  " << stats.sourceLoads << " source images read, "
+      << stats.sourceEvictions << " evicted\n"
+      << "  " << stats.tiles << " tiles, "
+      << stats.bytes / (1024.0*1024.0) << " MB resident (peak "
+      << stats.peakBytes / (1024.0*1024.0) << " MB, budget "
+      << memoryBudget / (1024.0*1024.0) << " MB)\n";
+}
+
+TextureCache::Bucket& TextureCache::getBucket(const TileKey& key) const
+{
+  unsigned int hash = (key.texture * 73856093u) ^ (key.level * 19349663u)
+    ^ (key.x * 83492791u) ^ (key.y * 2654435761u);
+  return *buckets[hash % NumBuckets];
+}
+
+TextureCache::Tile* TextureCache::acquireTile(const TileKey& key)
+{
+  Bucket& bucket = getBucket(key);
+  for(;;){
+    bucket.lock.lock();
+    map<TileKey, Tile*>::iterator iter = bucket.tiles.find(key);
+    if(iter == bucket.tiles.end())
+      break;
+    Tile* tile = iter->second;
+    if(tile->ready){
+      tile->pins++;
+      tile->referenced = true;
+      bucket.hits++;
+      bucket.lock.unlock();
+      return tile;
+    }
+    // Another thread is making the tile.
+    bucket.lock.unlock();
+    Thread::yield();
+  }
+
+  // Insert the tile pinned and not ready, so that nobody else makes or
+  // evicts it, and make it without holding the lock.
+  Tile* tile = new Tile;
+  bucket.tiles[key] = tile;
+  bucket.misses++;
+  bucket.lock.unlock();
+
+  try {
+    makeTile(key, tile);
+  } catch(...) {
+    // Let the next lookup try again rather than wait forever.
+    bucket.lock.lock();
+    bucket.tiles.erase(key);
+    bucket.lock.unlock();
+    delete tile;
+    throw;
+  }
+
+  bucket.lock.lock();
+  tile->ready = true;
+  bucket.lock.unlock();
+
+  accountingLock.lock();
+  tiles++;
+  accountingLock.unlock();
+  addBytes(sizeof(Tile) + tile->width * tile->height * sizeof(Color));
+  return tile;
+}
+
+void TextureCache::releaseTile(const TileKey& key, Tile* tile)
+{
+  Bucket& bucket = getBucket(key);
+  bucket.lock.lock();
+  tile->pins--;
+  bucket.lock.unlock();
+}
+
+TextureCache::Source* TextureCache::loadSource(int texture)
+{
+  Source* source = sources[texture];
+  size_t loaded = 0;
+  source->lock.lock();
+  if(!source->image){
+    try {
+      source->image = LoadTextureImage(source->file_name);
+    } catch(...) {
+      source->lock.unlock();
+      throw;
+    }
+    bool stereo;
+    source->image->getResolution(stereo, source->xres, source->yres);
+    source->numLevels = 1;
+    while(getLevelSize(source->xres, source->numLevels-1) > 1 ||
+          getLevelSize(source->yres, source->numLevels-1) > 1)
+      source->numLevels++;
+
+    loaded = imageBytes(source->image);
+  }
+  source->users++;
+  source->lock.unlock();
+
+  // Not under the lock, since this may evict source images.
+  if(loaded){
+    accountingLock.lock();
+    sourceLoads++;
+    accountingLock.unlock();
+    addBytes(loaded);
+  }
+  return source;
+}
+
+void TextureCache::makeTile(const TileKey& key, Tile* tile)
+{
+  Source* source = sources[key.texture];
+  int xres, yres;
+  getResolution(key.texture, xres, yres);
+  int levelXres = getLevelSize(xres, key.level);
+  int levelYres = getLevelSize(yres, key.level);
+  int x0 = key.x * TileSize;
+  int y0 = key.y * TileSize;
+  tile->width = Min(TileSize, levelXres - x0);
+  tile->height = Min(TileSize, levelYres - y0);
+  if(tile->width <= 0 || tile->height <= 0)
+    throw InternalError("TextureCache tile outside of the texture");
+  tile->texels = new Color[tile->width * tile->height];
+
+  if(key.level == 0){
+    // Copy the tile out of the source image.
+    loadSource(key.texture);
+    for(int y = 0; y < tile->height; y++){
+      Color* row = tile->texels + y * tile->width;
+      for(int x = 0; x < tile->width; x += Fragment::MaxSize){
+        int end = Min(x + Fragment::MaxSize, tile->width);
+        Fragment fragment(x0 + x, x0 + end, y0 + y, 0);
+        source->image->get(fragment);
+        for(int i = fragment.begin(); i < fragment.end(); i++){
+          Color value = fragment.getColor(i);
+          if(source->linearize)
+            for (int c = 0; c < Color::NumComponents; c++)
+              value[c] = Color::linearize(value[c]);
+          row[x + i] = value;
+        }
+      }
+    }
+    source->lock.lock();
+    source->users--;
+    source->lock.unlock();
+  } else {
+    // Average 2x2 texels of the level below.  At odd sizes the last
+    // texel is repeated.
+    int fineXres = getLevelSize(xres, key.level-1);
+    int fineYres = getLevelSize(yres, key.level-1);
+    Reader reader(this);
+    for(int y = 0; y < tile->height; y++){
+      int fy0 = 2*(y0 + y);
+      int fy1 = Min(fy0 + 1, fineYres - 1);
+      fy0 = Min(fy0, fineYres - 1);
+      for(int x = 0; x < tile->width; x++){
+        int fx0 = 2*(x0 + x);
+        int fx1 = Min(fx0 + 1, fineXres - 1);
+        fx0 = Min(fx0, fineXres - 1);
+        Color sum = (reader.getTexel(key.texture, key.level-1, fx0, fy0) +
+                     reader.getTexel(key.texture, key.level-1, fx1, fy0) +
+                     reader.getTexel(key.texture, key.level-1, fx0, fy1) +
+                     reader.getTexel(key.texture, key.level-1, fx1, fy1));
+        tile->texels[y * tile->width + x] = sum * 0.25f;
+      }
+    }
+  }
+}
+
+void TextureCache::addBytes(long added)
+{
+  accountingLock.lock();
+  bytes += added;
+  if(bytes > peakBytes)
+    peakBytes = bytes;
+  bool over = bytes > memoryBudget;
+  bool farOver = bytes > memoryBudget + memoryBudget / 4;
+  accountingLock.unlock();
+  if(over)
+    evict(farOver);
+}
+
+void TextureCache::evict(bool wait)
+{
+  // One thread evicts at a time.  The others keep going over budget
+  // until it is done, unless they are far over.
+  if(wait)
+    evictionLock.lock();
+  else if(!evictionLock.tryLock())
+    return;
+
+  // Evict down to 90% of the budget, so that a full cache does not
+  // sweep on every miss.
+  size_t target = memoryBudget - memoryBudget / 10;
+
+  accountingLock.lock();
+  int hand = clockHand;
+  size_t current = bytes;
+  accountingLock.unlock();
+
+  // Two passes over the buckets clear every reference bit once and
+  // then evict whatever has not been used since.
+  for(int visited = 0; visited < 2*NumBuckets && current > target; visited++){
+    Bucket& bucket = *buckets[hand];
+    hand = (hand + 1) % NumBuckets;
+
+    size_t freed = 0, numEvicted = 0;
+    bucket.lock.lock();
+    map<TileKey, Tile*>::iterator iter = bucket.tiles.begin();
+    while(iter != bucket.tiles.end() && current - freed > target){
+      Tile* tile = iter->second;
+      if(tile->pins > 0 || !tile->ready){
+        ++iter;
+      } else if(tile->referenced){
+        tile->referenced = false;
+        ++iter;
+      } else {
+        freed += sizeof(Tile) + tile->width * tile->height * sizeof(Color);
+        numEvicted++;
+        delete tile;
+        bucket.tiles.erase(iter++);
+      }
+    }
+    bucket.lock.unlock();
+
+    accountingLock.lock();
+    bytes -= freed;
+    tiles -= numEvicted;
+    evictions += numEvicted;
+    current = bytes;
+    accountingLock.unlock();
+  }
+
+  // Then the source images that can be read again.
+  for(size_t i = 0; i < sources.size() && current > target; i++){
+    Source* source = sources[i];
+    size_t freed = 0;
+    source->lock.lock();
+    if(source->image && !source->file_name.empty() && source->users == 0){
+      freed = imageBytes(source->image);
+      delete source->image;
+      source->image = 0;
+    }
+    source->lock.unlock();
+    if(freed){
+      accountingLock.lock();
+      bytes -= freed;
+      sourceEvictions++;
+      current = bytes;
+      accountingLock.unlock();
+    }
+  }
+
+  accountingLock.lock();
+  clockHand = hand;
+  accountingLock.unlock();
+  evictionLock.unlock();
+}
+
+TextureCache::Reader::Reader(TextureCache* cache)
+  : cache(cache), numTiles(0)
+{
+}
+
+TextureCache::Reader::~Reader()
+{
+  release();
+}
+
+Color TextureCache::Reader::getTexel(int texture, int level, int x, int y)
+{
+  int tx = x / TileSize;
+  int ty = y / TileSize;
+  Tile* tile = 0;
+  for(int i = 0; i < numTiles; i++){
+    if(keys[i][0] == texture && keys[i][1] == level &&
+       keys[i][2] == tx && keys[i][3] == ty){
+      tile = tiles[i];
+      break;
+    }
+  }
+  if(!tile){
+    if(numTiles == MaxTiles)
+      release();
+    TileKey key;
+    key.texture = texture;
+    key.level = level;
+    key.x = tx;
+    key.y = ty;
+    tile = cache->acquireTile(key);
+    keys[numTiles][0] = texture;
+    keys[numTiles][1] = level;
+    keys[numTiles][2] = tx;
+    keys[numTiles][3] = ty;
+    tiles[numTiles] = tile;
+    numTiles++;
+  }
+  return tile->texels[(y - ty*TileSize) * tile->width + (x - tx*TileSize)];
+}
+
+void TextureCache::Reader::release()
+{
+  for(int i = 0; i < numTiles; i++){
+    TileKey key;
+    key.texture = keys[i][0];
+    key.level = keys[i][1];
+    key.x = keys[i][2];
+    key.y = keys[i][3];
+    cache->releaseTile(key, tiles[i]);
+  }
+  numTiles = 0;
+}
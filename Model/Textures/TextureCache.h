@@ -0,0 +1,187 @@
+/*
+  For more information, please see: http://software.sci.utah.edu
+
+  The MIT License
+
+  Copyright (c) 2005
+  Scientific Computing and Imaging Institue, University of Utah
+
+  License for the specific language governing rights and limitations under
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  A texture cache shared by any number of CachedImageTextures.
+
+  Every texture is stored as a MIP pyramid of Color texels cut into
+  TileSize x TileSize tiles.  Nothing is read when a texture is added;
+  the source image is read by the Image/ readers when the first tile of
+  the texture is needed, and the tiles of every level are made when
+  they are first used (level 0 from the source image, coarser levels by
+  averaging the level below).
+
+  When the tiles and source images take more than the memory budget,
+  the tiles that have not been used since the last sweep are evicted
+  (the clock algorithm) and then the source images that can be read
+  again.  Evicted tiles are simply made again when they are needed.
+
+  Render threads read texels through a TextureCache::Reader, which
+  keeps the tiles it has used from being evicted until it is destroyed.
+  Textures must not be added while rendering.
+*/
+
+#ifndef Manta_Model_TextureCache_h
+#define Manta_Model_TextureCache_h
+
+#include <Core/Color/Color.h>
+#include <Core/Thread/Mutex.h>
+#include <Core/Util/Align.h>
+#include <Parameters.h>
+
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Manta {
+
+  class Image;
+
+  class TextureCache {
+  public:
+    // Width and height of a tile in texels.
+    static const int TileSize = 64;
+
+    TextureCache(size_t memoryBudget = 512*1024*1024);
+    ~TextureCache();
+
+    // A cache that textures can share when nobody passes them another.
+    static TextureCache* getDefault();
+
+    // Returns the id of a texture that is read from file_name when it is
+    // first needed, and read again if it was evicted.  Textures are
+    // converted to linear color when linearize is true.
+    int addTexture(const std::string& file_name, bool linearize = false);
+
+    // Returns the id of a texture made from image.  The cache takes
+    // ownership of image and never evicts it.
+    int addTexture(Image* image, bool linearize = false);
+
+    // Resolution of level 0 and the number of MIP levels, down to 1x1.
+    // These read the source image if it has not been read yet.
+    void getResolution(int texture, int& xres, int& yres);
+    int getNumLevels(int texture);
+
+    static int getLevelSize(int size, int level) {
+      size >>= level;
+      return size > 0 ? size : 1;
+    }
+
+    void setMemoryBudget(size_t bytes);
+    size_t getMemoryBudget() const {
+      return memoryBudget;
+    }
+
+    struct Statistics {
+      size_t hits;          // Tile lookups that found the tile
+      size_t misses;        // Tile lookups that had to make the tile
+      size_t evictions;     // Tiles evicted
+      size_t sourceLoads;   // Source images read
+      size_t sourceEvictions;
+      size_t tiles;         // Tiles resident now
+      size_t bytes;         // Bytes of tiles and source images resident now
+      size_t peakBytes;
+    };
+    Statistics getStatistics() const;
+    void resetStatistics();
+    void printStatistics(std::ostream& out) const;
+
+    class Tile;
+
+    // Reads the texels of one thread.  Tiles stay resident until the
+    // reader is destroyed, so keep one only for as long as a packet.
+    class Reader {
+    public:
+      Reader(TextureCache* cache);
+      ~Reader();
+
+      // x and y must lie inside the level.
+      Color getTexel(int texture, int level, int x, int y);
+
+      // Lets the cache evict the tiles read so far.
+      void release();
+
+    private:
+      Reader(const Reader&);
+      Reader& operator=(const Reader&);
+
+      enum { MaxTiles = 16 };
+      TextureCache* cache;
+      int numTiles;
+      int keys[MaxTiles][4];
+      Tile* tiles[MaxTiles];
+    };
+
+  private:
+    TextureCache(const TextureCache&);
+    TextureCache& operator=(const TextureCache&);
+
+    struct Source;
+    struct Bucket;
+
+    struct TileKey {
+      int texture, level, x, y;
+      bool operator<(const TileKey& k) const {
+        if(texture != k.texture) return texture < k.texture;
+        if(level != k.level)     return level < k.level;
+        if(y != k.y)             return y < k.y;
+        return x < k.x;
+      }
+    };
+
+    enum { NumBuckets = 64 };
+    Bucket& getBucket(const TileKey& key) const;
+
+    Tile* acquireTile(const TileKey& key);
+    void releaseTile(const TileKey& key, Tile* tile);
+    void makeTile(const TileKey& key, Tile* tile);
+    Source* loadSource(int texture);
+    void addBytes(long bytes);
+    void evict(bool wait);
+
+    std::vector<Source*> sources;
+    std::vector<Bucket*> buckets;
+    size_t memoryBudget;
+
+    // Guards the byte counts, the statistics that are not counted per
+    // bucket, and the clock hand.
+    mutable Mutex accountingLock;
+    Mutex evictionLock;
+    size_t bytes;
+    size_t peakBytes;
+    size_t tiles;
+    size_t evictions;
+    size_t sourceLoads;
+    size_t sourceEvictions;
+    int clockHand;
+  };
+
+} // end namespace Manta
+
+#endif // Manta_Model_TextureCache_h
@@ -38,6 +38,7 @@
 #include <Interface/Camera.h>
 #include <Interface/UserInterface.h>
 #include <Interface/Context.h>
+#include <Interface/FrameProfile.h>
 #include <Core/Geometry/BBox.h>
 #include <Core/Exceptions/Exception.h>
 #include <Core/Exceptions/InternalError.h>
@@ -119,6 +120,12 @@ static void usage(Factory* rtrt)
   cerr << " -bench [N [M]]  - Time N frames after an M frame warmup period and print out the framerate,\n";
   cerr << "                   default N=100, M=10\n";
   cerr << " -np N           - Use N processors\n";
+  cerr << " -affinity S     - Pin render threads to processors, S is compact (fill\n";
+  cerr << "                   one socket first), scatter (round robin over sockets)\n";
+  cerr << "                   or none (the default, leave it to the OS)\n";
+  cerr << " -frameprofile F - Record the time every thread spends in each stage of\n";
+  cerr << "                   every frame, print a summary and write a Chrome trace\n";
+  cerr << "                   (chrome://tracing) to F on exit\n";
   cerr << " -res NxM        - Use N by M pixels for rendering (needs the x).\n";
   cerr << " -imagedisplay S - Use image display mode named S, valid modes are:\n";
   printList(cerr, rtrt->listImageDisplays(), 4);
@@ -304,6 +311,7 @@ main(int argc, char* argv[])
     Color bgcolor;
     bool override_scene_bgcolor = false;
     int maxDepth = -1;          // -1 is invalid and represent unset state.
+    string frameProfileFile;
 
 
     // Parse command line args.
@@ -432,6 +440,23 @@ main(int argc, char* argv[])
             usage(factory);
           rtrt->changeNumWorkers(static_cast<int>(np));
 
+        } else if(arg == "-affinity"){
+          string s;
+          if(!getStringArg(i, args, s))
+            usage(factory);
+          if(s == "compact")
+            Thread::setPlacementPolicy(Thread::CompactPlacement);
+          else if(s == "scatter")
+            Thread::setPlacementPolicy(Thread::ScatterPlacement);
+          else if(s == "none")
+            Thread::setPlacementPolicy(Thread::NoPlacement);
+          else
+            throw IllegalArgument( s, i, args );
+
+        } else if(arg == "-frameprofile"){
+          if(!getStringArg(i, args, frameProfileFile))
+            usage(factory);
+
         } else if(arg == "-ui"){
           string s;
           if(!getStringArg(i, args, s))
@@ -616,8 +641,25 @@ main(int argc, char* argv[])
     // If maxDepth is < 0, this function has no effect.
     rtrt->getScene()->getRenderParameters().setMaxDepth(maxDepth);
 
+    FrameProfile* frameProfile = 0;
+    if(!frameProfileFile.empty()){
+      // Leave room for workers added while running.
+      int maxThreads = rtrt->numWorkers();
+      if(maxThreads < Thread::numProcessors())
+        maxThreads = Thread::numProcessors();
+      frameProfile = new FrameProfile(maxThreads);
+      rtrt->setFrameProfile(frameProfile);
+    }
+
     rtrt->beginRendering(true);
 
+    if(frameProfile){
+      rtrt->setFrameProfile(0);
+      frameProfile->printSummary(cerr);
+      frameProfile->writeChromeTrace(frameProfileFile);
+      delete frameProfile;
+    }
+
     //manually delete
 #ifdef USE_MPI
     if (rank == 0) {
@@ -8,7 +8,7 @@
 #include <Interface/Scene.h>
 #include <Model/AmbientLights/ConstantAmbient.h>
 #include <Model/Backgrounds/ConstantBackground.h>
-#include <Model/Groups/DynBVH.h>
+#include <Model/Groups/InstanceBVH.h>
 #include <Model/Groups/Group.h>
 #include <Model/Groups/ObjGroup.h>
 #include <Model/Instances/Instance.h>
@@ -450,7 +450,9 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
   //makeRandomStuff(group);
   scene->setBackground( new ConstantBackground( Color(RGB(0.9, 0.9, 0.9) ) ) );
 
-  DynBVH* bvh = new DynBVH();
+  // The bugs and the trees are instanced, so each gets one BVH that
+  // all of its instances share.
+  InstanceBVH* bvh = new InstanceBVH();
   bvh->setGroup(group);
   scene->setObject(bvh);
   //scene->setObject(group);
@@ -12,6 +12,7 @@
   -cube_scale - scale the bounding cube the primitives are rendered into
   -material - use a named shader instead of a constant color [lambertian, constant, null]
   -DynBVH - use DynBVH as the acceleration structure [default]
+  -InstanceBVH - use a two level InstanceBVH over the instances
   -CGT - use CGT as the acceleration structure
 
   Here are some example command lines:
@@ -45,6 +46,7 @@
 #include <Model/MiscObjects/Intersection.h>
 #include <Model/MiscObjects/KeyFrameAnimation.h>
 #include <Model/Groups/DynBVH.h>
+#include <Model/Groups/InstanceBVH.h>
 #include <Model/Groups/KDTree.h>
 #include <Model/Groups/Group.h>
 #include <Model/Groups/Mesh.h>
@@ -105,6 +107,9 @@ AccelerationStructure* getAS(string type)
   if(type == "KDTree")
     return new KDTree();
 
+  if(type == "InstanceBVH")
+    return new InstanceBVH();
+
 #ifdef USE_PRIVATE_CODE
   if(type == "CGT")
     return new Grid();
@@ -179,6 +184,8 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
       acc_struct = "CGT";
     } else if (arg == "-KDTree") {
       acc_struct = "KDTree";
+    } else if (arg == "-InstanceBVH") {
+      acc_struct = "InstanceBVH";
     } else if (arg == "-no_instances") {
       no_instances = true;
     } else {
@@ -17,6 +17,7 @@
 #include <Model/Groups/BSP/BSP.h>
 #include <Model/Groups/CellSkipper.h>
 #include <Model/Groups/DynBVH.h>
+#include <Model/Groups/MBVH.h>
 #include <Model/Groups/Group.h>
 #include <Model/Groups/KDTree.h>
 #include <Model/Groups/ObjGroup.h>
@@ -32,6 +33,7 @@
 #include <Model/Lights/PointLight.h>
 #include <Model/Lights/AreaLight.h>
 #include <Model/MiscObjects/KeyFrameAnimation.h>
+#include <Model/MiscObjects/TimeStepStreamer.h>
 #include <Model/Primitives/Parallelogram.h>
 #include <Model/Readers/PlyReader.h>
 #include <Model/Readers/IW.h>
@@ -42,6 +44,7 @@
 #include <Model/Primitives/Parallelogram.h>
 #include <Model/Textures/CheckerTexture.h>
 #include <Model/Textures/ImageTexture.h>
+#include <Model/Textures/TextureCache.h>
 #include <Model/TexCoordMappers/LinearMapper.h>
 
 
@@ -103,18 +106,31 @@ void argumentError(int i, const vector<string>& args) {
   cerr << "Valid options for scene meshViewer:\n";
   cerr << " -BSP   - use BSP acceleration structure\n";
   cerr << " -DynBVH   - use DynBVH acceleration structure\n";
+  cerr << " -MBVH     - use a DynBVH traced through a 4 wide tree\n";
+  cerr << " -MBVH8    - use a DynBVH traced through an 8 wide tree\n";
+  cerr << " -MBVHQ    - -MBVH with quantized nodes\n";
+  cerr << " -MBVH8Q   - -MBVH8 with quantized nodes\n";
+  cerr << " -spatialSplits [budget] - build the DynBVH or MBVH with spatial splits,\n"
+       << "             making up to budget (e.g. 0.3) extra references per object.\n";
+  cerr << " -backgroundRebuild [ratio] - keep refitting the DynBVH or MBVH of a\n"
+       << "             -smoothAnimation, and rebuild it on a background thread once\n"
+       << "             its SAH cost is ratio (e.g. 1.3) times what it was when built.\n";
 #ifdef USE_PRIVATE_CODE
   cerr << " -CGT      - use Coherent Grid Traversal acceleration structure\n";
 #endif
   cerr << " -KDTree   - use KDTree acceleration structure\n";
   cerr << " -CellSkipper - use CellSkipper grid acceleration structure\n";
   cerr << " -rgrid    - use single ray recursive grid acceleration structure\n";
+  cerr << " -RFGraph  - use RFGraph acceleration structure\n";
+  cerr << " -RFGraphMapped - RFGraph, tracing a -load cache file in place\n";
   cerr << " -model    - Required. The file to load (obj, ply, iw, or m file)\n";
   cerr << "             Can call this multiple times to load an animation.\n";
   cerr << " -save [filename]    - save acceleration structure to file (currently kdtree and bsp).\n";
   cerr << " -load [filename]    - load acceleration structure from file (currently kdtree and bsp).\n";
   cerr << " -saveOBJ [filename] - convert the mesh to an OBJ and MTL file (omit filename extension).\n";
   cerr << " -animationLength    - Number of seconds animation takes\n";
+  cerr << " -streamFrames N     - keep only N frames of an animation in memory, loading\n"
+       << "                       the upcoming ones (each with its own DynBVH) while it plays.\n";
   cerr << " -interpolateNormals - creates vertex normals if the data does not already contain vertex normals.\n";
   cerr << " -useFaceNormals     - force to use only face normals\n";
   cerr << " -smoothAnimation    - interpolates between keyframes.\n";
@@ -128,13 +144,15 @@ void argumentError(int i, const vector<string>& args) {
   cerr << " -ambient            - Type of ambient lighting to use.\n";
   cerr << "                     - arc, AO {bounce} {samples N}, constant, eye.\n";
   cerr << " -addFloor           - Adds a checkered floor.\n";
+  cerr << " -textureCache MB    - Keep the texture maps of obj files in a MIP mapped\n";
+  cerr << "                       texture cache of MB megabytes, read on demand.\n";
   cerr << " -background         - color R G B, image file, bgColor r g b, bgAngle radians, real (the current background) ";
   throw IllegalArgument("scene triangleSceneViewer", i, args);
 }
 
 Mesh* LoadModel(std::string modelName, Material* defaultMatl, Material *overrideMatl,
     MeshTriangle::TriangleType triangleType, bool useFaceNormals,
-    bool interpolateNormals ) {
+    bool interpolateNormals, TextureCache* textureCache ) {
   Mesh* frame = NULL;
   if (!strncmp(modelName.c_str()+modelName.length()-4, ".ply", 4)) {
     frame = new Mesh;
@@ -170,7 +188,8 @@ Mesh* LoadModel(std::string modelName, Material* defaultMatl, Material *override
     }
   }
   else if (!strncmp(modelName.c_str()+modelName.length()-4, ".obj", 4)) {
-    frame = new ObjGroup(modelName.c_str(), defaultMatl, triangleType);
+    frame = new ObjGroup(modelName.c_str(), defaultMatl, triangleType,
+                         textureCache);
   }
   else if (!strncmp(modelName.c_str()+modelName.length()-3, ".iw", 3)) {
     frame = readIW(modelName, triangleType);
@@ -242,6 +261,46 @@ Mesh* LoadModel(std::string modelName, Material* defaultMatl, Material *override
   return frame;
 }
 
+// Loads the frames of a streamed animation.  Each frame gets a DynBVH of
+// its own, built when the streamer preprocesses it.
+class MeshStreamLoader : public TimeStepStreamer::Loader {
+public:
+  MeshStreamLoader(const vector<string>& fileNames, Material* defaultMatl,
+                   Material* overrideMatl,
+                   MeshTriangle::TriangleType triangleType,
+                   bool useFaceNormals, bool interpolateNormals,
+                   TextureCache* textureCache) :
+    fileNames(fileNames), defaultMatl(defaultMatl), overrideMatl(overrideMatl),
+    triangleType(triangleType), useFaceNormals(useFaceNormals),
+    interpolateNormals(interpolateNormals), textureCache(textureCache)
+  {
+  }
+
+  Object* load(int step) {
+    Mesh* frame = LoadModel(fileNames[step], defaultMatl, overrideMatl,
+                            triangleType, useFaceNormals, interpolateNormals,
+                            textureCache);
+    DynBVH* bvh = new DynBVH(false);
+    bvh->setGroup(frame);
+    return bvh;
+  }
+
+  void unload(int, Object* object) {
+    DynBVH* bvh = static_cast<DynBVH*>(object);
+    delete bvh->getGroup();
+    delete bvh;
+  }
+
+private:
+  vector<string> fileNames;
+  Material* defaultMatl;
+  Material* overrideMatl;
+  MeshTriangle::TriangleType triangleType;
+  bool useFaceNormals;
+  bool interpolateNormals;
+  TextureCache* textureCache;
+};
+
 Material* stringToMaterial(string matlName) {
   Material* result = 0;
   if (matlName == "flat" ||
@@ -377,16 +436,20 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
   bool fixedAnimation = false;
   bool noLoop = false;
   float animationLength = 5; //in seconds
+  int streamFrames = 0;
   Material* overrideMatl = 0;
   Material* defaultMatl  = 0;
   bool setModel = false;
   bool setLight = false;
   bool addFloor = false;
+  TextureCache* textureCache = 0;
   Vector lightPosition;
   Color lightColor = Color::white();
   MeshTriangle::TriangleType triangleType = MeshTriangle::KENSLER_SHIRLEY_TRI;
   Background* background = NULL;
 
+  double spatialSplitBudget = 0;
+  double backgroundRebuild = 0;
   string saveName;
   string loadName;
   string saveOBJName;
@@ -407,6 +470,18 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
     } else if (arg == "-DynBVH") {
       delete as;
       as = new DynBVH;
+    } else if (arg == "-MBVH") {
+      delete as;
+      as = new MBVH(4);
+    } else if (arg == "-MBVH8") {
+      delete as;
+      as = new MBVH(8);
+    } else if (arg == "-MBVHQ") {
+      delete as;
+      as = new MBVH(4, true, MBVH::QuantizedNodes);
+    } else if (arg == "-MBVH8Q") {
+      delete as;
+      as = new MBVH(8, true, MBVH::QuantizedNodes);
     } else if (arg == "-KDTree") {
       delete as;
       as = new KDTree;
@@ -419,6 +494,9 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
     } else if (arg == "-RFGraph") {
       delete as;
       as = new RFGraph;
+    } else if (arg == "-RFGraphMapped") {
+      delete as;
+      as = new RFGraph(RFGraph::LoadMapped);
     } else if (arg == "-Rayforce") {
       delete as;
       as = new Rayforce;
@@ -432,6 +510,12 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
 #else
       throw IllegalArgument("CGT is not available to you.", i, args);
 #endif
+    } else if (arg == "-spatialSplits") {
+      if (!getDoubleArg(i, args, spatialSplitBudget) || spatialSplitBudget <= 0)
+        throw IllegalArgument("scene MeshLoader -spatialSplits", i, args);
+    } else if (arg == "-backgroundRebuild") {
+      if (!getDoubleArg(i, args, backgroundRebuild) || backgroundRebuild <= 1)
+        throw IllegalArgument("scene MeshLoader -backgroundRebuild", i, args);
     } else if(arg == "-save"){
       if (!getStringArg(i, args, saveName))
         throw IllegalArgument("wrong argument to -save", i, args);
@@ -444,6 +528,9 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
     } else if (arg == "-animationLength") {
       if(!getArg<float>(i, args, animationLength))
         throw IllegalArgument("scene MeshLoader -animationLength", i, args);
+    } else if (arg == "-streamFrames") {
+      if(!getIntArg(i, args, streamFrames) || streamFrames < 1)
+        throw IllegalArgument("scene MeshLoader -streamFrames", i, args);
     } else if (arg == "-interpolateNormals") {
       interpolateNormals = true;
     } else if (arg == "-useFaceNormals") {
@@ -454,6 +541,12 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
       fixedAnimation = true;
     } else if (arg == "-addFloor") {
       addFloor = true;
+    } else if (arg == "-textureCache") {
+      long megabytes;
+      if (!getLongArg(i, args, megabytes) || megabytes <= 0)
+        throw IllegalArgument("scene triangleSceneViewer -textureCache", i, args);
+      textureCache = TextureCache::getDefault();
+      textureCache->setMemoryBudget(size_t(megabytes)*1024*1024);
     } else if (arg == "-background") {
       if (args[i+1] == "image") {
         i++;
@@ -599,6 +692,22 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
   if (args.empty() || !setModel)
     argumentError(0, args);
 
+  if (spatialSplitBudget > 0) {
+    DynBVH* bvh = dynamic_cast<DynBVH*>(as);
+    if (!bvh)
+      throw IllegalArgument("scene MeshLoader -spatialSplits needs -DynBVH or -MBVH",
+                            0, args);
+    bvh->setSpatialSplitBudget(spatialSplitBudget);
+  }
+
+  if (backgroundRebuild > 0) {
+    DynBVH* bvh = dynamic_cast<DynBVH*>(as);
+    if (!bvh)
+      throw IllegalArgument("scene MeshLoader -backgroundRebuild needs -DynBVH or -MBVH",
+                            0, args);
+    bvh->setBackgroundRebuild(backgroundRebuild);
+  }
+
   Group* group = new Group();
 
   string modelName = fileNames[0];
@@ -618,14 +727,26 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
       animation->setInterpolation(KeyFrameAnimation::fixed);
 
     group->add(animation);
-    animation->useAccelerationStructure(as);
-
-    for (size_t i=0; i < fileNames.size(); ++i) {
-      modelName = fileNames[i];
-      cout << "loading " << modelName <<endl;
-      Mesh* frame = LoadModel(modelName, defaultMatl, overrideMatl, triangleType,
-          useFaceNormals, interpolateNormals);
-      animation->push_back(frame);
+
+    if (streamFrames > 0) {
+      // Streamed frames are played without interpolation.
+      animation->useStreamer
+        (new TimeStepStreamer(new MeshStreamLoader(fileNames, defaultMatl,
+                                                   overrideMatl, triangleType,
+                                                   useFaceNormals,
+                                                   interpolateNormals,
+                                                   textureCache),
+                              fileNames.size(), streamFrames));
+    } else {
+      animation->useAccelerationStructure(as);
+
+      for (size_t i=0; i < fileNames.size(); ++i) {
+        modelName = fileNames[i];
+        cout << "loading " << modelName <<endl;
+        Mesh* frame = LoadModel(modelName, defaultMatl, overrideMatl, triangleType,
+            useFaceNormals, interpolateNormals, textureCache);
+        animation->push_back(frame);
+      }
     }
 
     animation->lockFrames(false);
@@ -636,7 +757,7 @@ Scene* make_scene(const ReadContext&, const vector<string>& args)
     // If we're just a single mesh, load it directly instead of using
     // the animation class.
     Mesh* singleFrame = LoadModel(fileNames[0], defaultMatl, overrideMatl, triangleType,
-        useFaceNormals, interpolateNormals);
+        useFaceNormals, interpolateNormals, textureCache);
     as->setGroup(singleFrame);
 
     if (!saveOBJName.empty())
@@ -77,6 +77,10 @@ Scene* make_scene(const ReadContext& context, const vector<string>& args)
   string cMapFile = "";
   int depth = 2;
   string volFile = "";
+  string brickFile = "";
+  string writeBrickFile = "";
+  int brickSize = 16;
+  int brickMemory = 512;
   RGBAColorMap* cMap = NULL;
   size_t argc = args.size();
   vector<ColorSlice> slices;
@@ -111,6 +115,26 @@ Scene* make_scene(const ReadContext& context, const vector<string>& args)
         if(!getStringArg(i, args, volFile))
                 throw IllegalArgument("scene volumeTest -i", i, args);
     }
+    else if(arg == "-bricks")
+    {
+        if(!getStringArg(i, args, brickFile))
+                throw IllegalArgument("scene volumeTest -bricks", i, args);
+    }
+    else if(arg == "-brickMemory")
+    {
+        if(!getIntArg(i, args, brickMemory))
+                throw IllegalArgument("scene volumeTest -brickMemory", i, args);
+    }
+    else if(arg == "-writeBricks")
+    {
+        if(!getStringArg(i, args, writeBrickFile))
+                throw IllegalArgument("scene volumeTest -writeBricks", i, args);
+    }
+    else if(arg == "-brickSize")
+    {
+        if(!getIntArg(i, args, brickSize))
+                throw IllegalArgument("scene volumeTest -brickSize", i, args);
+    }
     else if (arg == "-depth") {
       if (!getIntArg(i, args, depth))
         throw IllegalArgument("scene volumeTest -depth", i, args);
@@ -152,6 +176,10 @@ Scene* make_scene(const ReadContext& context, const vector<string>& args)
       cerr<<"Valid options for scene pcgt:\n";
       cerr<<"  -depth <int>       depth of macrocells (1-5 is good, 2 default)\n";
       cerr<<"  -i <string>        input filename\n";
+      cerr<<"  -bricks <string>   brick file to read as it is rendered, instead of -i\n";
+      cerr<<"  -brickMemory <int> MB of bricks to keep in memory (512 default)\n";
+      cerr<<"  -writeBricks <string> write the -i volume to a brick file first\n";
+      cerr<<"  -brickSize <int>   cells along each side of a written brick (16 default)\n";
       cerr<<"  -minBound <float> <float> <float> minimum corner of bounding box\n";
       cerr<<"  -maxBound <float> <float> <float> maximum corner of bounding box\n";
       cerr<<"  -t <float>         t increment value for volume\n";
@@ -188,7 +216,17 @@ if(cMap == NULL)
 
 
   cMap->scaleAlphas(t_inc);
-  Volume<float>* mat = new Volume<float>(loadNRRDToGrid<float>(volFile), cMap, BBox(minBound, maxBound), t_inc, depth, dataMin, dataMax);
+  Volume<float>* mat;
+  if(brickFile != ""){
+    BrickedGridArray3<float>* bricks =
+      new BrickedGridArray3<float>(brickFile, (size_t)brickMemory*1024*1024);
+    mat = new Volume<float>(bricks, cMap, BBox(minBound, maxBound), t_inc, dataMin, dataMax);
+  } else {
+    GridArray3<float>* grid = loadNRRDToGrid<float>(volFile);
+    if(writeBrickFile != "")
+      BrickedGridArray3<float>::write(writeBrickFile, *grid, brickSize);
+    mat = new Volume<float>(grid, cMap, BBox(minBound, maxBound), t_inc, depth, dataMin, dataMax);
+  }
   Primitive* prim = new Cube(mat, minBound, maxBound);
   group->add(prim);
 
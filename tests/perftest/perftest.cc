@@ -0,0 +1,803 @@
+
+//
+// Hot path microbenchmarks
+// This program measures the raw throughput of the kernels that dominate a
+// frame: primitive and acceleration structure intersection, shadow ray
+// generation and material shading.  Each kernel is driven directly with
+// synthetic packets, so no display, camera or load balancer is involved.
+//
+// Every kernel is run with coherent packets (neighboring pixels of a
+// pinhole camera, sharing one origin) and incoherent packets (random
+// origins and directions through the scene), at every packet size up to
+// RayPacket::MaxSize.  Results are printed one per line as
+//
+//   kernel  packets  size  rays_per_sec
+//
+// with '#' comment lines in between, so they can be saved and handed back
+// with -baseline to see the relative change of every measurement.  Larger
+// packet sizes need a build configured with a larger
+// MANTA_RAYPACKET_MAXSIZE.
+//
+// Per packet timings include filling the packet and resetting its hits, as
+// a camera has to do.
+//
+// The mesh loaders are measured the same way, loading the height field
+// from ASCII and binary PLY files and from an OBJ file (or the files given
+// with -ply and -obj), with the file format in place of the packets, the
+// number of threads in place of the packet size, and triangles per second.
+//
+
+#include <MantaTypes.h>
+#include <Core/Color/Color.h>
+#include <Core/Geometry/Ray.h>
+#include <Core/Geometry/Vector.h>
+#include <Core/Math/MT_RNG.h>
+#include <Core/Math/Trig.h>
+#include <Core/Thread/Thread.h>
+#include <Core/Thread/Time.h>
+#include <Core/Util/Args.h>
+#include <Engine/Shadows/HardShadows.h>
+#include <Engine/Shadows/NoShadows.h>
+#include <Interface/Context.h>
+#include <Interface/LightSet.h>
+#include <Interface/RayPacket.h>
+#include <Interface/RayPacketArena.h>
+#include <Interface/Scene.h>
+#include <Model/AmbientLights/ConstantAmbient.h>
+#include <Model/Groups/DynBVH.h>
+#include <Model/Groups/Group.h>
+#include <Model/Groups/InstanceBVH.h>
+#include <Model/Groups/MBVH.h>
+#include <Model/Groups/KDTree.h>
+#include <Model/Groups/Mesh.h>
+#include <Model/Groups/ObjGroup.h>
+#include <Model/Instances/Instance.h>
+#include <Model/Lights/PointLight.h>
+#include <Model/Materials/Phong.h>
+#include <Model/Primitives/KenslerShirleyTriangle.h>
+#include <Model/Primitives/Sphere.h>
+#include <Model/Readers/PlyReader.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace Manta;
+using namespace std;
+
+namespace {
+
+  // Image used to generate coherent rays.
+  const int ImageRes = 256;
+
+  // A ray together with the hit it produced when the pool was built, so
+  // that shading kernels can be handed packets that are already intersected.
+  struct PoolRay {
+    Vector origin;
+    Vector direction;
+    Real t;
+    const Material* matl;
+    const Primitive* prim;
+    const TexCoordMapper* tex;
+  };
+
+  struct Pool {
+    vector<PoolRay> rays;
+    bool constantOrigin;
+  };
+
+  // A height field of 2*res*res triangles over [-1,1]x[-1,1].
+  Mesh* makeTerrain(Material* matl, int res)
+  {
+    Mesh* mesh = new Mesh();
+    mesh->materials.push_back(matl);
+    for (int j = 0; j <= res; ++j) {
+      for (int i = 0; i <= res; ++i) {
+        Real x = -1 + 2 * Real(i) / res;
+        Real y = -1 + 2 * Real(j) / res;
+        Real z = Real(0.15) * Sin(5 * x) * Cos(5 * y);
+        mesh->vertices.push_back(Vector(x, y, z));
+      }
+    }
+    for (int j = 0; j < res; ++j) {
+      for (int i = 0; i < res; ++i) {
+        unsigned int v00 = j*(res+1) + i;
+        unsigned int v10 = v00 + 1;
+        unsigned int v01 = v00 + res+1;
+        unsigned int v11 = v01 + 1;
+
+        mesh->vertex_indices.push_back(v00);
+        mesh->vertex_indices.push_back(v10);
+        mesh->vertex_indices.push_back(v11);
+        mesh->face_material.push_back(0);
+        mesh->addTriangle(new KenslerShirleyTriangle(mesh, mesh->size()));
+
+        mesh->vertex_indices.push_back(v00);
+        mesh->vertex_indices.push_back(v11);
+        mesh->vertex_indices.push_back(v01);
+        mesh->face_material.push_back(0);
+        mesh->addTriangle(new KenslerShirleyTriangle(mesh, mesh->size()));
+      }
+    }
+    return mesh;
+  }
+
+  // res x res copies of object, shrunk to tile [-1,1]x[-1,1] and turned
+  // a quarter further about z from one tile to the next.
+  void makeInstances(Object* object, int res, Group* group)
+  {
+    for (int j = 0; j < res; ++j) {
+      for (int i = 0; i < res; ++i) {
+        AffineTransform t;
+        t.initWithIdentity();
+        t.scale(Vector(1, 1, 1) / res);
+        t.rotate(Vector(0, 0, 1), (i + j) * M_PI_2);
+        t.translate(Vector(-1 + (2*i + 1) / Real(res),
+                           -1 + (2*j + 1) / Real(res), 0));
+        group->add(new Instance(object, t));
+      }
+    }
+  }
+
+  // Turns the vertices of a mesh about z by up to amount turns, more
+  // the farther they are from the axis, so that the triangles that
+  // started out together drift apart.
+  void twistMesh(Mesh* mesh, const vector<Vector>& rest, Real amount)
+  {
+    for (size_t i = 0; i < rest.size(); ++i) {
+      const Vector& v = rest[i];
+      Real angle = 2 * M_PI * amount * Vector(v.x(), v.y(), 0).length();
+      Real c = Cos(angle);
+      Real s = Sin(angle);
+      mesh->vertices[i] = Vector(c*v.x() - s*v.y(), s*v.x() + c*v.y(), v.z());
+    }
+  }
+
+  // Rays of a pinhole camera looking at the origin, grouped into
+  // width x height pixel tiles of packetSize rays each.
+  void makeCoherent(Pool& pool, int packetSize)
+  {
+    int width = 1;
+    while (width*width < packetSize)
+      width *= 2;
+    int height = packetSize / width;
+
+    Vector eye(0, -3, 2);
+    Vector lookat(0, 0, 0);
+    Vector up(0, 0, 1);
+    Vector w = (lookat - eye).normal();
+    Vector u = Cross(w, up).normal();
+    Vector v = Cross(u, w);
+    Real scale = Real(0.45);
+
+    pool.rays.clear();
+    pool.constantOrigin = true;
+    for (int ty = 0; ty < ImageRes; ty += height) {
+      for (int tx = 0; tx < ImageRes; tx += width) {
+        for (int y = ty; y < ty + height; ++y) {
+          for (int x = tx; x < tx + width; ++x) {
+            Real px = (2 * (x + Real(0.5)) / ImageRes - 1) * scale;
+            Real py = (2 * (y + Real(0.5)) / ImageRes - 1) * scale;
+            PoolRay ray;
+            ray.origin = eye;
+            ray.direction = (w + u*px + v*py).normal();
+            pool.rays.push_back(ray);
+          }
+        }
+      }
+    }
+  }
+
+  // Rays starting anywhere on a sphere around the scene and heading for a
+  // random point inside it.
+  void makeIncoherent(Pool& pool, int count)
+  {
+    MT_RNG rng;
+    rng.seed(1234);
+
+    pool.rays.clear();
+    pool.constantOrigin = false;
+    for (int i = 0; i < count; ++i) {
+      Vector origin;
+      do {
+        origin = Vector(2*rng.nextDouble()-1, 2*rng.nextDouble()-1,
+                        2*rng.nextDouble()-1);
+      } while (origin.length2() > 1 || origin.length2() < 1e-4);
+      origin = origin.normal() * 3;
+      Vector target(2*rng.nextDouble()-1, 2*rng.nextDouble()-1,
+                    2*rng.nextDouble()-1);
+      PoolRay ray;
+      ray.origin = origin;
+      ray.direction = (target - origin).normal();
+      pool.rays.push_back(ray);
+    }
+  }
+
+  void fillPacket(RayPacket& rays, const PoolRay* src)
+  {
+    for (int i = rays.begin(); i < rays.end(); ++i)
+      rays.setRay(i, src[i].origin, src[i].direction);
+    rays.resetHits();
+  }
+
+  void fillHits(RayPacket& rays, const PoolRay* src)
+  {
+    fillPacket(rays, src);
+    for (int i = rays.begin(); i < rays.end(); ++i)
+      rays.hit(i, src[i].t, src[i].matl, src[i].prim, src[i].tex);
+  }
+
+  int packetFlags(const Pool& pool)
+  {
+    int flags = RayPacket::NormalizedDirections;
+    if (pool.constantOrigin)
+      flags |= RayPacket::ConstantOrigin;
+    return flags;
+  }
+
+  // Intersects the pool against the scene once, recording the hits.  With
+  // hitsOnly the misses are dropped, so that every packet handed to a
+  // shading kernel is full.
+  void intersectPool(const RenderContext& context, Pool& pool,
+                     int packetSize, bool hitsOnly)
+  {
+    RayPacketData data;
+    vector<PoolRay> hits;
+    int flags = packetFlags(pool);
+    size_t npackets = pool.rays.size() / packetSize;
+    for (size_t p = 0; p < npackets; ++p) {
+      PoolRay* src = &pool.rays[p*packetSize];
+      RayPacket rays(data, RayPacket::UnknownShape, 0, packetSize, 0, flags);
+      fillPacket(rays, src);
+      context.scene->getObject()->intersect(context, rays);
+      for (int i = 0; i < packetSize; ++i) {
+        src[i].t = rays.getMinT(i);
+        src[i].matl = rays.getHitMaterial(i);
+        src[i].prim = rays.getHitPrimitive(i);
+        src[i].tex = rays.getHitTexCoordMapper(i);
+        if (rays.wasHit(i))
+          hits.push_back(src[i]);
+      }
+    }
+    if (hitsOnly)
+      pool.rays.swap(hits);
+  }
+
+  // Writes the mesh as a PLY file in the given format ("ascii" or
+  // "binary", in the byte order of this machine) or as an OBJ file.
+  void writeMesh(const Mesh* mesh, const string& filename,
+                 const string& format)
+  {
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (!out) {
+      cerr << "perftest: cannot write " << filename << '\n';
+      exit(1);
+    }
+    const size_t nverts = mesh->vertices.size();
+    const size_t ntris = mesh->vertex_indices.size()/3;
+    if (format == "obj") {
+      for (size_t i = 0; i < nverts; ++i)
+        fprintf(out, "v %g %g %g\n", mesh->vertices[i][0],
+                mesh->vertices[i][1], mesh->vertices[i][2]);
+      for (size_t i = 0; i < ntris; ++i)
+        fprintf(out, "f %u %u %u\n", mesh->vertex_indices[3*i]+1,
+                mesh->vertex_indices[3*i+1]+1, mesh->vertex_indices[3*i+2]+1);
+      fclose(out);
+      return;
+    }
+
+    const int one = 1;
+    const bool littleEndian = *reinterpret_cast<const char*>(&one) == 1;
+    fprintf(out, "ply\nformat %s 1.0\n"
+            "element vertex %lu\n"
+            "property float x\nproperty float y\nproperty float z\n"
+            "element face %lu\n"
+            "property list uchar uint vertex_indices\n"
+            "end_header\n",
+            format == "ascii" ? "ascii" :
+            littleEndian ? "binary_little_endian" : "binary_big_endian",
+            static_cast<unsigned long>(nverts),
+            static_cast<unsigned long>(ntris));
+    for (size_t i = 0; i < nverts; ++i) {
+      float v[3] = { float(mesh->vertices[i][0]), float(mesh->vertices[i][1]),
+                     float(mesh->vertices[i][2]) };
+      if (format == "ascii")
+        fprintf(out, "%g %g %g\n", v[0], v[1], v[2]);
+      else
+        fwrite(v, sizeof(v), 1, out);
+    }
+    for (size_t i = 0; i < ntris; ++i) {
+      const unsigned int* v = &mesh->vertex_indices[3*i];
+      if (format == "ascii") {
+        fprintf(out, "3 %u %u %u\n", v[0], v[1], v[2]);
+      } else {
+        const unsigned char count = 3;
+        fwrite(&count, 1, 1, out);
+        fwrite(v, sizeof(unsigned int), 3, out);
+      }
+    }
+    fclose(out);
+  }
+
+  // The loaders make the triangles in one array, which the mesh cannot
+  // delete on its own.
+  void deleteLoadedMesh(Mesh* mesh)
+  {
+    KenslerShirleyTriangle* triangles = 0;
+    if (mesh->size() > 0)
+      triangles = dynamic_cast<KenslerShirleyTriangle*>
+        (mesh->getVectorOfObjects()[0]);
+    mesh->shrinkTo(0, false);
+    delete mesh;
+    delete[] triangles;
+  }
+
+  // Loads the file until at least minTime seconds have passed.  Returns
+  // triangles per second.
+  double measureLoad(const string& filename, bool obj, Material* matl,
+                     int threads, double minTime)
+  {
+    double triangles = 0;
+    double start = Time::currentSeconds();
+    double elapsed = 0;
+    do {
+      Mesh* mesh;
+      if (obj) {
+        mesh = new ObjGroup(filename.c_str(), matl);
+      } else {
+        mesh = new Mesh();
+        if (!readPlyFile(filename, AffineTransform::createIdentity(), mesh,
+                         matl, MeshTriangle::KENSLER_SHIRLEY_TRI, threads)) {
+          cerr << "perftest: cannot read " << filename << '\n';
+          exit(1);
+        }
+      }
+      triangles += mesh->size();
+      deleteLoadedMesh(mesh);
+      elapsed = Time::currentSeconds() - start;
+    } while (elapsed < minTime);
+
+    return triangles / elapsed;
+  }
+
+  enum Kernel {
+    Intersect, Shadows, Shade
+  };
+
+  // Runs the kernel over the pool, one packet at a time, until at least
+  // minTime seconds have passed.  Returns rays per second.
+  double measure(Kernel kernel, const RenderContext& context,
+                 const LightSet* lights, const Material* matl,
+                 const Pool& pool, int packetSize, double minTime)
+  {
+    RayPacketData data;
+    RayPacketData shadowData;
+    int flags = packetFlags(pool);
+    size_t npackets = pool.rays.size() / packetSize;
+    if (npackets == 0)
+      return 0;
+
+    double rays_traced = 0;
+    double start = Time::currentSeconds();
+    double elapsed = 0;
+    do {
+      for (size_t p = 0; p < npackets; ++p) {
+        const PoolRay* src = &pool.rays[p*packetSize];
+        RayPacket rays(data, RayPacket::UnknownShape, 0, packetSize, 0, flags);
+        switch (kernel) {
+        case Intersect:
+          fillPacket(rays, src);
+          context.scene->getObject()->intersect(context, rays);
+          break;
+        case Shadows:
+          {
+            fillHits(rays, src);
+            ShadowAlgorithm::StateBuffer state;
+            do {
+              RayPacket shadowRays(shadowData, RayPacket::UnknownShape,
+                                   0, 0, 0, 0);
+              context.shadowAlgorithm->computeShadows(context, state, lights,
+                                                      rays, shadowRays);
+            } while (!state.done());
+          }
+          break;
+        case Shade:
+          fillHits(rays, src);
+          matl->shade(context, rays);
+          break;
+        }
+      }
+      rays_traced += double(npackets) * packetSize;
+      elapsed = Time::currentSeconds() - start;
+    } while (elapsed < minTime);
+
+    return rays_traced / elapsed;
+  }
+
+  void usage()
+  {
+    cerr << "Usage: perftest [options]\n"
+         << "  -time <seconds>      minimum time per measurement (0.5)\n"
+         << "  -terrain <n>         height field resolution (128)\n"
+         << "  -kernel <name>       only run kernels whose name contains name\n"
+         << "  -ply <file>          measure loading this file instead of the\n"
+         << "                       height field\n"
+         << "  -obj <file>          likewise for OBJ files\n"
+         << "  -baseline <file>     compare against earlier results\n"
+         << "  -tolerance <frac>    exit with failure if any measurement\n"
+         << "                       falls more than frac below the baseline\n";
+    exit(1);
+  }
+
+  string key(const string& kernel, const string& packets, int size)
+  {
+    ostringstream out;
+    out << kernel << ' ' << packets << ' ' << size;
+    return out.str();
+  }
+
+  void readBaseline(const string& filename, map<string, double>& baseline)
+  {
+    ifstream in(filename.c_str());
+    if (!in) {
+      cerr << "perftest: cannot read baseline " << filename << '\n';
+      exit(1);
+    }
+    string line;
+    while (getline(in, line)) {
+      if (line.empty() || line[0] == '#')
+        continue;
+      istringstream fields(line);
+      string kernel, packets;
+      int size;
+      double rate;
+      string extra;
+      // The acceleration structures chat on stdout while building, so only
+      // take lines that have exactly the four result fields.
+      if (fields >> kernel >> packets >> size >> rate && !(fields >> extra))
+        baseline[key(kernel, packets, size)] = rate;
+    }
+  }
+}
+
+int
+main(int argc, char* argv[])
+{
+  double minTime = 0.5;
+  int terrainRes = 128;
+  string kernelFilter;
+  string baselineFile;
+  double tolerance = -1;
+  string plyFile;
+  string objFile;
+
+  vector<string> args;
+  for (int i = 1; i < argc; ++i)
+    args.push_back(argv[i]);
+
+  for (size_t i = 0; i < args.size(); ++i) {
+    const string& arg = args[i];
+    if (arg == "-time") {
+      if (!getArg(i, args, minTime))
+        usage();
+    } else if (arg == "-terrain") {
+      if (!getArg(i, args, terrainRes) || terrainRes < 1)
+        usage();
+    } else if (arg == "-kernel") {
+      if (!getArg(i, args, kernelFilter))
+        usage();
+    } else if (arg == "-ply") {
+      if (!getArg(i, args, plyFile))
+        usage();
+    } else if (arg == "-obj") {
+      if (!getArg(i, args, objFile))
+        usage();
+    } else if (arg == "-baseline") {
+      if (!getArg(i, args, baselineFile))
+        usage();
+    } else if (arg == "-tolerance") {
+      if (!getArg(i, args, tolerance))
+        usage();
+    } else {
+      usage();
+    }
+  }
+
+  map<string, double> baseline;
+  if (!baselineFile.empty())
+    readBaseline(baselineFile, baseline);
+
+  LightSet lights;
+  lights.add(new PointLight(Vector(-2, -3, 4), Color(RGBColor(.6, .6, .6))));
+  lights.add(new PointLight(Vector(3, 1, 3), Color(RGBColor(.4, .3, .2))));
+  lights.setAmbientLight(new ConstantAmbient(Color(RGBColor(.1, .1, .1))));
+
+  PreprocessContext ppc;
+  ppc.globalLights = &lights;
+  lights.preprocess(ppc);
+
+  Phong phong(Color(RGBColor(.8, .7, .6)), Color(RGBColor(1, 1, 1)), 50, 0);
+  phong.preprocess(ppc);
+
+  Sphere sphere(&phong, Vector(0, 0, 0), 1);
+  sphere.preprocess(ppc);
+
+  Mesh* terrain = makeTerrain(&phong, terrainRes);
+  terrain->preprocess(ppc);
+
+  DynBVH bvh(false);
+  bvh.setGroup(terrain);
+  bvh.rebuild();
+
+  DynBVH sbvh(false);
+  sbvh.setSpatialSplitBudget(0.3);
+  sbvh.setGroup(terrain);
+  sbvh.rebuild();
+
+  MBVH mbvh4(4, false);
+  mbvh4.setGroup(terrain);
+  mbvh4.rebuild();
+
+  MBVH mbvh8(8, false);
+  mbvh8.setGroup(terrain);
+  mbvh8.rebuild();
+
+  // The compressed trees keep only the quantized wide nodes.
+  MBVH mbvh4q(4, false, MBVH::QuantizedNodes);
+  mbvh4q.setReleaseBinaryTree(true);
+  mbvh4q.setGroup(terrain);
+  mbvh4q.rebuild();
+
+  MBVH mbvh8q(8, false, MBVH::QuantizedNodes);
+  mbvh8q.setReleaseBinaryTree(true);
+  mbvh8q.setGroup(terrain);
+  mbvh8q.rebuild();
+
+  KDTree kdtree;
+  kdtree.setGroup(terrain);
+  kdtree.rebuild();
+
+  // 8x8 instances of the height field, under a DynBVH over the
+  // Instances and under an InstanceBVH.
+  Group instances;
+  makeInstances(&bvh, 8, &instances);
+  DynBVH instanceBVH(false);
+  instanceBVH.setGroup(&instances);
+  instanceBVH.rebuild();
+  InstanceBVH twoLevel(false);
+  twoLevel.setGroup(&instances);
+  twoLevel.rebuild();
+
+  Scene sphereScene;
+  sphereScene.setObject(&sphere);
+  Scene bvhScene;
+  bvhScene.setObject(&bvh);
+  Scene sbvhScene;
+  sbvhScene.setObject(&sbvh);
+  Scene mbvh4Scene;
+  mbvh4Scene.setObject(&mbvh4);
+  Scene mbvh8Scene;
+  mbvh8Scene.setObject(&mbvh8);
+  Scene mbvh4qScene;
+  mbvh4qScene.setObject(&mbvh4q);
+  Scene mbvh8qScene;
+  mbvh8qScene.setObject(&mbvh8q);
+  Scene kdtreeScene;
+  kdtreeScene.setObject(&kdtree);
+  Scene instanceScene;
+  instanceScene.setObject(&instanceBVH);
+  Scene twoLevelScene;
+  twoLevelScene.setObject(&twoLevel);
+
+  NoShadows noShadows;
+  HardShadows hardShadows;
+
+  struct Test {
+    const char* name;
+    Kernel kernel;
+    const Scene* scene;
+    ShadowAlgorithm* shadows;
+  } tests[] = {
+    { "Sphere::intersect", Intersect, &sphereScene, &noShadows },
+    { "DynBVH::intersect", Intersect, &bvhScene, &noShadows },
+    { "SBVH::intersect", Intersect, &sbvhScene, &noShadows },
+    { "MBVH4::intersect", Intersect, &mbvh4Scene, &noShadows },
+    { "MBVH8::intersect", Intersect, &mbvh8Scene, &noShadows },
+    { "MBVH4Q::intersect", Intersect, &mbvh4qScene, &noShadows },
+    { "MBVH8Q::intersect", Intersect, &mbvh8qScene, &noShadows },
+    { "KDTree::intersect", Intersect, &kdtreeScene, &noShadows },
+    { "Instance::intersect", Intersect, &instanceScene, &noShadows },
+    { "InstanceBVH::intersect", Intersect, &twoLevelScene, &noShadows },
+    { "HardShadows::computeShadows", Shadows, &bvhScene, &hardShadows },
+    { "HardShadows::computeShadows/MBVH4", Shadows, &mbvh4Scene,
+      &hardShadows },
+    { "HardShadows::computeShadows/InstanceBVH", Shadows, &twoLevelScene,
+      &hardShadows },
+    { "Phong::shade", Shade, &bvhScene, &noShadows },
+  };
+  const int ntests = sizeof(tests) / sizeof(tests[0]);
+
+  int sizes[] = { 4, 8, 16, 32, 64, 128, 256 };
+  const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+  cout << "# RAYPACKET_MAXSIZE " << RayPacket::MaxSize << '\n'
+       << "# terrain triangles " << terrain->size() << '\n'
+       << "# bytes DynBVH " << bvh.getMemoryUse()
+       << " SBVH " << sbvh.getMemoryUse()
+       << " MBVH4 " << mbvh4.getMemoryUse()
+       << " MBVH8 " << mbvh8.getMemoryUse()
+       << " MBVH4Q " << mbvh4q.getMemoryUse()
+       << " MBVH8Q " << mbvh8q.getMemoryUse() << '\n'
+       << "# kernel packets size rays_per_sec"
+       << (baseline.empty() ? "" : " baseline ratio") << '\n';
+
+  // Moving instances only rebuilds the top level of an InstanceBVH.
+  if (string("InstanceBVH::update").find(kernelFilter) != string::npos) {
+    Group field;
+    makeInstances(&bvh, 64, &field);
+    InstanceBVH fieldBVH(false);
+    fieldBVH.setGroup(&field);
+    fieldBVH.rebuild();
+    int updates = 0;
+    double start = Time::currentSeconds();
+    double elapsed;
+    do {
+      fieldBVH.update();
+      ++updates;
+      elapsed = Time::currentSeconds() - start;
+    } while (elapsed < minTime);
+    cout << "# InstanceBVH::update " << field.size() << " instances "
+         << elapsed / updates * 1e6 << " us\n";
+  }
+
+  // A twisting terrain, refit every frame, with and without rebuilding
+  // the tree in the background once refitting has made it costlier.
+  if (string("DynBVH::backgroundRebuild").find(kernelFilter) != string::npos) {
+    Mesh* twisted = makeTerrain(&phong, terrainRes);
+    twisted->preprocess(ppc);
+    const vector<Vector> rest(twisted->vertices);
+    const int frames = 100;
+    for (int background = 0; background <= 1; ++background) {
+      DynBVH deforming(false);
+      deforming.setGroup(twisted);
+      deforming.rebuild();
+      if (background)
+        deforming.setBackgroundRebuild(Real(1.2));
+      double start = Time::currentSeconds();
+      for (int f = 1; f <= frames; ++f) {
+        twistMesh(twisted, rest, Real(f) / frames);
+        deforming.update();
+      }
+      double elapsed = Time::currentSeconds() - start;
+      cout << "# DynBVH::update " << frames << " twisting frames "
+           << (background ? "with background rebuilds " : "refit only ")
+           << elapsed / frames * 1e6 << " us, final SAH cost "
+           << deforming.getTreeCost() << ", "
+           << deforming.getNumBackgroundRebuilds() << " rebuilds\n";
+      twistMesh(twisted, rest, 0);
+    }
+    delete twisted;
+  }
+
+  // Shading takes its shadow packets from here, like in a render thread.
+  RayPacketArena packetArena;
+
+  bool failed = false;
+  for (int t = 0; t < ntests; ++t) {
+    if (string(tests[t].name).find(kernelFilter) == string::npos)
+      continue;
+
+    RenderContext context(0, 0, 0, 1, 0, 0, 0, 0, tests[t].shadows,
+                          0, tests[t].scene, 0, 0, 0);
+    context.packetArena = &packetArena;
+
+    for (int coherent = 1; coherent >= 0; --coherent) {
+      const char* packets = coherent ? "coherent" : "incoherent";
+      for (int s = 0; s < nsizes; ++s) {
+        int size = sizes[s];
+        if (size > RayPacket::MaxSize)
+          break;
+
+        Pool pool;
+        if (coherent)
+          makeCoherent(pool, size);
+        else
+          makeIncoherent(pool, ImageRes*ImageRes);
+        if (tests[t].kernel != Intersect)
+          intersectPool(context, pool, size, true);
+
+        double rate = measure(tests[t].kernel, context, &lights, &phong,
+                              pool, size, minTime);
+
+        cout << tests[t].name << ' ' << packets << ' ' << size << ' '
+             << rate;
+        map<string, double>::const_iterator iter =
+          baseline.find(key(tests[t].name, packets, size));
+        if (iter != baseline.end()) {
+          double ratio = rate / iter->second;
+          cout << ' ' << iter->second << ' ' << ratio;
+          if (tolerance >= 0 && ratio < 1 - tolerance) {
+            cout << " SLOWER";
+            failed = true;
+          }
+        }
+        cout << endl;
+      }
+    }
+  }
+
+  // The loaders, reading the height field unless files were given.
+  struct Load {
+    const char* name;
+    const char* format;
+    bool obj;
+    string filename;
+  };
+  vector<Load> loads;
+  if (plyFile.empty()) {
+    Load ascii = { "readPlyFile", "ascii", false,
+                   "perftest-terrain-ascii.ply" };
+    Load binary = { "readPlyFile", "binary", false,
+                    "perftest-terrain-binary.ply" };
+    loads.push_back(ascii);
+    loads.push_back(binary);
+  } else {
+    Load file = { "readPlyFile", "file", false, plyFile };
+    loads.push_back(file);
+  }
+  if (objFile.empty()) {
+    Load obj = { "ObjGroup", "obj", true, "perftest-terrain.obj" };
+    loads.push_back(obj);
+  } else {
+    Load file = { "ObjGroup", "file", true, objFile };
+    loads.push_back(file);
+  }
+
+  bool loadHeader = false;
+  for (size_t l = 0; l < loads.size(); ++l) {
+    const Load& load = loads[l];
+    if (string(load.name).find(kernelFilter) == string::npos)
+      continue;
+    const bool temporary = string(load.format) != "file";
+    if (temporary)
+      writeMesh(terrain, load.filename, load.format);
+    if (!loadHeader) {
+      cout << "# loader format threads triangles_per_sec"
+           << (baseline.empty() ? "" : " baseline ratio") << '\n';
+      loadHeader = true;
+    }
+
+    // glm reads OBJ files on one thread.
+    int threads[] = { 1, load.obj ? 1 : Thread::numProcessors() };
+    for (int t = 0; t < 2; ++t) {
+      if (t > 0 && threads[t] == threads[0])
+        break;
+      double rate = measureLoad(load.filename, load.obj, &phong, threads[t],
+                                minTime);
+      cout << load.name << ' ' << load.format << ' ' << threads[t] << ' '
+           << rate;
+      map<string, double>::const_iterator iter =
+        baseline.find(key(load.name, load.format, threads[t]));
+      if (iter != baseline.end()) {
+        double ratio = rate / iter->second;
+        cout << ' ' << iter->second << ' ' << ratio;
+        if (tolerance >= 0 && ratio < 1 - tolerance) {
+          cout << " SLOWER";
+          failed = true;
+        }
+      }
+      cout << endl;
+    }
+    if (temporary)
+      remove(load.filename.c_str());
+  }
+
+  delete terrain;
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+#include <Core/Thread/Mutex.h>
+#include <Core/Thread/Time.h>
+#include <Interface/Context.h>
+#include <Model/Groups/Group.h>
+#include <Model/MiscObjects/TimeStepStreamer.h>
+#include <stdio.h>
+
+using namespace Manta;
+
+// Hands out empty groups, taking loadSeconds for each, and counts how
+// many are in memory at once.
+class CountingLoader : public TimeStepStreamer::Loader {
+public:
+  CountingLoader(double loadSeconds)
+    : loadSeconds(loadSeconds), lock("CountingLoader lock"),
+      live(0), maxLive(0)
+  {
+  }
+
+  Object* load(int)
+  {
+    Time::waitFor(loadSeconds);
+    lock.lock();
+    if (++live > maxLive)
+      maxLive = live;
+    lock.unlock();
+    return new Group();
+  }
+
+  void unload(int, Object* object)
+  {
+    lock.lock();
+    live--;
+    lock.unlock();
+    delete object;
+  }
+
+  int getMaxLive()
+  {
+    lock.lock();
+    int result = maxLive;
+    lock.unlock();
+    return result;
+  }
+
+private:
+  double loadSeconds;
+  Mutex lock;
+  int live;
+  int maxLive;
+};
+
+int main()
+{
+  PreprocessContext context;
+
+  {
+    // The window holds at least the current, the previous and one more
+    // timestep.
+    TimeStepStreamer small(new CountingLoader(0), 10, 1);
+    TimeStepStreamer large(new CountingLoader(0), 10, 6);
+    printf("window 1 -> %d, window 6 -> %d (expected 3 and 6)\n",
+           small.getWindow(), large.getWindow());
+    if (small.getWindow() != 3 || large.getWindow() != 6)
+      return -1;
+  }
+
+  {
+    // Playing every timestep twice never has more than the window in
+    // memory.
+    const int window = 4;
+    CountingLoader* loader = new CountingLoader(0.005);
+    TimeStepStreamer streamer(loader, 12, window);
+    streamer.setReportWaits(false);
+    streamer.start(context);
+    for (int step = 0; step < 24; ++step) {
+      streamer.get(step);
+      Time::waitFor(0.01);
+    }
+    const TimeStepStreamer::Statistics stats = streamer.getStatistics();
+    printf("at most %d of %d timesteps loaded, %d resident at the end\n",
+           loader->getMaxLive(), window, stats.resident);
+    if (loader->getMaxLive() > window || stats.resident > window)
+      return -1;
+  }
+
+  {
+    // The first timestep is not loaded when it is asked for, so get
+    // waits about as long as the load takes and reports it.  Once the
+    // next one has had time to load, getting it does not wait.
+    const double loadSeconds = 0.2;
+    TimeStepStreamer streamer(new CountingLoader(loadSeconds), 5, 4);
+    streamer.setReportWaits(false);
+    streamer.start(context);
+    const double start = Time::currentSeconds();
+    streamer.get(0);
+    const double elapsed = Time::currentSeconds() - start;
+    TimeStepStreamer::Statistics stats = streamer.getStatistics();
+    printf("waited %g seconds (%g measured, %d waits) for a %g second load\n",
+           stats.waitSeconds, elapsed, int(stats.waits), loadSeconds);
+    if (stats.waits != 1 || stats.waitSeconds < 0.5*loadSeconds ||
+        stats.waitSeconds > elapsed || stats.maxWaitSeconds != stats.waitSeconds)
+      return -1;
+
+    Time::waitFor(3*loadSeconds);
+    streamer.get(1);
+    stats = streamer.getStatistics();
+    printf("%d waits after getting a prefetched timestep (expected 1)\n",
+           int(stats.waits));
+    if (stats.waits != 1)
+      return -1;
+  }
+
+  return 0;
+}